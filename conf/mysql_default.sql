@@ -99,7 +99,11 @@ CREATE TABLE `Recipients` (
   `ReturnPath` VARCHAR(255),
   `DomainName` VARCHAR(255),
   `SendDate` INTEGER,
-  `AttemptsCount` INTEGER
+  `AttemptsCount` INTEGER,
+  `LeaseOwner` VARCHAR(255),
+  `LeaseExpiry` INTEGER DEFAULT 0,
+  KEY `CampaignRecipients` (CampaignID, RecipientID),
+  KEY `RecipientsLeases` (LeaseOwner)
 ) ENGINE=MyISAM DEFAULT CHARSET=utf8;
 SET character_set_client = @saved_cs_client;
 
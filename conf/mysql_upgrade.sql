@@ -0,0 +1,17 @@
+--
+-- Upgrade an existing database to the current schema
+-- Replace MyGiveMailDB with the name of your database
+-- Run this once, with the givemail service stopped
+--
+
+USE MyGiveMailDB;
+
+--
+-- Recipients can be listed by campaign in ID order, and leased by slaves
+--
+
+ALTER TABLE `Recipients`
+  ADD COLUMN `LeaseOwner` VARCHAR(255),
+  ADD COLUMN `LeaseExpiry` INTEGER DEFAULT 0,
+  ADD KEY `CampaignRecipients` (CampaignID, RecipientID),
+  ADD KEY `RecipientsLeases` (LeaseOwner);
@@ -22,6 +22,10 @@
 
 #include <stdio.h>
 #include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BASE64_X86
+#endif
 
 #include "Base64.h"
 
@@ -31,6 +35,184 @@ static unsigned char const code[] =
 #define B64NOP 128
 #define B64EOF  64
 
+/* Maps characters to their 6 bits value, B64NOP or B64EOF */
+static unsigned char const decodeTable[256] = {
+   64, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  62, 128, 128, 128,  63,
+   52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 128, 128, 128,  64, 128, 128,
+  128,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+   15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 128, 128, 128, 128, 128,
+  128,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+   41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+  128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128
+};
+
+typedef void (*EncodeBlocksFunc)(unsigned char const *, unsigned long, unsigned long, char *, unsigned long &);
+typedef bool (*DecodeBlockFunc)(unsigned char const *, unsigned char *);
+
+static bool g_useSIMD = true;
+
+#ifdef BASE64_X86
+/* Encodes 12 bytes into 16 characters at a time; 16 bytes must be readable */
+__attribute__((target("ssse3")))
+static inline __m128i encode_ssse3(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+	// Split each 3 bytes into 4 6 bits indices
+	__m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	__m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	__m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	__m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	__m128i indices = _mm_or_si128(t1, t3);
+
+	// Map indices to the alphabet by adding the offset of their range
+	__m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+	__m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	result = _mm_shuffle_epi8(offsets, result);
+
+	return _mm_add_epi8(result, indices);
+}
+
+__attribute__((target("ssse3")))
+static void encodeBlocks_ssse3(unsigned char const *pData, unsigned long dataLen,
+	unsigned long readableLen, char *pEncoded, unsigned long &dataPos)
+{
+	while ((dataLen - dataPos >= 12) &&
+		(readableLen - dataPos >= 16))
+	{
+		__m128i in = _mm_loadu_si128((const __m128i *)(pData + dataPos));
+
+		_mm_storeu_si128((__m128i *)pEncoded, encode_ssse3(in));
+		pEncoded += 16;
+		dataPos += 12;
+	}
+}
+
+__attribute__((target("avx2")))
+static void encodeBlocks_avx2(unsigned char const *pData, unsigned long dataLen,
+	unsigned long readableLen, char *pEncoded, unsigned long &dataPos)
+{
+	__m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	__m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+	while ((dataLen - dataPos >= 24) &&
+		(readableLen - dataPos >= 28))
+	{
+		// Each lane gets 12 bytes
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const __m128i *)(pData + dataPos))),
+			_mm_loadu_si128((const __m128i *)(pData + dataPos + 12)), 1);
+
+		in = _mm256_shuffle_epi8(in, shuffle);
+
+		__m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+		__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		__m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+		__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(t1, t3);
+
+		__m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		__m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		result = _mm256_shuffle_epi8(offsets, result);
+		result = _mm256_add_epi8(result, indices);
+
+		_mm256_storeu_si256((__m256i *)pEncoded, result);
+		pEncoded += 32;
+		dataPos += 24;
+	}
+
+	// Avoid AVX to SSE transition penalties, then finish off with 128 bits blocks
+	_mm256_zeroupper();
+	encodeBlocks_ssse3(pData, dataLen, readableLen, pEncoded, dataPos);
+}
+
+/* Decodes 16 characters into 12 bytes, provided they are all in the alphabet;
+   only checks them if pData is NULL */
+__attribute__((target("ssse3")))
+static bool decodeBlock_ssse3(unsigned char const *pEncoded, unsigned char *pData)
+{
+	__m128i in = _mm_loadu_si128((const __m128i *)pEncoded);
+	__m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+	__m128i loNibbles = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+	__m128i lo = _mm_shuffle_epi8(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a), loNibbles);
+	__m128i hi = _mm_shuffle_epi8(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10), hiNibbles);
+
+	// Padding, line breaks and other characters are left to the scalar code
+	if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0)
+	{
+		return false;
+	}
+	else if (pData == NULL)
+	{
+		// The caller only wants to know
+		return true;
+	}
+
+	__m128i eq2F = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+	__m128i roll = _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0), _mm_add_epi8(eq2F, hiNibbles));
+	__m128i values = _mm_add_epi8(in, roll);
+
+	// Pack 4 6 bits values into 3 bytes
+	__m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	__m128i out = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+	out = _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+	// The caller made room for 16 bytes
+	_mm_storeu_si128((__m128i *)pData, out);
+
+	return true;
+}
+#endif
+
+static EncodeBlocksFunc getBlocksEncoder(void)
+{
+#ifdef BASE64_X86
+	static EncodeBlocksFunc blocksEncoder = (__builtin_cpu_supports("avx2") ? encodeBlocks_avx2 :
+		(__builtin_cpu_supports("ssse3") ? encodeBlocks_ssse3 : NULL));
+
+	if (g_useSIMD == true)
+	{
+		return blocksEncoder;
+	}
+#endif
+
+	return NULL;
+}
+
+static DecodeBlockFunc getBlockDecoder(void)
+{
+#ifdef BASE64_X86
+	static DecodeBlockFunc blockDecoder = (__builtin_cpu_supports("ssse3") ? decodeBlock_ssse3 : NULL);
+
+	if (g_useSIMD == true)
+	{
+		return blockDecoder;
+	}
+#endif
+
+	return NULL;
+}
+
 /**Decode a BASE64-encoded string.
  *
  * The function base64_d() decodes a string @a b64s encoded with BASE64. It
@@ -43,6 +225,7 @@ static unsigned char const code[] =
  * @param buf  Buffer to store decoded data
  * @param bsiz Size of @a buf
  * @param b64s Base64-encoded string.
+ * @param b64len Length of @a b64s, which SIMD code won't read beyond.
  *
  * @return Length of data that can be decoded in bytes. 
  *
@@ -57,42 +240,41 @@ static unsigned char const code[] =
  * @code
  * int decoder(char const *encoded, void **return_decoded)
  * {
- *   int len = base64_d(NULL, 0, encoded);
+ *   int len = base64_d(NULL, 0, encoded, strlen(encoded));
  *   void *decoded = malloc(len);
- *   base64_d(decoded, len, encoded);
+ *   base64_d(decoded, len, encoded, strlen(encoded));
  *   *return_decoded = decoded;
  *   return len;
  * }
  * @endcode
  */
-static unsigned long base64_d(char buf[], unsigned long bsiz, char const *b64s) 
+static unsigned long base64_d(char buf[], unsigned long bsiz, char const *b64s,
+  unsigned long b64len) 
 {
-  static unsigned char decode[256] = "";
   unsigned char const *s = (unsigned char const *)b64s;
+  unsigned char const *end = s + b64len;
   unsigned char c, b1, b2 = B64EOF, b3 = B64EOF, b4 = B64EOF;
   unsigned long w;
   unsigned long i, len = 0, total_len = 0;
+  DecodeBlockFunc decodeBlock = getBlockDecoder();
 
   if (b64s == NULL)
     return 0;
 
-  if (decode['\0'] != B64EOF) {
-    /* Prepare decoding table */
-    for (i = 1; i < 256; i++)
-      decode[i] = B64NOP; 
-
-    for (i = 0; i < 64; i++) {
-      decode[code[i]] = (unsigned char)i;
+  /* Calculate length, skipping over blocks of valid characters */
+  while (1) {
+    if (decodeBlock != NULL) {
+      while ((end - s >= 16) && (decodeBlock(s, NULL) == true)) {
+        s += 16;
+        len += 16;
+      }
     }
-    decode['='] = B64EOF;
-    decode['\0'] = B64EOF;
-  }
-
-  /* Calculate length */
-  while ((c = decode[*s++]) != B64EOF) {
+    if ((c = decodeTable[*s++]) == B64EOF)
+      break;
     if (c != B64NOP)
       len++;
   }
+  end = s - 1;
   
   total_len = len = len * 3 / 4;
 
@@ -103,17 +285,27 @@ static unsigned long base64_d(char buf[], unsigned long bsiz, char const *b64s)
     len = bsiz;
   
   for (i = 0, s = (unsigned char const *)b64s; i < len; ) {
+    /* Whole blocks of valid characters can be decoded in one go */
+    if (decodeBlock != NULL) {
+      while ((i + 16 <= len) && (end - s >= 16) &&
+        (decodeBlock(s, (unsigned char *)buf + i) == true)) {
+        s += 16;
+        i += 12;
+      }
+      if (i >= len)
+        break;
+    }
       
-    while ((b1 = decode[*s++]) == B64NOP)
+    while ((b1 = decodeTable[*s++]) == B64NOP)
       ;
     if (b1 != B64EOF)
-      while ((b2 = decode[*s++]) == B64NOP)
+      while ((b2 = decodeTable[*s++]) == B64NOP)
 	;
     if (b2 != B64EOF)
-      while ((b3 = decode[*s++]) == B64NOP)
+      while ((b3 = decodeTable[*s++]) == B64NOP)
 	;
     if (b3 != B64EOF)
-      while ((b4 = decode[*s++]) == B64NOP)
+      while ((b4 = decodeTable[*s++]) == B64NOP)
 	;
       
     if (((b1 | b2 | b3 | b4) & (B64NOP|B64EOF)) == 0) {
@@ -239,6 +431,31 @@ static unsigned long base64_e(char buf[], unsigned long bsiz, void *data, unsign
   return n;
 }
 
+/* Encodes whole blocks with SIMD if possible, and the rest one group at a time */
+static unsigned long encodeData(char *pEncoded, const char *pData, unsigned long dataLen,
+	unsigned long readableLen)
+{
+	EncodeBlocksFunc blocksEncoder = getBlocksEncoder();
+	unsigned long dataPos = 0;
+
+	if (blocksEncoder != NULL)
+	{
+		blocksEncoder((unsigned char const *)pData, dataLen, readableLen, pEncoded, dataPos);
+	}
+
+	unsigned long encodedPos = (dataPos / 3) * 4;
+	unsigned long remainingLen = dataLen - dataPos;
+
+	if (remainingLen > 0)
+	{
+		// Leave room for the terminating NUL
+		encodedPos += base64_e(pEncoded + encodedPos, ((remainingLen + 2) / 3) * 4 + 1,
+			(void*)(pData + dataPos), remainingLen);
+	}
+
+	return encodedPos;
+}
+
 Base64::Base64()
 {
 }
@@ -257,13 +474,64 @@ char *Base64::encode(const char *pData, unsigned long &dataLen)
 
 	unsigned long encodedDataSize = base64_e(NULL, 0, (void*)pData, dataLen);
 	char *pEncodedData = new char[encodedDataSize + 1];
-	base64_e(pEncodedData, encodedDataSize + 1, (void*)pData, dataLen);
+	encodeData(pEncodedData, pData, dataLen, dataLen);
 	pEncodedData[encodedDataSize] = '\0';
 	dataLen = encodedDataSize;
 
 	return pEncodedData;
 }
 
+char *Base64::encodeLines(const char *pData, unsigned long &dataLen,
+	unsigned int lineLen)
+{
+	if ((pData == NULL) ||
+		(dataLen == 0))
+	{
+		return NULL;
+	}
+
+	// Lines hold a whole number of 4 characters groups
+	unsigned long groupsPerLine = lineLen / 4;
+	if (groupsPerLine == 0)
+	{
+		groupsPerLine = 1;
+	}
+	unsigned long bytesPerLine = groupsPerLine * 3;
+	unsigned long linesCount = (dataLen + bytesPerLine - 1) / bytesPerLine;
+	unsigned long encodedDataSize = base64_e(NULL, 0, (void*)pData, dataLen) + linesCount * 2;
+	char *pEncodedData = new char[encodedDataSize + 1];
+	unsigned long dataPos = 0, encodedPos = 0;
+
+	while (dataPos < dataLen)
+	{
+		unsigned long chunkLen = dataLen - dataPos;
+		if (chunkLen > bytesPerLine)
+		{
+			chunkLen = bytesPerLine;
+		}
+
+		// The terminating NUL is overwritten by the line's CR
+		encodedPos += encodeData(pEncodedData + encodedPos, pData + dataPos,
+			chunkLen, dataLen - dataPos);
+		pEncodedData[encodedPos++] = '\r';
+		pEncodedData[encodedPos++] = '\n';
+		dataPos += chunkLen;
+	}
+	pEncodedData[encodedDataSize] = '\0';
+	dataLen = encodedDataSize;
+
+	return pEncodedData;
+}
+
+bool Base64::useSIMD(bool enable)
+{
+	bool wasEnabled = g_useSIMD;
+
+	g_useSIMD = enable;
+
+	return wasEnabled;
+}
+
 char *Base64::decode(const char *pData, unsigned long &dataLen)
 {
 	if ((pData == NULL) ||
@@ -272,9 +540,9 @@ char *Base64::decode(const char *pData, unsigned long &dataLen)
 		return NULL;
 	}
 
-	unsigned long decodedDataSize = base64_d(NULL, 0, pData);
+	unsigned long decodedDataSize = base64_d(NULL, 0, pData, dataLen);
 	char *pDecodedData = new char[decodedDataSize + 1];
-	base64_d(pDecodedData, decodedDataSize + 1, pData);
+	base64_d(pDecodedData, decodedDataSize + 1, pData, dataLen);
 	pDecodedData[decodedDataSize] = '\0';
 	dataLen = decodedDataSize;
 
@@ -33,11 +33,24 @@ class Base64
 		static char *encode(const char *pData, unsigned long &dataLen);
 
 		/**
-		  * Decodes data.
+		  * Encodes data into CRLF terminated lines, as found in MIME bodies.
+		  * Caller frees with delete[].
+		  */
+		static char *encodeLines(const char *pData, unsigned long &dataLen,
+			unsigned int lineLen = 76);
+
+		/**
+		  * Decodes dataLen characters of data.
 		  * Caller frees with delete[].
 		  */
 		static char *decode(const char *pData, unsigned long &dataLen);
 
+		/**
+		  * Enables or disables SIMD code paths, where the CPU has them.
+		  * Returns the previous setting. This is meant for benchmarking.
+		  */
+		static bool useSIMD(bool enable);
+
 	protected:
 		Base64();
 
@@ -123,6 +123,22 @@ bool CampaignSQL::getAttachments(const string &campaignId,
 	return true;
 }
 
+void CampaignSQL::setCustomField(Recipient &recipient,
+	const string &fieldName, const string &fieldValue)
+{
+	// FIXME: CustomFieldName should really be a name, not an index
+	unsigned int fieldNum = (unsigned int)atoi(fieldName.c_str());
+	if ((fieldNum >= 1) &&
+		(fieldNum <= 6))
+	{
+		stringstream nameStr;
+
+		nameStr << "customfield" << fieldNum;
+
+		recipient.m_customFields[nameStr.str()] = fieldValue;
+	}
+}
+
 bool CampaignSQL::getCustomFields(Recipient *pRecipient)
 {
 	if ((m_pDb == NULL) ||
@@ -144,16 +160,123 @@ bool CampaignSQL::getCustomFields(Recipient *pRecipient)
 	SQLRow *pRecipientRow = pRecipientResults->nextRow();
 	while (pRecipientRow != NULL)
 	{
-		// FIXME: CustomFieldName should really be a name, not an index
-		unsigned int fieldNum = (unsigned int)atoi(pRecipientRow->getColumn(0).c_str());
-		if ((fieldNum >= 1) ||
-			(fieldNum <= 6))
+		setCustomField(*pRecipient, pRecipientRow->getColumn(0),
+			pRecipientRow->getColumn(1));
+
+		// Next row
+		delete pRecipientRow;
+		pRecipientRow = pRecipientResults->nextRow();
+	}
+	delete pRecipientResults;
+
+	return true;
+}
+
+string CampaignSQL::getDomainClause(const string &domainName)
+{
+	string domainClause;
+	bool hasRelay = false;
+
+	if (domainName.empty() == true)
+	{
+		return "";
+	}
+
+	// When requesting recipients for the relay, provide all recipients not on the internal domain
+	// or all recipients if the internal domain and the relay are one and the same
+	ConfigurationFile *pConfig = ConfigurationFile::getInstance("");
+	if ((pConfig != NULL) &&
+		(pConfig->m_options.m_internalDomain.empty() == false) &&
+		(pConfig->m_options.m_mailRelayAddress == domainName))
+	{
+		hasRelay = true;
+	}
+
+	if (hasRelay == false)
+	{
+		domainClause += " DomainName='";
+		domainClause += m_pDb->escapeString(domainName);
+		domainClause += "' AND";
+	}
+	else if (pConfig->m_options.m_mailRelayAddress != pConfig->m_options.m_internalDomain)
+	{
+		domainClause += " DomainName!='";
+		domainClause += m_pDb->escapeString(pConfig->m_options.m_internalDomain);
+		domainClause += "' AND";
+	}
+	// Else, all domains
+
+	return domainClause;
+}
+
+bool CampaignSQL::getRecipientsAndFields(const string &fromClause,
+	off_t maxCount, off_t startOffset,
+	map<string, Recipient> &recipients, string &lastId)
+{
+	stringstream selectStr;
+
+	// Join custom fields on the page of recipients rather than query them one recipient at a time
+	// Recipients with several fields span as many rows
+	selectStr << "SELECT r.RecipientID, r.RecipientName, r.Status, r.EmailAddress, "
+		"r.ReturnPath, r.StatusCode, r.SendDate, r.AttemptsCount, "
+		"f.CustomFieldName, f.CustomFieldValue FROM (SELECT RecipientID, "
+		"RecipientName, Status, EmailAddress, ReturnPath, StatusCode, SendDate, "
+		"AttemptsCount " << fromClause << " ORDER BY RecipientID LIMIT "
+		<< maxCount << " OFFSET " << startOffset << ") AS r "
+		"LEFT JOIN CustomFields AS f ON f.RecipientID=r.RecipientID "
+		"ORDER BY r.RecipientID;";
+
+	SQLResults *pRecipientResults = m_pDb->executeStatement("%s", selectStr.str().c_str());
+	if ((pRecipientResults == NULL) ||
+		(pRecipientResults->getRowsCount() == 0))
+	{
+		if (pRecipientResults != NULL)
 		{
-			stringstream nameStr;
+			delete pRecipientResults;
+		}
 
-			nameStr << "customfield" << fieldNum;
+		return false;
+	}
+
+	off_t recipientsCount = 0;
+	Recipient *pRecipient = NULL;
+
+	// Rows are sorted by ID, the last one is the largest
+	lastId.clear();
 
-			pRecipient->m_customFields[nameStr.str()] = pRecipientRow->getColumn(1);
+	SQLRow *pRecipientRow = pRecipientResults->nextRow();
+	while (pRecipientRow != NULL)
+	{
+		string recipientId(pRecipientRow->getColumn(0));
+
+		if ((pRecipient == NULL) ||
+			(recipientId != lastId))
+		{
+			Recipient recipObj(recipientId,
+				pRecipientRow->getColumn(1),
+				pRecipientRow->getColumn(2),
+				pRecipientRow->getColumn(3),
+				pRecipientRow->getColumn(4));
+
+			recipObj.m_statusCode = pRecipientRow->getColumn(5);
+			recipObj.m_timeSent = (time_t)atoi(pRecipientRow->getColumn(6).c_str());
+			recipObj.m_numAttempts = (off_t)atoll(pRecipientRow->getColumn(7).c_str());
+
+			clog << "Recipient " << recipObj.m_name << " " << recipObj.m_emailAddress
+				<< " (" << recipObj.m_id << ")" << endl;
+
+			// Add this to the list of recipients
+			recipients[recipObj.m_emailAddress] = recipObj;
+			pRecipient = &recipients[recipObj.m_emailAddress];
+			lastId = recipientId;
+			++recipientsCount;
+		}
+
+		// Recipients without custom fields have NULL ones
+		if (pRecipientRow->getColumn(8).empty() == false)
+		{
+			setCustomField(*pRecipient, pRecipientRow->getColumn(8),
+				pRecipientRow->getColumn(9));
 		}
 
 		// Next row
@@ -162,6 +285,8 @@ bool CampaignSQL::getCustomFields(Recipient *pRecipient)
 	}
 	delete pRecipientResults;
 
+	clog << "Got " << recipientsCount << "/" << maxCount << " recipients" << endl;
+
 	return true;
 }
 
@@ -879,7 +1004,8 @@ off_t CampaignSQL::countRecipients(const string &campaignId,
 
 bool CampaignSQL::getRecipients(const string &campaignId,
 	off_t maxCount, off_t startOffset,
-	map<string, Recipient> &recipients)
+	map<string, Recipient> &recipients,
+	string *pLastId)
 {
 	if ((m_pDb == NULL) ||
 		(campaignId.empty() == true))
@@ -887,79 +1013,58 @@ bool CampaignSQL::getRecipients(const string &campaignId,
 		return false;
 	}
 
-	// Get the actual rows
-	// Don't terminate this statement with a semi-colon
-	string selectSql("SELECT RecipientID, RecipientName, Status, "
-		"EmailAddress, ReturnPath, StatusCode, SendDate, "
-		"AttemptsCount FROM Recipients WHERE CampaignID='");
-	selectSql += m_pDb->escapeString(campaignId);
-	selectSql += "' ORDER BY RecipientID";
+	string fromClause("FROM Recipients WHERE CampaignID='");
+	fromClause += m_pDb->escapeString(campaignId);
+	fromClause += "'";
+	string lastId;
 
-	SQLResults *pRecipientResults = m_pDb->executeStatement(selectSql,
-		startOffset, startOffset + maxCount);
-	if ((pRecipientResults == NULL) ||
-		(pRecipientResults->getRowsCount() == 0))
+	if (getRecipientsAndFields(fromClause, maxCount, startOffset, recipients, lastId) == false)
 	{
-		if (pRecipientResults != NULL)
-		{
-			delete pRecipientResults;
-		}
-
 		return false;
 	}
-	clog << "Got " << pRecipientResults->getRowsCount() << "/" << maxCount << " recipients" << endl;
-
-	SQLRow *pRecipientRow = pRecipientResults->nextRow();
-	while (pRecipientRow != NULL)
+	if (pLastId != NULL)
 	{
-		Recipient recipObj(pRecipientRow->getColumn(0),
-			pRecipientRow->getColumn(1),
-			pRecipientRow->getColumn(2),
-			pRecipientRow->getColumn(3),
-			pRecipientRow->getColumn(4));
-
-		recipObj.m_statusCode = pRecipientRow->getColumn(5);
-		recipObj.m_timeSent = (time_t)atoi(pRecipientRow->getColumn(6).c_str());
-		recipObj.m_numAttempts = (off_t)atoll(pRecipientRow->getColumn(7).c_str());
-		getCustomFields(&recipObj);
+		*pLastId = lastId;
+	}
 
-		clog << "Recipient " << recipObj.m_name << " " << recipObj.m_emailAddress
-			<< " (" << recipObj.m_id << ")" << endl;
+	return true;
+}
 
-		// Add this to the list of recipients
-		recipients[recipObj.m_emailAddress] = recipObj;
+bool CampaignSQL::getNextRecipients(const string &campaignId,
+	off_t maxCount, const string &afterId,
+	map<string, Recipient> &recipients, string &lastId)
+{
+	if ((m_pDb == NULL) ||
+		(campaignId.empty() == true))
+	{
+		return false;
+	}
 
-		// Next row
-		delete pRecipientRow;
-		pRecipientRow = pRecipientResults->nextRow();
+	// Seek past the last recipient seen instead of skipping over all previous ones
+	string fromClause("FROM Recipients WHERE CampaignID='");
+	fromClause += m_pDb->escapeString(campaignId);
+	fromClause += "'";
+	if (afterId.empty() == false)
+	{
+		fromClause += " AND RecipientID>'";
+		fromClause += m_pDb->escapeString(afterId);
+		fromClause += "'";
 	}
-	delete pRecipientResults;
 
-	return true;
+	return getRecipientsAndFields(fromClause, maxCount, 0, recipients, lastId);
 }
 
 bool CampaignSQL::getRecipients(const string &campaignId, const string &status,
 	const string &domainName, off_t maxCount,
-	map<string, Recipient> &recipients)
+	map<string, Recipient> &recipients,
+	const string &afterId, string *pLastId)
 {
-	bool hasRelay = false;
-
 	if ((m_pDb == NULL) ||
 		(campaignId.empty() == true))
 	{
 		return false;
 	}
 
-	// When requesting recipients for the relay, provide all recipients not on the internal domain
-	// or all recipients if the internal domain and the relay are one and the same
-	ConfigurationFile *pConfig = ConfigurationFile::getInstance("");
-	if ((pConfig != NULL) &&
-		(pConfig->m_options.m_internalDomain.empty() == false) &&
-		(pConfig->m_options.m_mailRelayAddress == domainName))
-	{
-		hasRelay = true;
-	}
-
 	string fromClause("FROM Recipients WHERE");
 	if (status.empty() == false)
 	{
@@ -967,76 +1072,104 @@ bool CampaignSQL::getRecipients(const string &campaignId, const string &status,
 		fromClause += m_pDb->escapeString(status);
 		fromClause += "' AND";
 	}
-	if (domainName.empty() == false)
+	fromClause += getDomainClause(domainName);
+	if (afterId.empty() == false)
 	{
-		if (hasRelay == false)
-		{
-			fromClause += " DomainName='";
-			fromClause += m_pDb->escapeString(domainName);
-			fromClause += "' AND";
-		}
-		else if (pConfig->m_options.m_mailRelayAddress != pConfig->m_options.m_internalDomain)
-		{
-			fromClause += " DomainName!='";
-			fromClause += m_pDb->escapeString(pConfig->m_options.m_internalDomain);
-			fromClause += "' AND";
-		}
-		// Else, all domains
+		fromClause += " RecipientID>'";
+		fromClause += m_pDb->escapeString(afterId);
+		fromClause += "' AND";
 	}
 	fromClause += " CampaignID='";
-	fromClause += campaignId;
+	fromClause += m_pDb->escapeString(campaignId);
 	fromClause += "'";
+	string lastId;
 
-	string selectSql("SELECT COUNT(*) ");
-	selectSql += fromClause;
+	if (getRecipientsAndFields(fromClause, maxCount, 0, recipients, lastId) == false)
+	{
+		return false;
+	}
+	if (pLastId != NULL)
+	{
+		*pLastId = lastId;
+	}
 
-	// Get the actual rows
-	// Don't terminate this statement with a semi-colon
-	selectSql = "SELECT RecipientID, RecipientName, Status, "
-		"EmailAddress, ReturnPath, SendDate, AttemptsCount ";
-	selectSql += fromClause;
-	selectSql += " ORDER BY RecipientID";
+	return true;
+}
 
-	SQLResults *pRecipientResults = m_pDb->executeStatement(selectSql,
-		0, maxCount);
-	if ((pRecipientResults == NULL) ||
-		(pRecipientResults->getRowsCount() == 0))
+bool CampaignSQL::leaseRecipients(const string &campaignId,
+	const string &domainName, const string &leaseId,
+	unsigned int leaseDuration, off_t maxCount,
+	map<string, Recipient> &recipients)
+{
+	if ((m_pDb == NULL) ||
+		(campaignId.empty() == true) ||
+		(leaseId.empty() == true))
 	{
-		if (pRecipientResults != NULL)
+		return false;
+	}
+
+	stringstream selectStr;
+
+	// Pick waiting recipients nobody holds a lease on, or whose lease expired
+	// UPDATE with ORDER BY and LIMIT isn't safe for statement-based replication, select their IDs first
+	selectStr << "SELECT RecipientID FROM Recipients WHERE" << getDomainClause(domainName)
+		<< " CampaignID='" << m_pDb->escapeString(campaignId)
+		<< "' AND Status='Waiting' AND LeaseExpiry<UNIX_TIMESTAMP()"
+		<< " ORDER BY RecipientID LIMIT " << maxCount << ";";
+
+	SQLResults *pResults = m_pDb->executeStatement("%s", selectStr.str().c_str());
+	if ((pResults == NULL) ||
+		(pResults->getRowsCount() == 0))
+	{
+		if (pResults != NULL)
 		{
-			delete pRecipientResults;
+			delete pResults;
 		}
 
 		return false;
 	}
-	clog << "Got " << pRecipientResults->getRowsCount() << "/" << maxCount << " recipients" << endl;
-
-	SQLRow *pRecipientRow = pRecipientResults->nextRow();
-	while (pRecipientRow != NULL)
-	{
-		Recipient recipObj(pRecipientRow->getColumn(0),
-			pRecipientRow->getColumn(1),
-			pRecipientRow->getColumn(2),
-			pRecipientRow->getColumn(3),
-			pRecipientRow->getColumn(4));
 
-		recipObj.m_timeSent = (time_t)atoi(pRecipientRow->getColumn(5).c_str());
-		recipObj.m_numAttempts = (off_t)atoll(pRecipientRow->getColumn(6).c_str());
-		getCustomFields(&recipObj);
+	stringstream updateStr;
+	bool firstId = true;
 
-		clog << "Recipient " << recipObj.m_name << " " << recipObj.m_emailAddress
-			<< " (" << recipObj.m_id << ")" << endl;
+	// Claim them, unless another slave got there in between
+	// Sending them moves them out of Waiting, so they won't be claimed again
+	updateStr << "UPDATE Recipients SET LeaseOwner='" << m_pDb->escapeString(leaseId)
+		<< "', LeaseExpiry=UNIX_TIMESTAMP()+" << leaseDuration
+		<< " WHERE RecipientID IN (";
 
-		// Add this to the list of recipients
-		recipients[recipObj.m_emailAddress] = recipObj;
+	SQLRow *pRow = pResults->nextRow();
+	while (pRow != NULL)
+	{
+		if (firstId == false)
+		{
+			updateStr << ",";
+		}
+		updateStr << "'" << m_pDb->escapeString(pRow->getColumn(0)) << "'";
+		firstId = false;
 
 		// Next row
-		delete pRecipientRow;
-		pRecipientRow = pRecipientResults->nextRow();
+		delete pRow;
+		pRow = pResults->nextRow();
 	}
-	delete pRecipientResults;
+	delete pResults;
 
-	return true;
+	updateStr << ") AND Status='Waiting' AND LeaseExpiry<UNIX_TIMESTAMP()";
+
+	if (m_pDb->executeSimpleStatement(updateStr.str()) == false)
+	{
+		return false;
+	}
+
+	// Lease IDs are unique, this returns what the statements above claimed
+	string fromClause("FROM Recipients WHERE LeaseOwner='");
+	fromClause += m_pDb->escapeString(leaseId);
+	fromClause += "' AND Status='Waiting' AND CampaignID='";
+	fromClause += m_pDb->escapeString(campaignId);
+	fromClause += "'";
+	string lastId;
+
+	return getRecipientsAndFields(fromClause, maxCount, 0, recipients, lastId);
 }
 
 bool CampaignSQL::getChangedRecipients(time_t sinceTime, vector<string> &recipientIds)
@@ -99,18 +99,40 @@ class CampaignSQL
 			const std::string &status, const std::string &statusCode,
 			bool isLike);
 
-		/// Gets a list of recipients.
+		/// Gets a list of recipients, sorted by ID.
 		bool getRecipients(const std::string &campaignId,
 			off_t maxCount, off_t startOffset,
-			std::map<std::string, Recipient> &recipients);
+			std::map<std::string, Recipient> &recipients,
+			std::string *pLastId = NULL);
+
+		/**
+		  * Gets the next recipients, sorted by ID, following afterId.
+		  * lastId is set to the ID of the last one, where the next call may resume.
+		  */
+		bool getNextRecipients(const std::string &campaignId,
+			off_t maxCount, const std::string &afterId,
+			std::map<std::string, Recipient> &recipients,
+			std::string &lastId);
 
 		/**
 		  * Gets a list of recipients.
 		  * Status and domain name may be empty if no filtering is desirable.
+		  * If afterId isn't empty, only recipients with a larger ID are returned.
 		  */
 		bool getRecipients(const std::string &campaignId,
 			const std::string &status, const std::string &domainName,
 			off_t maxCount,
+			std::map<std::string, Recipient> &recipients,
+			const std::string &afterId = "",
+			std::string *pLastId = NULL);
+
+		/**
+		  * Leases waiting recipients for the given domain, or whose lease expired.
+		  * leaseId must be unique to this call; leases last leaseDuration seconds.
+		  */
+		bool leaseRecipients(const std::string &campaignId,
+			const std::string &domainName, const std::string &leaseId,
+			unsigned int leaseDuration, off_t maxCount,
 			std::map<std::string, Recipient> &recipients);
 
 		/// Gets a list of recipients that have changed since a given time.
@@ -150,8 +172,18 @@ class CampaignSQL
 		bool getAttachments(const std::string &campaignId,
 			MessageDetails *pDetails);
 
+		static void setCustomField(Recipient &recipient,
+			const std::string &fieldName, const std::string &fieldValue);
+
 		bool getCustomFields(Recipient *pRecipient);
 
+		std::string getDomainClause(const std::string &domainName);
+
+		bool getRecipientsAndFields(const std::string &fromClause,
+			off_t maxCount, off_t startOffset,
+			std::map<std::string, Recipient> &recipients,
+			std::string &lastId);
+
 	private:
 		CampaignSQL(const CampaignSQL &other);
 		CampaignSQL &operator=(const CampaignSQL &other);
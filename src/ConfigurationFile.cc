@@ -38,6 +38,13 @@ ConfigurationFile *ConfigurationFile::m_pInstance = NULL;
 ConfigurationFile::ConfigurationFile(const string &fileName) :
 	m_threaded(true),
 	m_maxSlaves(10),
+	m_maxSlavesPerExchanger(0),
+	m_adaptiveThrottling(false),
+	m_statusFlushSize(500),
+	m_statusFlushInterval(1000),
+	m_statusDurability("EXIT"),
+	m_leaseDuration(0),
+	m_dnsCacheSlots(0),
 	m_hideRecipients(true),
 	m_fileName(fileName)
 {
@@ -256,7 +263,23 @@ bool ConfigurationFile::parse(void)
 						continue;
 					}
 
-					if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"dkprivatekey", 12) == 0)
+					if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"dkprivatekey2", 13) == 0)
+					{
+						m_dkPrivateKey2 = childNodeContent;
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"dkselector2", 11) == 0)
+					{
+						m_dkSelector2 = childNodeContent;
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"dkalgorithm2", 12) == 0)
+					{
+						m_dkAlgorithm2 = childNodeContent;
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"dkalgorithm", 11) == 0)
+					{
+						m_dkAlgorithm = childNodeContent;
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"dkprivatekey", 12) == 0)
 					{
 						m_dkPrivateKey = childNodeContent;
 					}
@@ -283,15 +306,66 @@ bool ConfigurationFile::parse(void)
 							m_threaded = true;
 						}
 					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"maxslavesperexchanger", 21) == 0)
+					{
+						m_maxSlavesPerExchanger = (unsigned int)atoi(childNodeContent.c_str());
+					}
 					else if ((xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"maxthreads", 10) == 0) ||
 						(xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"maxslaves", 9) == 0))
 					{
 						m_maxSlaves = (off_t)atoll(childNodeContent.c_str());
 					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"adaptivethrottling", 18) == 0)
+					{
+						if (strncasecmp(childNodeContent.c_str(), "YES", 3) == 0)
+						{
+							m_adaptiveThrottling = true;
+						}
+						else
+						{
+							m_adaptiveThrottling = false;
+						}
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"statusflushsize", 15) == 0)
+					{
+						m_statusFlushSize = (unsigned int)atoi(childNodeContent.c_str());
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"statusflushinterval", 19) == 0)
+					{
+						m_statusFlushInterval = (unsigned int)atoi(childNodeContent.c_str());
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"statusdurability", 16) == 0)
+					{
+						m_statusDurability = childNodeContent;
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"leaseduration", 13) == 0)
+					{
+						m_leaseDuration = (unsigned int)atoi(childNodeContent.c_str());
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"dnscachefile", 12) == 0)
+					{
+						m_dnsCacheFile = childNodeContent;
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"dnscacheslots", 13) == 0)
+					{
+						m_dnsCacheSlots = (unsigned int)atoi(childNodeContent.c_str());
+					}
 					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"dsnnotify", 9) == 0)
 					{
 						m_options.m_dsnNotify = childNodeContent;
 					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"connectionidletimeout", 21) == 0)
+					{
+						m_options.m_connectionIdleTimeout = (unsigned int)atoi(childNodeContent.c_str());
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"maxmsgsperconnection", 20) == 0)
+					{
+						m_options.m_maxMsgsPerConnection = (unsigned int)atoi(childNodeContent.c_str());
+					}
+					else if (xmlStrncmp(pCurrentSlaveNode->name, BAD_CAST"maxconnectionsperserver", 23) == 0)
+					{
+						m_options.m_maxConnectionsPerServer = (unsigned int)atoi(childNodeContent.c_str());
+					}
 				}
 			}
 			else if (xmlStrncmp(pCurrentNode->name, BAD_CAST"endofcampaign", 13) == 0)
@@ -526,14 +600,13 @@ bool ConfigurationFile::parse(void)
 bool ConfigurationFile::findDomainLimits(DomainLimits &domainLimits,
 	bool fallbackToARecord)
 {
-	bool wasFound = false, isUsable = true;
+	bool isUsable = true;
 
 	pthread_mutex_lock(&m_mutex);
 	set<DomainLimits>::iterator limitIter = m_domainLimits.find(domainLimits);
 	if (limitIter != m_domainLimits.end())
 	{
 		domainLimits = *limitIter;
-		wasFound = true;
 
 #ifdef DEBUG
 		clog << "ConfigurationFile::findDomainLimits: " << domainLimits.m_domainName
@@ -541,25 +614,45 @@ bool ConfigurationFile::findDomainLimits(DomainLimits &domainLimits,
 #endif
 	}
 
+	// Records found earlier may have expired since
+	time_t timeNow = time(NULL);
+	for (set<ResourceRecord>::const_iterator recordIter = domainLimits.m_mxRecords.begin();
+		recordIter != domainLimits.m_mxRecords.end(); ++recordIter)
+	{
+		if (recordIter->hasExpired(timeNow) == true)
+		{
+			domainLimits.m_mxRecords.clear();
+			break;
+		}
+	}
+
 	// Get the MX records for this domain if necessary
 	if (domainLimits.m_mxRecords.empty() == true)
 	{
+		// Don't hold up other threads while waiting on DNS
+		pthread_mutex_unlock(&m_mutex);
 		if (Resolver::queryMXRecords(domainLimits.m_domainName, domainLimits.m_mxRecords) == false)
 		{
 			if (fallbackToARecord == true)
 			{
-				// No MX record for this domain, fallback to A records
-				isUsable = Resolver::queryARecords(domainLimits.m_domainName,
+				// No MX record for this domain, fallback to A and AAAA records
+				bool hasIPv4 = Resolver::queryARecords(domainLimits.m_domainName,
 					domainLimits.m_mxRecords);
+				bool hasIPv6 = Resolver::queryAAAARecords(domainLimits.m_domainName,
+					domainLimits.m_mxRecords);
+
+				isUsable = (hasIPv4 || hasIPv6);
 			}
 			else
 			{
 				isUsable = false;
 			}
 		}
+		pthread_mutex_lock(&m_mutex);
 
-		// Insert or update this entry
-		if (wasFound == true)
+		// Insert or update this entry, which may have changed in the meantime
+		limitIter = m_domainLimits.find(domainLimits);
+		if (limitIter != m_domainLimits.end())
 		{
 			m_domainLimits.erase(limitIter);
 		}
@@ -57,8 +57,20 @@ class ConfigurationFile
 		std::string m_dkPublicKey;
 		std::string m_dkDomain;
 		std::string m_dkSelector;
+		std::string m_dkAlgorithm;
+		std::string m_dkPrivateKey2;
+		std::string m_dkSelector2;
+		std::string m_dkAlgorithm2;
 		bool m_threaded;
 		off_t m_maxSlaves;
+		unsigned int m_maxSlavesPerExchanger;
+		bool m_adaptiveThrottling;
+		unsigned int m_statusFlushSize;
+		unsigned int m_statusFlushInterval;
+		std::string m_statusDurability;
+		unsigned int m_leaseDuration;
+		std::string m_dnsCacheFile;
+		unsigned int m_dnsCacheSlots;
 		std::string m_endOfCampaignCommand;
 		std::string m_spamCheckCommand;
 		bool m_hideRecipients;
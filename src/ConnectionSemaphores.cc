@@ -0,0 +1,441 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <iostream>
+#include <sstream>
+
+#include "ConnectionSemaphores.h"
+
+// Bump when the layout of the segment changes
+#define CONNECTION_SEMAPHORES_MAGIC 0x474d4353
+#define CONNECTION_SEMAPHORES_VERSION 1
+#define CONNECTION_SEMAPHORES_SLOTS 1024
+// Slots looked at for any given destination
+#define CONNECTION_SEMAPHORES_PROBES 16
+// Connections to one destination that can be accounted for
+#define CONNECTION_SEMAPHORES_MAX_HOLDERS 64
+
+using std::clog;
+using std::endl;
+using std::string;
+using std::stringstream;
+
+/// A destination's semaphore as stored in shared memory.
+class ConnectionSlot
+{
+	public:
+		uint64_t m_key;
+		int m_count;
+		pid_t m_holders[CONNECTION_SEMAPHORES_MAX_HOLDERS];
+
+};
+
+/// The layout of the shared memory segment.
+class ConnectionSegment
+{
+	public:
+		unsigned int m_magic;
+		unsigned int m_version;
+		ConnectionSlot m_slots[CONNECTION_SEMAPHORES_SLOTS];
+
+};
+
+// Set once running out of slots has been logged
+static bool g_loggedNoSlot = false;
+
+static uint64_t hashDestination(const string &destination)
+{
+	// FNV-1a, case insensitive
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (string::size_type pos = 0; pos < destination.length(); ++pos)
+	{
+		hash ^= (unsigned char)tolower((unsigned char)destination[pos]);
+		hash *= 1099511628211ULL;
+	}
+
+	// 0 marks free slots
+	if (hash == 0)
+	{
+		hash = 1;
+	}
+
+	return hash;
+}
+
+ConnectionSemaphores *ConnectionSemaphores::m_pInstance = NULL;
+pthread_mutex_t ConnectionSemaphores::m_instanceMutex = PTHREAD_MUTEX_INITIALIZER;
+
+ConnectionSemaphores::ConnectionSemaphores() :
+	m_pSegment(NULL),
+	m_segmentSize(sizeof(ConnectionSegment)),
+	m_isShared(false)
+{
+	stringstream nameStr;
+
+	// One segment per user, so that permissions don't get in the way
+	nameStr << "/givemail-connections-" << getuid();
+	if (attachSegment(nameStr.str()) == true)
+	{
+		m_isShared = true;
+		return;
+	}
+
+	// Fall back to memory shared by this process' threads
+	void *pAddress = mmap(NULL, m_segmentSize, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (pAddress == MAP_FAILED)
+	{
+		clog << "Couldn't allocate connection semaphores" << endl;
+		return;
+	}
+
+	m_pSegment = static_cast<ConnectionSegment*>(pAddress);
+	m_pSegment->m_magic = CONNECTION_SEMAPHORES_MAGIC;
+	m_pSegment->m_version = CONNECTION_SEMAPHORES_VERSION;
+}
+
+ConnectionSemaphores::~ConnectionSemaphores()
+{
+	if (m_pSegment != NULL)
+	{
+		munmap(m_pSegment, m_segmentSize);
+	}
+}
+
+ConnectionSemaphores *ConnectionSemaphores::getInstance(void)
+{
+	pthread_mutex_lock(&m_instanceMutex);
+	if (m_pInstance == NULL)
+	{
+		m_pInstance = new ConnectionSemaphores();
+	}
+	pthread_mutex_unlock(&m_instanceMutex);
+
+	return m_pInstance;
+}
+
+bool ConnectionSemaphores::tryAcquire(const string &destination, unsigned int maxCount,
+	int &handle)
+{
+	handle = -1;
+
+	// Don't hold up sending if connections can't be accounted for
+	if (m_pSegment == NULL)
+	{
+		return true;
+	}
+
+	int maxHolders = (int)maxCount;
+	if ((maxHolders <= 0) ||
+		(maxHolders > CONNECTION_SEMAPHORES_MAX_HOLDERS))
+	{
+		maxHolders = CONNECTION_SEMAPHORES_MAX_HOLDERS;
+	}
+	uint64_t key = hashDestination(destination);
+	int slotNum = -1;
+	bool reclaimed = false;
+
+	while (slotNum < 0)
+	{
+		slotNum = findSlot(key);
+		if (slotNum < 0)
+		{
+			if (__sync_bool_compare_and_swap(&g_loggedNoSlot, false, true) == true)
+			{
+				clog << "No connection semaphore left, some connections aren't capped" << endl;
+			}
+#ifdef DEBUG
+			clog << "ConnectionSemaphores::tryAcquire: no semaphore left for " << destination << endl;
+#endif
+			return true;
+		}
+
+		ConnectionSlot &slot = m_pSegment->m_slots[slotNum];
+		int count = slot.m_count;
+
+		if (count >= maxHolders)
+		{
+			// Processes that died can't give theirs back
+			if ((reclaimed == true) ||
+				(reclaimConnections(slotNum) == 0))
+			{
+				return false;
+			}
+			reclaimed = true;
+			slotNum = -1;
+			continue;
+		}
+
+		if (__sync_bool_compare_and_swap(&slot.m_count, count, count + 1) == false)
+		{
+			slotNum = -1;
+		}
+		else if (slot.m_key != key)
+		{
+			// The slot went to another destination in the meantime
+			__sync_fetch_and_sub(&slot.m_count, 1);
+			slotNum = -1;
+		}
+	}
+
+	ConnectionSlot &slot = m_pSegment->m_slots[slotNum];
+
+	// There are at least as many free holders as the count allows
+	pid_t pid = getpid();
+	while (true)
+	{
+		for (int holderNum = 0; holderNum < CONNECTION_SEMAPHORES_MAX_HOLDERS; ++holderNum)
+		{
+			if ((slot.m_holders[holderNum] == 0) &&
+				(__sync_bool_compare_and_swap(&slot.m_holders[holderNum], 0, pid) == true))
+			{
+#ifdef DEBUG
+				clog << "ConnectionSemaphores::tryAcquire: " << destination << " "
+					<< slot.m_count << "/" << maxHolders << endl;
+#endif
+				handle = (slotNum * CONNECTION_SEMAPHORES_MAX_HOLDERS) + holderNum;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void ConnectionSemaphores::release(int handle)
+{
+	if ((m_pSegment == NULL) ||
+		(handle < 0) ||
+		(handle >= CONNECTION_SEMAPHORES_SLOTS * CONNECTION_SEMAPHORES_MAX_HOLDERS))
+	{
+		return;
+	}
+
+	ConnectionSlot &slot = m_pSegment->m_slots[handle / CONNECTION_SEMAPHORES_MAX_HOLDERS];
+	int holderNum = handle % CONNECTION_SEMAPHORES_MAX_HOLDERS;
+
+	// Free the holder before the count, so that counted holders can always be found
+	if (__sync_bool_compare_and_swap(&slot.m_holders[holderNum], getpid(), 0) == true)
+	{
+		__sync_fetch_and_sub(&slot.m_count, 1);
+	}
+}
+
+bool ConnectionSemaphores::isShared(void) const
+{
+	return m_isShared;
+}
+
+bool ConnectionSemaphores::attachSegment(const string &segmentName)
+{
+	bool isCreator = true;
+
+	int segmentFd = shm_open(segmentName.c_str(), O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+	if ((segmentFd < 0) &&
+		(errno == EEXIST))
+	{
+		isCreator = false;
+		segmentFd = shm_open(segmentName.c_str(), O_RDWR, S_IRUSR|S_IWUSR);
+	}
+	if (segmentFd < 0)
+	{
+		clog << "Couldn't open connection semaphores " << segmentName << endl;
+		return false;
+	}
+
+	// Another user may have created it to hold connections on this one's behalf
+	struct stat segmentStat;
+	if ((fstat(segmentFd, &segmentStat) != 0) ||
+		(segmentStat.st_uid != getuid()) ||
+		((segmentStat.st_mode & (S_IRWXG|S_IRWXO)) != 0))
+	{
+		clog << "Connection semaphores " << segmentName << " are not private" << endl;
+		close(segmentFd);
+		return false;
+	}
+
+	if ((isCreator == true) &&
+		(ftruncate(segmentFd, (off_t)m_segmentSize) != 0))
+	{
+		clog << "Couldn't size connection semaphores " << segmentName << endl;
+		close(segmentFd);
+		shm_unlink(segmentName.c_str());
+		return false;
+	}
+
+	// The creator may not have sized it yet
+	for (unsigned int attemptNum = 0; attemptNum < 100; ++attemptNum)
+	{
+		if ((fstat(segmentFd, &segmentStat) == 0) &&
+			(segmentStat.st_size >= (off_t)m_segmentSize))
+		{
+			break;
+		}
+		usleep(10000);
+	}
+	if (segmentStat.st_size < (off_t)m_segmentSize)
+	{
+		clog << "Connection semaphores " << segmentName << " have an unexpected size" << endl;
+		close(segmentFd);
+		return false;
+	}
+
+	void *pAddress = mmap(NULL, m_segmentSize, PROT_READ|PROT_WRITE,
+		MAP_SHARED, segmentFd, 0);
+	close(segmentFd);
+	if (pAddress == MAP_FAILED)
+	{
+		clog << "Couldn't map connection semaphores " << segmentName << endl;
+		return false;
+	}
+
+	ConnectionSegment *pSegment = static_cast<ConnectionSegment*>(pAddress);
+
+	if (isCreator == true)
+	{
+		// Slots are zeroed out, and thus free
+		pSegment->m_version = CONNECTION_SEMAPHORES_VERSION;
+		__sync_synchronize();
+		pSegment->m_magic = CONNECTION_SEMAPHORES_MAGIC;
+	}
+	else
+	{
+		// Wait for the creator to initialize it
+		for (unsigned int attemptNum = 0; attemptNum < 100; ++attemptNum)
+		{
+			if (pSegment->m_magic == CONNECTION_SEMAPHORES_MAGIC)
+			{
+				break;
+			}
+			usleep(10000);
+		}
+		__sync_synchronize();
+		if ((pSegment->m_magic != CONNECTION_SEMAPHORES_MAGIC) ||
+			(pSegment->m_version != CONNECTION_SEMAPHORES_VERSION))
+		{
+			clog << "Connection semaphores " << segmentName << " were created by another version" << endl;
+			munmap(pAddress, m_segmentSize);
+			return false;
+		}
+	}
+
+	m_pSegment = pSegment;
+#ifdef DEBUG
+	clog << "ConnectionSemaphores::attachSegment: attached to " << segmentName << ", creator " << isCreator << endl;
+#endif
+
+	return true;
+}
+
+int ConnectionSemaphores::findSlot(uint64_t key)
+{
+	unsigned int firstSlotNum = (unsigned int)(key % CONNECTION_SEMAPHORES_SLOTS);
+
+	// Destinations keep their slot while they have connections
+	for (unsigned int probeNum = 0; probeNum < CONNECTION_SEMAPHORES_PROBES; ++probeNum)
+	{
+		unsigned int slotNum = (firstSlotNum + probeNum) % CONNECTION_SEMAPHORES_SLOTS;
+		ConnectionSlot &slot = m_pSegment->m_slots[slotNum];
+
+		if ((slot.m_key == key) ||
+			((slot.m_key == 0) &&
+			((__sync_bool_compare_and_swap(&slot.m_key, 0, key) == true) ||
+			(slot.m_key == key))))
+		{
+			return (int)slotNum;
+		}
+	}
+
+	// All taken, hand over a slot that no connection is counted against
+	// Holders are freed before counts, so a zero count means no holder is left
+	for (unsigned int probeNum = 0; probeNum < CONNECTION_SEMAPHORES_PROBES; ++probeNum)
+	{
+		unsigned int slotNum = (firstSlotNum + probeNum) % CONNECTION_SEMAPHORES_SLOTS;
+		ConnectionSlot &slot = m_pSegment->m_slots[slotNum];
+		uint64_t slotKey = slot.m_key;
+
+		if ((slot.m_count > 0) &&
+			(reclaimConnections((int)slotNum) == 0))
+		{
+			continue;
+		}
+		if ((slot.m_count == 0) &&
+			(__sync_bool_compare_and_swap(&slot.m_key, slotKey, key) == true))
+		{
+#ifdef DEBUG
+			clog << "ConnectionSemaphores::findSlot: reused slot " << slotNum << endl;
+#endif
+			break;
+		}
+	}
+
+	// Another process may have taken a different slot for the same destination,
+	// both use whichever comes first
+	for (unsigned int probeNum = 0; probeNum < CONNECTION_SEMAPHORES_PROBES; ++probeNum)
+	{
+		unsigned int slotNum = (firstSlotNum + probeNum) % CONNECTION_SEMAPHORES_SLOTS;
+
+		if (m_pSegment->m_slots[slotNum].m_key == key)
+		{
+			return (int)slotNum;
+		}
+	}
+
+	return -1;
+}
+
+unsigned int ConnectionSemaphores::reclaimConnections(int slotNum)
+{
+	ConnectionSlot &slot = m_pSegment->m_slots[slotNum];
+	unsigned int reclaimedCount = 0;
+
+	for (int holderNum = 0; holderNum < CONNECTION_SEMAPHORES_MAX_HOLDERS; ++holderNum)
+	{
+		pid_t holderPid = slot.m_holders[holderNum];
+
+		if ((holderPid == 0) ||
+			(kill(holderPid, 0) == 0) ||
+			(errno != ESRCH))
+		{
+			continue;
+		}
+
+		if (__sync_bool_compare_and_swap(&slot.m_holders[holderNum], holderPid, 0) == true)
+		{
+			__sync_fetch_and_sub(&slot.m_count, 1);
+			++reclaimedCount;
+		}
+	}
+	if (reclaimedCount > 0)
+	{
+		clog << "Reclaimed " << reclaimedCount << " connections held by slaves that exited" << endl;
+	}
+
+	return reclaimedCount;
+}
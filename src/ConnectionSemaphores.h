@@ -0,0 +1,81 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _CONNECTIONSEMAPHORES_H_
+#define _CONNECTIONSEMAPHORES_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+
+class ConnectionSegment;
+
+/**
+  * Counting semaphores, one per destination, shared by all threads and
+  * processes of this user. Slaves of all running campaigns go through them
+  * before connecting, so that limits hold globally. They don't lock:
+  * counts are updated with atomic operations, and connections held by
+  * processes that died are reclaimed.
+  */
+class ConnectionSemaphores
+{
+	public:
+		virtual ~ConnectionSemaphores();
+
+		/// Returns the semaphores.
+		static ConnectionSemaphores *getInstance(void);
+
+		/**
+		  * Takes one of maxCount connections to destination, without waiting.
+		  * Returns false if all are taken. handle is what to release it with,
+		  * -1 if the connection couldn't be accounted for.
+		  */
+		bool tryAcquire(const std::string &destination, unsigned int maxCount,
+			int &handle);
+
+		/// Gives back a connection taken with tryAcquire().
+		void release(int handle);
+
+		/// Returns true if semaphores are shared with other processes.
+		bool isShared(void) const;
+
+	protected:
+		static ConnectionSemaphores *m_pInstance;
+		static pthread_mutex_t m_instanceMutex;
+		ConnectionSegment *m_pSegment;
+		size_t m_segmentSize;
+		bool m_isShared;
+
+		ConnectionSemaphores();
+
+		bool attachSegment(const std::string &segmentName);
+
+		int findSlot(uint64_t key);
+
+		unsigned int reclaimConnections(int slotNum);
+
+	private:
+		// ConnectionSemaphores objects cannot be copied.
+		ConnectionSemaphores(const ConnectionSemaphores &other);
+		ConnectionSemaphores &operator=(const ConnectionSemaphores &other);
+
+};
+
+#endif // _CONNECTIONSEMAPHORES_H_
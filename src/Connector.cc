@@ -0,0 +1,252 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+#include "Connector.h"
+
+// Milliseconds to wait before starting the next attempt, as recommended by RFC 8305
+#define CONNECTION_ATTEMPT_DELAY 250
+
+using std::clog;
+using std::endl;
+using std::string;
+using std::stringstream;
+using std::vector;
+using std::min;
+using std::max;
+
+static long long getTimeInMs(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (long long)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+Connector::Connector()
+{
+}
+
+int Connector::connectFirst(const vector<string> &addresses,
+	unsigned int port, unsigned int timeout,
+	string &connectedAddress)
+{
+	vector<struct pollfd> pollFds;
+	vector<string> attemptAddresses;
+	vector<string>::size_type addressNum = 0;
+	long long timeNow = getTimeInMs();
+	long long deadline = timeNow + (long long)timeout * 1000;
+	long long nextAttemptTime = timeNow;
+	int connectedFd = -1;
+
+	while ((connectedFd < 0) &&
+		(timeNow < deadline))
+	{
+		// Start the next attempt when it's time, or when all others have failed
+		if ((addressNum < addresses.size()) &&
+			((timeNow >= nextAttemptTime) || (pollFds.empty() == true)))
+		{
+			int attemptFd = startAttempt(addresses[addressNum], port);
+
+			if (attemptFd >= 0)
+			{
+				struct pollfd pollFd;
+
+				pollFd.fd = attemptFd;
+				pollFd.events = POLLOUT;
+				pollFd.revents = 0;
+				pollFds.push_back(pollFd);
+				attemptAddresses.push_back(addresses[addressNum]);
+				nextAttemptTime = timeNow + CONNECTION_ATTEMPT_DELAY;
+			}
+			++addressNum;
+			continue;
+		}
+		if (pollFds.empty() == true)
+		{
+			// All attempts failed
+			break;
+		}
+
+		long long waitTime = deadline - timeNow;
+		if (addressNum < addresses.size())
+		{
+			waitTime = min(waitTime, nextAttemptTime - timeNow);
+		}
+
+		int readyCount = poll(&pollFds[0], pollFds.size(), (int)max(waitTime, 0LL));
+		timeNow = getTimeInMs();
+		if (readyCount <= 0)
+		{
+			continue;
+		}
+
+		vector<struct pollfd>::size_type attemptNum = 0;
+		while (attemptNum < pollFds.size())
+		{
+			int socketError = 0;
+			socklen_t errorLength = sizeof(socketError);
+
+			if (pollFds[attemptNum].revents == 0)
+			{
+				++attemptNum;
+				continue;
+			}
+
+			if ((getsockopt(pollFds[attemptNum].fd, SOL_SOCKET, SO_ERROR, &socketError, &errorLength) == 0) &&
+				(socketError == 0))
+			{
+				// The first one wins
+				connectedFd = pollFds[attemptNum].fd;
+				connectedAddress = attemptAddresses[attemptNum];
+				pollFds.erase(pollFds.begin() + attemptNum);
+				attemptAddresses.erase(attemptAddresses.begin() + attemptNum);
+				break;
+			}
+
+#ifdef DEBUG
+			clog << "Connector::connectFirst: couldn't connect to " << attemptAddresses[attemptNum]
+				<< ":" << port << ", error " << socketError << endl;
+#endif
+			close(pollFds[attemptNum].fd);
+			pollFds.erase(pollFds.begin() + attemptNum);
+			attemptAddresses.erase(attemptAddresses.begin() + attemptNum);
+
+			// Don't wait to try the next address
+			nextAttemptTime = timeNow;
+		}
+	}
+
+	// Abandon the losers
+	for (vector<struct pollfd>::const_iterator pollIter = pollFds.begin();
+		pollIter != pollFds.end(); ++pollIter)
+	{
+		close(pollIter->fd);
+	}
+
+	if (connectedFd >= 0)
+	{
+		// Callers expect a blocking socket
+		int flags = fcntl(connectedFd, F_GETFL, 0);
+		if (flags >= 0)
+		{
+			fcntl(connectedFd, F_SETFL, flags & ~O_NONBLOCK);
+		}
+
+		if ((addresses.empty() == false) &&
+			(connectedAddress != addresses.front()))
+		{
+			clog << "Connected to " << connectedAddress << ":" << port
+				<< " rather than " << addresses.front() << endl;
+		}
+	}
+
+	return connectedFd;
+}
+
+void Connector::interleaveFamilies(vector<string> &addresses)
+{
+	vector<string> ipv6Addresses, ipv4Addresses;
+
+	for (vector<string>::const_iterator addressIter = addresses.begin();
+		addressIter != addresses.end(); ++addressIter)
+	{
+		if (addressIter->find(':') != string::npos)
+		{
+			ipv6Addresses.push_back(*addressIter);
+		}
+		else
+		{
+			ipv4Addresses.push_back(*addressIter);
+		}
+	}
+
+	addresses.clear();
+	for (vector<string>::size_type addressNum = 0;
+		addressNum < max(ipv6Addresses.size(), ipv4Addresses.size()); ++addressNum)
+	{
+		if (addressNum < ipv6Addresses.size())
+		{
+			addresses.push_back(ipv6Addresses[addressNum]);
+		}
+		if (addressNum < ipv4Addresses.size())
+		{
+			addresses.push_back(ipv4Addresses[addressNum]);
+		}
+	}
+}
+
+int Connector::startAttempt(const string &address, unsigned int port)
+{
+	struct addrinfo hints;
+	struct addrinfo *pResults = NULL;
+	stringstream portStr;
+
+	// Addresses are picked from A and AAAA records
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV;
+	portStr << port;
+	if ((getaddrinfo(address.c_str(), portStr.str().c_str(), &hints, &pResults) != 0) ||
+		(pResults == NULL))
+	{
+		clog << "Couldn't parse address " << address << endl;
+		return -1;
+	}
+
+	int attemptFd = socket(pResults->ai_family, SOCK_STREAM, 0);
+	if (attemptFd < 0)
+	{
+		// No IPv6 on this host, for instance
+		freeaddrinfo(pResults);
+		return -1;
+	}
+
+	int flags = fcntl(attemptFd, F_GETFL, 0);
+	if ((flags < 0) ||
+		(fcntl(attemptFd, F_SETFL, flags | O_NONBLOCK) < 0) ||
+		((connect(attemptFd, pResults->ai_addr, pResults->ai_addrlen) < 0) &&
+		(errno != EINPROGRESS)))
+	{
+#ifdef DEBUG
+		clog << "Connector::startAttempt: couldn't connect to " << address
+			<< ":" << port << ", error " << errno << endl;
+#endif
+		freeaddrinfo(pResults);
+		close(attemptFd);
+		return -1;
+	}
+	freeaddrinfo(pResults);
+
+	return attemptFd;
+}
@@ -0,0 +1,56 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _CONNECTOR_H_
+#define _CONNECTOR_H_
+
+#include <string>
+#include <vector>
+
+/**
+  * Races TCP connections to a server's addresses, in the manner of
+  * RFC 8305 "Happy Eyeballs".
+  */
+class Connector
+{
+	public:
+		/**
+		  * Starts connecting to addresses in order, one every 250 ms or as soon
+		  * as the previous attempt fails, and returns the first socket that
+		  * connects, or -1 if none did within timeout seconds.
+		  */
+		static int connectFirst(const std::vector<std::string> &addresses,
+			unsigned int port, unsigned int timeout,
+			std::string &connectedAddress);
+
+		/// Orders addresses so that IPv6 and IPv4 ones alternate, IPv6 first.
+		static void interleaveFamilies(std::vector<std::string> &addresses);
+
+	protected:
+		Connector();
+
+		static int startAttempt(const std::string &address, unsigned int port);
+
+	private:
+		Connector(const Connector &other);
+		Connector &operator=(const Connector &other);
+
+};
+
+#endif // _CONNECTOR_H_
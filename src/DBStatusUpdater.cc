@@ -18,6 +18,9 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <errno.h>
+#include <strings.h>
+#include <sys/time.h>
 #include <iostream>
 #include <algorithm>
 #include <sstream>
@@ -29,11 +32,393 @@ using std::endl;
 using std::min;
 using std::string;
 using std::stringstream;
+using std::map;
+using std::vector;
+using std::pair;
 
-DBStatusUpdater::DBStatusUpdater(SQLDB *pDb, const string &campaignId) :
+StatusUpdate::StatusUpdate(const string &campaignId,
+	const string &recipientId, const string &emailAddress,
+	const string &status, int statusCode) :
+	m_campaignId(campaignId),
+	m_recipientId(recipientId),
+	m_emailAddress(emailAddress),
+	m_status(status),
+	m_statusCode(statusCode)
+{
+}
+
+StatusUpdate::StatusUpdate(const StatusUpdate &other) :
+	m_campaignId(other.m_campaignId),
+	m_recipientId(other.m_recipientId),
+	m_emailAddress(other.m_emailAddress),
+	m_status(other.m_status),
+	m_statusCode(other.m_statusCode)
+{
+}
+
+StatusUpdate::~StatusUpdate()
+{
+}
+
+StatusUpdate &StatusUpdate::operator=(const StatusUpdate &other)
+{
+	if (this != &other)
+	{
+		m_campaignId = other.m_campaignId;
+		m_recipientId = other.m_recipientId;
+		m_emailAddress = other.m_emailAddress;
+		m_status = other.m_status;
+		m_statusCode = other.m_statusCode;
+	}
+
+	return *this;
+}
+
+DBStatusWriter::DBStatusWriter(SQLDB *pDb, unsigned int flushSize,
+	unsigned int flushInterval, Durability durability) :
+	m_pDb(pDb),
+	m_flushSize(flushSize),
+	m_flushInterval(flushInterval),
+	m_durability(durability),
+	m_isRunning(false),
+	m_mustQuit(false),
+	m_mustFlush(false),
+	m_queuedCount(0),
+	m_writtenCount(0)
+{
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_queueCond, NULL);
+	pthread_cond_init(&m_writtenCond, NULL);
+}
+
+DBStatusWriter::~DBStatusWriter()
+{
+	stop();
+	pthread_cond_destroy(&m_writtenCond);
+	pthread_cond_destroy(&m_queueCond);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+DBStatusWriter::Durability DBStatusWriter::toDurability(const string &name)
+{
+	if (strncasecmp(name.c_str(), "NONE", 4) == 0)
+	{
+		return DURABILITY_NONE;
+	}
+	else if (strncasecmp(name.c_str(), "SYNC", 4) == 0)
+	{
+		return DURABILITY_SYNC;
+	}
+
+	return DURABILITY_EXIT;
+}
+
+bool DBStatusWriter::writeUpdates(SQLDB *pDb, const vector<StatusUpdate> &updates)
+{
+	map<string, string> statements;
+
+	if ((pDb == NULL) ||
+		(updates.empty() == true))
+	{
+		return true;
+	}
+
+	// Group updates that set the same status
+	for (vector<StatusUpdate>::const_iterator updateIter = updates.begin();
+		updateIter != updates.end(); ++updateIter)
+	{
+		bool byId = !updateIter->m_recipientId.empty();
+		stringstream keyStr;
+
+		keyStr << byId << "," << updateIter->m_statusCode << ","
+			<< updateIter->m_status << "," << updateIter->m_campaignId;
+
+		map<string, string>::iterator statIter = statements.find(keyStr.str());
+		if (statIter == statements.end())
+		{
+			stringstream updateStr;
+
+			updateStr << "UPDATE Recipients SET Status='" << pDb->escapeString(updateIter->m_status)
+				<< "', StatusCode=" << updateIter->m_statusCode
+				<< ", SendDate=UNIX_TIMESTAMP(), AttemptsCount=AttemptsCount+1 WHERE ";
+			if (byId == true)
+			{
+				updateStr << "RecipientID IN (";
+			}
+			else
+			{
+				// Email addresses are unique within a campaign
+				updateStr << "CampaignID='" << pDb->escapeString(updateIter->m_campaignId)
+					<< "' AND EmailAddress IN (";
+			}
+
+			statIter = statements.insert(pair<string, string>(keyStr.str(), updateStr.str())).first;
+		}
+		else
+		{
+			statIter->second += ",";
+		}
+
+		statIter->second += "'";
+		if (byId == true)
+		{
+			statIter->second += pDb->escapeString(updateIter->m_recipientId);
+		}
+		else
+		{
+			statIter->second += pDb->escapeString(updateIter->m_emailAddress);
+		}
+		statIter->second += "'";
+	}
+
+	bool inTransaction = pDb->beginTransaction();
+	bool allWritten = true;
+
+	for (map<string, string>::iterator statIter = statements.begin();
+		statIter != statements.end(); ++statIter)
+	{
+		statIter->second += ")";
+
+		if (pDb->executeSimpleStatement(statIter->second) == false)
+		{
+			allWritten = false;
+			break;
+		}
+	}
+
+	if (inTransaction == true)
+	{
+		if (allWritten == true)
+		{
+			allWritten = pDb->endTransaction();
+		}
+		else
+		{
+			pDb->rollbackTransaction();
+		}
+	}
+	if (allWritten == false)
+	{
+		clog << "Couldn't write " << updates.size() << " status updates" << endl;
+	}
+
+	return allWritten;
+}
+
+bool DBStatusWriter::start(void)
+{
+	if (m_isRunning == true)
+	{
+		return true;
+	}
+
+	m_mustQuit = false;
+	if (pthread_create(&m_threadId, NULL, threadFunc, (void*)this) != 0)
+	{
+		clog << "Couldn't start status writer" << endl;
+		return false;
+	}
+	m_isRunning = true;
+
+	return true;
+}
+
+void DBStatusWriter::queueUpdate(const StatusUpdate &update)
+{
+	if (m_isRunning == false)
+	{
+		// Write it straight away
+		writeUpdates(m_pDb, vector<StatusUpdate>(1, update));
+		return;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	m_updates.push_back(update);
+	m_pendingKeys.insert(getPendingKey(update.m_campaignId,
+		update.m_recipientId, update.m_emailAddress));
+	++m_queuedCount;
+	if (m_updates.size() >= m_flushSize)
+	{
+		pthread_cond_signal(&m_queueCond);
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void DBStatusWriter::flush(void)
+{
+	if (m_durability == DURABILITY_SYNC)
+	{
+		waitForWrites();
+	}
+}
+
+void DBStatusWriter::waitForWrites(void)
+{
+	if (m_isRunning == false)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	unsigned long long queuedCount = m_queuedCount;
+
+	// Updates queued by other threads meanwhile go in the same batch
+	m_mustFlush = true;
+	pthread_cond_signal(&m_queueCond);
+	while ((m_writtenCount < queuedCount) &&
+		(m_isRunning == true))
+	{
+		pthread_cond_wait(&m_writtenCond, &m_mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+unsigned int DBStatusWriter::skipPending(const string &campaignId,
+	map<string, Recipient> &recipients)
+{
+	unsigned int skippedCount = 0;
+
+	pthread_mutex_lock(&m_mutex);
+	if (m_pendingKeys.empty() == false)
+	{
+		map<string, Recipient>::iterator recipIter = recipients.begin();
+		while (recipIter != recipients.end())
+		{
+			// Updates are keyed by ID when it was known, by email address otherwise
+			if ((m_pendingKeys.find(getPendingKey(campaignId, recipIter->second.m_id, "")) != m_pendingKeys.end()) ||
+				(m_pendingKeys.find(getPendingKey(campaignId, "", recipIter->second.m_emailAddress)) != m_pendingKeys.end()))
+			{
+				recipients.erase(recipIter++);
+				++skippedCount;
+				continue;
+			}
+
+			++recipIter;
+		}
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	return skippedCount;
+}
+
+void DBStatusWriter::stop(void)
+{
+	if (m_isRunning == false)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	if ((m_durability == DURABILITY_NONE) &&
+		(m_updates.empty() == false))
+	{
+		clog << "Dropping " << m_updates.size() << " status updates" << endl;
+		unlockedForget(m_updates);
+		m_writtenCount += m_updates.size();
+		m_updates.clear();
+	}
+	m_mustQuit = true;
+	pthread_cond_signal(&m_queueCond);
+	pthread_mutex_unlock(&m_mutex);
+
+	pthread_join(m_threadId, NULL);
+
+	pthread_mutex_lock(&m_mutex);
+	m_isRunning = false;
+	pthread_cond_broadcast(&m_writtenCond);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+string DBStatusWriter::getPendingKey(const string &campaignId,
+	const string &recipientId, const string &emailAddress)
+{
+	if (recipientId.empty() == false)
+	{
+		return campaignId + "/" + recipientId;
+	}
+
+	return campaignId + "@" + emailAddress;
+}
+
+void DBStatusWriter::unlockedForget(const vector<StatusUpdate> &updates)
+{
+	for (vector<StatusUpdate>::const_iterator updateIter = updates.begin();
+		updateIter != updates.end(); ++updateIter)
+	{
+		m_pendingKeys.erase(getPendingKey(updateIter->m_campaignId,
+			updateIter->m_recipientId, updateIter->m_emailAddress));
+	}
+}
+
+void *DBStatusWriter::threadFunc(void *pArg)
+{
+	DBStatusWriter *pWriter = (DBStatusWriter *)pArg;
+
+	if (pWriter != NULL)
+	{
+		pWriter->loop();
+	}
+
+	return NULL;
+}
+
+void DBStatusWriter::loop(void)
+{
+	pthread_mutex_lock(&m_mutex);
+	while (true)
+	{
+		struct timeval now;
+		struct timespec flushTime;
+
+		gettimeofday(&now, NULL);
+		flushTime.tv_sec = now.tv_sec + (m_flushInterval / 1000);
+		flushTime.tv_nsec = (now.tv_usec * 1000) + ((m_flushInterval % 1000) * 1000000);
+		if (flushTime.tv_nsec >= 1000000000)
+		{
+			++flushTime.tv_sec;
+			flushTime.tv_nsec -= 1000000000;
+		}
+
+		// Wait until there's enough to write, or it's time to
+		while ((m_mustQuit == false) &&
+			(m_mustFlush == false) &&
+			(m_updates.size() < m_flushSize))
+		{
+			if (pthread_cond_timedwait(&m_queueCond, &m_mutex, &flushTime) == ETIMEDOUT)
+			{
+				break;
+			}
+		}
+
+		vector<StatusUpdate> updates;
+
+		updates.swap(m_updates);
+		m_mustFlush = false;
+		pthread_mutex_unlock(&m_mutex);
+
+		// Other threads can queue more while these are written
+		writeUpdates(m_pDb, updates);
+
+		pthread_mutex_lock(&m_mutex);
+		// Failed updates are forgotten too, those recipients remain Waiting
+		unlockedForget(updates);
+		m_writtenCount += updates.size();
+		pthread_cond_broadcast(&m_writtenCond);
+		if ((m_mustQuit == true) &&
+			(m_updates.empty() == true))
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+DBStatusUpdater::DBStatusUpdater(SQLDB *pDb, const string &campaignId,
+	DBStatusWriter *pWriter) :
 	StatusUpdater(),
 	m_pDb(pDb),
 	m_campaignId(campaignId),
+	m_pWriter(pWriter),
 	m_recipientsCount(0)
 {
 }
@@ -47,46 +432,75 @@ unsigned int DBStatusUpdater::getRecipientsCount(void)
 	return m_recipientsCount;
 }
 
+void DBStatusUpdater::setRecipients(const map<string, Recipient> &recipients)
+{
+	m_recipientIds.clear();
+	for (map<string, Recipient>::const_iterator recipIter = recipients.begin();
+		recipIter != recipients.end(); ++recipIter)
+	{
+		m_recipientIds[recipIter->second.m_emailAddress] = recipIter->second.m_id;
+	}
+}
+
+void DBStatusUpdater::flush(void)
+{
+	if (m_pWriter != NULL)
+	{
+		m_pWriter->flush();
+	}
+}
+
+void DBStatusUpdater::waitForWrites(void)
+{
+	if (m_pWriter != NULL)
+	{
+		m_pWriter->waitForWrites();
+	}
+}
+
+unsigned int DBStatusUpdater::skipPending(map<string, Recipient> &recipients)
+{
+	if (m_pWriter == NULL)
+	{
+		return 0;
+	}
+
+	return m_pWriter->skipPending(m_campaignId, recipients);
+}
+
 void DBStatusUpdater::updateRecipientsStatus(const string &domainName,
 	int statusCode, const char *pText)
 {
-	string updateSql("UPDATE evaa_emailrecipient SET status='");
-	string statusValue;
-	stringstream statusStr;
+	string updateSql("UPDATE Recipients SET Status='");
 
 	if (m_pDb == NULL)
 	{
 		return;
 	}
 
-	statusStr << statusCode;
-	if (pText != NULL)
-	{
-		statusStr << " " << pText << endl;
-	}
-
 	// Could this recipient be sent email ?
 	if ((statusCode == 250) ||
 		((statusCode == 0) && (pText == NULL)))
 	{
-		statusValue = "Sent";
+		updateSql += "Sent";
 	}
 	else
 	{
-		statusValue = "Failed";
+		updateSql += "Failed";
 	}
-	updateSql += statusValue;
-	updateSql += "', statuscode='";
-	statusValue = m_pDb->escapeString(statusStr.str());
-	updateSql += statusValue.substr(0, min((string::size_type)255, statusValue.length()));
-	updateSql += "', timesent=UNIX_TIMESTAMP(), numattempts=numattempts+1";
+
+	stringstream statusStr;
+	statusStr << statusCode;
+	updateSql += "', StatusCode=";
+	updateSql += statusStr.str();
+	updateSql += ", SendDate=UNIX_TIMESTAMP(), AttemptsCount=AttemptsCount+1";
 
 	// Apply this to all recipients of this domain
-	updateSql += " WHERE domainname='";
-	updateSql += domainName;
-	updateSql += "' AND evaa_emailcampaignid=";
-	updateSql += m_campaignId;
-	updateSql += ";";
+	updateSql += " WHERE DomainName='";
+	updateSql += m_pDb->escapeString(domainName);
+	updateSql += "' AND CampaignID='";
+	updateSql += m_pDb->escapeString(m_campaignId);
+	updateSql += "'";
 
 	if (m_pDb->executeSimpleStatement(updateSql) == false)
 	{
@@ -101,21 +515,13 @@ void DBStatusUpdater::updateRecipientStatus(const string &emailAddress,
 	int statusCode, const char *pText,
 	const string &msgId)
 {
-	string updateSql("UPDATE evaa_emailrecipient SET status='");
 	string statusValue;
-	stringstream statusStr;
 
 	if (m_pDb == NULL)
 	{
 		return;
 	}
 
-	statusStr << statusCode;
-	if (pText != NULL)
-	{
-		statusStr << " " << pText << endl;
-	}
-
 	// Could this recipient be sent email ?
 	if ((statusCode == 250) ||
 		((statusCode == 0) && (pText == NULL)))
@@ -126,21 +532,23 @@ void DBStatusUpdater::updateRecipientStatus(const string &emailAddress,
 	{
 		statusValue = "Failed";
 	}
-	updateSql += statusValue;
-	updateSql += "', statuscode='";
-	statusValue = m_pDb->escapeString(statusStr.str());
-	updateSql += statusValue.substr(0, min((string::size_type)255, statusValue.length()));
-	updateSql += "', timesent=UNIX_TIMESTAMP(), numattempts=numattempts+1";
 
-	// Email addresses are unique within a campaign, so we don't have to
-	// remember recipientId
-	updateSql += " WHERE emailaddress='";
-	updateSql += emailAddress;
-	updateSql += "' AND evaa_emailcampaignid=";
-	updateSql += m_campaignId;
-	updateSql += ";";
+	string recipientId;
+	map<string, string>::const_iterator idIter = m_recipientIds.find(emailAddress);
+	if (idIter != m_recipientIds.end())
+	{
+		recipientId = idIter->second;
+	}
 
-	if (m_pDb->executeSimpleStatement(updateSql) == true)
+	StatusUpdate update(m_campaignId, recipientId, emailAddress,
+		statusValue, statusCode);
+
+	if (m_pWriter != NULL)
+	{
+		m_pWriter->queueUpdate(update);
+		++m_recipientsCount;
+	}
+	else if (DBStatusWriter::writeUpdates(m_pDb, vector<StatusUpdate>(1, update)) == true)
 	{
 		++m_recipientsCount;
 	}
@@ -152,4 +560,3 @@ void DBStatusUpdater::updateRecipientStatus(const string &emailAddress,
 	// Call parent's implementation
 	StatusUpdater::updateRecipientStatus(emailAddress, statusCode, pText, msgId);
 }
-
@@ -21,22 +21,145 @@
 #ifndef _DBSTATUSUPDATER_H_
 #define _DBSTATUSUPDATER_H_
 
+#include <pthread.h>
+#include <time.h>
 #include <string>
+#include <map>
+#include <set>
+#include <vector>
 
+#include "Recipient.h"
 #include "SQLDB.h"
 #include "StatusUpdater.h"
 
+/// A recipient's new status.
+class StatusUpdate
+{
+	public:
+		StatusUpdate(const std::string &campaignId,
+			const std::string &recipientId,
+			const std::string &emailAddress,
+			const std::string &status, int statusCode);
+		StatusUpdate(const StatusUpdate &other);
+		~StatusUpdate();
+
+		StatusUpdate &operator=(const StatusUpdate &other);
+
+		std::string m_campaignId;
+		std::string m_recipientId;
+		std::string m_emailAddress;
+		std::string m_status;
+		int m_statusCode;
+
+};
+
+/**
+  * Writes recipients' status from a background thread. Updates are
+  * grouped by status and written as multi-row statements, every flushSize
+  * updates or flushInterval milliseconds. The statements are wrapped in a
+  * transaction, which only makes them atomic on tables that support it.
+  */
+class DBStatusWriter
+{
+	public:
+		/// What happens to updates that haven't been written yet.
+		typedef enum { DURABILITY_NONE = 0, DURABILITY_EXIT, DURABILITY_SYNC } Durability;
+
+		DBStatusWriter(SQLDB *pDb, unsigned int flushSize,
+			unsigned int flushInterval, Durability durability);
+		virtual ~DBStatusWriter();
+
+		/// Returns the durability setting matching the given name.
+		static Durability toDurability(const std::string &name);
+
+		/// Writes updates now, each group as one statement.
+		static bool writeUpdates(SQLDB *pDb, const std::vector<StatusUpdate> &updates);
+
+		/// Starts the writer thread.
+		bool start(void);
+
+		/// Queues an update.
+		void queueUpdate(const StatusUpdate &update);
+
+		/**
+		  * Asks for updates queued so far to be written.
+		  * With DURABILITY_SYNC, waits until they are.
+		  */
+		void flush(void);
+
+		/// Waits until updates queued so far are written.
+		void waitForWrites(void);
+
+		/**
+		  * Removes recipients whose update hasn't been written yet, and are
+		  * thus still Waiting in the database. Returns how many were removed.
+		  */
+		unsigned int skipPending(const std::string &campaignId,
+			std::map<std::string, Recipient> &recipients);
+
+		/**
+		  * Stops the writer thread. Updates not written yet are dropped
+		  * with DURABILITY_NONE, written otherwise.
+		  */
+		void stop(void);
+
+	protected:
+		SQLDB *m_pDb;
+		unsigned int m_flushSize;
+		unsigned int m_flushInterval;
+		Durability m_durability;
+		pthread_mutex_t m_mutex;
+		pthread_cond_t m_queueCond;
+		pthread_cond_t m_writtenCond;
+		pthread_t m_threadId;
+		bool m_isRunning;
+		bool m_mustQuit;
+		bool m_mustFlush;
+		std::vector<StatusUpdate> m_updates;
+		std::set<std::string> m_pendingKeys;
+		unsigned long long m_queuedCount;
+		unsigned long long m_writtenCount;
+
+		static std::string getPendingKey(const std::string &campaignId,
+			const std::string &recipientId, const std::string &emailAddress);
+
+		static void *threadFunc(void *pArg);
+
+		void unlockedForget(const std::vector<StatusUpdate> &updates);
+
+		void loop(void);
+
+	private:
+		// DBStatusWriter objects cannot be copied
+		DBStatusWriter(const DBStatusWriter &other);
+		DBStatusWriter &operator=(const DBStatusWriter &other);
+
+};
+
 /// Updates the status of recipients in the database.
 class DBStatusUpdater : public StatusUpdater
 {
 	public:
 		DBStatusUpdater(SQLDB *pDb,
-			const std::string &campaignId);
+			const std::string &campaignId,
+			DBStatusWriter *pWriter = NULL);
 		virtual ~DBStatusUpdater();
 
 		/// Returns the number of updated recipients.
 		unsigned int getRecipientsCount(void);
 
+		/// Sets the recipients being sent to, so that updates are keyed by recipient ID.
+		void setRecipients(const std::map<std::string, Recipient> &recipients);
+
+		/// Makes sure updates are written as configured.
+		void flush(void);
+
+		/// Waits until all queued updates are written.
+		void waitForWrites(void);
+
+		/// Removes recipients whose update is still queued, returns how many.
+		unsigned int skipPending(std::map<std::string, Recipient> &recipients);
+
 		/// Updates the status of a domain recipients.
 		virtual void updateRecipientsStatus(const std::string &domainName,
 			int statusCode, const char *pText);
@@ -49,6 +172,8 @@ class DBStatusUpdater : public StatusUpdater
 	protected:
 		SQLDB *m_pDb;
 		std::string m_campaignId;
+		DBStatusWriter *m_pWriter;
+		std::map<std::string, std::string> m_recipientIds;
 		unsigned int m_recipientsCount;
 
 	private:
@@ -0,0 +1,925 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <iostream>
+#include <sstream>
+
+#include "DNSCache.h"
+
+// Bump when the layout of the segment changes
+#define DNS_CACHE_MAGIC 0x474d4443
+#define DNS_CACHE_VERSION 3
+// Slots in the smallest cache
+#define DNS_CACHE_SLOTS 4096
+// An MX answer, and A and AAAA answers for a couple of exchangers
+#define DNS_CACHE_SLOTS_PER_DOMAIN 6
+// Slots looked at for any given name
+#define DNS_CACHE_PROBES 16
+// Records kept per answer
+#define DNS_CACHE_MAX_RECORDS 6
+#define DNS_CACHE_MAX_NAME 256
+// Room in the names pool, and entries in its index, per slot
+#define DNS_CACHE_NAME_BYTES_PER_SLOT 48
+#define DNS_CACHE_NAMES_PER_SLOT 2
+// The segment never gets larger than this
+#define DNS_CACHE_MAX_SIZE (128 * 1024 * 1024)
+// Bump when the format of saved files changes
+#define DNS_CACHE_FILE_MAGIC 0x474d4446
+#define DNS_CACHE_FILE_VERSION 1
+
+using std::clog;
+using std::endl;
+using std::string;
+using std::stringstream;
+using std::set;
+
+/// A record as stored in shared memory. Names are offsets into the names pool.
+class DNSCacheRecord
+{
+	public:
+		int m_priority;
+		uint32_t m_expiryTime;
+		uint32_t m_hostNameOffset;
+
+};
+
+/// An answer as stored in shared memory.
+class DNSCacheSlot
+{
+	public:
+		unsigned int m_hash;
+		int m_type;
+		uint32_t m_expiryTime;
+		uint32_t m_nameOffset;
+		unsigned int m_recordsCount;
+		DNSCacheRecord m_records[DNS_CACHE_MAX_RECORDS];
+
+};
+
+/// An entry in the index of the names pool.
+class DNSCacheName
+{
+	public:
+		unsigned int m_hash;
+		uint32_t m_offset;
+
+};
+
+/**
+  * The layout of the shared memory segment, followed by more slots,
+  * the index of the names pool and the pool itself.
+  */
+class DNSCacheSegment
+{
+	public:
+		unsigned int m_magic;
+		unsigned int m_version;
+		unsigned int m_slotsCount;
+		unsigned int m_namesCount;
+		uint32_t m_poolSize;
+		uint32_t m_poolUsed;
+		pthread_mutex_t m_mutex;
+		DNSCacheSlot m_slots[1];
+
+};
+
+static bool g_loggedEviction = false;
+static bool g_loggedPoolFull = false;
+
+static size_t getSegmentSize(unsigned int slotsCount)
+{
+	return sizeof(DNSCacheSegment) + (slotsCount - 1) * sizeof(DNSCacheSlot) +
+		(size_t)slotsCount * DNS_CACHE_NAMES_PER_SLOT * sizeof(DNSCacheName) +
+		(size_t)slotsCount * DNS_CACHE_NAME_BYTES_PER_SLOT;
+}
+
+static void initializeSegment(DNSCacheSegment *pSegment, unsigned int slotsCount)
+{
+	pSegment->m_version = DNS_CACHE_VERSION;
+	pSegment->m_slotsCount = slotsCount;
+	pSegment->m_namesCount = slotsCount * DNS_CACHE_NAMES_PER_SLOT;
+	pSegment->m_poolSize = slotsCount * DNS_CACHE_NAME_BYTES_PER_SLOT;
+	// Offset 0 means no name
+	pSegment->m_poolUsed = 1;
+}
+
+static DNSCacheName *getNames(DNSCacheSegment *pSegment)
+{
+	return reinterpret_cast<DNSCacheName*>(&pSegment->m_slots[pSegment->m_slotsCount]);
+}
+
+static char *getPool(DNSCacheSegment *pSegment)
+{
+	return reinterpret_cast<char*>(getNames(pSegment) + pSegment->m_namesCount);
+}
+
+static string getSegmentName(unsigned int slotsCount)
+{
+	stringstream nameStr;
+
+	// One segment per user, so that permissions don't get in the way, and per size
+	nameStr << "/givemail-dns-" << getuid() << "-" << slotsCount;
+
+	return nameStr.str();
+}
+
+static bool normalizeName(const string &domainName, char *pName)
+{
+	string::size_type nameLen = domainName.length();
+
+	// Ignore the root
+	if ((nameLen > 0) &&
+		(domainName[nameLen - 1] == '.'))
+	{
+		--nameLen;
+	}
+	if ((nameLen == 0) ||
+		(nameLen >= DNS_CACHE_MAX_NAME))
+	{
+		return false;
+	}
+
+	for (string::size_type pos = 0; pos < nameLen; ++pos)
+	{
+		pName[pos] = (char)tolower((unsigned char)domainName[pos]);
+	}
+	pName[nameLen] = '\0';
+
+	return true;
+}
+
+static unsigned int hashName(const char *pName, int type)
+{
+	// FNV-1a
+	unsigned int hash = 2166136261U ^ (unsigned int)type;
+
+	for (; *pName != '\0'; ++pName)
+	{
+		hash ^= (unsigned char)*pName;
+		hash *= 16777619U;
+	}
+
+	// Zero marks empty slots
+	return (hash == 0 ? 1 : hash);
+}
+
+static void appendValue(string &data, const void *pValue, size_t valueLen)
+{
+	data.append(static_cast<const char*>(pValue), valueLen);
+}
+
+static void appendName(string &data, const char *pName)
+{
+	unsigned short nameLen = (unsigned short)strlen(pName);
+
+	appendValue(data, &nameLen, sizeof(nameLen));
+	data.append(pName, nameLen);
+}
+
+static bool readValue(const char *&pData, const char *pEnd,
+	void *pValue, size_t valueLen)
+{
+	if ((size_t)(pEnd - pData) < valueLen)
+	{
+		return false;
+	}
+	memcpy(pValue, pData, valueLen);
+	pData += valueLen;
+
+	return true;
+}
+
+static bool readName(const char *&pData, const char *pEnd, string &name)
+{
+	unsigned short nameLen = 0;
+
+	if ((readValue(pData, pEnd, &nameLen, sizeof(nameLen)) == false) ||
+		(nameLen >= DNS_CACHE_MAX_NAME) ||
+		((size_t)(pEnd - pData) < nameLen))
+	{
+		return false;
+	}
+	name.assign(pData, nameLen);
+	pData += nameLen;
+
+	return true;
+}
+
+DNSCache *DNSCache::m_pInstance = NULL;
+pthread_mutex_t DNSCache::m_instanceMutex = PTHREAD_MUTEX_INITIALIZER;
+
+DNSCache::DNSCache() :
+	m_pSegment(NULL),
+	m_slotsCount(0),
+	m_segmentSize(0),
+	m_isShared(false)
+{
+	attachSegment(DNS_CACHE_SLOTS);
+}
+
+DNSCache::~DNSCache()
+{
+	if (m_pSegment != NULL)
+	{
+		munmap(m_pSegment, m_segmentSize);
+	}
+}
+
+DNSCache *DNSCache::getInstance(void)
+{
+	pthread_mutex_lock(&m_instanceMutex);
+	if (m_pInstance == NULL)
+	{
+		m_pInstance = new DNSCache();
+	}
+	pthread_mutex_unlock(&m_instanceMutex);
+
+	return m_pInstance;
+}
+
+bool DNSCache::attachSegment(unsigned int slotsCount)
+{
+	size_t segmentSize = getSegmentSize(slotsCount);
+
+	if (attachSharedSegment(getSegmentName(slotsCount), slotsCount, segmentSize) == true)
+	{
+		m_isShared = true;
+	}
+	else
+	{
+		// Fall back to memory shared by this process' threads
+		void *pAddress = mmap(NULL, segmentSize, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (pAddress == MAP_FAILED)
+		{
+			clog << "Couldn't allocate DNS cache" << endl;
+			return false;
+		}
+
+		pthread_mutexattr_t mutexAttr;
+
+		m_pSegment = static_cast<DNSCacheSegment*>(pAddress);
+		pthread_mutexattr_init(&mutexAttr);
+		pthread_mutex_init(&m_pSegment->m_mutex, &mutexAttr);
+		pthread_mutexattr_destroy(&mutexAttr);
+		initializeSegment(m_pSegment, slotsCount);
+		m_pSegment->m_magic = DNS_CACHE_MAGIC;
+		m_isShared = false;
+	}
+	m_slotsCount = slotsCount;
+	m_segmentSize = segmentSize;
+
+	return true;
+}
+
+bool DNSCache::attachSharedSegment(const string &segmentName,
+	unsigned int slotsCount, size_t segmentSize)
+{
+	bool isCreator = true;
+
+	int segmentFd = shm_open(segmentName.c_str(), O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+	if ((segmentFd < 0) &&
+		(errno == EEXIST))
+	{
+		isCreator = false;
+		segmentFd = shm_open(segmentName.c_str(), O_RDWR, S_IRUSR|S_IWUSR);
+	}
+	if (segmentFd < 0)
+	{
+		clog << "Couldn't open DNS cache " << segmentName << endl;
+		return false;
+	}
+
+	// Another user may have created it to feed answers to this one
+	struct stat segmentStat;
+	if ((fstat(segmentFd, &segmentStat) != 0) ||
+		(segmentStat.st_uid != getuid()) ||
+		((segmentStat.st_mode & (S_IRWXG|S_IRWXO)) != 0))
+	{
+		clog << "DNS cache " << segmentName << " is not private" << endl;
+		close(segmentFd);
+		return false;
+	}
+
+	if ((isCreator == true) &&
+		(ftruncate(segmentFd, (off_t)segmentSize) != 0))
+	{
+		clog << "Couldn't size DNS cache " << segmentName << endl;
+		close(segmentFd);
+		shm_unlink(segmentName.c_str());
+		return false;
+	}
+
+	// The creator may not have sized it yet
+	for (unsigned int attemptNum = 0; attemptNum < 100; ++attemptNum)
+	{
+		if ((fstat(segmentFd, &segmentStat) == 0) &&
+			(segmentStat.st_size >= (off_t)segmentSize))
+		{
+			break;
+		}
+		usleep(10000);
+	}
+	if (segmentStat.st_size < (off_t)segmentSize)
+	{
+		clog << "DNS cache " << segmentName << " has an unexpected size" << endl;
+		close(segmentFd);
+		return false;
+	}
+
+	void *pAddress = mmap(NULL, segmentSize, PROT_READ|PROT_WRITE,
+		MAP_SHARED, segmentFd, 0);
+	close(segmentFd);
+	if (pAddress == MAP_FAILED)
+	{
+		clog << "Couldn't map DNS cache " << segmentName << endl;
+		return false;
+	}
+
+	DNSCacheSegment *pSegment = static_cast<DNSCacheSegment*>(pAddress);
+
+	if (isCreator == true)
+	{
+		pthread_mutexattr_t mutexAttr;
+
+		pthread_mutexattr_init(&mutexAttr);
+		pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+		// Slaves may be killed while holding the lock
+		pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&pSegment->m_mutex, &mutexAttr);
+		pthread_mutexattr_destroy(&mutexAttr);
+		initializeSegment(pSegment, slotsCount);
+		__sync_synchronize();
+		pSegment->m_magic = DNS_CACHE_MAGIC;
+	}
+	else
+	{
+		// Wait for the creator to initialize it
+		for (unsigned int attemptNum = 0; attemptNum < 100; ++attemptNum)
+		{
+			if (pSegment->m_magic == DNS_CACHE_MAGIC)
+			{
+				break;
+			}
+			usleep(10000);
+		}
+		__sync_synchronize();
+		if ((pSegment->m_magic != DNS_CACHE_MAGIC) ||
+			(pSegment->m_version != DNS_CACHE_VERSION) ||
+			(pSegment->m_slotsCount != slotsCount))
+		{
+			clog << "DNS cache " << segmentName << " was created by another version" << endl;
+			munmap(pAddress, segmentSize);
+			return false;
+		}
+	}
+
+	m_pSegment = pSegment;
+#ifdef DEBUG
+	clog << "DNSCache::attachSegment: attached to " << segmentName << ", creator " << isCreator << endl;
+#endif
+
+	return true;
+}
+
+bool DNSCache::lockSegment(void)
+{
+	if (m_pSegment == NULL)
+	{
+		return false;
+	}
+
+	int lockStatus = pthread_mutex_lock(&m_pSegment->m_mutex);
+	if (lockStatus == EOWNERDEAD)
+	{
+		// Slots are only keyed once complete, so what's there can be used
+		pthread_mutex_consistent(&m_pSegment->m_mutex);
+		lockStatus = 0;
+	}
+
+	return (lockStatus == 0);
+}
+
+void DNSCache::unlockSegment(void)
+{
+	pthread_mutex_unlock(&m_pSegment->m_mutex);
+}
+
+bool DNSCache::getAnswer(const string &domainName, int type,
+	set<ResourceRecord> &records, bool &found)
+{
+	char name[DNS_CACHE_MAX_NAME];
+	bool isCached = false;
+
+	if (normalizeName(domainName, name) == false)
+	{
+		return false;
+	}
+
+	unsigned int hash = hashName(name, type);
+	time_t timeNow = time(NULL);
+
+	if (lockSegment() == false)
+	{
+		return false;
+	}
+
+	for (unsigned int probeNum = 0; probeNum < DNS_CACHE_PROBES; ++probeNum)
+	{
+		DNSCacheSlot &slot = m_pSegment->m_slots[(hash + probeNum) % m_slotsCount];
+
+		if ((slot.m_hash != hash) ||
+			(slot.m_type != type) ||
+			(strcmp(getName(slot.m_nameOffset), name) != 0))
+		{
+			continue;
+		}
+
+		if ((time_t)slot.m_expiryTime > timeNow)
+		{
+			for (unsigned int recordNum = 0; recordNum < slot.m_recordsCount; ++recordNum)
+			{
+				const DNSCacheRecord &record = slot.m_records[recordNum];
+
+				records.insert(ResourceRecord(domainName, record.m_priority,
+					getName(record.m_hostNameOffset),
+					(int)((time_t)record.m_expiryTime - timeNow), timeNow));
+			}
+			found = (slot.m_recordsCount > 0);
+			isCached = true;
+		}
+		break;
+	}
+
+	unlockSegment();
+
+	return isCached;
+}
+
+void DNSCache::setAnswer(const string &domainName, int type,
+	const set<ResourceRecord> &records, time_t expiryTime)
+{
+	char name[DNS_CACHE_MAX_NAME];
+
+	if (normalizeName(domainName, name) == false)
+	{
+		return;
+	}
+
+	unsigned int hash = hashName(name, type);
+	time_t timeNow = time(NULL);
+	const ResourceRecord *pRecords[DNS_CACHE_MAX_RECORDS];
+	uint32_t nameOffset = 0, hostNameOffsets[DNS_CACHE_MAX_RECORDS];
+	unsigned int recordsCount = 0;
+
+	// Records are sorted by decreasing priority value, keep the best ones
+	for (set<ResourceRecord>::const_reverse_iterator recordIter = records.rbegin();
+		(recordIter != records.rend()) && (recordsCount < DNS_CACHE_MAX_RECORDS);
+		++recordIter)
+	{
+		if (recordIter->m_hostName.length() < DNS_CACHE_MAX_NAME)
+		{
+			pRecords[recordsCount] = &(*recordIter);
+			++recordsCount;
+		}
+	}
+
+	if (lockSegment() == false)
+	{
+		return;
+	}
+
+	// Pool names before picking a slot, as running out of room empties the cache
+	for (unsigned int attemptNum = 0; attemptNum < 2; ++attemptNum)
+	{
+		bool isPooled = true;
+
+		nameOffset = addName(name);
+		for (unsigned int recordNum = 0; (recordNum < recordsCount) && (nameOffset > 0); ++recordNum)
+		{
+			hostNameOffsets[recordNum] = addName(pRecords[recordNum]->m_hostName.c_str());
+			if (hostNameOffsets[recordNum] == 0)
+			{
+				isPooled = false;
+				break;
+			}
+		}
+		if ((nameOffset > 0) &&
+			(isPooled == true))
+		{
+			break;
+		}
+
+		if (attemptNum > 0)
+		{
+			unlockSegment();
+			return;
+		}
+		if (__sync_bool_compare_and_swap(&g_loggedPoolFull, false, true) == true)
+		{
+			clog << "DNS cache ran out of room for names, answers were dropped" << endl;
+		}
+		clearSegment();
+	}
+
+	// Reuse this name's slot, else an empty or expired one, else the one closest to expiring
+	DNSCacheSlot *pSlot = NULL;
+	for (unsigned int probeNum = 0; probeNum < DNS_CACHE_PROBES; ++probeNum)
+	{
+		DNSCacheSlot &slot = m_pSegment->m_slots[(hash + probeNum) % m_slotsCount];
+
+		// Pooled names are unique
+		if ((slot.m_hash == hash) &&
+			(slot.m_type == type) &&
+			(slot.m_nameOffset == nameOffset))
+		{
+			pSlot = &slot;
+			break;
+		}
+		if ((pSlot == NULL) ||
+			((pSlot->m_hash != 0) && ((time_t)pSlot->m_expiryTime > timeNow) &&
+			((slot.m_hash == 0) || (slot.m_expiryTime < pSlot->m_expiryTime))))
+		{
+			pSlot = &slot;
+		}
+	}
+
+	if ((pSlot->m_hash != 0) &&
+		((time_t)pSlot->m_expiryTime > timeNow) &&
+		((pSlot->m_hash != hash) || (pSlot->m_type != type) || (pSlot->m_nameOffset != nameOffset)) &&
+		(__sync_bool_compare_and_swap(&g_loggedEviction, false, true) == true))
+	{
+		clog << "DNS cache is full, answers are dropped before they expire" << endl;
+	}
+
+	// Unkey the slot until it's complete
+	pSlot->m_hash = 0;
+	pSlot->m_type = type;
+	pSlot->m_expiryTime = (uint32_t)expiryTime;
+	pSlot->m_nameOffset = nameOffset;
+	for (unsigned int recordNum = 0; recordNum < recordsCount; ++recordNum)
+	{
+		DNSCacheRecord &record = pSlot->m_records[recordNum];
+
+		record.m_priority = pRecords[recordNum]->m_priority;
+		record.m_expiryTime = (uint32_t)pRecords[recordNum]->m_expiryTime;
+		record.m_hostNameOffset = hostNameOffsets[recordNum];
+	}
+	pSlot->m_recordsCount = recordsCount;
+	__sync_synchronize();
+	pSlot->m_hash = hash;
+
+	unlockSegment();
+}
+
+unsigned int DNSCache::getSlotsCount(size_t domainsCount)
+{
+	unsigned int slotsCount = DNS_CACHE_SLOTS;
+
+	// Round up, so that slaves working on similar campaigns share the same segment
+	while ((slotsCount < domainsCount * DNS_CACHE_SLOTS_PER_DOMAIN) &&
+		(getSegmentSize(slotsCount * 2) <= DNS_CACHE_MAX_SIZE))
+	{
+		slotsCount *= 2;
+	}
+
+	return slotsCount;
+}
+
+bool DNSCache::reserve(unsigned int slotsCount)
+{
+	DNSCacheSegment *pOldSegment = m_pSegment;
+	unsigned int oldSlotsCount = m_slotsCount;
+	size_t oldSegmentSize = m_segmentSize;
+	bool wasShared = m_isShared;
+	string data;
+
+	// Beyond that, answers that expire soonest make room
+	while ((slotsCount > DNS_CACHE_SLOTS) &&
+		(getSegmentSize(slotsCount) > DNS_CACHE_MAX_SIZE))
+	{
+		slotsCount /= 2;
+	}
+	if ((pOldSegment != NULL) &&
+		(slotsCount <= oldSlotsCount))
+	{
+		return true;
+	}
+
+	// Bring live answers along
+	unsigned int answersCount = 0;
+	if (lockSegment() == true)
+	{
+		answersCount = copyAnswers(data);
+		unlockSegment();
+	}
+
+	if (attachSegment(slotsCount) == false)
+	{
+		return false;
+	}
+
+	restoreAnswers(data.c_str(), data.c_str() + data.length(), answersCount);
+	if (pOldSegment != NULL)
+	{
+		munmap(pOldSegment, oldSegmentSize);
+		if (wasShared == true)
+		{
+			// Processes still attached to the smaller segment keep it until they exit
+			shm_unlink(getSegmentName(oldSlotsCount).c_str());
+		}
+	}
+
+	clog << "DNS cache holds " << slotsCount << " answers" << endl;
+
+	return true;
+}
+
+bool DNSCache::load(const string &fileName)
+{
+	struct stat fileStat;
+	unsigned int loadedCount = 0;
+
+	if (fileName.empty() == true)
+	{
+		return false;
+	}
+
+	int fileFd = open(fileName.c_str(), O_RDONLY);
+	if (fileFd < 0)
+	{
+		return false;
+	}
+	if ((fstat(fileFd, &fileStat) != 0) ||
+		(fileStat.st_size == 0))
+	{
+		close(fileFd);
+		return false;
+	}
+
+	void *pAddress = mmap(NULL, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fileFd, 0);
+	close(fileFd);
+	if (pAddress == MAP_FAILED)
+	{
+		clog << "Couldn't map DNS cache file " << fileName << endl;
+		return false;
+	}
+
+	const char *pData = static_cast<const char*>(pAddress);
+	const char *pEnd = pData + fileStat.st_size;
+	unsigned int magic = 0, version = 0, answersCount = 0;
+
+	if ((readValue(pData, pEnd, &magic, sizeof(magic)) == false) ||
+		(readValue(pData, pEnd, &version, sizeof(version)) == false) ||
+		(readValue(pData, pEnd, &answersCount, sizeof(answersCount)) == false) ||
+		(magic != DNS_CACHE_FILE_MAGIC) ||
+		(version != DNS_CACHE_FILE_VERSION))
+	{
+		clog << "DNS cache file " << fileName << " is not in a known format" << endl;
+		munmap(pAddress, (size_t)fileStat.st_size);
+		return false;
+	}
+
+	loadedCount = restoreAnswers(pData, pEnd, answersCount);
+	munmap(pAddress, (size_t)fileStat.st_size);
+
+	clog << "Loaded " << loadedCount << "/" << answersCount << " DNS answers from " << fileName << endl;
+
+	return true;
+}
+
+bool DNSCache::save(const string &fileName)
+{
+	string data, headerData;
+	unsigned int magic = DNS_CACHE_FILE_MAGIC, version = DNS_CACHE_FILE_VERSION, answersCount = 0;
+
+	if ((fileName.empty() == true) ||
+		(lockSegment() == false))
+	{
+		return false;
+	}
+
+	// Copy live answers while locked, write them out after
+	answersCount = copyAnswers(data);
+
+	unlockSegment();
+
+	appendValue(headerData, &magic, sizeof(magic));
+	appendValue(headerData, &version, sizeof(version));
+	appendValue(headerData, &answersCount, sizeof(answersCount));
+
+	// Other slaves may be saving too, replace the file in one go
+	stringstream tempNameStr;
+	tempNameStr << fileName << "." << getpid();
+	string tempFileName(tempNameStr.str());
+
+	int fileFd = open(tempFileName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	if (fileFd < 0)
+	{
+		clog << "Couldn't save DNS cache to " << fileName << endl;
+		return false;
+	}
+
+	bool isSaved = ((write(fileFd, headerData.c_str(), headerData.length()) == (ssize_t)headerData.length()) &&
+		(write(fileFd, data.c_str(), data.length()) == (ssize_t)data.length()));
+	if (close(fileFd) != 0)
+	{
+		isSaved = false;
+	}
+	if ((isSaved == false) ||
+		(rename(tempFileName.c_str(), fileName.c_str()) != 0))
+	{
+		clog << "Couldn't save DNS cache to " << fileName << endl;
+		unlink(tempFileName.c_str());
+		return false;
+	}
+
+#ifdef DEBUG
+	clog << "DNSCache::save: saved " << answersCount << " answers to " << fileName << endl;
+#endif
+
+	return true;
+}
+
+unsigned int DNSCache::restoreAnswers(const char *pData, const char *pEnd,
+	unsigned int answersCount)
+{
+	unsigned int restoredCount = 0;
+	time_t timeNow = time(NULL);
+
+	for (unsigned int answerNum = 0; answerNum < answersCount; ++answerNum)
+	{
+		set<ResourceRecord> records;
+		string domainName;
+		time_t expiryTime = 0;
+		int type = 0;
+		unsigned short recordsCount = 0;
+		bool isValid = true;
+
+		if ((readValue(pData, pEnd, &type, sizeof(type)) == false) ||
+			(readValue(pData, pEnd, &expiryTime, sizeof(expiryTime)) == false) ||
+			(readName(pData, pEnd, domainName) == false) ||
+			(readValue(pData, pEnd, &recordsCount, sizeof(recordsCount)) == false))
+		{
+			break;
+		}
+		for (unsigned short recordNum = 0; recordNum < recordsCount; ++recordNum)
+		{
+			string hostName;
+			time_t recordExpiryTime = 0;
+			int priority = 0;
+
+			if ((readValue(pData, pEnd, &priority, sizeof(priority)) == false) ||
+				(readValue(pData, pEnd, &recordExpiryTime, sizeof(recordExpiryTime)) == false) ||
+				(readName(pData, pEnd, hostName) == false))
+			{
+				isValid = false;
+				break;
+			}
+			records.insert(ResourceRecord(domainName, priority, hostName,
+				(int)(recordExpiryTime - timeNow), timeNow));
+		}
+		if (isValid == false)
+		{
+			break;
+		}
+
+		// Only reuse live answers, and don't override fresher ones
+		set<ResourceRecord> cachedRecords;
+		bool found = false;
+		if ((expiryTime > timeNow) &&
+			(getAnswer(domainName, type, cachedRecords, found) == false))
+		{
+			setAnswer(domainName, type, records, expiryTime);
+			++restoredCount;
+		}
+	}
+
+	return restoredCount;
+}
+
+unsigned int DNSCache::copyAnswers(string &data)
+{
+	unsigned int answersCount = 0;
+	time_t timeNow = time(NULL);
+
+	for (unsigned int slotNum = 0; slotNum < m_slotsCount; ++slotNum)
+	{
+		const DNSCacheSlot &slot = m_pSegment->m_slots[slotNum];
+
+		if ((slot.m_hash == 0) ||
+			((time_t)slot.m_expiryTime <= timeNow))
+		{
+			continue;
+		}
+
+		unsigned short recordsCount = (unsigned short)slot.m_recordsCount;
+		// Saved files have full times
+		time_t expiryTime = (time_t)slot.m_expiryTime;
+
+		appendValue(data, &slot.m_type, sizeof(slot.m_type));
+		appendValue(data, &expiryTime, sizeof(expiryTime));
+		appendName(data, getName(slot.m_nameOffset));
+		appendValue(data, &recordsCount, sizeof(recordsCount));
+		for (unsigned int recordNum = 0; recordNum < slot.m_recordsCount; ++recordNum)
+		{
+			const DNSCacheRecord &record = slot.m_records[recordNum];
+			time_t recordExpiryTime = (time_t)record.m_expiryTime;
+
+			appendValue(data, &record.m_priority, sizeof(record.m_priority));
+			appendValue(data, &recordExpiryTime, sizeof(recordExpiryTime));
+			appendName(data, getName(record.m_hostNameOffset));
+		}
+		++answersCount;
+	}
+
+	return answersCount;
+}
+
+uint32_t DNSCache::addName(const char *pName)
+{
+	DNSCacheName *pNames = getNames(m_pSegment);
+	char *pPool = getPool(m_pSegment);
+	unsigned int hash = hashName(pName, 0);
+
+	// Exchangers in particular are shared by many domains, store them once
+	for (unsigned int probeNum = 0; probeNum < DNS_CACHE_PROBES; ++probeNum)
+	{
+		DNSCacheName &entry = pNames[(hash + probeNum) % m_pSegment->m_namesCount];
+
+		if (entry.m_offset == 0)
+		{
+			uint32_t nameLen = (uint32_t)strlen(pName) + 1;
+			uint32_t offset = m_pSegment->m_poolUsed;
+
+			if (nameLen > m_pSegment->m_poolSize - offset)
+			{
+				return 0;
+			}
+			memcpy(pPool + offset, pName, nameLen);
+			// Use up the room before indexing it
+			m_pSegment->m_poolUsed += nameLen;
+			entry.m_hash = hash;
+			__sync_synchronize();
+			entry.m_offset = offset;
+
+			return offset;
+		}
+		if ((entry.m_hash == hash) &&
+			(strcmp(pPool + entry.m_offset, pName) == 0))
+		{
+			return entry.m_offset;
+		}
+	}
+
+	return 0;
+}
+
+const char *DNSCache::getName(uint32_t offset) const
+{
+	return getPool(m_pSegment) + offset;
+}
+
+void DNSCache::clearSegment(void)
+{
+	// Answers go first, they point into the pool
+	for (unsigned int slotNum = 0; slotNum < m_slotsCount; ++slotNum)
+	{
+		m_pSegment->m_slots[slotNum].m_hash = 0;
+	}
+	__sync_synchronize();
+	memset(getNames(m_pSegment), 0, m_pSegment->m_namesCount * sizeof(DNSCacheName));
+	__sync_synchronize();
+	m_pSegment->m_poolUsed = 1;
+}
+
+bool DNSCache::isShared(void) const
+{
+	return m_isShared;
+}
@@ -0,0 +1,111 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DNSCACHE_H_
+#define _DNSCACHE_H_
+
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <set>
+
+#include "Resolver.h"
+
+class DNSCacheSegment;
+
+/**
+  * A cache of DNS answers shared by all threads and processes of this user.
+  * Answers without records are kept too, so that dead domains are only
+  * looked up once per TTL.
+  */
+class DNSCache
+{
+	public:
+		virtual ~DNSCache();
+
+		/// Returns the cache.
+		static DNSCache *getInstance(void);
+
+		/// Returns true if a live answer was found; found tells if it has records.
+		bool getAnswer(const std::string &domainName, int type,
+			std::set<ResourceRecord> &records, bool &found);
+
+		/// Keeps an answer, records or lack thereof, until expiryTime.
+		void setAnswer(const std::string &domainName, int type,
+			const std::set<ResourceRecord> &records, time_t expiryTime);
+
+		/// Returns how many answers a cache for that many domains should hold.
+		static unsigned int getSlotsCount(size_t domainsCount);
+
+		/**
+		  * Makes room for at least slotsCount answers, keeping live ones.
+		  * Other threads must not use the cache meanwhile.
+		  */
+		bool reserve(unsigned int slotsCount);
+
+		/// Loads answers saved by save() that haven't expired yet.
+		bool load(const std::string &fileName);
+
+		/// Saves answers that haven't expired yet.
+		bool save(const std::string &fileName);
+
+		/// Returns true if the cache is shared with other processes.
+		bool isShared(void) const;
+
+	protected:
+		static DNSCache *m_pInstance;
+		static pthread_mutex_t m_instanceMutex;
+		DNSCacheSegment *m_pSegment;
+		unsigned int m_slotsCount;
+		size_t m_segmentSize;
+		bool m_isShared;
+
+		DNSCache();
+
+		bool attachSegment(unsigned int slotsCount);
+
+		bool attachSharedSegment(const std::string &segmentName,
+			unsigned int slotsCount, size_t segmentSize);
+
+		unsigned int restoreAnswers(const char *pData, const char *pEnd,
+			unsigned int answersCount);
+
+		unsigned int copyAnswers(std::string &data);
+
+		/// Returns the offset of the name in the pool, adding it if needed; 0 if there's no room.
+		uint32_t addName(const char *pName);
+
+		const char *getName(uint32_t offset) const;
+
+		/// Drops all answers and pooled names.
+		void clearSegment(void);
+
+		bool lockSegment(void);
+
+		void unlockSegment(void);
+
+	private:
+		// DNSCache objects cannot be copied.
+		DNSCache(const DNSCache &other);
+		DNSCache &operator=(const DNSCache &other);
+
+};
+
+#endif // _DNSCACHE_H_
@@ -18,18 +18,72 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <algorithm>
 #include <iostream>
 
 #include "DomainsMap.h"
+#include "ExchangerThrottle.h"
+#include "Resolver.h"
 
 using std::clog;
 using std::endl;
 using std::string;
+using std::map;
 using std::multimap;
+using std::set;
+using std::deque;
+using std::pair;
+using std::sort;
+using std::make_pair;
+
+static unsigned int hashName(const string &name)
+{
+	// FNV-1a, the same in every slave process
+	unsigned int hash = 2166136261U;
+
+	for (string::size_type pos = 0; pos < name.length(); ++pos)
+	{
+		hash ^= (unsigned char)name[pos];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+DomainsGroup::DomainsGroup() :
+	m_recipientsCount(0),
+	m_workersCount(0)
+{
+}
+
+DomainsGroup::DomainsGroup(const DomainsGroup &other) :
+	m_domains(other.m_domains),
+	m_recipientsCount(other.m_recipientsCount),
+	m_workersCount(other.m_workersCount)
+{
+}
+
+DomainsGroup::~DomainsGroup()
+{
+}
+
+DomainsGroup &DomainsGroup::operator=(const DomainsGroup &other)
+{
+	if (this != &other)
+	{
+		m_domains = other.m_domains;
+		m_recipientsCount = other.m_recipientsCount;
+		m_workersCount = other.m_workersCount;
+	}
+
+	return *this;
+}
 
 DomainsMap *DomainsMap::m_pInstance = NULL;
 
-DomainsMap::DomainsMap()
+DomainsMap::DomainsMap() :
+	m_maxWorkersPerExchanger(0),
+	m_isGrouped(false)
 {
 	pthread_mutex_init(&m_mutex, 0);
 }
@@ -54,92 +108,270 @@ multimap<off_t, string> &DomainsMap::getMap(void)
 	return m_domainsByRecipients;
 }
 
-bool DomainsMap::getTopDomain(string &domainName,
-	unsigned int &recipientsCount)
+off_t DomainsMap::groupByExchanger(unsigned int maxWorkersPerExchanger,
+	off_t slavesCount, off_t slaveNum)
 {
-	bool foundTop = false;
+	map<string, DomainsGroup> allGroups, groups;
+	map<string, string> exchangers;
+	off_t recipientsCount = 0, domainsCount = 0;
 
-	// Lock the map
-	if (pthread_mutex_lock(&m_mutex) == 0)
+	// MX records should have been prefetched
+	for (multimap<off_t, string>::const_iterator domainIter = m_domainsByRecipients.begin();
+		domainIter != m_domainsByRecipients.end(); ++domainIter)
 	{
-		multimap<off_t, std::string>::iterator domainIter = m_domainsByRecipients.begin();
-		if (domainIter != m_domainsByRecipients.end())
+		set<ResourceRecord> mxRecords;
+
+		Resolver::queryMXRecords(domainIter->second, mxRecords);
+
+		DomainsGroup &group = allGroups[ExchangerThrottle::getExchangerName(domainIter->second, mxRecords)];
+
+		group.m_domains.push_back(*domainIter);
+		group.m_recipientsCount += domainIter->first;
+		recipientsCount += domainIter->first;
+	}
+
+	// Slave processes split exchangers, rather than domains, between them,
+	// unless an exchanger has more recipients than a slave's fair share
+	off_t fairShare = (slavesCount > 1) ? recipientsCount / slavesCount : 0;
+	for (map<string, DomainsGroup>::iterator groupIter = allGroups.begin();
+		groupIter != allGroups.end(); ++groupIter)
+	{
+		DomainsGroup &allGroup = groupIter->second;
+		off_t ownerNum = 0;
+
+		if (slavesCount > 1)
 		{
-			foundTop = true;
+			ownerNum = (off_t)(hashName(groupIter->first) % (unsigned int)slavesCount);
+		}
 
-			if ((m_lowestDomainCount == domainIter->first) &&
-				(m_lowestDomainName == domainIter->second))
+		if ((slavesCount <= 1) ||
+			(allGroup.m_recipientsCount <= fairShare) ||
+			(allGroup.m_domains.size() == 1))
+		{
+			if (ownerNum != slaveNum)
 			{
-#ifdef DEBUG
-				clog << "DomainsMap::getTopDomain: reached low water-mark " << domainIter->second << endl;
-#endif
-				foundTop = false;
+				continue;
 			}
-			else
+
+			for (deque<pair<off_t, string> >::const_iterator domainIter = allGroup.m_domains.begin();
+				domainIter != allGroup.m_domains.end(); ++domainIter)
 			{
-				recipientsCount = domainIter->first;
-				domainName = domainIter->second;
-				m_domainsByRecipients.erase(domainIter);
-#ifdef DEBUG
-				clog << "DomainsMap::getTopDomain: returning domain " << domainName << endl;
-#endif
+				exchangers[domainIter->second] = groupIter->first;
+				++domainsCount;
 			}
+			groups[groupIter->first] = allGroup;
+			continue;
 		}
 
-		// Unlock the map
-		pthread_mutex_unlock(&m_mutex);
+		// Deal domains out, largest first, in an order all slaves agree on
+		deque<pair<off_t, string> > sortedDomains(allGroup.m_domains);
+		sort(sortedDomains.begin(), sortedDomains.end());
+
+		DomainsGroup group;
+		off_t domainNum = 0;
+
+		for (deque<pair<off_t, string> >::const_reverse_iterator domainIter = sortedDomains.rbegin();
+			domainIter != sortedDomains.rend(); ++domainIter, ++domainNum)
+		{
+			if ((ownerNum + domainNum) % slavesCount != slaveNum)
+			{
+				continue;
+			}
+
+			group.m_domains.push_front(*domainIter);
+			group.m_recipientsCount += domainIter->first;
+			exchangers[domainIter->second] = groupIter->first;
+			++domainsCount;
+		}
+		if (group.m_domains.empty() == false)
+		{
+			clog << "Exchanger " << groupIter->first << " is shared with other slaves, taking "
+				<< group.m_domains.size() << " of its " << allGroup.m_domains.size() << " domains" << endl;
+			groups[groupIter->first] = group;
+		}
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	m_groups.swap(groups);
+	m_exchangers.swap(exchangers);
+	m_availableGroups.clear();
+	for (map<string, DomainsGroup>::const_iterator groupIter = m_groups.begin();
+		groupIter != m_groups.end(); ++groupIter)
+	{
+		m_availableGroups.insert(make_pair(groupIter->second.m_recipientsCount, groupIter->first));
+
+		if (groupIter->second.m_domains.size() > 1)
+		{
+			clog << "Exchanger " << groupIter->first << " serves " << groupIter->second.m_domains.size()
+				<< " domains, " << groupIter->second.m_recipientsCount << " recipients" << endl;
+		}
 	}
+	m_maxWorkersPerExchanger = maxWorkersPerExchanger;
+	m_isGrouped = true;
+	pthread_mutex_unlock(&m_mutex);
+
+	clog << "Grouped " << domainsCount << " domains under " << m_groups.size() << " exchangers" << endl;
 
-	return foundTop;
+	return domainsCount;
+}
+
+bool DomainsMap::getTopDomain(string &domainName,
+	unsigned int &recipientsCount)
+{
+	return getDomain(true, domainName, recipientsCount);
 }
 
 bool DomainsMap::getBottomDomain(string &domainName,
 	unsigned int &recipientsCount)
 {
-	bool foundBottom = false;
+	return getDomain(false, domainName, recipientsCount);
+}
+
+bool DomainsMap::getDomain(bool fromTop, string &domainName,
+	unsigned int &recipientsCount)
+{
+	bool foundDomain = false;
 
 	// Lock the map
-	if (pthread_mutex_lock(&m_mutex) == 0)
+	if (pthread_mutex_lock(&m_mutex) != 0)
+	{
+		return false;
+	}
+
+	if (m_isGrouped == false)
+	{
+		// Each domain is its own group
+		for (multimap<off_t, string>::const_iterator domainIter = m_domainsByRecipients.begin();
+			domainIter != m_domainsByRecipients.end(); ++domainIter)
+		{
+			DomainsGroup &group = m_groups[domainIter->second];
+
+			group.m_domains.push_back(*domainIter);
+			group.m_recipientsCount += domainIter->first;
+			m_exchangers[domainIter->second] = domainIter->second;
+		}
+		for (map<string, DomainsGroup>::const_iterator groupIter = m_groups.begin();
+			groupIter != m_groups.end(); ++groupIter)
+		{
+			m_availableGroups.insert(make_pair(groupIter->second.m_recipientsCount, groupIter->first));
+		}
+		m_isGrouped = true;
+	}
+
+	// Is the caller done with a domain ?
+	map<string, string>::const_iterator exchangerIter = m_exchangers.end();
+	if (domainName.empty() == false)
+	{
+		exchangerIter = m_exchangers.find(domainName);
+	}
+	if (exchangerIter != m_exchangers.end())
 	{
-		multimap<off_t, string>::reverse_iterator domainIter = m_domainsByRecipients.rbegin();
+		map<string, DomainsGroup>::iterator groupIter = m_groups.find(exchangerIter->second);
 
-		// Go up to the low watermark
-		while (domainIter != m_domainsByRecipients.rend())
+		if (groupIter != m_groups.end())
 		{
-			if ((m_lowestDomainCount == domainIter->first) &&
-				(m_lowestDomainName == domainIter->second))
+			DomainsGroup &group = groupIter->second;
+
+			unsigned int maxWorkers = getMaxWorkers(groupIter->first);
+
+			if ((group.m_domains.empty() == false) &&
+				((maxWorkers == 0) ||
+				(group.m_workersCount <= maxWorkers)))
+			{
+				// Stay on this exchanger, connections to it may be reused
+				takeDomain(groupIter->first, group, fromTop, domainName, recipientsCount);
+				foundDomain = true;
+			}
+			else if (group.m_workersCount > 0)
 			{
-				// Here we are
-				break;
+				// The exchanger may have been throttled down since this worker joined
+				--group.m_workersCount;
+				updateAvailability(groupIter->first, group, group.m_recipientsCount);
 			}
+		}
+	}
 
-			// Next
-			++domainIter;
-		} 
+	if (foundDomain == false)
+	{
+		// Pick the largest or smallest group that can take another worker
+		set<pair<off_t, string> >::iterator availableIter = m_availableGroups.end();
+		if (m_availableGroups.empty() == false)
+		{
+			if (fromTop == true)
+			{
+				--availableIter;
+			}
+			else
+			{
+				availableIter = m_availableGroups.begin();
+			}
+		}
 
-		if (domainIter != m_domainsByRecipients.rend())
+		if (availableIter != m_availableGroups.end())
 		{
-			// Get the next one
-			++domainIter;
+			map<string, DomainsGroup>::iterator groupIter = m_groups.find(availableIter->second);
 
-			if (domainIter != m_domainsByRecipients.rend())
+			if (groupIter != m_groups.end())
 			{
-				// Record this as the new low watermark beyond which domains have been processed
-				m_lowestDomainCount = domainIter->first;
-				m_lowestDomainName = domainIter->second;
-
-				recipientsCount = domainIter->first;
-				domainName = domainIter->second;
-				foundBottom = true;
-#ifdef DEBUG
-				clog << "DomainsMap::getBottomDomain: returning domain " << domainName << endl;
-#endif
+				++groupIter->second.m_workersCount;
+				takeDomain(groupIter->first, groupIter->second, fromTop, domainName, recipientsCount);
+				foundDomain = true;
 			}
 		}
+	}
+#ifdef DEBUG
+	if (foundDomain == true)
+	{
+		clog << "DomainsMap::getDomain: returning domain " << domainName << endl;
+	}
+#endif
+
+	// Unlock the map
+	pthread_mutex_unlock(&m_mutex);
 
-		// Unlock the map
-		pthread_mutex_unlock(&m_mutex);
+	return foundDomain;
+}
+
+void DomainsMap::takeDomain(const string &exchanger, DomainsGroup &group,
+	bool fromTop, string &domainName, unsigned int &recipientsCount)
+{
+	off_t previousRecipientsCount = group.m_recipientsCount;
+
+	if (fromTop == true)
+	{
+		recipientsCount = (unsigned int)group.m_domains.back().first;
+		domainName = group.m_domains.back().second;
+		group.m_domains.pop_back();
+	}
+	else
+	{
+		recipientsCount = (unsigned int)group.m_domains.front().first;
+		domainName = group.m_domains.front().second;
+		group.m_domains.pop_front();
+	}
+	group.m_recipientsCount -= recipientsCount;
+
+	updateAvailability(exchanger, group, previousRecipientsCount);
+}
+
+void DomainsMap::updateAvailability(const string &exchanger, DomainsGroup &group,
+	off_t previousRecipientsCount)
+{
+	m_availableGroups.erase(make_pair(previousRecipientsCount, exchanger));
+
+	unsigned int maxWorkers = getMaxWorkers(exchanger);
+
+	// Groups with nothing left, or enough workers, are not available
+	if ((group.m_domains.empty() == false) &&
+		((maxWorkers == 0) ||
+		(group.m_workersCount < maxWorkers)))
+	{
+		m_availableGroups.insert(make_pair(group.m_recipientsCount, exchanger));
 	}
+}
 
-	return foundBottom;
+unsigned int DomainsMap::getMaxWorkers(const string &exchanger)
+{
+	// The throttle knows best, if enabled
+	return ExchangerThrottle::getInstance()->getConcurrency(exchanger, m_maxWorkersPerExchanger);
 }
@@ -22,8 +22,30 @@
 #define _DOMAINSMAP_H_
 
 #include <unistd.h>
+#include <pthread.h>
+#include <deque>
 #include <map>
+#include <set>
 #include <string>
+#include <utility>
+
+
+/// Domains that share mail exchangers.
+class DomainsGroup
+{
+	public:
+		DomainsGroup();
+		DomainsGroup(const DomainsGroup &other);
+		~DomainsGroup();
+
+		DomainsGroup &operator=(const DomainsGroup &other);
+
+		/// Domains by increasing number of recipients.
+		std::deque<std::pair<off_t, std::string> > m_domains;
+		off_t m_recipientsCount;
+		unsigned int m_workersCount;
+
+};
 
 /// Map of domains that have recipients.
 class DomainsMap
@@ -39,16 +61,30 @@ class DomainsMap
 		  */
 		std::multimap<off_t, std::string> &getMap(void);
 
+		/**
+		  * Groups domains of the map by mail exchanger, so that workers can go
+		  * from one domain to the next over the same connections, and no more than
+		  * maxWorkersPerExchanger (if not 0) deliver to the same exchanger at once.
+		  * If the exchanger throttle is enabled, its concurrency applies instead.
+		  * If slavesCount is more than 1, only groups that belong to slave slaveNum
+		  * are kept, and groups larger than a slave's share have their domains
+		  * dealt out between slaves. Returns the number of domains kept.
+		  */
+		off_t groupByExchanger(unsigned int maxWorkersPerExchanger,
+			off_t slavesCount = 0, off_t slaveNum = 0);
+
 		/**
 		  * Returns a domain from the top of the map.
-		  * Top domains have the most recipients.
+		  * Top domains have the most recipients. If domainName is set,
+		  * it's the domain the caller is done with, and the next one
+		  * will share its exchanger if possible.
 		  */
 		bool getTopDomain(std::string &domainName,
 			unsigned int &recipientsCount);
 
 		/**
 		  * Returns a domain from the bottom of the map.
-		  * Bottom domains have few recipients.
+		  * Bottom domains have few recipients. domainName is as for getTopDomain().
 		  */
 		bool getBottomDomain(std::string &domainName,
 			unsigned int &recipientsCount);
@@ -57,11 +93,25 @@ class DomainsMap
 		static DomainsMap *m_pInstance;
 		pthread_mutex_t m_mutex;
 		std::multimap<off_t, std::string> m_domainsByRecipients;
-		off_t m_lowestDomainCount;
-		std::string m_lowestDomainName;
+		std::map<std::string, DomainsGroup> m_groups;
+		std::map<std::string, std::string> m_exchangers;
+		std::set<std::pair<off_t, std::string> > m_availableGroups;
+		unsigned int m_maxWorkersPerExchanger;
+		bool m_isGrouped;
 
 		DomainsMap();
 
+		bool getDomain(bool fromTop, std::string &domainName,
+			unsigned int &recipientsCount);
+
+		void takeDomain(const std::string &exchanger, DomainsGroup &group,
+			bool fromTop, std::string &domainName, unsigned int &recipientsCount);
+
+		void updateAvailability(const std::string &exchanger, DomainsGroup &group,
+			off_t previousRecipientsCount);
+
+		unsigned int getMaxWorkers(const std::string &exchanger);
+
 	private:
 		// DomainsMap objects cannot be copied
 		DomainsMap(const DomainsMap &other);
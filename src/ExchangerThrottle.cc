@@ -0,0 +1,334 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <ctype.h>
+#include <iostream>
+#include <algorithm>
+
+#include "ExchangerThrottle.h"
+
+// Largest batch the throttle will grow to
+#define MAX_BATCH_SIZE 100
+// Good batches in a row before one more worker is allowed
+#define CONCURRENCY_INCREASE_INTERVAL 4
+// Latency is rising once it's this many times the average
+#define LATENCY_INCREASE_FACTOR 2.0
+// Weight of the latest batch in the average latency
+#define LATENCY_WEIGHT 0.2
+
+using std::clog;
+using std::endl;
+using std::string;
+using std::map;
+using std::set;
+using std::pair;
+using std::max;
+using std::min;
+
+ThrottleState::ThrottleState(unsigned int batchSize, unsigned int concurrency) :
+	m_batchSize(batchSize),
+	m_concurrency(concurrency),
+	m_goodBatchesCount(0),
+	m_latency(0.0),
+	m_acceptedCount(0),
+	m_deferredCount(0),
+	m_decreasesCount(0)
+{
+}
+
+ThrottleState::ThrottleState(const ThrottleState &other) :
+	m_batchSize(other.m_batchSize),
+	m_concurrency(other.m_concurrency),
+	m_goodBatchesCount(other.m_goodBatchesCount),
+	m_latency(other.m_latency),
+	m_acceptedCount(other.m_acceptedCount),
+	m_deferredCount(other.m_deferredCount),
+	m_decreasesCount(other.m_decreasesCount)
+{
+}
+
+ThrottleState::~ThrottleState()
+{
+}
+
+ThrottleState &ThrottleState::operator=(const ThrottleState &other)
+{
+	if (this != &other)
+	{
+		m_batchSize = other.m_batchSize;
+		m_concurrency = other.m_concurrency;
+		m_goodBatchesCount = other.m_goodBatchesCount;
+		m_latency = other.m_latency;
+		m_acceptedCount = other.m_acceptedCount;
+		m_deferredCount = other.m_deferredCount;
+		m_decreasesCount = other.m_decreasesCount;
+	}
+
+	return *this;
+}
+
+ExchangerThrottle *ExchangerThrottle::m_pInstance = NULL;
+pthread_mutex_t ExchangerThrottle::m_instanceMutex = PTHREAD_MUTEX_INITIALIZER;
+
+ExchangerThrottle::ExchangerThrottle() :
+	m_maxConcurrency(0),
+	m_isEnabled(false)
+{
+	pthread_mutex_init(&m_mutex, 0);
+}
+
+ExchangerThrottle::~ExchangerThrottle()
+{
+	pthread_mutex_destroy(&m_mutex);
+}
+
+ExchangerThrottle *ExchangerThrottle::getInstance(void)
+{
+	pthread_mutex_lock(&m_instanceMutex);
+	if (m_pInstance == NULL)
+	{
+		m_pInstance = new ExchangerThrottle();
+	}
+	pthread_mutex_unlock(&m_instanceMutex);
+
+	return m_pInstance;
+}
+
+string ExchangerThrottle::getExchangerName(const string &domainName,
+	const set<ResourceRecord> &mxRecords)
+{
+	// Records are sorted by decreasing priority
+	if (mxRecords.empty() == true)
+	{
+		return domainName;
+	}
+
+	string exchanger(mxRecords.rbegin()->m_hostName);
+	for (string::size_type pos = 0; pos < exchanger.length(); ++pos)
+	{
+		exchanger[pos] = (char)tolower((unsigned char)exchanger[pos]);
+	}
+
+	// Drop the host part if there's a parent domain left
+	string::size_type dotPos = exchanger.find('.');
+	if ((dotPos != string::npos) &&
+		(exchanger.find('.', dotPos + 1) != string::npos))
+	{
+		exchanger.erase(0, dotPos + 1);
+	}
+
+	return exchanger;
+}
+
+bool ExchangerThrottle::isDeferral(int statusCode)
+{
+	// Service not available, mailbox busy or rate limited, local error
+	if ((statusCode == 421) ||
+		(statusCode == 450) ||
+		(statusCode == 451))
+	{
+		return true;
+	}
+
+	return false;
+}
+
+void ExchangerThrottle::enable(unsigned int maxConcurrency)
+{
+	pthread_mutex_lock(&m_mutex);
+	m_maxConcurrency = maxConcurrency;
+	m_isEnabled = true;
+	pthread_mutex_unlock(&m_mutex);
+}
+
+bool ExchangerThrottle::isEnabled(void) const
+{
+	return m_isEnabled;
+}
+
+unsigned int ExchangerThrottle::getBatchSize(const string &exchanger,
+	unsigned int defaultSize)
+{
+	unsigned int batchSize = defaultSize;
+
+	if (m_isEnabled == false)
+	{
+		return defaultSize;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	batchSize = getState(exchanger, defaultSize).m_batchSize;
+	pthread_mutex_unlock(&m_mutex);
+
+	return batchSize;
+}
+
+unsigned int ExchangerThrottle::getConcurrency(const string &exchanger,
+	unsigned int defaultCount)
+{
+	unsigned int concurrency = defaultCount;
+
+	if ((m_isEnabled == false) ||
+		(m_maxConcurrency == 0))
+	{
+		return defaultCount;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	// Exchangers nothing was sent to yet get all workers allowed
+	map<string, ThrottleState>::const_iterator stateIter = m_states.find(exchanger);
+	if (stateIter != m_states.end())
+	{
+		concurrency = stateIter->second.m_concurrency;
+	}
+	else
+	{
+		concurrency = m_maxConcurrency;
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	return concurrency;
+}
+
+unsigned int ExchangerThrottle::recordBatch(const string &exchanger,
+	unsigned int defaultSize, unsigned int msgsCount,
+	unsigned int acceptedCount, unsigned int deferredCount,
+	unsigned int milliSecs)
+{
+	unsigned int batchSize = defaultSize;
+
+	if ((m_isEnabled == false) ||
+		(msgsCount == 0))
+	{
+		return getBatchSize(exchanger, defaultSize);
+	}
+
+	double latency = (double)milliSecs / (double)msgsCount;
+
+	pthread_mutex_lock(&m_mutex);
+	ThrottleState &state = getState(exchanger, defaultSize);
+	unsigned int previousBatchSize = state.m_batchSize;
+	unsigned int previousConcurrency = state.m_concurrency;
+	const char *pReason = NULL;
+
+	state.m_acceptedCount += acceptedCount;
+	state.m_deferredCount += deferredCount;
+
+	if (deferredCount > 0)
+	{
+		// Back off hard, the exchanger told us to
+		state.m_batchSize = max(state.m_batchSize / 2, 1U);
+		state.m_concurrency = max(state.m_concurrency / 2, 1U);
+		state.m_goodBatchesCount = 0;
+		++state.m_decreasesCount;
+		pReason = "deferrals";
+	}
+	else if ((state.m_latency > 0.0) &&
+		(latency > state.m_latency * LATENCY_INCREASE_FACTOR))
+	{
+		// Replies are getting slower, ease off before deferrals start
+		state.m_batchSize = max((state.m_batchSize * 3) / 4, 1U);
+		state.m_concurrency = max((state.m_concurrency * 3) / 4, 1U);
+		state.m_goodBatchesCount = 0;
+		++state.m_decreasesCount;
+		pReason = "rising latency";
+	}
+	else if (acceptedCount > 0)
+	{
+		// Probe for more
+		if (state.m_batchSize < MAX_BATCH_SIZE)
+		{
+			++state.m_batchSize;
+		}
+		++state.m_goodBatchesCount;
+		if ((state.m_goodBatchesCount >= CONCURRENCY_INCREASE_INTERVAL) &&
+			(state.m_concurrency < m_maxConcurrency))
+		{
+			++state.m_concurrency;
+			state.m_goodBatchesCount = 0;
+		}
+		pReason = "fast replies";
+	}
+
+	if (state.m_latency == 0.0)
+	{
+		state.m_latency = latency;
+	}
+	else
+	{
+		state.m_latency = (LATENCY_WEIGHT * latency) + ((1.0 - LATENCY_WEIGHT) * state.m_latency);
+	}
+	batchSize = state.m_batchSize;
+
+	// Growing the batch by one is routine, other changes aren't
+	bool logChange = (state.m_concurrency != previousConcurrency) ||
+		(state.m_batchSize < previousBatchSize);
+#ifdef DEBUG
+	logChange |= (state.m_batchSize != previousBatchSize);
+#endif
+	if ((pReason != NULL) &&
+		(logChange == true))
+	{
+		clog << "Throttle for " << exchanger << ": batch " << state.m_batchSize
+			<< ", concurrency " << state.m_concurrency << ", latency "
+			<< (unsigned int)state.m_latency << " ms/message (" << pReason << ")" << endl;
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	return batchSize;
+}
+
+void ExchangerThrottle::logStatistics(void)
+{
+	if (m_isEnabled == false)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	for (map<string, ThrottleState>::const_iterator stateIter = m_states.begin();
+		stateIter != m_states.end(); ++stateIter)
+	{
+		const ThrottleState &state = stateIter->second;
+
+		clog << "Throttle for " << stateIter->first << ": batch " << state.m_batchSize
+			<< ", concurrency " << state.m_concurrency << ", latency "
+			<< (unsigned int)state.m_latency << " ms/message, "
+			<< state.m_acceptedCount << " accepted, " << state.m_deferredCount
+			<< " deferred, " << state.m_decreasesCount << " decreases" << endl;
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+ThrottleState &ExchangerThrottle::getState(const string &exchanger,
+	unsigned int defaultSize)
+{
+	map<string, ThrottleState>::iterator stateIter = m_states.find(exchanger);
+
+	if (stateIter == m_states.end())
+	{
+		// Start from the configured limits
+		ThrottleState state(max(min(defaultSize, (unsigned int)MAX_BATCH_SIZE), 1U),
+			max(m_maxConcurrency, 1U));
+
+		stateIter = m_states.insert(pair<string, ThrottleState>(exchanger, state)).first;
+	}
+
+	return stateIter->second;
+}
@@ -0,0 +1,121 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _EXCHANGERTHROTTLE_H_
+#define _EXCHANGERTHROTTLE_H_
+
+#include <time.h>
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <string>
+
+#include "Resolver.h"
+
+/// How hard an exchanger is currently being pushed.
+class ThrottleState
+{
+	public:
+		ThrottleState(unsigned int batchSize, unsigned int concurrency);
+		ThrottleState(const ThrottleState &other);
+		~ThrottleState();
+
+		ThrottleState &operator=(const ThrottleState &other);
+
+		unsigned int m_batchSize;
+		unsigned int m_concurrency;
+		unsigned int m_goodBatchesCount;
+		double m_latency;
+		unsigned int m_acceptedCount;
+		unsigned int m_deferredCount;
+		unsigned int m_decreasesCount;
+
+};
+
+/**
+  * Adapts batch size and concurrency to what each mail exchanger tolerates.
+  * Both are increased additively while replies are fast and positive, and
+  * decreased multiplicatively on 421/450/451 replies or rising latency.
+  */
+class ExchangerThrottle
+{
+	public:
+		virtual ~ExchangerThrottle();
+
+		/// Returns the throttle.
+		static ExchangerThrottle *getInstance(void);
+
+		/**
+		  * Returns the name domains with these MX records are grouped under.
+		  * This is the preferred exchanger's parent domain, so that a farm's
+		  * hosts, eg mx1.example.net and mx2.example.net, end up together.
+		  */
+		static std::string getExchangerName(const std::string &domainName,
+			const std::set<ResourceRecord> &mxRecords);
+
+		/// Returns true if the reply is an exchanger asking us to slow down.
+		static bool isDeferral(int statusCode);
+
+		/// Turns adaptation on, with concurrency up to maxConcurrency (if not 0).
+		void enable(unsigned int maxConcurrency);
+
+		/// Returns true if adaptation is on.
+		bool isEnabled(void) const;
+
+		/// Returns how many messages to send per batch, defaultSize if not adapting.
+		unsigned int getBatchSize(const std::string &exchanger,
+			unsigned int defaultSize);
+
+		/// Returns how many workers may deliver at once, defaultCount if not adapting.
+		unsigned int getConcurrency(const std::string &exchanger,
+			unsigned int defaultCount);
+
+		/**
+		  * Records how a batch of msgsCount messages went, and adapts.
+		  * Returns the batch size to use next.
+		  */
+		unsigned int recordBatch(const std::string &exchanger,
+			unsigned int defaultSize, unsigned int msgsCount,
+			unsigned int acceptedCount, unsigned int deferredCount,
+			unsigned int milliSecs);
+
+		/// Logs current values for all exchangers.
+		void logStatistics(void);
+
+	protected:
+		static ExchangerThrottle *m_pInstance;
+		static pthread_mutex_t m_instanceMutex;
+		pthread_mutex_t m_mutex;
+		std::map<std::string, ThrottleState> m_states;
+		unsigned int m_maxConcurrency;
+		bool m_isEnabled;
+
+		ExchangerThrottle();
+
+		ThrottleState &getState(const std::string &exchanger,
+			unsigned int defaultSize);
+
+	private:
+		// ExchangerThrottle objects cannot be copied.
+		ExchangerThrottle(const ExchangerThrottle &other);
+		ExchangerThrottle &operator=(const ExchangerThrottle &other);
+
+};
+
+#endif // _EXCHANGERTHROTTLE_H_
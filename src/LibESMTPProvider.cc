@@ -30,7 +30,6 @@
 #include <algorithm>
 
 #include "config.h"
-#include "Base64.h"
 #include "LibESMTPProvider.h"
 #include "QuotedPrintable.h"
 #include "SMTPSession.h"
@@ -38,10 +37,11 @@
 using std::clog;
 using std::endl;
 using std::map;
+using std::min;
 using std::set;
 using std::string;
 using std::stringstream;
-using std::min;
+using std::vector;
 
 static int authenticationCallback(auth_client_request_t request, char **ppResult, int fields, void *pArg)
 {
@@ -605,6 +605,28 @@ void resetMessagesCallback(smtp_message_t message, void *pArg)
 	smtp_enumerate_recipients(message, resetRecipientsCallback, pArg);
 }
 
+static void appendWithCRLF(const char *pText, size_t textLen, string &content)
+{
+	const char *pCurrentPos = pText;
+	const char *pEnd = pText + textLen;
+	const char *pNLPos = (const char *)memchr(pCurrentPos, '\n', textLen);
+
+	content.reserve(content.length() + textLen + textLen / 32);
+	while (pNLPos != NULL)
+	{
+		content.append(pCurrentPos, pNLPos - pCurrentPos);
+		content.append("\r\n", 2);
+
+		// Next
+		pCurrentPos = pNLPos + 1;
+		pNLPos = (const char *)memchr(pCurrentPos, '\n', pEnd - pCurrentPos);
+	}
+	if (pCurrentPos < pEnd)
+	{
+		content.append(pCurrentPos, pEnd - pCurrentPos);
+	}
+}
+
 static void qpEncode(string &content)
 {
 	if (content.empty() == true)
@@ -618,28 +640,7 @@ static void qpEncode(string &content)
 	if (pEncodedContent != NULL)
 	{
 		content.clear();
-
-		char *pCurrentPos = pEncodedContent;
-		char *pNLPos = strchr(pCurrentPos, '\n');
-		while (pNLPos != NULL)
-		{
-			size_t lineLen = pNLPos - pCurrentPos;
-
-			content.append(pCurrentPos, lineLen);
-			content.append("\r\n", 2);
-
-			// Next
-			pCurrentPos = pNLPos + 1;
-			if ((size_t)(pCurrentPos - pEncodedContent) >= encodedLength)
-			{
-				break;
-			}
-			pNLPos = strchr(pCurrentPos, '\n');
-		} 
-		if ((size_t)(pCurrentPos - pEncodedContent) < encodedLength)
-		{
-			content.append(pCurrentPos, encodedLength - (pCurrentPos - pEncodedContent));
-		}
+		appendWithCRLF(pEncodedContent, encodedLength, content);
 
 		delete[] pEncodedContent;
 	}
@@ -648,6 +649,23 @@ static void qpEncode(string &content)
 #endif
 }
 
+static void substituteAndEncode(Substituter *pSubstituter,
+	const map<string, string> &fieldValues, string &content)
+{
+	string encodedContent;
+
+	if (pSubstituter->substituteEncoded(fieldValues, encodedContent) == true)
+	{
+		// Literals were encoded once, only substituted values were encoded here
+		content.clear();
+		appendWithCRLF(encodedContent.c_str(), encodedContent.length(), content);
+		return;
+	}
+
+	pSubstituter->substitute(fieldValues, content);
+	qpEncode(content);
+}
+
 LibESMTPMessage::LibESMTPMessage(const map<string, string> &fieldValues,
 	MessageDetails *pDetails, DSNNotification dsnFlags,
 	bool enableMdn,
@@ -663,13 +681,13 @@ LibESMTPMessage::LibESMTPMessage(const map<string, string> &fieldValues,
 	if (m_pDetails != NULL)
 	{
 		// Substitute fields in content once
-		substituteContent(fieldValues);
-
-		qpEncode(m_plainContent);
-		qpEncode(m_htmlContent);
+		substituteAndEncode(m_pDetails->getPlainSubstituter(m_msgId + "p"),
+			fieldValues, m_plainContent);
+		substituteAndEncode(m_pDetails->getHtmlSubstituter(m_msgId + "h"),
+			fieldValues, m_htmlContent);
 
-		// Load attachments
-		m_pDetails->loadAttachments();
+		// Load and encode attachments
+		m_pDetails->encodeAttachments();
 	}
 	buildHeaders();
 }
@@ -769,6 +787,21 @@ bool LibESMTPMessage::setSignatureHeader(const string &header,
 	return true;
 }
 
+void LibESMTPMessage::clearSignatureHeaders(void)
+{
+	string::size_type signaturesLength = 0;
+
+	// Signatures were prepended to the headers
+	for (vector<string>::const_iterator headerIter = m_signatureHeaders.begin();
+		headerIter != m_signatureHeaders.end(); ++headerIter)
+	{
+		signaturesLength += headerIter->length();
+	}
+	m_headersDump.erase(0, min(signaturesLength, m_headersDump.length()));
+
+	SMTPMessage::clearSignatureHeaders();
+}
+
 void LibESMTPMessage::setEnvId(const string &dsnEnvId)
 {
 	if ((m_message != NULL) &&
@@ -841,40 +874,30 @@ const char *LibESMTPMessage::getAttachmentLine(off_t &lineLen,
 
 	m_hasMoreLines = false;
 
+	// Attachments were encoded up front
 	if ((pAttachment == NULL) ||
-		(pAttachment->m_pContent == NULL) ||
-		(pAttachment->m_contentLength == 0))
+		(pAttachment->m_pEncodedContent == NULL) ||
+		(pAttachment->m_encodedLength == 0))
 	{
 		return NULL;
 	}
 
-	// Encode the content, if necessary
-	if (pAttachment->m_pEncodedContent == NULL)
+	if (m_encodedPos < pAttachment->m_encodedLength)
 	{
-		unsigned long encodedLen = (unsigned long)pAttachment->m_contentLength;
+		const char *pLine = pAttachment->m_pEncodedContent + m_encodedPos;
+		const char *pEndOfLine = strstr(pLine, "\r\n");
 
-		pAttachment->m_pEncodedContent = Base64::encode(pAttachment->m_pContent, encodedLen);
-		if (pAttachment->m_pEncodedContent == NULL)
+		// Lines are returned without their CRLF
+		if (pEndOfLine != NULL)
 		{
-			clog << "Couldn't encode contents of " << pAttachment->m_filePath << endl;
-			pAttachment->m_encodedLength = 0;
+			lineLen = (off_t)(pEndOfLine - pLine);
+			m_encodedPos += lineLen + 2;
 		}
 		else
 		{
-			pAttachment->m_encodedLength = (off_t)encodedLen;
+			lineLen = pAttachment->m_encodedLength - m_encodedPos;
+			m_encodedPos += lineLen;
 		}
-	}
-
-	if ((pAttachment->m_pEncodedContent != NULL) &&
-		(pAttachment->m_encodedLength > 0) &&
-		(m_encodedPos < pAttachment->m_encodedLength))
-	{
-		const char *pLine = pAttachment->m_pEncodedContent + m_encodedPos;
-
-		lineLen = min((off_t)76, pAttachment->m_encodedLength - m_encodedPos);
-
-		// Move forward
-		m_encodedPos += lineLen;
 		// Any more line after this ?
 		if (m_encodedPos < pAttachment->m_encodedLength)
 		{
@@ -1036,8 +1059,10 @@ bool LibESMTPProvider::setServer(const string &hostName,
 	hostNameAndPortStr << ":";
 	hostNameAndPortStr << port;
 
+	// libESMTP can't tell a literal IPv6 address from the port
 	if ((m_session == NULL) ||
 		(hostName.empty() == true) ||
+		(hostName.find(':') != string::npos) ||
 		(smtp_set_server(m_session, hostNameAndPortStr.str().c_str()) == 0))
 	{
 		return false;
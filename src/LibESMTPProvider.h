@@ -59,6 +59,9 @@ class LibESMTPMessage : public SMTPMessage
 		virtual bool setSignatureHeader(const std::string &header,
 			const std::string &value);
 
+		/// Drops signature headers, before the message is signed again.
+		virtual void clearSignatureHeaders(void);
+
 		/// Adds a header.
 		virtual bool addHeader(const std::string &header,
 			const std::string &value, const std::string &path);
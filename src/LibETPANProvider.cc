@@ -32,7 +32,9 @@
 #include <algorithm>
 
 #include "config.h"
+#include "Connector.h"
 #include "LibETPANProvider.h"
+#include "LibETPANSessionPool.h"
 #include "QuotedPrintable.h"
 #include "SMTPSession.h"
 
@@ -132,10 +134,8 @@ static string catValuePath(const string &value, const string &path)
 
 static char *asciiOnly(const string &value)
 {
-	string encodedValue;
+	string encodedValue, encodedWord;
 	string::size_type pos = 0;
-	char *pEncodedWord = NULL;
-	size_t wordLen = value.length();
 	bool isAscii = true;
 
 	while (pos < value.length())
@@ -148,19 +148,17 @@ static char *asciiOnly(const string &value)
 		++pos;
 	}
 
-	if (isAscii == false)
-	{
-#ifdef DEBUG
-		clog << "asciiOnly: '" << value << "' needs to be QP-encoded" << endl;
-#endif
-		pEncodedWord = QuotedPrintable::encode(value.c_str(), wordLen);
-	}
-	if (pEncodedWord == NULL)
+	if (isAscii == true)
 	{
 		return strndup(value.c_str(), value.length());
 	}
+#ifdef DEBUG
+	clog << "asciiOnly: '" << value << "' needs to be QP-encoded" << endl;
+#endif
 
-	string encodedWord(pEncodedWord);
+	QPEncoder encoder;
+
+	encoder.encode(value.c_str(), value.length(), encodedWord);
 
 	// http://en.wikipedia.org/wiki/MIME#Encoded-Word
 	// QuotedPrintable encodes '='
@@ -209,8 +207,6 @@ static char *asciiOnly(const string &value)
 	encodedValue += encodedWord;
 	encodedValue += "?=";
 
-	delete[] pEncodedWord;
-
 	return strndup(encodedValue.c_str(), encodedValue.length());
 }
 
@@ -505,10 +501,11 @@ static mailmime *buildFilePart(Attachment *pAttachment)
 
 	struct mailmime_fields *mime_fields = NULL;
 	struct mailmime_field *mime_id = NULL;
+	int encoding = MAILMIME_MECHANISM_BASE64;
 
 	if (pAttachment->isInline() == true)
 	{
-		int encoding = getEncoding(pAttachment->m_encoding,
+		encoding = getEncoding(pAttachment->m_encoding,
 			MAILMIME_MECHANISM_BASE64);
 
 		// These must be malloc-ed
@@ -538,7 +535,7 @@ static mailmime *buildFilePart(Attachment *pAttachment)
 		clog << "buildFilePart: attachment " << pFileName << " is not inline" << endl;
 #endif
 		mime_fields = mailmime_fields_new_filename(MAILMIME_DISPOSITION_TYPE_ATTACHMENT,
-			pFileName, MAILMIME_MECHANISM_BASE64);
+			pFileName, encoding);
 	}
 	if (mime_fields == NULL)
 	{
@@ -565,8 +562,25 @@ static mailmime *buildFilePart(Attachment *pAttachment)
 	struct mailmime *mime_sub = mailmime_new_empty(content, mime_fields);
 	if (mime_sub != NULL)
 	{
+		// The file has already been encoded, share that
+		if ((encoding == MAILMIME_MECHANISM_BASE64) &&
+			(pAttachment->m_pEncodedContent != NULL) &&
+			(pAttachment->m_encodedLength > 0))
+		{
+#ifdef DEBUG
+			clog << "buildFilePart: attaching " << pAttachment->m_encodedLength << " bytes of encoded content" << endl;
+#endif
+			mime_sub->mm_data.mm_single = mailmime_data_new(MAILMIME_DATA_TEXT,
+				MAILMIME_MECHANISM_BASE64, 1, pAttachment->m_pEncodedContent,
+				(size_t)pAttachment->m_encodedLength, NULL);
+			if (mime_sub->mm_data.mm_single == NULL)
+			{
+				mailmime_free(mime_sub);
+				mime_sub = NULL;
+			}
+		}
 		// The file has already been loaded
-		if ((pAttachment->m_pContent != NULL) &&
+		else if ((pAttachment->m_pContent != NULL) &&
 			(pAttachment->m_contentLength > 0))
 		{
 #ifdef DEBUG
@@ -621,6 +635,9 @@ static size_t attachFileParts(MessageDetails *pDetails, struct mailmime *pPart,
 	unsigned int attachmentCount = pDetails->getAttachmentCount(inlineParts);
 	size_t messageSizeIncrement = 0;
 
+	// Attachments are encoded once and for all
+	pDetails->encodeAttachments();
+
 	for (unsigned int attachmentNum = 0; attachmentNum < attachmentCount; ++attachmentNum)
 	{
 		Attachment *pAttachment = pDetails->getAttachment(attachmentNum, inlineParts);
@@ -630,7 +647,14 @@ static size_t attachFileParts(MessageDetails *pDetails, struct mailmime *pPart,
 		{
 			mailmime_smart_add_part(pPart, pFilePart);
 
-			messageSizeIncrement += pAttachment->m_contentLength;
+			if (pAttachment->m_encodedLength > 0)
+			{
+				messageSizeIncrement += pAttachment->m_encodedLength;
+			}
+			else
+			{
+				messageSizeIncrement += pAttachment->m_contentLength;
+			}
 #ifdef DEBUG
 			clog << "attachFileParts: attachment #" << attachmentNum << " size "
 				<< messageSizeIncrement << endl;
@@ -712,6 +736,59 @@ int errorToStatusCode(int errNum)
 	return statusCode;
 }
 
+// Maps a reply code to the error libetpan would return for a MAIL, RCPT or DATA command.
+int replyCodeToError(int replyCode, int successCode)
+{
+	if ((replyCode == successCode) ||
+		((successCode == 250) && (replyCode == 251)))
+	{
+		return MAILSMTP_NO_ERROR;
+	}
+
+	switch (replyCode)
+	{
+		case 0:
+			return MAILSMTP_ERROR_STREAM;
+		case 421:
+			return MAILSMTP_ERROR_SERVICE_NOT_AVAILABLE;
+		case 450:
+		case 550:
+			return MAILSMTP_ERROR_MAILBOX_UNAVAILABLE;
+		case 451:
+			return MAILSMTP_ERROR_IN_PROCESSING;
+		case 452:
+			return MAILSMTP_ERROR_INSUFFICIENT_SYSTEM_STORAGE;
+		case 503:
+			return MAILSMTP_ERROR_BAD_SEQUENCE_OF_COMMAND;
+		case 551:
+			return MAILSMTP_ERROR_USER_NOT_LOCAL;
+		case 552:
+			return MAILSMTP_ERROR_EXCEED_STORAGE_ALLOCATION;
+		case 553:
+			return MAILSMTP_ERROR_MAILBOX_NAME_NOT_ALLOWED;
+		case 554:
+			return MAILSMTP_ERROR_TRANSACTION_FAILED;
+		default:
+			break;
+	}
+
+	return MAILSMTP_ERROR_UNEXPECTED_CODE;
+}
+
+int dsnFlagsToNotify(SMTPMessage::DSNNotification dsnFlags)
+{
+	if (dsnFlags == SMTPMessage::SUCCESS)
+	{
+		return MAILSMTP_DSN_NOTIFY_SUCCESS;
+	}
+	else if (dsnFlags == SMTPMessage::FAILURE)
+	{
+		return MAILSMTP_DSN_NOTIFY_FAILURE;
+	}
+
+	return MAILSMTP_DSN_NOTIFY_NEVER;
+}
+
 // A function object to delete optional fields with for_each().
 struct DeleteOptionalFieldFunc
 {
@@ -723,6 +800,93 @@ struct DeleteOptionalFieldFunc
 
 };
 
+/**
+  * The serialized MIME structure of a campaign's messages, minus the
+  * message header block and the text parts' bodies. Segments alternate
+  * with bodies, so there's one more segment than there are bodies.
+  */
+class LibETPANSkeleton : public MessageSkeleton
+{
+	public:
+		LibETPANSkeleton() :
+			MessageSkeleton(),
+			m_isValid(false),
+			m_length(0)
+		{
+		}
+		virtual ~LibETPANSkeleton()
+		{
+		}
+
+		bool m_isValid;
+		size_t m_length;
+		vector<string> m_segments;
+		vector<bool> m_isHtmlBody;
+		vector<int> m_bodyEncodings;
+
+	private:
+		// LibETPANSkeleton objects cannot be copied
+		LibETPANSkeleton(const LibETPANSkeleton &other);
+		LibETPANSkeleton &operator=(const LibETPANSkeleton &other);
+
+};
+
+static bool appendBodyText(MMAPString *pString, const string &content,
+	int encoding)
+{
+	// Bodies start on a new line
+	int col = 0;
+	struct mailmime_data *pData = mailmime_data_new(MAILMIME_DATA_TEXT,
+		encoding, 0, const_cast<char*>(content.c_str()), content.length(), NULL);
+	if (pData == NULL)
+	{
+		return false;
+	}
+
+	int errNum = mailmime_data_write_mem(pString, &col, pData, 1);
+	mailmime_data_free(pData);
+
+	return (errNum == MAILIMF_NO_ERROR);
+}
+
+static void appendWithCRLF(const char *pText, size_t textLen, string &content)
+{
+	const char *pCurrentPos = pText;
+	const char *pEnd = pText + textLen;
+	const char *pNLPos = (const char *)memchr(pCurrentPos, '\n', textLen);
+
+	content.reserve(content.length() + textLen + textLen / 32);
+	while (pNLPos != NULL)
+	{
+		content.append(pCurrentPos, pNLPos - pCurrentPos);
+		content.append("\r\n", 2);
+
+		// Next
+		pCurrentPos = pNLPos + 1;
+		pNLPos = (const char *)memchr(pCurrentPos, '\n', pEnd - pCurrentPos);
+	}
+	if (pCurrentPos < pEnd)
+	{
+		content.append(pCurrentPos, pEnd - pCurrentPos);
+	}
+}
+
+static void protectTrailingSpace(string &encodedContent)
+{
+	string::size_type contentLen = encodedContent.length();
+
+	// Relays may strip whitespace at the end of the last line, where the encoder leaves it
+	if ((contentLen > 0) &&
+		((encodedContent[contentLen - 1] == ' ') ||
+		(encodedContent[contentLen - 1] == '\t')))
+	{
+		char lastChar = encodedContent[contentLen - 1];
+
+		encodedContent.erase(contentLen - 1);
+		encodedContent += (lastChar == ' ' ? "=\n=20" : "=\n=09");
+	}
+}
+
 LibETPANMessage::LibETPANMessage(const map<string, string> &fieldValues,
 	MessageDetails *pDetails, DSNNotification dsnFlags,
 	bool enableMdn,
@@ -732,7 +896,8 @@ LibETPANMessage::LibETPANMessage(const map<string, string> &fieldValues,
 	m_date(time(NULL)),
 	m_pString(NULL),
 	m_sent(false),
-	m_relatedFirst(false)
+	m_relatedFirst(false),
+	m_pEncodedSkeleton(NULL)
 {
 	char *pEnvVar = getenv("GIVEMAIL_RELATED_FIRST");
 
@@ -743,8 +908,11 @@ LibETPANMessage::LibETPANMessage(const map<string, string> &fieldValues,
 		m_relatedFirst = true;
 	}
 
-	// Substitute fields in content once
-	substituteContent(fieldValues);
+	// Substitute fields in content once, encoded if it can go straight into a skeleton
+	if (substituteEncodedContent(fieldValues) == false)
+	{
+		substituteContent(fieldValues);
+	}
 
 	buildHeaders();
 }
@@ -882,7 +1050,9 @@ struct mailimf_fields *LibETPANMessage::headersToFields(void)
 }
 
 bool LibETPANMessage::serialize(size_t messageSizeEstimate,
-	struct mailmime *pMessage)
+	struct mailmime *pMessage,
+	struct mailmime *pPlainPart,
+	struct mailmime *pHtmlPart)
 {
 	int col = 0;
 	bool serialized = true;
@@ -906,12 +1076,315 @@ bool LibETPANMessage::serialize(size_t messageSizeEstimate,
 
 		serialized = false;
 	}
+	else if (getSkeletonKey() > 0)
+	{
+		// Other messages of this campaign can reuse this one's structure
+		buildSkeleton(pMessage, pPlainPart, pHtmlPart);
+	}
 
 	mailmime_free(pMessage);
 
 	return serialized;
 }
 
+bool LibETPANMessage::substituteEncodedContent(const map<string, string> &fieldValues)
+{
+	if ((m_pDetails == NULL) ||
+		(isDeliveryReceipt() == true) ||
+		(isReadNotification() == true) ||
+		(getEncoding(m_pDetails->getEncoding("text/plain"), MAILMIME_MECHANISM_QUOTED_PRINTABLE) != MAILMIME_MECHANISM_QUOTED_PRINTABLE) ||
+		(getEncoding(m_pDetails->getEncoding("/html"), MAILMIME_MECHANISM_QUOTED_PRINTABLE) != MAILMIME_MECHANISM_QUOTED_PRINTABLE))
+	{
+		return false;
+	}
+
+	Substituter *pSubstituters[2] = { m_pDetails->getPlainSubstituter(m_msgId + "p"),
+		m_pDetails->getHtmlSubstituter(m_msgId + "h") };
+	string *pContents[2] = { &m_plainContent, &m_htmlContent };
+	string encodedContent;
+
+	for (unsigned int partNum = 0; partNum < 2; ++partNum)
+	{
+		// Literals were encoded once, only substituted values are encoded here
+		// libetpan takes carriage returns as line breaks, the encoder doesn't
+		// Soft line breaks and escapes are QPEncoder's, not libetpan's, so bodies
+		// aren't the same bytes libetpan would write; signatures are computed
+		// on the message built from them, which is what gets sent
+		encodedContent.clear();
+		if ((pSubstituters[partNum]->substituteEncoded(fieldValues, encodedContent) == false) ||
+			(encodedContent.find("=0D") != string::npos))
+		{
+			m_plainContent.clear();
+			m_htmlContent.clear();
+			return false;
+		}
+		protectTrailingSpace(encodedContent);
+		pContents[partNum]->clear();
+		appendWithCRLF(encodedContent.c_str(), encodedContent.length(), *pContents[partNum]);
+	}
+
+	// Only messages spliced into a skeleton can use encoded bodies
+	const LibETPANSkeleton *pSkeleton = dynamic_cast<const LibETPANSkeleton*>(m_pDetails->getSkeleton(getSkeletonKey()));
+	if ((pSkeleton == NULL) ||
+		(pSkeleton->m_isValid == false))
+	{
+		m_plainContent.clear();
+		m_htmlContent.clear();
+		return false;
+	}
+	m_pEncodedSkeleton = pSkeleton;
+
+	return true;
+}
+
+unsigned int LibETPANMessage::getSkeletonKey(void) const
+{
+	if ((m_pDetails == NULL) ||
+		(isDeliveryReceipt() == true) ||
+		(isReadNotification() == true))
+	{
+		return 0;
+	}
+
+	// Which text parts are present determines the structure
+	unsigned int skeletonKey = 1;
+	if (m_plainContent.empty() == false)
+	{
+		skeletonKey |= 2;
+	}
+	if (m_htmlContent.empty() == false)
+	{
+		skeletonKey |= 4;
+	}
+
+	return skeletonKey;
+}
+
+void LibETPANMessage::buildSkeleton(struct mailmime *pMessage,
+	struct mailmime *pPlainPart, struct mailmime *pHtmlPart)
+{
+	unsigned int skeletonKey = getSkeletonKey();
+
+	if ((pMessage == NULL) ||
+		(m_pString == NULL) ||
+		(skeletonKey == 0) ||
+		(m_pDetails->getSkeleton(skeletonKey) != NULL))
+	{
+		return;
+	}
+
+	struct mailmime *pBodyParts[2] = { pPlainPart, pHtmlPart };
+	struct mailmime_data *pBodyData[2] = { NULL, NULL };
+	string markers[2];
+	int bodyEncodings[2] = {
+		getEncoding(m_pDetails->getEncoding("text/plain"), MAILMIME_MECHANISM_QUOTED_PRINTABLE),
+		getEncoding(m_pDetails->getEncoding("/html"), MAILMIME_MECHANISM_QUOTED_PRINTABLE) };
+
+	// Swap bodies for markers that are written as they are
+	for (unsigned int partNum = 0; partNum < 2; ++partNum)
+	{
+		if ((pBodyParts[partNum] == NULL) ||
+			(pBodyParts[partNum]->mm_type != MAILMIME_SINGLE))
+		{
+			continue;
+		}
+
+		stringstream markerStr;
+		markerStr << "{givemail-skeleton-" << this << "-" << partNum << "}";
+		markers[partNum] = markerStr.str();
+
+		pBodyData[partNum] = pBodyParts[partNum]->mm_data.mm_single;
+		pBodyParts[partNum]->mm_data.mm_single = mailmime_data_new(MAILMIME_DATA_TEXT,
+			MAILMIME_MECHANISM_8BIT, 1, const_cast<char*>(markers[partNum].c_str()),
+			markers[partNum].length(), NULL);
+	}
+
+	// Leave out the message headers
+	struct mailimf_fields *pFields = pMessage->mm_data.mm_message.mm_fields;
+	pMessage->mm_data.mm_message.mm_fields = NULL;
+
+	MMAPString *pSkeletonString = mmap_string_sized_new(m_pString->len);
+	int col = 0;
+	bool written = false;
+
+	if ((pSkeletonString != NULL) &&
+		(mailmime_write_mem(pSkeletonString, &col, pMessage) == MAILIMF_NO_ERROR))
+	{
+		written = true;
+	}
+
+	// Put the tree back the way it was
+	pMessage->mm_data.mm_message.mm_fields = pFields;
+	for (unsigned int partNum = 0; partNum < 2; ++partNum)
+	{
+		if (pBodyData[partNum] != NULL)
+		{
+			if (pBodyParts[partNum]->mm_data.mm_single != NULL)
+			{
+				mailmime_data_free(pBodyParts[partNum]->mm_data.mm_single);
+			}
+			pBodyParts[partNum]->mm_data.mm_single = pBodyData[partNum];
+		}
+	}
+
+	LibETPANSkeleton *pSkeleton = new LibETPANSkeleton();
+
+	if (written == true)
+	{
+		string skeletonData(pSkeletonString->str, pSkeletonString->len);
+		string::size_type startPos = 0;
+
+		// Split the structure around the markers
+		while (startPos != string::npos)
+		{
+			string::size_type markerPos = string::npos;
+			unsigned int markerNum = 0;
+
+			for (unsigned int partNum = 0; partNum < 2; ++partNum)
+			{
+				if (markers[partNum].empty() == true)
+				{
+					continue;
+				}
+
+				string::size_type pos = skeletonData.find(markers[partNum], startPos);
+				if ((pos != string::npos) &&
+					((markerPos == string::npos) || (pos < markerPos)))
+				{
+					markerPos = pos;
+					markerNum = partNum;
+				}
+			}
+
+			if (markerPos == string::npos)
+			{
+				pSkeleton->m_segments.push_back(skeletonData.substr(startPos));
+				startPos = markerPos;
+			}
+			else
+			{
+				pSkeleton->m_segments.push_back(skeletonData.substr(startPos, markerPos - startPos));
+				pSkeleton->m_isHtmlBody.push_back(markerNum == 1);
+				pSkeleton->m_bodyEncodings.push_back(bodyEncodings[markerNum]);
+				startPos = markerPos + markers[markerNum].length();
+			}
+		}
+		pSkeleton->m_length = skeletonData.length();
+
+		// Only use the skeleton if it reproduces this message exactly
+		MMAPString *pCheckString = mmap_string_sized_new(m_pString->len);
+		if (pCheckString != NULL)
+		{
+			col = 0;
+			if ((mailimf_fields_write_mem(pCheckString, &col, pFields) == MAILIMF_NO_ERROR) &&
+				(appendSkeleton(pSkeleton, pCheckString) == true) &&
+				(pCheckString->len == m_pString->len) &&
+				(memcmp(pCheckString->str, m_pString->str, m_pString->len) == 0))
+			{
+				pSkeleton->m_isValid = true;
+			}
+			mmap_string_free(pCheckString);
+		}
+	}
+	if (pSkeletonString != NULL)
+	{
+		mmap_string_free(pSkeletonString);
+	}
+
+	if (pSkeleton->m_isValid == false)
+	{
+		// Remember not to try again
+		clog << "Couldn't build a MIME skeleton, messages will be built in full" << endl;
+	}
+#ifdef DEBUG
+	else clog << "LibETPANMessage::buildSkeleton: " << pSkeleton->m_segments.size()
+		<< " segments, " << pSkeleton->m_length << " bytes" << endl;
+#endif
+	m_pDetails->setSkeleton(skeletonKey, pSkeleton);
+}
+
+bool LibETPANMessage::appendSkeleton(const LibETPANSkeleton *pSkeleton,
+	MMAPString *pString)
+{
+	if ((pSkeleton == NULL) ||
+		(pString == NULL))
+	{
+		return false;
+	}
+
+	for (unsigned int segmentNum = 0; segmentNum < pSkeleton->m_segments.size(); ++segmentNum)
+	{
+		const string &segment = pSkeleton->m_segments[segmentNum];
+
+		if ((segment.empty() == false) &&
+			(mmap_string_append_len(pString, segment.c_str(), segment.length()) == NULL))
+		{
+			return false;
+		}
+
+		// Splice this recipient's body in
+		if (segmentNum < pSkeleton->m_isHtmlBody.size())
+		{
+			const string &content = (pSkeleton->m_isHtmlBody[segmentNum] == true ? m_htmlContent : m_plainContent);
+
+			if (m_pEncodedSkeleton != NULL)
+			{
+				// Already encoded
+				if ((content.empty() == false) &&
+					(mmap_string_append_len(pString, content.c_str(), content.length()) == NULL))
+				{
+					return false;
+				}
+			}
+			else if (appendBodyText(pString, content, pSkeleton->m_bodyEncodings[segmentNum]) == false)
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool LibETPANMessage::buildFromSkeleton(const LibETPANSkeleton *pSkeleton)
+{
+	struct mailimf_fields *pFields = headersToFields();
+	if (pFields == NULL)
+	{
+		return false;
+	}
+
+	// Delete any previously allocated string
+	if (m_pString != NULL)
+	{
+		mmap_string_free(m_pString);
+		m_pString = NULL;
+	}
+
+	// Headers will definitely fit in 4kB
+	m_pString = mmap_string_sized_new(4096 + pSkeleton->m_length +
+		m_plainContent.length() + m_htmlContent.length());
+
+	int col = 0;
+	bool built = false;
+
+	if ((m_pString != NULL) &&
+		(mailimf_fields_write_mem(m_pString, &col, pFields) == MAILIMF_NO_ERROR) &&
+		(appendSkeleton(pSkeleton, m_pString) == true))
+	{
+		built = true;
+	}
+	else if (m_pString != NULL)
+	{
+		mmap_string_free(m_pString);
+		m_pString = NULL;
+	}
+
+	mailimf_fields_free(pFields);
+
+	return built;
+}
+
 string LibETPANMessage::getUserAgent(void) const
 {
 	if ((m_pDetails != NULL) &&
@@ -969,8 +1442,34 @@ void LibETPANMessage::addRecipient(const string &emailAddress)
 	m_recipients[emailAddress] = -1;
 }
 
+void LibETPANMessage::clearRecipients(void)
+{
+	m_recipients.clear();
+	m_response.clear();
+	m_sent = false;
+}
+
 bool LibETPANMessage::buildMessage(void)
 {
+	unsigned int skeletonKey = getSkeletonKey();
+
+	if (m_pEncodedSkeleton != NULL)
+	{
+		// Bodies were encoded for this skeleton, which outlives cleared ones
+		return buildFromSkeleton(m_pEncodedSkeleton);
+	}
+	if (skeletonKey > 0)
+	{
+		const LibETPANSkeleton *pSkeleton = dynamic_cast<const LibETPANSkeleton*>(m_pDetails->getSkeleton(skeletonKey));
+
+		// Splice this message into the campaign's structure
+		if ((pSkeleton != NULL) &&
+			(pSkeleton->m_isValid == true))
+		{
+			return buildFromSkeleton(pSkeleton);
+		}
+	}
+
 	struct mailimf_fields *pFields = headersToFields();
 	if (pFields == NULL)
 	{
@@ -1188,7 +1687,7 @@ bool LibETPANMessage::buildMessage(void)
 			}
 		}
 
-		return serialize(messageSizeEstimate, pMessage);
+		return serialize(messageSizeEstimate, pMessage, pPlainPart, pHtmlPart);
 	}
 	else
 	{
@@ -1219,7 +1718,9 @@ LibETPANProvider::LibETPANProvider() :
 	m_port(25),
 	m_authenticate(false),
 	m_startTLS(false),
-	m_error(0)
+	m_error(0),
+	m_isESMTP(false),
+	m_sessionMsgsCount(0)
 {
 	char *pEnvVar = getenv("GIVEMAIL_DEBUG");
 
@@ -1315,6 +1816,11 @@ void LibETPANProvider::destroySession(void)
 {
 	if (m_session != NULL)
 	{
+		if (m_session->stream != NULL)
+		{
+			mailsmtp_quit(m_session);
+			m_session->stream = NULL;
+		}
 		mailsmtp_free(m_session);
 		m_session = NULL;
 
@@ -1322,6 +1828,8 @@ void LibETPANProvider::destroySession(void)
 		m_port = 25;
 		m_authenticate = false;
 	}
+	// Messages are queued again on the next session
+	m_messages.clear();
 }
 
 bool LibETPANProvider::setServer(const string &hostName,
@@ -1329,6 +1837,7 @@ bool LibETPANProvider::setServer(const string &hostName,
 {
 	m_hostName = hostName;
 	m_port = port;
+	m_fallbackAddresses.clear();
 
 	return true;
 }
@@ -1439,28 +1948,46 @@ int LibETPANProvider::authenticate(void)
 	return returnValue;
 }
 
-bool LibETPANProvider::startSession(bool reset)
+void LibETPANProvider::openSession(void)
 {
-	bool isESMTP = false;
+	m_isESMTP = false;
+	m_sessionMsgsCount = 0;
 
-	if (m_session == NULL)
+	// Open the stream
+	if (m_fallbackAddresses.empty() == true)
 	{
-#ifdef DEBUG
-		clog << "LibETPANProvider::startSession: no session" << endl;
-#endif
-		return false;
+		m_error = mailsmtp_socket_connect(m_session, m_hostName.c_str(), m_port);
 	}
-
-	if (m_messages.empty() == true)
+	else
 	{
-#ifdef DEBUG
-		clog << "LibETPANProvider::startSession: no message" << endl;
-#endif
-		return true;
-	}
+		vector<string> addresses(1, m_hostName);
+		string connectedAddress;
 
-	// Open the stream
-	m_error = mailsmtp_socket_connect(m_session, m_hostName.c_str(), m_port);
+		// Don't let a slow or unreachable address hold up the others
+		// Alternate families, IPv6 first, as per RFC 8305
+		addresses.insert(addresses.end(), m_fallbackAddresses.begin(), m_fallbackAddresses.end());
+		Connector::interleaveFamilies(addresses);
+		int connectedFd = Connector::connectFirst(addresses, m_port,
+			(unsigned int)mailstream_network_delay.tv_sec, connectedAddress);
+		if (connectedFd < 0)
+		{
+			m_error = MAILSMTP_ERROR_CONNECTION_REFUSED;
+		}
+		else
+		{
+			mailstream *pStream = mailstream_socket_open(connectedFd);
+
+			if (pStream == NULL)
+			{
+				close(connectedFd);
+				m_error = MAILSMTP_ERROR_MEMORY;
+			}
+			else
+			{
+				m_error = mailsmtp_connect(m_session, pStream);
+			}
+		}
+	}
 	if (m_error == MAILSMTP_NO_ERROR)
 	{
 		int returnValue = mailesmtp_ehlo(m_session);
@@ -1468,22 +1995,22 @@ bool LibETPANProvider::startSession(bool reset)
 		if (returnValue == MAILSMTP_NO_ERROR)
 		{
 			m_error = returnValue;
-			isESMTP = true;
+			m_isESMTP = true;
 		}
 		else if (returnValue == MAILSMTP_ERROR_NOT_IMPLEMENTED)
 		{
 			m_error = mailsmtp_helo(m_session);
 		}
 #ifdef DEBUG
-		clog << "LibETPANProvider::startSession: sent HELO" << endl;
+		clog << "LibETPANProvider::openSession: sent HELO" << endl;
 #endif
 
 		if ((m_error == MAILSMTP_NO_ERROR) &&
-			(isESMTP == true) &&
+			(m_isESMTP == true) &&
 			(m_startTLS == true))
 		{
 #ifdef DEBUG
-			clog << "LibETPANProvider::startSession: trying STARTTLS" << endl;
+			clog << "LibETPANProvider::openSession: trying STARTTLS" << endl;
 #endif
 			returnValue = mailesmtp_starttls(m_session);
 			if (returnValue == MAILSMTP_NO_ERROR)
@@ -1500,7 +2027,7 @@ bool LibETPANProvider::startSession(bool reset)
 		}
 
 		if ((m_error == MAILSMTP_NO_ERROR) &&
-			(isESMTP == true) &&
+			(m_isESMTP == true) &&
 			(m_authenticate == true))
 		{
 			m_error = authenticate();
@@ -1523,22 +2050,377 @@ bool LibETPANProvider::startSession(bool reset)
 
 		if (m_error == MAILSMTP_NO_ERROR)
 		{
+			LibETPANSessionPool::getInstance()->recordOpened();
+		}
+	}
+	else
+	{
+#ifdef DEBUG
+		clog << "LibETPANProvider::openSession: connection failed with error " << m_error << endl;
+#endif
+		m_error = MAILSMTP_ERROR_CONNECTION_REFUSED;
+	}
+}
+
+string LibETPANProvider::getServerKey(void) const
+{
+	string authUserName;
+
+	if (m_authenticate == true)
+	{
+		authUserName = m_authUserName;
+	}
+
+	return LibETPANSessionPool::getServerKey(m_hostName, m_port,
+		authUserName, m_startTLS);
+}
+
+bool LibETPANProvider::reuseSession(void)
+{
+	if ((m_idleTimeout == 0) ||
+		(m_maxMsgsPerConnection == 0))
+	{
+		return false;
+	}
+
+	LibETPANSessionPool *pPool = LibETPANSessionPool::getInstance();
+	string serverKey(getServerKey());
+	unsigned int msgsCount = 0;
+	bool isESMTP = false;
+
+	mailsmtp *pSession = pPool->acquire(serverKey, m_idleTimeout, isESMTP, msgsCount);
+	while (pSession != NULL)
+	{
+		// RSET both checks the server is still there and starts a clean transaction
+		if (mailsmtp_reset(pSession) == MAILSMTP_NO_ERROR)
+		{
+#ifdef DEBUG
+			clog << "LibETPANProvider::reuseSession: reusing session to " << serverKey
+				<< " after " << msgsCount << " messages" << endl;
+#endif
+			pPool->recordReused();
+
+			// Swap the unconnected session for the established one
+			mailsmtp_free(m_session);
+			m_session = pSession;
+			m_isESMTP = isESMTP;
+			m_sessionMsgsCount = msgsCount;
+			m_error = MAILSMTP_NO_ERROR;
+
+			return true;
+		}
+
+		pPool->discard(pSession, true);
+		pSession = pPool->acquire(serverKey, m_idleTimeout, isESMTP, msgsCount);
+	}
+
+	return false;
+}
+
+bool LibETPANProvider::isSessionReusable(void) const
+{
+	if ((m_session == NULL) ||
+		(m_session->stream == NULL) ||
+		(m_idleTimeout == 0) ||
+		(m_maxMsgsPerConnection == 0))
+	{
+		return false;
+	}
+
+	// Only errors that concern the last transaction leave the connection usable
+	switch (m_error)
+	{
+		case MAILSMTP_NO_ERROR:
+		case MAILSMTP_ERROR_ACTION_NOT_TAKEN:
+		case MAILSMTP_ERROR_MAILBOX_UNAVAILABLE:
+		case MAILSMTP_ERROR_IN_PROCESSING:
+		case MAILSMTP_ERROR_INSUFFICIENT_SYSTEM_STORAGE:
+		case MAILSMTP_ERROR_MAILBOX_NAME_NOT_ALLOWED:
+		case MAILSMTP_ERROR_USER_NOT_LOCAL:
+		case MAILSMTP_ERROR_EXCEED_STORAGE_ALLOCATION:
+		case MAILSMTP_ERROR_TRANSACTION_FAILED:
+			return true;
+		default:
+			break;
+	}
+
+	return false;
+}
+
+void LibETPANProvider::closeSession(void)
+{
+	if ((m_session == NULL) ||
+		(m_session->stream == NULL))
+	{
+		return;
+	}
+
+	if (isSessionReusable() == true)
+	{
+		// Keep an unconnected session around so that hasSession() holds
+		mailsmtp *pNewSession = mailsmtp_new(0, NULL);
+
+		if (pNewSession != NULL)
+		{
+			LibETPANSessionPool *pPool = LibETPANSessionPool::getInstance();
+
+			if (m_sessionMsgsCount < m_maxMsgsPerConnection)
+			{
+				pPool->release(getServerKey(), m_session, m_isESMTP,
+					m_sessionMsgsCount, m_idleTimeout);
+			}
+			else
+			{
+				pPool->discard(m_session, false);
+			}
+			m_session = pNewSession;
+			m_sessionMsgsCount = 0;
+
+			return;
+		}
+	}
+
+	mailsmtp_quit(m_session);
+	m_session->stream = NULL;
+}
+
+bool LibETPANProvider::canPipeline(void) const
+{
+#ifdef HAVE_MAILSMTP_ESMTP_PIPELINING
+	if ((m_isESMTP == true) &&
+		(m_session->esmtp & MAILSMTP_ESMTP_PIPELINING))
+	{
+		return true;
+	}
+#endif
+
+	return false;
+}
+
+int LibETPANProvider::readReply(int successCode)
+{
+	int replyCode = 0;
+
+	mmap_string_assign(m_session->response_buffer, "");
+	while (true)
+	{
+		char *pLine = mailstream_read_line_remove_eol(m_session->stream,
+			m_session->line_buffer);
+
+		if ((pLine == NULL) ||
+			(strlen(pLine) < 3))
+		{
+			return MAILSMTP_ERROR_STREAM;
+		}
+
+		replyCode = (int)strtol(string(pLine, 3).c_str(), NULL, 10);
+		if (strlen(pLine) > 4)
+		{
+			mmap_string_append(m_session->response_buffer, pLine + 4);
+			mmap_string_append_c(m_session->response_buffer, '\n');
+		}
+
+		// Multi-line replies have a dash after the code
+		if (pLine[3] != '-')
+		{
+			break;
+		}
+	}
+	m_session->response = m_session->response_buffer->str;
+
+	return replyCodeToError(replyCode, successCode);
+}
+
+bool LibETPANProvider::pipelineCommands(LibETPANMessage *pETPANMsg,
+	unsigned int &successfulRecipients)
+{
+	const char *pEnvId = pETPANMsg->getEnvId();
+	int notify = dsnFlagsToNotify(pETPANMsg->m_dsnFlags);
+	bool sendData = false;
+	stringstream commandsStr;
+
+	// Same commands as mailesmtp_mail() and mailesmtp_rcpt() would send
+	commandsStr << "MAIL FROM:<" << pETPANMsg->m_smtpFrom << ">";
+	if (m_session->esmtp & MAILSMTP_ESMTP_DSN)
+	{
+		commandsStr << " RET=FULL";
+		if (pEnvId != NULL)
+		{
+			commandsStr << " ENVID=" << pEnvId;
+		}
+	}
+	commandsStr << "\r\n";
+	for (map<string, int>::iterator recipIter = pETPANMsg->m_recipients.begin();
+		recipIter != pETPANMsg->m_recipients.end(); ++recipIter)
+	{
+		commandsStr << "RCPT TO:<" << recipIter->first << ">";
+		if (m_session->esmtp & MAILSMTP_ESMTP_DSN)
+		{
+			if (notify == MAILSMTP_DSN_NOTIFY_SUCCESS)
+			{
+				commandsStr << " NOTIFY=SUCCESS";
+			}
+			else if (notify == MAILSMTP_DSN_NOTIFY_FAILURE)
+			{
+				commandsStr << " NOTIFY=FAILURE";
+			}
+			else
+			{
+				commandsStr << " NOTIFY=NEVER";
+			}
+		}
+		commandsStr << "\r\n";
+	}
+	if (pETPANMsg->m_pString != NULL)
+	{
+		commandsStr << "DATA\r\n";
+		sendData = true;
+	}
+
+	string commands(commandsStr.str());
+	if ((mailstream_write(m_session->stream, commands.c_str(), commands.length()) < 0) ||
+		(mailstream_flush(m_session->stream) < 0))
+	{
+		m_error = MAILSMTP_ERROR_STREAM;
+		return false;
+	}
+#ifdef DEBUG
+	clog << "LibETPANProvider::pipelineCommands: sent " << pETPANMsg->m_recipients.size() << " recipients" << endl;
+#endif
+
+	// Replies come back in the order commands were sent
+	m_error = readReply(250);
+	if (m_error == MAILSMTP_ERROR_STREAM)
+	{
+		return false;
+	}
+	int mailError = m_error;
+
+	for (map<string, int>::iterator recipIter = pETPANMsg->m_recipients.begin();
+		recipIter != pETPANMsg->m_recipients.end(); ++recipIter)
+	{
+		int rcptError = readReply(250);
+
+		if (rcptError == MAILSMTP_ERROR_STREAM)
+		{
+			m_error = rcptError;
+			return false;
+		}
+		if (mailError != MAILSMTP_NO_ERROR)
+		{
+			// These were rejected because MAIL was
+			continue;
+		}
+		m_error = rcptError;
+
+		int statusCode = errorToStatusCode(m_error);
+		if (statusCode <= 250)
+		{
+			++successfulRecipients;
+		}
+		else
+		{
+			// Update this failed recipient now
+			recipIter->second = statusCode;
+		}
 #ifdef DEBUG
-			clog << "LibETPANProvider::startSession: " << m_messages.size() << " messages" << endl;
+		clog << "LibETPANProvider::pipelineCommands: recipient " << recipIter->first
+			<< ", status " << statusCode << "/" << m_error << "/" << successfulRecipients << endl;
 #endif
-			for (vector<LibETPANMessage*>::iterator msgIter = m_messages.begin();
-				msgIter != m_messages.end(); ++msgIter)
+	}
+
+	if (sendData == true)
+	{
+		int dataError = readReply(354);
+
+		if (dataError == MAILSMTP_ERROR_STREAM)
+		{
+			m_error = dataError;
+			return false;
+		}
+		if ((dataError == MAILSMTP_NO_ERROR) &&
+			((mailError != MAILSMTP_NO_ERROR) || (successfulRecipients == 0)))
+		{
+			// The server shouldn't have accepted DATA, end it with an empty message
+			if ((mailstream_write(m_session->stream, ".\r\n", 3) < 0) ||
+				(mailstream_flush(m_session->stream) < 0) ||
+				(readReply(250) == MAILSMTP_ERROR_STREAM))
 			{
-				LibETPANMessage *pETPANMsg = (*msgIter);
+				m_error = MAILSMTP_ERROR_STREAM;
+				return false;
+			}
+		}
+		else if (successfulRecipients > 0)
+		{
+			m_error = dataError;
+		}
+	}
+
+	if (mailError != MAILSMTP_NO_ERROR)
+	{
+		m_error = mailError;
+		return false;
+	}
+
+	return true;
+}
+
+bool LibETPANProvider::startSession(bool reset)
+{
+	if (m_session == NULL)
+	{
+#ifdef DEBUG
+		clog << "LibETPANProvider::startSession: no session" << endl;
+#endif
+		return false;
+	}
 
-				if ((pETPANMsg == NULL) ||
-					(pETPANMsg->m_sent == true))
+	if (m_messages.empty() == true)
+	{
+#ifdef DEBUG
+		clog << "LibETPANProvider::startSession: no message" << endl;
+#endif
+		return true;
+	}
+
+	// Reuse an established session to this server if there's one
+	if (reuseSession() == false)
+	{
+		openSession();
+	}
+
+	if (m_error == MAILSMTP_NO_ERROR)
+	{
+#ifdef DEBUG
+		clog << "LibETPANProvider::startSession: " << m_messages.size() << " messages" << endl;
+#endif
+		for (vector<LibETPANMessage*>::iterator msgIter = m_messages.begin();
+			msgIter != m_messages.end(); ++msgIter)
+		{
+			LibETPANMessage *pETPANMsg = (*msgIter);
+
+			if ((pETPANMsg == NULL) ||
+				(pETPANMsg->m_sent == true))
+			{
+				continue;
+			}
+			pETPANMsg->m_sent = true;
+			++m_sessionMsgsCount;
+
+			unsigned int successfulRecipients = 0;
+			bool pipelined = canPipeline();
+
+			if (pipelined == true)
+			{
+				// Send MAIL, RCPT and DATA in one go
+				if (pipelineCommands(pETPANMsg, successfulRecipients) == false)
 				{
-					continue;
+					break;
 				}
-				pETPANMsg->m_sent = true;
-
-				if (isESMTP == true)
+			}
+			else
+			{
+				if (m_isESMTP == true)
 				{
 					m_error = mailesmtp_mail(m_session,
 						pETPANMsg->m_smtpFrom.c_str(), 1,
@@ -1557,26 +2439,14 @@ bool LibETPANProvider::startSession(bool reset)
 				clog << "LibETPANProvider::startSession: " << pETPANMsg->m_recipients.size() << " recipients" << endl;
 #endif
 
-				unsigned int successfulRecipients = 0;
-
 				// Add recipients
 				for (map<string, int>::iterator recipIter = pETPANMsg->m_recipients.begin();
 					recipIter != pETPANMsg->m_recipients.end(); ++recipIter)
 				{
-					if (isESMTP == true)
+					if (m_isESMTP == true)
 					{
-						int notify = MAILSMTP_DSN_NOTIFY_NEVER;
-
-						if (pETPANMsg->m_dsnFlags == SMTPMessage::SUCCESS)
-						{
-							notify = MAILSMTP_DSN_NOTIFY_SUCCESS;
-						}
-						else if (pETPANMsg->m_dsnFlags == SMTPMessage::FAILURE)
-						{
-							notify = MAILSMTP_DSN_NOTIFY_FAILURE;
-						}
-
-						m_error = mailesmtp_rcpt(m_session, const_cast<char*>(recipIter->first.c_str()), notify, NULL);
+						m_error = mailesmtp_rcpt(m_session, const_cast<char*>(recipIter->first.c_str()),
+							dsnFlagsToNotify(pETPANMsg->m_dsnFlags), NULL);
 					}
 					else
 					{
@@ -1598,75 +2468,66 @@ bool LibETPANProvider::startSession(bool reset)
 						<< ", status " << statusCode << "/" << m_error << "/" << successfulRecipients << endl;
 #endif
 				}
+			}
 
-				if (successfulRecipients == 0)
-				{
+			if (successfulRecipients == 0)
+			{
 #ifdef DEBUG
-					clog << "LibETPANProvider::startSession: all recipients failed, skipping message delivery" << endl;
+				clog << "LibETPANProvider::startSession: all recipients failed, skipping message delivery" << endl;
 #endif
-					continue;
-				}
+				continue;
+			}
 
-				// Deliver the message
-				if (pETPANMsg->m_pString != NULL)
+			// Deliver the message
+			if (pETPANMsg->m_pString != NULL)
+			{
+				if (pipelined == false)
 				{
 					m_error = mailsmtp_data(m_session);
-					if (m_error == MAILSMTP_NO_ERROR)
-					{
+				}
+				if (m_error == MAILSMTP_NO_ERROR)
+				{
 #ifdef DEBUG
-						clog << "LibETPANProvider::startSession: data is " << string(pETPANMsg->m_pString->str, pETPANMsg->m_pString->len) << endl;
+					clog << "LibETPANProvider::startSession: data is " << string(pETPANMsg->m_pString->str, pETPANMsg->m_pString->len) << endl;
 #endif
-						m_error = mailsmtp_data_message(m_session,
-							pETPANMsg->m_pString->str, pETPANMsg->m_pString->len);
-					}
+					m_error = mailsmtp_data_message(m_session,
+						pETPANMsg->m_pString->str, pETPANMsg->m_pString->len);
+				}
 #ifdef DEBUG
-					else clog << "LibETPANProvider::startSession: message delivery failed" << endl;
+				else clog << "LibETPANProvider::startSession: message delivery failed" << endl;
 #endif
-				}
+			}
 #ifdef DEBUG
-				else clog << "LibETPANProvider::startSession: no message to deliver" << endl;
+			else clog << "LibETPANProvider::startSession: no message to deliver" << endl;
 #endif
 
-				successfulRecipients = 0;
+			successfulRecipients = 0;
 
-				int statusCode = errorToStatusCode(m_error);
-				for (map<string, int>::iterator recipIter = pETPANMsg->m_recipients.begin();
-					recipIter != pETPANMsg->m_recipients.end(); ++recipIter)
-				{
-					// Update those recipients that didn't fail earlier
-					if (recipIter->second == -1)
-					{
-						recipIter->second = statusCode;
-						++successfulRecipients;
-					}
-				}
-				if (m_session->response != NULL)
+			int statusCode = errorToStatusCode(m_error);
+			for (map<string, int>::iterator recipIter = pETPANMsg->m_recipients.begin();
+				recipIter != pETPANMsg->m_recipients.end(); ++recipIter)
+			{
+				// Update those recipients that didn't fail earlier
+				if (recipIter->second == -1)
 				{
-					pETPANMsg->m_response = m_session->response;
+					recipIter->second = statusCode;
+					++successfulRecipients;
 				}
-#ifdef DEBUG
-				clog << "LibETPANProvider::startSession: message status "
-					<< " " << statusCode << "/" << m_error << "/" << successfulRecipients
-					<< ", response " << pETPANMsg->m_response << endl;
-#endif
 			}
-		}
-	}
-	else
-	{
+			if (m_session->response != NULL)
+			{
+				pETPANMsg->m_response = m_session->response;
+			}
 #ifdef DEBUG
-		clog << "LibETPANProvider::startSession: connection failed with error " << m_error << endl;
+			clog << "LibETPANProvider::startSession: message status "
+				<< " " << statusCode << "/" << m_error << "/" << successfulRecipients
+				<< ", response " << pETPANMsg->m_response << endl;
 #endif
-		m_error = MAILSMTP_ERROR_CONNECTION_REFUSED;
+		}
 	}
 
 	// We are done
-	if ((m_session != NULL) &&
-		(m_session->stream != NULL))
-	{
-		mailsmtp_quit(m_session);
-		m_session->stream = NULL;
-	}
+	closeSession();
 
 	return true;
 }
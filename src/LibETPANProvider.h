@@ -28,6 +28,14 @@
 
 #include "SMTPProvider.h"
 
+/// Converts a libetpan error to a SMTP status code.
+int errorToStatusCode(int errNum);
+
+/// Converts a SMTP reply code to a libetpan error.
+int replyCodeToError(int replyCode, int successCode);
+
+class LibETPANSkeleton;
+
 /// Wraps a libetpan message.
 class LibETPANMessage : public SMTPMessage
 {
@@ -63,6 +71,9 @@ class LibETPANMessage : public SMTPMessage
 		/// Adds a recipient.
 		virtual void addRecipient(const std::string &emailAddress);
 
+		/// Forgets recipients, before the message is queued again.
+		virtual void clearRecipients(void);
+
 		/// Builds the message string.
 		bool buildMessage(void);
 
@@ -71,11 +82,31 @@ class LibETPANMessage : public SMTPMessage
 
 	protected:
 		bool m_relatedFirst;
+		const LibETPANSkeleton *m_pEncodedSkeleton;
+
+		/**
+		  * Substitutes fields in content quoted-printable encoded, if the
+		  * campaign's skeleton has room for it. Returns false otherwise.
+		  */
+		bool substituteEncodedContent(const std::map<std::string, std::string> &fieldValues);
 
 		struct mailimf_fields *headersToFields(void);
 
 		bool serialize(size_t messageSizeEstimate,
-			struct mailmime *pMessage);
+			struct mailmime *pMessage,
+			struct mailmime *pPlainPart = NULL,
+			struct mailmime *pHtmlPart = NULL);
+
+		unsigned int getSkeletonKey(void) const;
+
+		void buildSkeleton(struct mailmime *pMessage,
+			struct mailmime *pPlainPart,
+			struct mailmime *pHtmlPart);
+
+		bool appendSkeleton(const LibETPANSkeleton *pSkeleton,
+			MMAPString *pString);
+
+		bool buildFromSkeleton(const LibETPANSkeleton *pSkeleton);
 
 	private:
 		LibETPANMessage(const LibETPANMessage &other);
@@ -135,9 +166,28 @@ class LibETPANProvider : public SMTPProvider
 		bool m_startTLS;
 		std::vector<LibETPANMessage*> m_messages;
 		int m_error;
+		bool m_isESMTP;
+		unsigned int m_sessionMsgsCount;
 
 		int authenticate(void);
 
+		std::string getServerKey(void) const;
+
+		bool reuseSession(void);
+
+		void openSession(void);
+
+		bool isSessionReusable(void) const;
+
+		void closeSession(void);
+
+		bool canPipeline(void) const;
+
+		int readReply(int successCode);
+
+		bool pipelineCommands(LibETPANMessage *pETPANMsg,
+			unsigned int &successfulRecipients);
+
 	private:
 		LibETPANProvider(const LibETPANProvider &other);
 		LibETPANProvider &operator=(const LibETPANProvider &other);
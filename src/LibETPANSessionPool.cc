@@ -0,0 +1,274 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include "LibETPANSessionPool.h"
+
+// Maximum number of idle sessions kept for any one server
+#define MAX_IDLE_SESSIONS_PER_SERVER 10
+
+using std::clog;
+using std::endl;
+using std::string;
+using std::stringstream;
+using std::multimap;
+using std::pair;
+using std::vector;
+using std::for_each;
+
+PooledSession::PooledSession(mailsmtp *pSession, bool isESMTP,
+	unsigned int msgsCount) :
+	m_pSession(pSession),
+	m_isESMTP(isESMTP),
+	m_msgsCount(msgsCount),
+	m_lastUsed(time(NULL))
+{
+}
+
+PooledSession::PooledSession(const PooledSession &other) :
+	m_pSession(other.m_pSession),
+	m_isESMTP(other.m_isESMTP),
+	m_msgsCount(other.m_msgsCount),
+	m_lastUsed(other.m_lastUsed)
+{
+}
+
+PooledSession::~PooledSession()
+{
+}
+
+PooledSession &PooledSession::operator=(const PooledSession &other)
+{
+	if (this != &other)
+	{
+		m_pSession = other.m_pSession;
+		m_isESMTP = other.m_isESMTP;
+		m_msgsCount = other.m_msgsCount;
+		m_lastUsed = other.m_lastUsed;
+	}
+
+	return *this;
+}
+
+LibETPANSessionPool *LibETPANSessionPool::m_pInstance = NULL;
+pthread_mutex_t LibETPANSessionPool::m_instanceMutex = PTHREAD_MUTEX_INITIALIZER;
+
+LibETPANSessionPool::LibETPANSessionPool() :
+	m_openedCount(0),
+	m_reusedCount(0),
+	m_expiredCount(0),
+	m_failedChecksCount(0),
+	m_retiredCount(0)
+{
+	pthread_mutex_init(&m_mutex, 0);
+}
+
+LibETPANSessionPool::~LibETPANSessionPool()
+{
+	closeIdle(0);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+LibETPANSessionPool *LibETPANSessionPool::getInstance(void)
+{
+	// Worker threads may race to create the pool
+	pthread_mutex_lock(&m_instanceMutex);
+	if (m_pInstance == NULL)
+	{
+		m_pInstance = new LibETPANSessionPool();
+	}
+	pthread_mutex_unlock(&m_instanceMutex);
+
+	return m_pInstance;
+}
+
+string LibETPANSessionPool::getServerKey(const string &hostName,
+	unsigned int port, const string &authUserName,
+	bool startTLS)
+{
+	stringstream keyStr;
+
+	// Sessions authenticated as someone else or without TLS don't qualify
+	keyStr << hostName << ":" << port << "/" << authUserName;
+	if (startTLS == true)
+	{
+		keyStr << "/tls";
+	}
+
+	return keyStr.str();
+}
+
+void LibETPANSessionPool::closeSession(mailsmtp *pSession)
+{
+	if (pSession == NULL)
+	{
+		return;
+	}
+
+	if (pSession->stream != NULL)
+	{
+		mailsmtp_quit(pSession);
+		pSession->stream = NULL;
+	}
+	mailsmtp_free(pSession);
+}
+
+mailsmtp *LibETPANSessionPool::acquire(const string &serverKey,
+	unsigned int idleTimeout, bool &isESMTP,
+	unsigned int &msgsCount)
+{
+	vector<mailsmtp *> expiredSessions;
+	mailsmtp *pSession = NULL;
+	time_t timeNow = time(NULL);
+
+	pthread_mutex_lock(&m_mutex);
+	multimap<string, PooledSession>::iterator sessionIter = m_sessions.find(serverKey);
+	while ((sessionIter != m_sessions.end()) &&
+		(sessionIter->first == serverKey))
+	{
+		PooledSession pooledSession(sessionIter->second);
+
+		m_sessions.erase(sessionIter++);
+
+		if (pooledSession.m_lastUsed + (time_t)idleTimeout <= timeNow)
+		{
+			// The server has probably hung up on this one already
+#ifdef DEBUG
+			clog << "LibETPANSessionPool::acquire: session to " << serverKey << " expired" << endl;
+#endif
+			expiredSessions.push_back(pooledSession.m_pSession);
+			++m_expiredCount;
+			continue;
+		}
+
+		pSession = pooledSession.m_pSession;
+		isESMTP = pooledSession.m_isESMTP;
+		msgsCount = pooledSession.m_msgsCount;
+		break;
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	// Say goodbye without holding the lock
+	for_each(expiredSessions.begin(), expiredSessions.end(), closeSession);
+
+	return pSession;
+}
+
+void LibETPANSessionPool::release(const string &serverKey, mailsmtp *pSession,
+	bool isESMTP, unsigned int msgsCount,
+	unsigned int idleTimeout)
+{
+	if (pSession == NULL)
+	{
+		return;
+	}
+
+	vector<mailsmtp *> expiredSessions;
+
+	pthread_mutex_lock(&m_mutex);
+	// Don't let sessions to servers that are no longer used linger
+	unlockedCloseIdle(time(NULL), idleTimeout, expiredSessions);
+	if (m_sessions.count(serverKey) < MAX_IDLE_SESSIONS_PER_SERVER)
+	{
+		m_sessions.insert(pair<string, PooledSession>(serverKey,
+			PooledSession(pSession, isESMTP, msgsCount)));
+		pSession = NULL;
+	}
+	else
+	{
+		++m_retiredCount;
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	for_each(expiredSessions.begin(), expiredSessions.end(), closeSession);
+	closeSession(pSession);
+}
+
+void LibETPANSessionPool::discard(mailsmtp *pSession, bool failedCheck)
+{
+	closeSession(pSession);
+
+	pthread_mutex_lock(&m_mutex);
+	if (failedCheck == true)
+	{
+		++m_failedChecksCount;
+	}
+	else
+	{
+		++m_retiredCount;
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void LibETPANSessionPool::recordOpened(void)
+{
+	pthread_mutex_lock(&m_mutex);
+	++m_openedCount;
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void LibETPANSessionPool::recordReused(void)
+{
+	pthread_mutex_lock(&m_mutex);
+	++m_reusedCount;
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void LibETPANSessionPool::unlockedCloseIdle(time_t timeNow, unsigned int idleTimeout,
+	vector<mailsmtp *> &expiredSessions)
+{
+	multimap<string, PooledSession>::iterator sessionIter = m_sessions.begin();
+	while (sessionIter != m_sessions.end())
+	{
+		if ((idleTimeout == 0) ||
+			(sessionIter->second.m_lastUsed + (time_t)idleTimeout <= timeNow))
+		{
+			expiredSessions.push_back(sessionIter->second.m_pSession);
+			m_sessions.erase(sessionIter++);
+			++m_expiredCount;
+			continue;
+		}
+
+		++sessionIter;
+	}
+}
+
+void LibETPANSessionPool::closeIdle(unsigned int idleTimeout)
+{
+	vector<mailsmtp *> expiredSessions;
+
+	pthread_mutex_lock(&m_mutex);
+	unlockedCloseIdle(time(NULL), idleTimeout, expiredSessions);
+	pthread_mutex_unlock(&m_mutex);
+
+	for_each(expiredSessions.begin(), expiredSessions.end(), closeSession);
+}
+
+void LibETPANSessionPool::logStatistics(void)
+{
+	pthread_mutex_lock(&m_mutex);
+	clog << "SMTP sessions: " << m_openedCount << " opened, "
+		<< m_reusedCount << " reused, " << m_expiredCount << " expired, "
+		<< m_failedChecksCount << " failed RSET, " << m_retiredCount << " retired, "
+		<< m_sessions.size() << " idle" << endl;
+	pthread_mutex_unlock(&m_mutex);
+}
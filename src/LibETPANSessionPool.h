@@ -0,0 +1,117 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _LIBETPANSESSIONPOOL_H_
+#define _LIBETPANSESSIONPOOL_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <libetpan/libetpan.h>
+#include <string>
+#include <map>
+#include <vector>
+
+/// An established SMTP session waiting to be reused.
+class PooledSession
+{
+	public:
+		PooledSession(mailsmtp *pSession, bool isESMTP,
+			unsigned int msgsCount);
+		PooledSession(const PooledSession &other);
+		~PooledSession();
+
+		PooledSession &operator=(const PooledSession &other);
+
+		mailsmtp *m_pSession;
+		bool m_isESMTP;
+		unsigned int m_msgsCount;
+		time_t m_lastUsed;
+
+};
+
+/**
+  * A pool of established libetpan SMTP sessions, keyed by server.
+  * Sessions are connected, past EHLO and possibly STARTTLS and AUTH.
+  */
+class LibETPANSessionPool
+{
+	public:
+		virtual ~LibETPANSessionPool();
+
+		static LibETPANSessionPool *getInstance(void);
+
+		/// Builds the key sessions to the given server are pooled under.
+		static std::string getServerKey(const std::string &hostName,
+			unsigned int port, const std::string &authUserName,
+			bool startTLS);
+
+		/**
+		  * Takes an idle session to the given server, if any.
+		  * Sessions idle for more than idleTimeout seconds are closed.
+		  */
+		mailsmtp *acquire(const std::string &serverKey,
+			unsigned int idleTimeout, bool &isESMTP,
+			unsigned int &msgsCount);
+
+		/// Returns a session to the pool.
+		void release(const std::string &serverKey, mailsmtp *pSession,
+			bool isESMTP, unsigned int msgsCount,
+			unsigned int idleTimeout);
+
+		/// Closes a session that can't be reused.
+		void discard(mailsmtp *pSession, bool failedCheck);
+
+		/// Records that a new connection was opened.
+		void recordOpened(void);
+
+		/// Records that an acquired session passed its check and was reused.
+		void recordReused(void);
+
+		/// Closes sessions idle for more than idleTimeout seconds, all of them if 0.
+		void closeIdle(unsigned int idleTimeout);
+
+		/// Logs pool counters.
+		void logStatistics(void);
+
+	protected:
+		static LibETPANSessionPool *m_pInstance;
+		static pthread_mutex_t m_instanceMutex;
+		pthread_mutex_t m_mutex;
+		std::multimap<std::string, PooledSession> m_sessions;
+		unsigned int m_openedCount;
+		unsigned int m_reusedCount;
+		unsigned int m_expiredCount;
+		unsigned int m_failedChecksCount;
+		unsigned int m_retiredCount;
+
+		LibETPANSessionPool();
+
+		static void closeSession(mailsmtp *pSession);
+
+		void unlockedCloseIdle(time_t timeNow, unsigned int idleTimeout,
+			std::vector<mailsmtp *> &expiredSessions);
+
+	private:
+		// LibETPANSessionPool objects cannot be copied
+		LibETPANSessionPool(const LibETPANSessionPool &other);
+		LibETPANSessionPool &operator=(const LibETPANSessionPool &other);
+
+};
+
+#endif // _LIBETPANSESSIONPOOL_H_
@@ -18,8 +18,15 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
 #include <sstream>
 #include <iostream>
 #include <fstream>
@@ -40,6 +47,13 @@ using std::stringstream;
 using std::for_each;
 using std::ios;
 
+// Where each user gets a private directory, for instance for encoded attachments
+#define PRIVATE_DIRECTORY_PREFIX "/var/tmp/givemail-"
+
+// Set once the first ctemplate fallback has been logged
+static bool g_loggedFallback = false;
+// Set once an unsafe private directory has been logged
+static bool g_loggedPrivateDirectory = false;
 struct DeleteContentPieceFunc
 {
 	public:
@@ -60,6 +74,28 @@ struct DeleteAttachmentFunc
 
 };
 
+RawContent::RawContent(char *pData, off_t dataLen, bool isMapped) :
+	m_pData(pData),
+	m_dataLen(dataLen),
+	m_isMapped(isMapped)
+{
+}
+
+RawContent::~RawContent()
+{
+	if (m_pData != NULL)
+	{
+		if (m_isMapped == true)
+		{
+			munmap(m_pData, (size_t)m_dataLen);
+		}
+		else
+		{
+			delete[] m_pData;
+		}
+	}
+}
+
 Attachment::Attachment(const string &filePath,
 	const string &contentType,
 	const string &contentId,
@@ -71,7 +107,9 @@ Attachment::Attachment(const string &filePath,
 	m_contentLength(0),
 	m_pContent(NULL),
 	m_encodedLength(0),
-	m_pEncodedContent(NULL)
+	m_pEncodedContent(NULL),
+	m_pRawContent(NULL),
+	m_pEncodedRawContent(NULL)
 {
 	resolveContentType();
 }
@@ -146,16 +184,28 @@ void Attachment::resolveContentType(void)
 
 Attachment::~Attachment()
 {
-	if (m_pContent != NULL)
+	if (m_pRawContent != NULL)
+	{
+		// m_pContent points into this
+		delete m_pRawContent;
+		m_pRawContent = NULL;
+	}
+	else if (m_pContent != NULL)
 	{
 		delete[] m_pContent;
-		m_pContent = NULL;
 	}
-	if (m_pEncodedContent != NULL)
+	m_pContent = NULL;
+	if (m_pEncodedRawContent != NULL)
+	{
+		// m_pEncodedContent points into this
+		delete m_pEncodedRawContent;
+		m_pEncodedRawContent = NULL;
+	}
+	else if (m_pEncodedContent != NULL)
 	{
 		delete[] m_pEncodedContent;
-		m_pEncodedContent = NULL;
 	}
+	m_pEncodedContent = NULL;
 }
 
 string Attachment::getFileName(void) const
@@ -186,6 +236,165 @@ bool Attachment::isInline(void) const
 	return false;
 }
 
+bool Attachment::loadContent(void)
+{
+	if ((m_pContent != NULL) ||
+		(m_filePath.empty() == true))
+	{
+		return true;
+	}
+
+	// Read rather than map, a file that shrinks under a mapping would crash readers
+	off_t fileSize = 0;
+	char *pBuffer = MessageDetails::loadRaw(m_filePath, fileSize);
+
+	if (pBuffer != NULL)
+	{
+		m_pRawContent = new RawContent(pBuffer, fileSize, false);
+	}
+	if (m_pRawContent == NULL)
+	{
+		clog << "Couldn't load contents of " << m_filePath << endl;
+
+		return false;
+	}
+	m_pContent = m_pRawContent->m_pData;
+	m_contentLength = m_pRawContent->m_dataLen;
+
+	return true;
+}
+
+bool Attachment::encodeContent(void)
+{
+	struct stat fileStat;
+	string cacheDirectory, cacheFileName;
+
+	if (m_pEncodedContent != NULL)
+	{
+		return true;
+	}
+
+	// Any version of the file is encoded once, whichever slave gets there first
+	if (m_filePath.empty() == false)
+	{
+		cacheDirectory = MessageDetails::getPrivateDirectory();
+	}
+	if ((cacheDirectory.empty() == false) &&
+		(stat(m_filePath.c_str(), &fileStat) == 0))
+	{
+		stringstream nameStr;
+
+		nameStr << cacheDirectory << "/"
+			<< fileStat.st_dev << "-" << fileStat.st_ino << "-"
+			<< fileStat.st_size << "-" << fileStat.st_mtime << ".b64";
+		cacheFileName = nameStr.str();
+
+		if (mapEncodedContent(cacheFileName) == true)
+		{
+			return true;
+		}
+	}
+
+	if ((m_pContent == NULL) ||
+		(m_contentLength == 0))
+	{
+		return false;
+	}
+
+	unsigned long encodedLen = (unsigned long)m_contentLength;
+
+	m_pEncodedContent = Base64::encodeLines(m_pContent, encodedLen);
+	if (m_pEncodedContent == NULL)
+	{
+		clog << "Couldn't encode contents of " << m_filePath << endl;
+		m_encodedLength = 0;
+
+		return false;
+	}
+	m_encodedLength = (off_t)encodedLen;
+
+	// Share it with other processes, and let go of this copy
+	if ((cacheFileName.empty() == false) &&
+		(saveEncodedContent(cacheFileName) == true))
+	{
+		char *pEncodedContent = m_pEncodedContent;
+
+		m_pEncodedContent = NULL;
+		if (mapEncodedContent(cacheFileName) == true)
+		{
+			delete[] pEncodedContent;
+		}
+		else
+		{
+			m_pEncodedContent = pEncodedContent;
+		}
+	}
+
+	return true;
+}
+
+bool Attachment::mapEncodedContent(const string &cacheFileName)
+{
+	// Cache files are replaced, never truncated, so the mapping stays whole
+	RawContent *pEncodedRawContent = MessageDetails::mapRaw(cacheFileName, true);
+	if (pEncodedRawContent == NULL)
+	{
+		return false;
+	}
+
+	m_pEncodedRawContent = pEncodedRawContent;
+	m_pEncodedContent = m_pEncodedRawContent->m_pData;
+	m_encodedLength = m_pEncodedRawContent->m_dataLen;
+#ifdef DEBUG
+	clog << "Attachment::mapEncodedContent: mapped " << cacheFileName << endl;
+#endif
+
+	if ((m_pRawContent != NULL) &&
+		(m_encoding == "base64"))
+	{
+		// The file itself isn't needed any more
+		delete m_pRawContent;
+		m_pRawContent = NULL;
+		m_pContent = NULL;
+	}
+
+	return true;
+}
+
+bool Attachment::saveEncodedContent(const string &cacheFileName)
+{
+	stringstream tempNameStr;
+
+	// Other slaves may be saving too, replace the file in one go
+	tempNameStr << cacheFileName << "." << getpid();
+	string tempFileName(tempNameStr.str());
+
+	// Left over from a process that had the same PID ?
+	unlink(tempFileName.c_str());
+
+	int fileFd = open(tempFileName.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, S_IRUSR|S_IWUSR);
+	if (fileFd < 0)
+	{
+		clog << "Couldn't save encoded contents of " << m_filePath << endl;
+		return false;
+	}
+
+	bool isSaved = (write(fileFd, m_pEncodedContent, (size_t)m_encodedLength) == (ssize_t)m_encodedLength);
+	if (close(fileFd) != 0)
+	{
+		isSaved = false;
+	}
+	if ((isSaved == false) ||
+		(rename(tempFileName.c_str(), cacheFileName.c_str()) != 0))
+	{
+		clog << "Couldn't save encoded contents of " << m_filePath << endl;
+		unlink(tempFileName.c_str());
+		return false;
+	}
+
+	return true;
+}
+
 ContentPiece::ContentPiece(const string &contentType,
 	const string &encoding, bool personalize) :
 	Attachment("", contentType, "", encoding),
@@ -197,6 +406,14 @@ ContentPiece::~ContentPiece()
 {
 }
 
+MessageSkeleton::MessageSkeleton()
+{
+}
+
+MessageSkeleton::~MessageSkeleton()
+{
+}
+
 MessageDetails::MessageDetails() :
 	m_charset("UTF-8"),
 	m_useXMailer(false),
@@ -205,8 +422,14 @@ MessageDetails::MessageDetails() :
 	m_pPlainSub(NULL),
 	m_pHtmlSub(NULL),
 	m_attachmentsCount(0),
-	m_inlinePartsCount(0)
+	m_inlinePartsCount(0),
+	m_attachmentsEncoded(false)
 {
+	for (unsigned int headerNum = 0; headerNum < HEADER_FIELDS_COUNT; ++headerNum)
+	{
+		m_pHeaderSubs[headerNum] = NULL;
+	}
+	pthread_mutex_init(&m_subMutex, NULL);
 }
 
 MessageDetails::~MessageDetails()
@@ -219,11 +442,27 @@ MessageDetails::~MessageDetails()
 	{
 		delete m_pHtmlSub;
 	}
+	for (unsigned int headerNum = 0; headerNum < HEADER_FIELDS_COUNT; ++headerNum)
+	{
+		if (m_pHeaderSubs[headerNum] != NULL)
+		{
+			delete m_pHeaderSubs[headerNum];
+		}
+	}
+
+	// Worker threads are done with skeletons by now
+	clearSkeletons();
+	for (vector<MessageSkeleton *>::iterator retiredIter = m_retiredSkeletons.begin();
+		retiredIter != m_retiredSkeletons.end(); ++retiredIter)
+	{
+		delete *retiredIter;
+	}
 
 	for_each(m_contentPieces.begin(), m_contentPieces.end(),
 		DeleteContentPieceFunc());
 	for_each(m_attachments.begin(), m_attachments.end(),
 		DeleteAttachmentFunc());
+	pthread_mutex_destroy(&m_subMutex);
 }
 
 char *MessageDetails::loadRaw(const string &filePath, off_t &fileSize)
@@ -254,6 +493,102 @@ char *MessageDetails::loadRaw(const string &filePath, off_t &fileSize)
 	return NULL;
 }
 
+RawContent *MessageDetails::mapRaw(const string &filePath, bool ownFileOnly)
+{
+	struct stat fileStat;
+	int fd = -1;
+
+	if (ownFileOnly == true)
+	{
+		fd = open(filePath.c_str(), O_RDONLY|O_NOFOLLOW);
+	}
+	else
+	{
+		fd = open(filePath.c_str(), O_RDONLY);
+	}
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	if (fstat(fd, &fileStat) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	if ((ownFileOnly == true) &&
+		((S_ISREG(fileStat.st_mode) == 0) ||
+		(fileStat.st_uid != getuid()) ||
+		((fileStat.st_mode & 0777) != (S_IRUSR|S_IWUSR)) ||
+		(fileStat.st_size == 0)))
+	{
+		// Someone else may be able to change this file
+		close(fd);
+		return NULL;
+	}
+
+	if (fileStat.st_size > 0)
+	{
+		void *pMapping = mmap(NULL, (size_t)fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (pMapping != MAP_FAILED)
+		{
+			// The mapping stays valid once the file is closed
+			close(fd);
+			madvise(pMapping, (size_t)fileStat.st_size, MADV_SEQUENTIAL);
+
+			return new RawContent((char*)pMapping, (off_t)fileStat.st_size, true);
+		}
+	}
+	close(fd);
+
+	if (ownFileOnly == true)
+	{
+		return NULL;
+	}
+
+	// Empty files and files that can't be mapped are read instead
+	off_t fileSize = 0;
+	char *pBuffer = loadRaw(filePath, fileSize);
+	if (pBuffer == NULL)
+	{
+		return NULL;
+	}
+
+	return new RawContent(pBuffer, fileSize, false);
+}
+
+string MessageDetails::getPrivateDirectory(void)
+{
+	struct stat dirStat;
+	stringstream dirStr;
+
+	dirStr << PRIVATE_DIRECTORY_PREFIX << getuid();
+	string dirName(dirStr.str());
+
+	if ((mkdir(dirName.c_str(), S_IRWXU) != 0) &&
+		(errno != EEXIST))
+	{
+		return "";
+	}
+
+	// It may have been created by someone else
+	if ((lstat(dirName.c_str(), &dirStat) != 0) ||
+		(S_ISDIR(dirStat.st_mode) == 0) ||
+		(dirStat.st_uid != getuid()) ||
+		((dirStat.st_mode & (S_IRWXG|S_IRWXO)) != 0))
+	{
+		if (__sync_bool_compare_and_swap(&g_loggedPrivateDirectory, false, true) == true)
+		{
+			clog << "Not using " << dirName << ", it is not private" << endl;
+		}
+
+		return "";
+	}
+
+	return dirName;
+}
+
 string MessageDetails::encodeRecipientId(const string &recipientId)
 {
 	string idStr("&recipientId=");
@@ -332,22 +667,27 @@ string MessageDetails::createMessageId(const string &suffix, bool isReplyId)
 
 Substituter *MessageDetails::getPlainSubstituter(const string &dictionaryId)
 {
+	// Worker threads share these
+	pthread_mutex_lock(&m_subMutex);
 	if (m_pPlainSub == NULL)
 	{
 		m_pPlainSub = newSubstituter(dictionaryId,
 			getContent("text/plain"), false);
 	}
+	pthread_mutex_unlock(&m_subMutex);
 
 	return m_pPlainSub;
 }
 
 Substituter *MessageDetails::getHtmlSubstituter(const string &dictionaryId)
 {
+	pthread_mutex_lock(&m_subMutex);
 	if (m_pHtmlSub == NULL)
 	{
 		m_pHtmlSub = newSubstituter(dictionaryId,
 			getContent("/html"), true);
 	}
+	pthread_mutex_unlock(&m_subMutex);
 
 	return m_pHtmlSub;
 }
@@ -355,8 +695,13 @@ Substituter *MessageDetails::getHtmlSubstituter(const string &dictionaryId)
 string MessageDetails::substitute(const string &dictionaryId,
 	const string &content, const map<string, string> &fieldValues)
 {
-	// m_version 1 is obsolete
-	Substituter *pSub = new CTemplateSubstituter(dictionaryId,
+	// Constant strings need no substitution
+	if (content.find("{{") == string::npos)
+	{
+		return content;
+	}
+
+	Substituter *pSub = newSubstituter(dictionaryId,
 		content, false);
 	string subContent;
 
@@ -367,6 +712,36 @@ string MessageDetails::substitute(const string &dictionaryId,
 	return subContent;
 }
 
+string MessageDetails::substituteHeader(HeaderField headerField,
+	const map<string, string> &fieldValues)
+{
+	const string &content = getHeaderTemplate(headerField);
+
+	if (content.find("{{") == string::npos)
+	{
+		return content;
+	}
+
+	pthread_mutex_lock(&m_subMutex);
+	if (m_pHeaderSubs[headerField] == NULL)
+	{
+		stringstream idStr;
+
+		// Names must be unique within the ctemplate cache
+		idStr << "header" << headerField << "-" << this;
+		m_pHeaderSubs[headerField] = newSubstituter(idStr.str(),
+			content, false);
+	}
+	Substituter *pSub = m_pHeaderSubs[headerField];
+	pthread_mutex_unlock(&m_subMutex);
+
+	string subContent;
+
+	pSub->substitute(fieldValues, subContent);
+
+	return subContent;
+}
+
 bool MessageDetails::isRecipientPersonalized(void)
 {
 	if ((checkFields("text/plain") == true) ||
@@ -378,6 +753,46 @@ bool MessageDetails::isRecipientPersonalized(void)
 	return false;
 }
 
+MessageSkeleton *MessageDetails::getSkeleton(unsigned int skeletonKey)
+{
+	MessageSkeleton *pSkeleton = NULL;
+
+	pthread_mutex_lock(&m_subMutex);
+	map<unsigned int, MessageSkeleton *>::const_iterator skeletonIter = m_skeletons.find(skeletonKey);
+	if (skeletonIter != m_skeletons.end())
+	{
+		pSkeleton = skeletonIter->second;
+	}
+	pthread_mutex_unlock(&m_subMutex);
+
+	return pSkeleton;
+}
+
+MessageSkeleton *MessageDetails::setSkeleton(unsigned int skeletonKey,
+	MessageSkeleton *pSkeleton)
+{
+	if (pSkeleton == NULL)
+	{
+		return NULL;
+	}
+
+	pthread_mutex_lock(&m_subMutex);
+	map<unsigned int, MessageSkeleton *>::const_iterator skeletonIter = m_skeletons.find(skeletonKey);
+	if (skeletonIter != m_skeletons.end())
+	{
+		// Another thread got there first
+		delete pSkeleton;
+		pSkeleton = skeletonIter->second;
+	}
+	else
+	{
+		m_skeletons[skeletonKey] = pSkeleton;
+	}
+	pthread_mutex_unlock(&m_subMutex);
+
+	return pSkeleton;
+}
+
 bool MessageDetails::addAttachment(Attachment *pAttachment)
 {
 	if (pAttachment == NULL)
@@ -385,6 +800,10 @@ bool MessageDetails::addAttachment(Attachment *pAttachment)
 		return false;
 	}
 
+	// Skeletons don't have this attachment
+	clearSkeletons();
+	m_attachmentsEncoded = false;
+
 	// What kind of attachment is it ?
 	if (pAttachment->isInline() == true)
 	{
@@ -403,6 +822,8 @@ bool MessageDetails::addAttachment(Attachment *pAttachment)
 void MessageDetails::setAttachments(const vector<string> &filePaths,
 	bool append)
 {
+	clearSkeletons();
+	m_attachmentsEncoded = false;
 	if (append == false)
 	{
 		// Delete and clear all attachments, if any
@@ -431,15 +852,30 @@ void MessageDetails::loadAttachments(void)
 		}
 
 		// Load the file
-		if (pAttachment->m_contentLength == 0)
+		pAttachment->loadContent();
+	}
+}
+
+void MessageDetails::encodeAttachments(void)
+{
+	pthread_mutex_lock(&m_subMutex);
+	if (m_attachmentsEncoded == false)
+	{
+		loadAttachments();
+
+		for (vector<Attachment *>::iterator attachmentIter = m_attachments.begin();
+			attachmentIter != m_attachments.end(); ++attachmentIter)
 		{
-			pAttachment->m_pContent = loadRaw(pAttachment->m_filePath, pAttachment->m_contentLength);
-			if (pAttachment->m_pContent == NULL)
+			Attachment *pAttachment = (*attachmentIter);
+
+			if (pAttachment != NULL)
 			{
-				clog << "Couldn't load contents of " << pAttachment->m_filePath << endl;
+				pAttachment->encodeContent();
 			}
 		}
+		m_attachmentsEncoded = true;
 	}
+	pthread_mutex_unlock(&m_subMutex);
 }
 
 unsigned int MessageDetails::getAttachmentCount(bool inlineParts) const
@@ -490,6 +926,9 @@ bool MessageDetails::setContentPiece(const string &contentType,
 	off_t contentLength = (off_t)strlen(pContent);
 	bool pushObject = false;
 
+	// Skeletons may not have the right parts any more
+	clearSkeletons();
+
 	for (vector<ContentPiece *>::iterator contentIter = m_contentPieces.begin();
 		contentIter != m_contentPieces.end(); ++contentIter)
 	{
@@ -642,10 +1081,62 @@ bool MessageDetails::checkFields(const string &contentType)
 	return false;
 }
 
+void MessageDetails::clearSkeletons(void)
+{
+	pthread_mutex_lock(&m_subMutex);
+	// Threads may still be rendering from these, they are deleted along with this object
+	for (map<unsigned int, MessageSkeleton *>::iterator skeletonIter = m_skeletons.begin();
+		skeletonIter != m_skeletons.end(); ++skeletonIter)
+	{
+		m_retiredSkeletons.push_back(skeletonIter->second);
+	}
+	m_skeletons.clear();
+	pthread_mutex_unlock(&m_subMutex);
+}
+
+const string &MessageDetails::getHeaderTemplate(HeaderField headerField) const
+{
+	switch (headerField)
+	{
+		case SENDER_HEADER:
+			return m_senderEmailAddress;
+		case FROM_NAME_HEADER:
+			return m_fromName;
+		case FROM_ADDRESS_HEADER:
+			return m_fromEmailAddress;
+		case REPLY_TO_NAME_HEADER:
+			return m_replyToName;
+		case REPLY_TO_ADDRESS_HEADER:
+			return m_replyToEmailAddress;
+		case SUBJECT_HEADER:
+		default:
+			break;
+	}
+
+	return m_subject;
+}
+
 Substituter *MessageDetails::newSubstituter(const string &dictionaryId,
 	const string &contentTemplate, bool escapeEntities)
 {
 	// m_version 1 is obsolete
+	CompiledSubstituter *pCompiledSub = new CompiledSubstituter(dictionaryId,
+		contentTemplate, escapeEntities);
+
+	if (pCompiledSub->isValid() == true)
+	{
+		return pCompiledSub;
+	}
+	delete pCompiledSub;
+
+	// Let ctemplate deal with whatever the compiler doesn't support
+	// substitute() gets here for every recipient, only say it the first time
+	if (__sync_bool_compare_and_swap(&g_loggedFallback, false, true) == true)
+	{
+		clog << "Falling back to ctemplate for " << dictionaryId
+			<< " and any other template the compiler doesn't support" << endl;
+	}
+
 	Substituter *pSub = new CTemplateSubstituter(dictionaryId,
 		contentTemplate, escapeEntities);
 
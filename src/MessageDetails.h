@@ -21,6 +21,7 @@
 #ifndef _MESSAGEDETAILS_H_
 #define _MESSAGEDETAILS_H_
 
+#include <pthread.h>
 #include <string>
 #include <vector>
 #include <set>
@@ -28,6 +29,24 @@
 
 #include "Substituter.h"
 
+/// An owning handle on a file's content, memory-mapped if possible.
+class RawContent
+{
+	public:
+		RawContent(char *pData, off_t dataLen, bool isMapped);
+		virtual ~RawContent();
+
+		char *m_pData;
+		off_t m_dataLen;
+		bool m_isMapped;
+
+	private:
+		// RawContent objects cannot be copied
+		RawContent(const RawContent &other);
+		RawContent &operator=(const RawContent &other);
+
+};
+
 /// An attachment.
 class Attachment
 {
@@ -44,6 +63,16 @@ class Attachment
 		/// Indicates whether this is an inline attachment.
 		bool isInline(void) const;
 
+		/// Loads the file's content, unless it's already loaded.
+		bool loadContent(void);
+
+		/**
+		  * Base64-encodes loaded content into CRLF terminated lines.
+		  * Files are encoded once into a cache file, in this user's private
+		  * directory, that all processes map.
+		  */
+		bool encodeContent(void);
+
 		std::string m_filePath;
 		std::string m_contentType;
 		std::string m_contentId;
@@ -54,8 +83,15 @@ class Attachment
 		char *m_pEncodedContent;
 
 	protected:
+		RawContent *m_pRawContent;
+		RawContent *m_pEncodedRawContent;
+
 		void resolveContentType(void);
 
+		bool mapEncodedContent(const std::string &cacheFileName);
+
+		bool saveEncodedContent(const std::string &cacheFileName);
+
 	private:
 		Attachment(const Attachment &other);
 		Attachment &operator=(const Attachment &other);
@@ -79,10 +115,27 @@ class ContentPiece: public Attachment
 
 };
 
+/// Something a provider derives from a message's details and caches with them.
+class MessageSkeleton
+{
+	public:
+		MessageSkeleton();
+		virtual ~MessageSkeleton();
+
+	private:
+		// MessageSkeleton objects cannot be copied
+		MessageSkeleton(const MessageSkeleton &other);
+		MessageSkeleton &operator=(const MessageSkeleton &other);
+
+};
+
 /// A message's details.
 class MessageDetails
 {
 	public:
+		typedef enum { SUBJECT_HEADER = 0, SENDER_HEADER, FROM_NAME_HEADER, FROM_ADDRESS_HEADER,
+			REPLY_TO_NAME_HEADER, REPLY_TO_ADDRESS_HEADER, HEADER_FIELDS_COUNT } HeaderField;
+
 		MessageDetails();
 		virtual ~MessageDetails();
 
@@ -92,6 +145,22 @@ class MessageDetails
 		  */
 		static char *loadRaw(const std::string &filePath, off_t &fileSize);
 
+		/**
+		  * Maps the contents of the file read-only, so that processes
+		  * share the same pages. Falls back to loadRaw(), unless ownFileOnly
+		  * is true; files that aren't regular, owned by this user and 0600
+		  * are then refused.
+		  * Caller frees with delete.
+		  */
+		static RawContent *mapRaw(const std::string &filePath,
+			bool ownFileOnly = false);
+
+		/**
+		  * Returns a directory that only this user can access, creating it if necessary.
+		  * The string is empty if no such directory is available.
+		  */
+		static std::string getPrivateDirectory(void);
+
 		/// Generates the string to substitute {Recipient ID} with.
 		static std::string encodeRecipientId(const std::string &recipientId);
 
@@ -127,8 +196,23 @@ class MessageDetails
 			const std::string &content,
 			const std::map<std::string, std::string> &fieldValues);
 
+		/// Substitutes a header field, compiling it the first time around.
+		std::string substituteHeader(HeaderField headerField,
+			const std::map<std::string, std::string> &fieldValues);
+
 		/// Returns whether the message has to be personalized for each recipient.
 		bool isRecipientPersonalized(void);
+
+		/// Gets the skeleton cached under the given key, if any.
+		MessageSkeleton *getSkeleton(unsigned int skeletonKey);
+
+		/**
+		  * Caches a skeleton under the given key and takes ownership of it.
+		  * Returns the skeleton that ends up cached, which may be another
+		  * thread's if it got there first.
+		  */
+		MessageSkeleton *setSkeleton(unsigned int skeletonKey,
+			MessageSkeleton *pSkeleton);
  
 		/// Adds an attachment.
 		bool addAttachment(Attachment *pAttachment);
@@ -140,6 +224,12 @@ class MessageDetails
 		/// Loads all attached files' content.
 		void loadAttachments(void);
 
+		/**
+		  * Loads and encodes all attached files' content, once.
+		  * Encoded content may then be shared by all threads.
+		  */
+		void encodeAttachments(void);
+
 		/// Returns the number of attachments.
 		unsigned int getAttachmentCount(bool inlineParts = false) const;
 
@@ -166,14 +256,23 @@ class MessageDetails
 
 	protected:
 		unsigned int m_version;
+		pthread_mutex_t m_subMutex;
 		Substituter *m_pPlainSub;
 		Substituter *m_pHtmlSub;
+		Substituter *m_pHeaderSubs[HEADER_FIELDS_COUNT];
+		std::map<unsigned int, MessageSkeleton *> m_skeletons;
+		std::vector<MessageSkeleton *> m_retiredSkeletons;
 		std::vector<Attachment *> m_attachments;
 		unsigned int m_attachmentsCount;
 		unsigned int m_inlinePartsCount;
+		bool m_attachmentsEncoded;
 
 		bool checkFields(const std::string &contentType);
 
+		void clearSkeletons(void);
+
+		const std::string &getHeaderTemplate(HeaderField headerField) const;
+
 		Substituter *newSubstituter(const std::string &dictionaryId,
 			const std::string &contentTemplate,
 			bool escapeEntities);
@@ -45,6 +45,9 @@ using std::vector;
 using std::pair;
 using std::for_each;
 
+// Idle connections are checked before they are used again
+#define MYSQL_CONNECTION_CHECK_INTERVAL 60
+
 // A function object to close statements with for_each()
 struct CloseStatementsFunc
 {
@@ -592,7 +595,20 @@ bool MySQLResults::rewind(void)
 	return true;
 }
 
+MySQLConnection::MySQLConnection(MySQLBase *pOwner) :
+	m_pOwner(pOwner),
+	m_isOpen(false),
+	m_inTransaction(false),
+	m_lastUsed(0)
+{
+}
+
+MySQLConnection::~MySQLConnection()
+{
+}
+
 pthread_mutex_t MySQLBase::m_initMutex = PTHREAD_MUTEX_INITIALIZER;
+bool MySQLBase::m_isInitialized = false;
 
 MySQLBase::MySQLBase(const string &hostName, const string &databaseName,
 	const string &userName, const string &password, bool readOnly) :
@@ -600,67 +616,260 @@ MySQLBase::MySQLBase(const string &hostName, const string &databaseName,
 	m_hostName(hostName),
 	m_userName(userName),
 	m_password(password),
-	m_isOpen(false)
+	m_isOpen(false),
+	m_threadsCount(0)
 {
+	// The library must be initialized before threads use it
+	initialize();
+
 	pthread_mutex_init(&m_mutex, 0);
-	open();
+	pthread_cond_init(&m_threadsCond, 0);
+	pthread_key_create(&m_connectionKey, releaseConnection);
+
+	// Make sure the database can be reached
+	if (getConnection() != NULL)
+	{
+		m_isOpen = true;
+	}
 }
 
 MySQLBase::~MySQLBase()
 {
-	close();
+	MySQLConnection *pConnection = static_cast<MySQLConnection*>(pthread_getspecific(m_connectionKey));
+
+	pthread_mutex_lock(&m_mutex);
+	if (pConnection != NULL)
+	{
+		// This thread is done with its connection
+		pthread_setspecific(m_connectionKey, NULL);
+		--m_threadsCount;
+	}
+	// Connections are freed below, and releaseConnection() refers to this object
+	while (m_threadsCount > 0)
+	{
+		clog << "Waiting for " << m_threadsCount << " thread(s) to release their connection" << endl;
+		pthread_cond_wait(&m_threadsCond, &m_mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	pthread_key_delete(m_connectionKey);
+	for (set<MySQLConnection*>::iterator connIter = m_connections.begin();
+		connIter != m_connections.end(); ++connIter)
+	{
+		closeConnection(*connIter);
+		delete *connIter;
+	}
+	pthread_cond_destroy(&m_threadsCond);
 	pthread_mutex_destroy(&m_mutex);
 }
 
-void MySQLBase::open(void)
+MySQLConnection *MySQLBase::getConnection(void)
+{
+	MySQLConnection *pConnection = static_cast<MySQLConnection*>(pthread_getspecific(m_connectionKey));
+
+	if (pConnection == NULL)
+	{
+		// Whether the connection is new or not, the library needs this thread's state
+		// releaseConnection() ends it
+		mysql_thread_init();
+
+		// Reuse the connection of a thread that exited, if any
+		pthread_mutex_lock(&m_mutex);
+		if (m_idleConnections.empty() == false)
+		{
+			pConnection = m_idleConnections.back();
+			m_idleConnections.pop_back();
+		}
+		else
+		{
+			pConnection = new MySQLConnection(this);
+			m_connections.insert(pConnection);
+		}
+		++m_threadsCount;
+		pthread_mutex_unlock(&m_mutex);
+
+		pthread_setspecific(m_connectionKey, pConnection);
+	}
+
+	time_t timeNow = time(NULL);
+
+	if (pConnection->m_isOpen == false)
+	{
+		openConnection(pConnection);
+	}
+	else if ((pConnection->m_inTransaction == false) &&
+		(pConnection->m_lastUsed + MYSQL_CONNECTION_CHECK_INTERVAL < timeNow) &&
+		(mysql_ping(&pConnection->m_database) != 0))
+	{
+		clog << "Reconnecting to " << m_databaseName << " after error "
+			<< mysql_errno(&pConnection->m_database) << ": "
+			<< mysql_error(&pConnection->m_database) << endl;
+
+		closeConnection(pConnection);
+		openConnection(pConnection);
+	}
+	pConnection->m_lastUsed = timeNow;
+
+	if (pConnection->m_isOpen == false)
+	{
+		return NULL;
+	}
+
+	return pConnection;
+}
+
+void MySQLBase::releaseConnection(void *pArg)
+{
+	MySQLConnection *pConnection = static_cast<MySQLConnection*>(pArg);
+
+	if (pConnection == NULL)
+	{
+		return;
+	}
+
+	MySQLBase *pOwner = pConnection->m_pOwner;
+
+	if (pConnection->m_inTransaction == true)
+	{
+		// Don't hand over a transaction that was left open
+		pOwner->closeConnection(pConnection);
+	}
+
+	pthread_mutex_lock(&pOwner->m_mutex);
+	pOwner->m_idleConnections.push_back(pConnection);
+	--pOwner->m_threadsCount;
+	// The owner may be waiting to be deleted, don't touch it after this
+	pthread_cond_broadcast(&pOwner->m_threadsCond);
+	pthread_mutex_unlock(&pOwner->m_mutex);
+
+	mysql_thread_end();
+}
+
+bool MySQLBase::openConnection(MySQLConnection *pConnection)
 {
 	if ((m_hostName.empty() == true) ||
 		(m_userName.empty() == true) ||
 		(m_databaseName.empty() == true))
 	{
-		return;
+		return false;
 	}
 
 	// Initialize
-	if (mysql_init(&m_database) == NULL)
+	if (mysql_init(&pConnection->m_database) == NULL)
 	{
 		clog << "Couldn't initialize MySQL API" << endl;
-		return;
-	}
-
-	// Enable automatic reconnections
-	bool reconnect = true;
-	if (mysql_options(&m_database, MYSQL_OPT_RECONNECT, (const char*)&reconnect) != 0)
-	{
-		clog << "Couldn't enable reconnections" << endl;
+		return false;
 	}
 
 	// Connect to the database
-	if (mysql_real_connect(&m_database, m_hostName.c_str(),
+	// Reconnections are handled here, so that prepared statements are known to be gone
+	if (mysql_real_connect(&pConnection->m_database, m_hostName.c_str(),
 		m_userName.c_str(), m_password.c_str(), m_databaseName.c_str(),
 		0, "/var/lib/mysql/mysql.sock", 0) == NULL)
 	{
-		clog << "MySQL error " << mysql_errno(&m_database)
-			<< ": " << mysql_error(&m_database) << endl;
-		return;
+		clog << "MySQL error " << mysql_errno(&pConnection->m_database)
+			<< ": " << mysql_error(&pConnection->m_database) << endl;
+		mysql_close(&pConnection->m_database);
+		return false;
 	}
 
-	m_isOpen = true;
+	pConnection->m_isOpen = true;
+	pConnection->m_inTransaction = false;
+	pConnection->m_lastUsed = time(NULL);
+
+	return true;
 }
 
-void MySQLBase::close(void)
+void MySQLBase::closeConnection(MySQLConnection *pConnection)
 {
-	if (m_isOpen == true)
+	if (pConnection->m_isOpen == true)
 	{
-		m_isOpen = false;
-		for_each(m_statements.begin(), m_statements.end(),
+		pConnection->m_isOpen = false;
+		pConnection->m_inTransaction = false;
+		for_each(pConnection->m_statements.begin(), pConnection->m_statements.end(),
 			CloseStatementsFunc());
-		m_statements.clear();
+		pConnection->m_statements.clear();
 
-		mysql_close(&m_database);
+		mysql_close(&pConnection->m_database);
 	}
 }
 
+bool MySQLBase::query(MySQLConnection *pConnection, const char *pSql)
+{
+	if (mysql_query(&pConnection->m_database, pSql) == 0)
+	{
+		return true;
+	}
+
+	unsigned int errorCode = mysql_errno(&pConnection->m_database);
+
+	// Did the server go away, or was the connection lost ?
+	if (((errorCode == 2006) || (errorCode == 2013)) &&
+		(pConnection->m_inTransaction == false))
+	{
+		clog << "Reconnecting to " << m_databaseName << " after error "
+			<< errorCode << ": " << mysql_error(&pConnection->m_database) << endl;
+
+		closeConnection(pConnection);
+		if ((openConnection(pConnection) == true) &&
+			(mysql_query(&pConnection->m_database, pSql) == 0))
+		{
+			return true;
+		}
+		if (pConnection->m_isOpen == false)
+		{
+			return false;
+		}
+		errorCode = mysql_errno(&pConnection->m_database);
+	}
+
+	clog << "SQL statement <" << pSql << "> failed with error "
+		<< errorCode << ": " << mysql_error(&pConnection->m_database) << endl;
+
+	return false;
+}
+
+MYSQL_STMT *MySQLBase::getStatement(MySQLConnection *pConnection,
+	const string &statementId)
+{
+	map<string, MYSQL_STMT*>::iterator statIter = pConnection->m_statements.find(statementId);
+	if (statIter != pConnection->m_statements.end())
+	{
+		return statIter->second;
+	}
+
+	// The statement may have been prepared by another thread, or before reconnecting
+	pthread_mutex_lock(&m_mutex);
+	map<string, string>::const_iterator sqlIter = m_statementsSql.find(statementId);
+	if (sqlIter == m_statementsSql.end())
+	{
+		pthread_mutex_unlock(&m_mutex);
+		return NULL;
+	}
+	string sqlFormat(sqlIter->second);
+	pthread_mutex_unlock(&m_mutex);
+
+	MYSQL_STMT *pStatement = mysql_stmt_init(&pConnection->m_database);
+
+	if (pStatement == NULL)
+	{
+		return NULL;
+	}
+
+	if (mysql_stmt_prepare(pStatement,
+		sqlFormat.c_str(),
+		(unsigned long)sqlFormat.length()) != 0)
+	{
+		clog << m_databaseName << ": failed to compile SQL statement " << statementId
+			<< " with error " << mysql_stmt_error(pStatement) << endl;
+		mysql_stmt_close(pStatement);
+		return NULL;
+	}
+	pConnection->m_statements.insert(pair<string, MYSQL_STMT*>(statementId, pStatement));
+
+	return pStatement;
+}
+
 string MySQLBase::getUniversalUniqueId(void)
 {
 	SQLResults *pResults = executeStatement("SELECT UUID();");
@@ -687,8 +896,10 @@ string MySQLBase::getUniversalUniqueId(void)
 
 string MySQLBase::escapeString(const string &text)
 {
+	MySQLConnection *pConnection = NULL;
+
 	if ((text.empty() == true) ||
-		(m_isOpen == false))
+		((pConnection = getConnection()) == NULL))
 	{
 		return "";
 	}
@@ -714,7 +925,7 @@ string MySQLBase::escapeString(const string &text)
 
 	char *pEscapedText = new char[(modText.length() * 2) + 1];
 
-	off_t escapedLen = mysql_real_escape_string(&m_database,
+	off_t escapedLen = mysql_real_escape_string(&pConnection->m_database,
 		pEscapedText, modText.c_str(), modText.length());
 
 	string escapedText(pEscapedText, escapedLen);
@@ -773,13 +984,17 @@ bool MySQLBase::alterTable(const string &tableName,
 
 bool MySQLBase::beginTransaction(void)
 {
-	if (m_isOpen == false)
+	MySQLConnection *pConnection = getConnection();
+
+	if (pConnection == NULL)
 	{
 		return false;
 	}
 
-	if (mysql_autocommit(&m_database, 0) == 0)
+	if (mysql_autocommit(&pConnection->m_database, 0) == 0)
 	{
+		pConnection->m_inTransaction = true;
+
 		return true;
 	}
 
@@ -790,42 +1005,48 @@ bool MySQLBase::beginTransaction(void)
 
 bool MySQLBase::rollbackTransaction(void)
 {
-	if (m_isOpen == false)
+	MySQLConnection *pConnection = getConnection();
+
+	if (pConnection == NULL)
 	{
 		return false;
 	}
 
-	if (mysql_rollback(&m_database) == 0)
+	pConnection->m_inTransaction = false;
+	if (mysql_rollback(&pConnection->m_database) == 0)
 	{
-		mysql_autocommit(&m_database, 1);
+		mysql_autocommit(&pConnection->m_database, 1);
 
 		return true;
 	}
 
 	clog << m_databaseName << ": failed to rollback transaction" << endl;
 
-	mysql_autocommit(&m_database, 1);
+	mysql_autocommit(&pConnection->m_database, 1);
 
 	return false;
 }
 
 bool MySQLBase::endTransaction(void)
 {
-	if (m_isOpen == false)
+	MySQLConnection *pConnection = getConnection();
+
+	if (pConnection == NULL)
 	{
 		return false;
 	}
 
-	if (mysql_commit(&m_database) == 0)
+	pConnection->m_inTransaction = false;
+	if (mysql_commit(&pConnection->m_database) == 0)
 	{
-		mysql_autocommit(&m_database, 1);
+		mysql_autocommit(&pConnection->m_database, 1);
 
 		return true;
 	}
 
 	clog << m_databaseName << ": failed to end transaction" << endl;
 
-	mysql_autocommit(&m_database, 1);
+	mysql_autocommit(&pConnection->m_database, 1);
 
 	return false;
 }
@@ -834,9 +1055,16 @@ void MySQLBase::initialize(void)
 {
 	pthread_mutex_lock(&m_initMutex);
 
-	if (mysql_library_init(0, NULL, NULL) != 0)
+	if (m_isInitialized == false)
 	{
-		clog << "Failed to initialize MySQL" << endl;
+		if (mysql_library_init(0, NULL, NULL) != 0)
+		{
+			clog << "Failed to initialize MySQL" << endl;
+		}
+		else
+		{
+			m_isInitialized = true;
+		}
 	}
 
 	pthread_mutex_unlock(&m_initMutex);
@@ -922,8 +1150,10 @@ time_t MySQLBase::fromMySQLTime(MYSQL_TIME time, bool inGMTime)
 
 bool MySQLBase::executeSimpleStatement(const string &sql)
 {
+	MySQLConnection *pConnection = NULL;
+
 	if ((sql.empty() == true) ||
-		(m_isOpen == false))
+		((pConnection = getConnection()) == NULL))
 	{
 		return false;
 	}
@@ -939,24 +1169,16 @@ bool MySQLBase::executeSimpleStatement(const string &sql)
 
 		clog << "Simple SQL statement <" << statement << ">" << endl;
 
-		pthread_mutex_lock(&m_mutex);
-		if (mysql_query(&m_database, statement.c_str()))
+		if (query(pConnection, statement.c_str()) == false)
 		{
-			unsigned int errorCode = mysql_errno(&m_database);
-
-			clog << "SQL statement <" << statement << "> failed with error "
-				<< errorCode << ": " << mysql_error(&m_database) << endl;
-			pthread_mutex_unlock(&m_mutex);
-
 			return false;
 		}
 
-		MYSQL_RES *pResult = mysql_store_result(&m_database);
+		MYSQL_RES *pResult = mysql_store_result(&pConnection->m_database);
 		if (pResult != NULL)
 		{
 			mysql_free_result(pResult);
 		}
-		pthread_mutex_unlock(&m_mutex);
 	}
 
 	return true;
@@ -964,12 +1186,13 @@ bool MySQLBase::executeSimpleStatement(const string &sql)
 
 SQLResults *MySQLBase::executeStatement(const char *sqlFormat, ...)
 {
+	MySQLConnection *pConnection = NULL;
 	MySQLResults *pResults = NULL;
 	char stringBuff[2048];
 	va_list ap;
 
 	if ((sqlFormat == NULL) ||
-		(m_isOpen == false))
+		((pConnection = getConnection()) == NULL))
 	{
 		return NULL;
 	}
@@ -994,24 +1217,16 @@ SQLResults *MySQLBase::executeStatement(const char *sqlFormat, ...)
 	stringBuff[numChars] = '\0';
 	va_end(ap);
 
-	pthread_mutex_lock(&m_mutex);
-	if (mysql_query(&m_database, stringBuff))
+	if (query(pConnection, stringBuff) == false)
 	{
-		unsigned int errorCode = mysql_errno(&m_database);
-
-		clog << "SQL statement <" << stringBuff << "> failed with error "
-			<< errorCode << ": " << mysql_error(&m_database) << endl;
-		pthread_mutex_unlock(&m_mutex);
-
 		return NULL;
 	}
 
-	MYSQL_RES *pResult = mysql_store_result(&m_database);
+	MYSQL_RES *pResult = mysql_store_result(&pConnection->m_database);
 	if (pResult != NULL)
 	{
 		pResults = new MySQLResults(pResult);
 	}
-	pthread_mutex_unlock(&m_mutex);
 
 	return pResults;
 }
@@ -1039,36 +1254,27 @@ SQLResults *MySQLBase::executeStatement(const string &sqlFormat,
 bool MySQLBase::prepareStatement(const string &statementId,
 	const string &sqlFormat)
 {
+	MySQLConnection *pConnection = NULL;
+
 	if ((sqlFormat.empty() == true) ||
-		(m_isOpen == false))
+		((pConnection = getConnection()) == NULL))
 	{
 		return false;
 	}
 
-	map<string, MYSQL_STMT*>::iterator statIter = m_statements.find(statementId);
-	if (statIter != m_statements.end())
-	{
-		return true;
-	}
-
-	MYSQL_STMT *pStatement = mysql_stmt_init(&m_database);
-
-	if (pStatement == NULL)
+	// Other threads prepare it on their own connection when they first need it
+	pthread_mutex_lock(&m_mutex);
+	if (m_statementsSql.find(statementId) == m_statementsSql.end())
 	{
-		return false;
+		m_statementsSql.insert(pair<string, string>(statementId, sqlFormat));
 	}
+	pthread_mutex_unlock(&m_mutex);
 
-	if (mysql_stmt_prepare(pStatement,
-		sqlFormat.c_str(),
-		(unsigned long)sqlFormat.length()) == 0)
+	if (getStatement(pConnection, statementId) != NULL)
 	{
-		m_statements.insert(pair<string, MYSQL_STMT*>(statementId, pStatement));
-
 		return true;
 	}
 
-	clog << m_databaseName << ": failed to compile SQL statement " << statementId << endl;
-
 	return false;
 }
 
@@ -1090,9 +1296,11 @@ SQLResults *MySQLBase::executePreparedStatement(const string &statementId,
 SQLResults *MySQLBase::executePreparedStatement(const string &statementId,
 	const vector<pair<string, SQLRow::SQLType> > &values)
 {
-	map<string, MYSQL_STMT*>::iterator statIter = m_statements.find(statementId);
-	if ((statIter == m_statements.end()) ||
-		(statIter->second == NULL))
+	MySQLConnection *pConnection = getConnection();
+	MYSQL_STMT *pStatement = NULL;
+
+	if ((pConnection == NULL) ||
+		((pStatement = getStatement(pConnection, statementId)) == NULL))
 	{
 #ifdef DEBUG
 		clog << "MySQLBase::executePreparedStatement: invalid SQL statement ID " << statementId << endl;
@@ -1100,7 +1308,7 @@ SQLResults *MySQLBase::executePreparedStatement(const string &statementId,
 		return NULL;
 	}
 
-	unsigned long paramCount = mysql_stmt_param_count(statIter->second);
+	unsigned long paramCount = mysql_stmt_param_count(pStatement);
 	if (paramCount != (unsigned long)values.size())
 	{
 		clog << "Statement " << statementId << " expected " << paramCount
@@ -1179,16 +1387,16 @@ SQLResults *MySQLBase::executePreparedStatement(const string &statementId,
 
 	MySQLResults *pResults = NULL;
 
-	if (mysql_stmt_bind_param(statIter->second, bindValues) != 0)
+	if (mysql_stmt_bind_param(pStatement, bindValues) != 0)
 	{
 		clog << m_databaseName << ": failed to bind parameter to statement "
 			<< statementId << " with error "
-			<< mysql_stmt_error(statIter->second) << endl;
+			<< mysql_stmt_error(pStatement) << endl;
 	}
 	else
 	{
-		pResults = new MySQLResults(statIter->first,
-			statIter->second);
+		pResults = new MySQLResults(statementId,
+			pStatement);
 	}
 
 	paramIndex = 0;
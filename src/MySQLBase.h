@@ -24,8 +24,10 @@
 
 #include <mysql/mysql.h>
 #include <pthread.h>
+#include <time.h>
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
 #include <utility>
 
@@ -86,7 +88,35 @@ class MySQLResults : public SQLResults
 
 };
 
-/// Simple C++ wrapper around the MySQL API.
+class MySQLBase;
+
+/// A connection to the database, used by one thread at a time.
+class MySQLConnection
+{
+	public:
+		MySQLConnection(MySQLBase *pOwner);
+		~MySQLConnection();
+
+		MySQLBase *m_pOwner;
+		MYSQL m_database;
+		bool m_isOpen;
+		bool m_inTransaction;
+		time_t m_lastUsed;
+		std::map<std::string, MYSQL_STMT*> m_statements;
+
+	private:
+		// MySQLConnection objects cannot be copied
+		MySQLConnection(const MySQLConnection &other);
+		MySQLConnection &operator=(const MySQLConnection &other);
+
+};
+
+/**
+  * Simple C++ wrapper around the MySQL API.
+  * Each thread gets its own connection from a pool, so that queries
+  * made by different threads run in parallel.
+  * Deleting it waits for other threads that hold a connection to exit.
+  */
 class MySQLBase : public SQLDB
 {
 	public:
@@ -144,17 +174,34 @@ class MySQLBase : public SQLDB
 
 	protected:
 		static pthread_mutex_t m_initMutex;
+		static bool m_isInitialized;
 		pthread_mutex_t m_mutex;
+		pthread_cond_t m_threadsCond;
+		pthread_key_t m_connectionKey;
 		std::string m_hostName;
 		std::string m_userName;
 		std::string m_password;
-		MYSQL m_database;
 		bool m_isOpen;
-		std::map<std::string, MYSQL_STMT*> m_statements;
+		std::set<MySQLConnection*> m_connections;
+		std::vector<MySQLConnection*> m_idleConnections;
+		unsigned int m_threadsCount;
+		std::map<std::string, std::string> m_statementsSql;
+
+		/// Returns the calling thread's connection, checking it's still alive.
+		MySQLConnection *getConnection(void);
+
+		/// Gives a connection back to the pool when its thread exits.
+		static void releaseConnection(void *pArg);
+
+		bool openConnection(MySQLConnection *pConnection);
+
+		void closeConnection(MySQLConnection *pConnection);
 
-		void open(void);
+		/// Runs a query, reconnecting and trying again once if the server went away.
+		bool query(MySQLConnection *pConnection, const char *pSql);
 
-		void close(void);
+		MYSQL_STMT *getStatement(MySQLConnection *pConnection,
+			const std::string &statementId);
 
 	private:
 		MySQLBase(const MySQLBase &other);
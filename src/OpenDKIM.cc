@@ -17,33 +17,313 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 
 #include "OpenDKIM.h"
+#include "Base64.h"
 #include "MessageDetails.h"
 
 //#define _DEBUG_FEEDING
 #define DK_HEADER_NAME "DKIM-Signature"
 #define JOBID "givemail-OpenDKIM"
+// Number of body hashes kept around
+#define MAX_CACHED_BODY_HASHES 256
+// Signature header lines are folded past this length
+#define SIGNATURE_MARGIN 75
 
 using std::clog;
 using std::endl;
 using std::string;
 using std::vector;
+using std::map;
+using std::deque;
 using std::stringstream;
 using std::ofstream;
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_reset EVP_MD_CTX_cleanup
+#define EVP_PKEY_up_ref(pKey) CRYPTO_add(&(pKey)->references, 1, CRYPTO_LOCK_EVP_PKEY)
+#endif
+
+/// What each thread needs to sign messages.
+class DKIMThreadState
+{
+	public:
+		DKIMThreadState() :
+			m_pHashCtx(EVP_MD_CTX_create()),
+			m_pSignCtx(EVP_MD_CTX_create())
+		{
+			m_canonBuffer.reserve(65536);
+		}
+		virtual ~DKIMThreadState()
+		{
+			if (m_pHashCtx != NULL)
+			{
+				EVP_MD_CTX_destroy(m_pHashCtx);
+			}
+			if (m_pSignCtx != NULL)
+			{
+				EVP_MD_CTX_destroy(m_pSignCtx);
+			}
+		}
+
+		EVP_MD_CTX *m_pHashCtx;
+		EVP_MD_CTX *m_pSignCtx;
+		string m_canonBuffer;
+		map<string, string> m_bodyHashes;
+		deque<string> m_bodyHashKeys;
+
+	private:
+		// DKIMThreadState objects cannot be copied
+		DKIMThreadState(const DKIMThreadState &other);
+		DKIMThreadState &operator=(const DKIMThreadState &other);
+
+};
+
+static void deleteThreadState(void *pData)
+{
+	if (pData != NULL)
+	{
+		delete static_cast<DKIMThreadState*>(pData);
+	}
+}
+
+static string formatHeader(const SMTPHeader &header)
+{
+	string headerStr(header.m_name);
+
+	headerStr += ":";
+	if (header.m_value.empty() == false)
+	{
+		headerStr += " ";
+		headerStr += header.m_value;
+	}
+	if (header.m_path.empty() == false)
+	{
+		headerStr += " <";
+		headerStr += header.m_path;
+		headerStr += ">";
+	}
+	headerStr += "\r\n";
+
+	return headerStr;
+}
+
+static bool digestBody(EVP_MD_CTX *pHashCtx, const char *pBody, size_t bodyLen,
+	string &digest)
+{
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int hashLen = 0;
+
+	// Bodies are only taken to be the same if their SHA-256 is
+	if ((EVP_DigestInit_ex(pHashCtx, EVP_sha256(), NULL) != 1) ||
+		(EVP_DigestUpdate(pHashCtx, pBody, bodyLen) != 1) ||
+		(EVP_DigestFinal_ex(pHashCtx, hash, &hashLen) != 1))
+	{
+		return false;
+	}
+	digest.append((const char *)hash, hashLen);
+
+	return true;
+}
+
+static void hashBody(const char *pBody, size_t bodyLen, bool simpleCanon,
+	EVP_MD_CTX *pCtx, string &canonBuffer)
+{
+	size_t emptyLines = 0, lineStart = 0;
+	bool hasLines = false;
+
+	canonBuffer.clear();
+	while (lineStart < bodyLen)
+	{
+		const char *pNL = (const char *)memchr(pBody + lineStart, '\n', bodyLen - lineStart);
+		size_t lineEnd = (pNL == NULL ? bodyLen : pNL - pBody);
+		size_t nextStart = (pNL == NULL ? bodyLen : lineEnd + 1);
+
+		if ((lineEnd > lineStart) &&
+			(pBody[lineEnd - 1] == '\r'))
+		{
+			--lineEnd;
+		}
+
+		string::size_type canonStart = canonBuffer.length();
+		if (simpleCanon == true)
+		{
+			canonBuffer.append(pBody + lineStart, lineEnd - lineStart);
+		}
+		else
+		{
+			bool inWhiteSpace = false;
+
+			// Reduce whitespace sequences to a single space, drop trailing ones
+			for (size_t pos = lineStart; pos < lineEnd; ++pos)
+			{
+				if ((pBody[pos] == ' ') ||
+					(pBody[pos] == '\t'))
+				{
+					inWhiteSpace = true;
+					continue;
+				}
+				if (inWhiteSpace == true)
+				{
+					canonBuffer += ' ';
+					inWhiteSpace = false;
+				}
+				canonBuffer += pBody[pos];
+			}
+		}
+
+		if (canonBuffer.length() == canonStart)
+		{
+			// Empty lines only count if something follows
+			++emptyLines;
+		}
+		else
+		{
+			if (emptyLines > 0)
+			{
+				string emptyLinesStr;
+
+				for (; emptyLines > 0; --emptyLines)
+				{
+					emptyLinesStr += "\r\n";
+				}
+				canonBuffer.insert(canonStart, emptyLinesStr);
+			}
+			canonBuffer += "\r\n";
+			hasLines = true;
+		}
+
+		if (canonBuffer.length() >= 65536 - 1024)
+		{
+			EVP_DigestUpdate(pCtx, canonBuffer.c_str(), canonBuffer.length());
+			canonBuffer.clear();
+		}
+		lineStart = nextStart;
+	}
+
+	if ((simpleCanon == true) &&
+		(hasLines == false))
+	{
+		// An empty body is a single line break
+		canonBuffer = "\r\n";
+	}
+	if (canonBuffer.empty() == false)
+	{
+		EVP_DigestUpdate(pCtx, canonBuffer.c_str(), canonBuffer.length());
+	}
+}
+
+static string relaxHeader(const string &header)
+{
+	string::size_type colonPos = header.find(':');
+	string relaxedHeader;
+
+	if (colonPos == string::npos)
+	{
+		return header;
+	}
+
+	string::size_type nameEnd = colonPos;
+	while ((nameEnd > 0) &&
+		((header[nameEnd - 1] == ' ') || (header[nameEnd - 1] == '\t')))
+	{
+		--nameEnd;
+	}
+	for (string::size_type pos = 0; pos < nameEnd; ++pos)
+	{
+		relaxedHeader += (char)tolower((unsigned char)header[pos]);
+	}
+	relaxedHeader += ':';
+
+	bool inWhiteSpace = false;
+	for (string::size_type pos = colonPos + 1; pos < header.length(); ++pos)
+	{
+		char headerChar = header[pos];
+
+		// Unfold, then reduce whitespace sequences to a single space
+		if ((headerChar == '\r') ||
+			(headerChar == '\n'))
+		{
+			continue;
+		}
+		if ((headerChar == ' ') ||
+			(headerChar == '\t'))
+		{
+			inWhiteSpace = true;
+			continue;
+		}
+		if ((inWhiteSpace == true) &&
+			(relaxedHeader.length() > nameEnd + 1))
+		{
+			relaxedHeader += ' ';
+		}
+		inWhiteSpace = false;
+		relaxedHeader += headerChar;
+	}
+
+	return relaxedHeader;
+}
+
+static bool shouldSignHeader(const string &headerName)
+{
+	for (unsigned int hdrNum = 0; dkim_should_signhdrs[hdrNum] != NULL; ++hdrNum)
+	{
+		if (strcasecmp(headerName.c_str(), (const char *)dkim_should_signhdrs[hdrNum]) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void appendFolded(string &value, string::size_type &lineLen,
+	const string &token)
+{
+	string::size_type tokenStart = 0;
+
+	if ((lineLen > 1) &&
+		(lineLen + token.length() > SIGNATURE_MARGIN))
+	{
+		value += "\r\n\t";
+		lineLen = 1;
+		if ((token.empty() == false) &&
+			(token[0] == ' '))
+		{
+			tokenStart = 1;
+		}
+	}
+	value.append(token, tokenStart, string::npos);
+	lineLen += token.length() - tokenStart;
+}
+
 static DKIM_STAT keyLookup(DKIM *dkim, DKIM_SIGINFO *sig, unsigned char *buf, size_t buflen)
 {
 	ConfigurationFile *pConfig = ConfigurationFile::getInstance("");
 
+	// Only the first key's public key is known
+	if ((sig != NULL) &&
+		(pConfig != NULL) &&
+		(dkim_sig_getselector(sig) != NULL) &&
+		(pConfig->m_dkSelector != reinterpret_cast<const char*>(dkim_sig_getselector(sig))))
+	{
+		return DKIM_STAT_NOKEY;
+	}
+
 	if ((buf != NULL) &&
 		(pConfig != NULL) &&
 		(pConfig->m_dkPublicKey.empty() == false))
@@ -68,9 +348,124 @@ static DKIM_STAT keyLookup(DKIM *dkim, DKIM_SIGINFO *sig, unsigned char *buf, si
 
 pthread_mutex_t OpenDKIM::m_mutex = PTHREAD_MUTEX_INITIALIZER;
 DKIM_LIB *OpenDKIM::m_pLib = NULL;
+pthread_once_t OpenDKIM::m_stateKeyOnce = PTHREAD_ONCE_INIT;
+pthread_key_t OpenDKIM::m_stateKey;
+bool OpenDKIM::m_serializeSigning = false;
+bool OpenDKIM::m_loggedSecondKey = false;
+pthread_mutex_t OpenDKIM::m_keysMutex = PTHREAD_MUTEX_INITIALIZER;
+map<string, DKIMSigningKey> OpenDKIM::m_cachedKeys;
+
+DKIMSigningKey::DKIMSigningKey() :
+	m_modTime(0),
+	m_size(0),
+	m_algorithm(RSA_SHA1),
+	m_pKey(NULL)
+{
+}
+
+DKIMSigningKey::DKIMSigningKey(const DKIMSigningKey &other) :
+	m_fileName(other.m_fileName),
+	m_modTime(other.m_modTime),
+	m_size(other.m_size),
+	m_selector(other.m_selector),
+	m_algorithm(other.m_algorithm),
+	m_pKey(other.m_pKey)
+{
+	if (m_pKey != NULL)
+	{
+		EVP_PKEY_up_ref(m_pKey);
+	}
+}
+
+DKIMSigningKey::~DKIMSigningKey()
+{
+	if (m_pKey != NULL)
+	{
+		EVP_PKEY_free(m_pKey);
+	}
+}
+
+DKIMSigningKey &DKIMSigningKey::operator=(const DKIMSigningKey &other)
+{
+	if (this != &other)
+	{
+		if (other.m_pKey != NULL)
+		{
+			EVP_PKEY_up_ref(other.m_pKey);
+		}
+		if (m_pKey != NULL)
+		{
+			EVP_PKEY_free(m_pKey);
+		}
+		m_fileName = other.m_fileName;
+		m_modTime = other.m_modTime;
+		m_size = other.m_size;
+		m_selector = other.m_selector;
+		m_algorithm = other.m_algorithm;
+		m_pKey = other.m_pKey;
+	}
+
+	return *this;
+}
+
+string DKIMSigningKey::getAlgorithmName(Algorithm algorithm)
+{
+	if (algorithm == RSA_SHA256)
+	{
+		return "rsa-sha256";
+	}
+	else if (algorithm == ED25519_SHA256)
+	{
+		return "ed25519-sha256";
+	}
+
+	return "rsa-sha1";
+}
+
+bool DKIMSigningKey::parseAlgorithm(const string &name, Algorithm &algorithm)
+{
+	if (strcasecmp(name.c_str(), "rsa-sha1") == 0)
+	{
+		algorithm = RSA_SHA1;
+	}
+	else if (strcasecmp(name.c_str(), "rsa-sha256") == 0)
+	{
+		algorithm = RSA_SHA256;
+	}
+#ifdef EVP_PKEY_ED25519
+	else if (strcasecmp(name.c_str(), "ed25519-sha256") == 0)
+	{
+		algorithm = ED25519_SHA256;
+	}
+#endif
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool DKIMSigningKey::isSuitable(Algorithm algorithm) const
+{
+	if (m_pKey == NULL)
+	{
+		return false;
+	}
+
+#ifdef EVP_PKEY_ED25519
+	if (algorithm == ED25519_SHA256)
+	{
+		return (EVP_PKEY_base_id(m_pKey) == EVP_PKEY_ED25519);
+	}
+#endif
+
+	return (EVP_PKEY_base_id(m_pKey) == EVP_PKEY_RSA);
+}
 
 OpenDKIM::OpenDKIM() :
 	DomainAuth(),
+	m_algorithm(DKIMSigningKey::RSA_SHA1),
 	m_pObj(NULL)
 {
 }
@@ -79,6 +474,352 @@ OpenDKIM::~OpenDKIM()
 {
 }
 
+void OpenDKIM::createStateKey(void)
+{
+	pthread_key_create(&m_stateKey, deleteThreadState);
+}
+
+bool OpenDKIM::getCachedKey(const string &domainName,
+	const string &selector, const string &fileName,
+	DKIMSigningKey &key)
+{
+	struct stat fileStat;
+	string cacheKey(selector + "._domainkey." + domainName);
+
+	if (stat(fileName.c_str(), &fileStat) != 0)
+	{
+		clog << "OpenDKIM: couldn't stat " << fileName << endl;
+		return false;
+	}
+
+	pthread_mutex_lock(&m_keysMutex);
+	map<string, DKIMSigningKey>::iterator keyIter = m_cachedKeys.find(cacheKey);
+	if ((keyIter != m_cachedKeys.end()) &&
+		(keyIter->second.m_fileName == fileName) &&
+		(keyIter->second.m_modTime == fileStat.st_mtime) &&
+		(keyIter->second.m_size == fileStat.st_size))
+	{
+		key = keyIter->second;
+		pthread_mutex_unlock(&m_keysMutex);
+
+		return true;
+	}
+	pthread_mutex_unlock(&m_keysMutex);
+
+	// Parse the key outside the lock, keys being signed with are unaffected
+	EVP_PKEY *pKey = NULL;
+	BIO *pKeyBio = BIO_new_file(fileName.c_str(), "r");
+	if (pKeyBio != NULL)
+	{
+		pKey = PEM_read_bio_PrivateKey(pKeyBio, NULL, NULL, NULL);
+		BIO_free(pKeyBio);
+	}
+	if (pKey == NULL)
+	{
+#ifdef DEBUG
+		clog << "OpenDKIM::getCachedKey: couldn't parse " << fileName << endl;
+#endif
+		return false;
+	}
+
+	DKIMSigningKey parsedKey;
+
+	parsedKey.m_fileName = fileName;
+	parsedKey.m_modTime = fileStat.st_mtime;
+	parsedKey.m_size = fileStat.st_size;
+	parsedKey.m_selector = selector;
+	parsedKey.m_pKey = pKey;
+#ifdef EVP_PKEY_ED25519
+	if (EVP_PKEY_base_id(pKey) == EVP_PKEY_ED25519)
+	{
+		parsedKey.m_algorithm = DKIMSigningKey::ED25519_SHA256;
+	}
+#endif
+	if (parsedKey.isSuitable(parsedKey.m_algorithm) == false)
+	{
+		clog << "OpenDKIM: unsupported key type in " << fileName << endl;
+		return false;
+	}
+
+	pthread_mutex_lock(&m_keysMutex);
+	m_cachedKeys[cacheKey] = parsedKey;
+	pthread_mutex_unlock(&m_keysMutex);
+#ifdef DEBUG
+	clog << "OpenDKIM::getCachedKey: parsed " << fileName << " for " << cacheKey << endl;
+#endif
+
+	key = parsedKey;
+
+	return true;
+}
+
+bool OpenDKIM::addKey(DKIMSigningKey &key, const string &algorithmName)
+{
+	// Ed25519 keys default to ed25519-sha256, RSA keys to rsa-sha1
+	if ((algorithmName.empty() == false) &&
+		((DKIMSigningKey::parseAlgorithm(algorithmName, key.m_algorithm) == false) ||
+		(key.isSuitable(key.m_algorithm) == false)))
+	{
+		clog << "OpenDKIM: can't sign with " << algorithmName << " and key " << key.m_fileName << endl;
+		return false;
+	}
+	m_keys.push_back(key);
+
+	return true;
+}
+
+string OpenDKIM::getBodyHash(const char *pBody, size_t bodyLen,
+	bool simpleCanon, bool useSHA256)
+{
+	DKIMThreadState *pState = static_cast<DKIMThreadState*>(pthread_getspecific(m_stateKey));
+	string hashKey(simpleCanon == true ? "s" : "r");
+
+	hashKey += (useSHA256 == true ? "2" : "1");
+	if (digestBody(pState->m_pHashCtx, pBody, bodyLen, hashKey) == false)
+	{
+		return "";
+	}
+
+	map<string, string>::const_iterator hashIter = pState->m_bodyHashes.find(hashKey);
+	if (hashIter != pState->m_bodyHashes.end())
+	{
+		return hashIter->second;
+	}
+
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int hashLen = 0;
+
+	if (EVP_DigestInit_ex(pState->m_pHashCtx,
+		(useSHA256 == true ? EVP_sha256() : EVP_sha1()), NULL) != 1)
+	{
+		return "";
+	}
+	hashBody(pBody, bodyLen, simpleCanon, pState->m_pHashCtx, pState->m_canonBuffer);
+	EVP_DigestFinal_ex(pState->m_pHashCtx, hash, &hashLen);
+
+	unsigned long encodedLen = hashLen;
+	char *pEncodedHash = Base64::encode((const char *)hash, encodedLen);
+	if (pEncodedHash == NULL)
+	{
+		return "";
+	}
+	string bodyHash(pEncodedHash, encodedLen);
+	delete[] pEncodedHash;
+
+	pState->m_bodyHashes[hashKey] = bodyHash;
+	pState->m_bodyHashKeys.push_back(hashKey);
+	if (pState->m_bodyHashKeys.size() > MAX_CACHED_BODY_HASHES)
+	{
+		// Forget the oldest
+		pState->m_bodyHashes.erase(pState->m_bodyHashKeys.front());
+		pState->m_bodyHashKeys.pop_front();
+	}
+
+	return bodyHash;
+}
+
+string OpenDKIM::signWithKey(const DKIMSigningKey &key,
+	const char *pBody, size_t bodyLen,
+	SMTPMessage *pMsg, bool simpleCanon)
+{
+	DKIMThreadState *pState = static_cast<DKIMThreadState*>(pthread_getspecific(m_stateKey));
+	bool useSHA256 = (key.m_algorithm != DKIMSigningKey::RSA_SHA1);
+
+	string bodyHash(getBodyHash(pBody, bodyLen, simpleCanon, useSHA256));
+	if (bodyHash.empty() == true)
+	{
+		return "";
+	}
+
+	// Pick headers the way OpenDKIM does
+	vector<string> signedNames, signedHeaders;
+	vector<bool> usedHeaders(pMsg->m_headers.size(), false);
+	for (vector<SMTPHeader>::const_iterator headerIter = pMsg->m_headers.begin();
+		headerIter != pMsg->m_headers.end(); ++headerIter)
+	{
+		if (shouldSignHeader(headerIter->m_name) == true)
+		{
+			signedNames.push_back(headerIter->m_name);
+		}
+	}
+	for (vector<string>::const_iterator nameIter = signedNames.begin();
+		nameIter != signedNames.end(); ++nameIter)
+	{
+		// Repeated headers are signed bottom up
+		for (unsigned int hdrNum = pMsg->m_headers.size(); hdrNum > 0; --hdrNum)
+		{
+			const SMTPHeader &header = pMsg->m_headers[hdrNum - 1];
+
+			if ((usedHeaders[hdrNum - 1] == false) &&
+				(strcasecmp(header.m_name.c_str(), nameIter->c_str()) == 0))
+			{
+				signedHeaders.push_back(relaxHeader(formatHeader(header)));
+				usedHeaders[hdrNum - 1] = true;
+				break;
+			}
+		}
+	}
+
+	stringstream tagsStr;
+	string value;
+	string::size_type lineLen = strlen(DK_HEADER_NAME) + 2;
+
+	tagsStr << time(NULL);
+	appendFolded(value, lineLen, "v=1;");
+	appendFolded(value, lineLen, " a=" + DKIMSigningKey::getAlgorithmName(key.m_algorithm) + ";");
+	appendFolded(value, lineLen, string(" c=relaxed/") + (simpleCanon == true ? "simple;" : "relaxed;"));
+	appendFolded(value, lineLen, " d=" + m_domainName + ";");
+	appendFolded(value, lineLen, " s=" + key.m_selector + ";");
+	appendFolded(value, lineLen, " t=" + tagsStr.str() + ";");
+	appendFolded(value, lineLen, " bh=" + bodyHash + ";");
+	for (vector<string>::const_iterator nameIter = signedNames.begin();
+		nameIter != signedNames.end(); ++nameIter)
+	{
+		appendFolded(value, lineLen, (nameIter == signedNames.begin() ? " h=" : ":") + *nameIter);
+	}
+	appendFolded(value, lineLen, "; b=");
+
+	// The signature header itself is hashed last, without its value
+	string signatureHeader(relaxHeader(string(DK_HEADER_NAME) + ": " + value));
+	EVP_MD_CTX *pCtx = pState->m_pSignCtx;
+	size_t signatureLen = 0;
+	unsigned char *pSignature = NULL;
+
+	EVP_MD_CTX_reset(pCtx);
+	if (key.m_algorithm == DKIMSigningKey::ED25519_SHA256)
+	{
+		unsigned char headersHash[EVP_MAX_MD_SIZE];
+		unsigned int headersHashLen = 0;
+
+		// RFC 8463: Ed25519 signs the SHA-256 hash of the headers
+		if (EVP_DigestInit_ex(pState->m_pHashCtx, EVP_sha256(), NULL) != 1)
+		{
+			return "";
+		}
+		for (vector<string>::const_iterator headerIter = signedHeaders.begin();
+			headerIter != signedHeaders.end(); ++headerIter)
+		{
+			EVP_DigestUpdate(pState->m_pHashCtx, headerIter->c_str(), headerIter->length());
+			EVP_DigestUpdate(pState->m_pHashCtx, "\r\n", 2);
+		}
+		EVP_DigestUpdate(pState->m_pHashCtx, signatureHeader.c_str(), signatureHeader.length());
+		EVP_DigestFinal_ex(pState->m_pHashCtx, headersHash, &headersHashLen);
+
+#ifdef EVP_PKEY_ED25519
+		if ((EVP_DigestSignInit(pCtx, NULL, NULL, NULL, key.m_pKey) == 1) &&
+			(EVP_DigestSign(pCtx, NULL, &signatureLen, headersHash, headersHashLen) == 1))
+		{
+			pSignature = new unsigned char[signatureLen];
+			if (EVP_DigestSign(pCtx, pSignature, &signatureLen, headersHash, headersHashLen) != 1)
+			{
+				delete[] pSignature;
+				pSignature = NULL;
+			}
+		}
+#endif
+	}
+	else if (EVP_DigestSignInit(pCtx, NULL, (useSHA256 == true ? EVP_sha256() : EVP_sha1()), NULL, key.m_pKey) == 1)
+	{
+		for (vector<string>::const_iterator headerIter = signedHeaders.begin();
+			headerIter != signedHeaders.end(); ++headerIter)
+		{
+			EVP_DigestSignUpdate(pCtx, headerIter->c_str(), headerIter->length());
+			EVP_DigestSignUpdate(pCtx, "\r\n", 2);
+		}
+		EVP_DigestSignUpdate(pCtx, signatureHeader.c_str(), signatureHeader.length());
+
+		if (EVP_DigestSignFinal(pCtx, NULL, &signatureLen) == 1)
+		{
+			pSignature = new unsigned char[signatureLen];
+			if (EVP_DigestSignFinal(pCtx, pSignature, &signatureLen) != 1)
+			{
+				delete[] pSignature;
+				pSignature = NULL;
+			}
+		}
+	}
+	if (pSignature == NULL)
+	{
+		clog << "OpenDKIM: couldn't sign headers with " << DKIMSigningKey::getAlgorithmName(key.m_algorithm) << endl;
+		return "";
+	}
+
+	unsigned long encodedLen = signatureLen;
+	char *pEncodedSignature = Base64::encode((const char *)pSignature, encodedLen);
+	delete[] pSignature;
+	if (pEncodedSignature == NULL)
+	{
+		return "";
+	}
+	string encodedSignature(pEncodedSignature, encodedLen);
+	delete[] pEncodedSignature;
+
+	for (string::size_type pos = 0; pos < encodedSignature.length(); pos += SIGNATURE_MARGIN - 11)
+	{
+		appendFolded(value, lineLen, encodedSignature.substr(pos, SIGNATURE_MARGIN - 11));
+	}
+
+	return value;
+}
+
+bool OpenDKIM::signWithBodyHash(const string &messageData,
+	SMTPMessage *pMsg, bool simpleCanon)
+{
+	pthread_once(&m_stateKeyOnce, createStateKey);
+
+	DKIMThreadState *pState = static_cast<DKIMThreadState*>(pthread_getspecific(m_stateKey));
+	if (pState == NULL)
+	{
+		pState = new DKIMThreadState();
+		pthread_setspecific(m_stateKey, pState);
+	}
+	if ((pState->m_pHashCtx == NULL) ||
+		(pState->m_pSignCtx == NULL))
+	{
+		return false;
+	}
+
+	string::size_type startOfMessage = messageData.find("\r\n\r\n");
+
+	if (startOfMessage == string::npos)
+	{
+		startOfMessage = 0;
+	}
+	else
+	{
+		startOfMessage += 4;
+	}
+
+	vector<string> values;
+	for (vector<DKIMSigningKey>::const_iterator keyIter = m_keys.begin();
+		keyIter != m_keys.end(); ++keyIter)
+	{
+		string value(signWithKey(*keyIter, messageData.c_str() + startOfMessage,
+			messageData.length() - startOfMessage, pMsg, simpleCanon));
+
+		if (value.empty() == true)
+		{
+			return false;
+		}
+		values.push_back(value);
+	}
+
+	// Each signature is prepended to the message, so the last one ends up on top
+	for (vector<string>::size_type valueNum = 0; valueNum < values.size(); ++valueNum)
+	{
+		if (valueNum + 1 < values.size())
+		{
+			values[valueNum + 1] += "\r\n";
+		}
+		if (pMsg->setSignatureHeader(DK_HEADER_NAME, values[valueNum]) == false)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
 bool OpenDKIM::feedHeader(const string &header)
 {
 	if (m_pObj == NULL)
@@ -130,22 +871,7 @@ bool OpenDKIM::feedMessage(const string &messageData,
 	for (vector<SMTPHeader>::const_iterator headerIter = pMsg->m_headers.begin();
 		headerIter != pMsg->m_headers.end(); ++headerIter)
 	{
-		string headerName(headerIter->m_name);
-		string value(headerIter->m_value);
-		string path(headerIter->m_path);
-		stringstream headerStr;
-
-		headerStr << headerName << ":";
-		if (value.empty() == false)
-		{
-			headerStr << " " << value;
-		}
-		if (path.empty() == false)
-		{
-			headerStr << " <" << path << ">";
-		}
-		headerStr << "\r\n";
-		string header(headerStr.str());
+		string header(formatHeader(*headerIter));
 
 #ifdef _DEBUG_FEEDING
 		dataFile << header;
@@ -239,13 +965,53 @@ bool OpenDKIM::loadPrivateKey(ConfigurationFile *pConfig)
 {
 	if ((pConfig == NULL) ||
 		(pConfig->m_dkSelector.empty() == true) ||
-		(DomainAuth::loadPrivateKey(pConfig) == false))
+		(pConfig->m_dkPrivateKey.empty() == true) ||
+		(pConfig->m_dkDomain.empty() == true))
 	{
 		return false;
 	}
 
+	m_domainName = pConfig->m_dkDomain;
 	m_selector = pConfig->m_dkSelector;
 	m_privateKeyFileName = pConfig->m_dkPrivateKey;
+	m_algorithm = DKIMSigningKey::RSA_SHA1;
+	m_keys.clear();
+
+	DKIMSigningKey key;
+	if (getCachedKey(m_domainName, m_selector, m_privateKeyFileName, key) == true)
+	{
+		if (addKey(key, pConfig->m_dkAlgorithm) == false)
+		{
+			return false;
+		}
+	}
+	else
+	{
+		// Keys that can't be parsed here are left to OpenDKIM
+		if (((pConfig->m_dkAlgorithm.empty() == false) &&
+			(DKIMSigningKey::parseAlgorithm(pConfig->m_dkAlgorithm, m_algorithm) == false)) ||
+			(m_algorithm == DKIMSigningKey::ED25519_SHA256) ||
+			(DomainAuth::loadPrivateKey(pConfig) == false))
+		{
+			return false;
+		}
+#ifdef DEBUG
+		clog << "OpenDKIM::loadPrivateKey: signing with OpenDKIM" << endl;
+#endif
+
+		return true;
+	}
+
+	// Sign a second time with another key ?
+	if ((pConfig->m_dkSelector2.empty() == false) &&
+		(pConfig->m_dkPrivateKey2.empty() == false) &&
+		((getCachedKey(m_domainName, pConfig->m_dkSelector2, pConfig->m_dkPrivateKey2, key) == false) ||
+		(addKey(key, pConfig->m_dkAlgorithm2) == false)) &&
+		(__sync_bool_compare_and_swap(&m_loggedSecondKey, false, true) == true))
+	{
+		// Each thread loads keys, only say it the first time
+		clog << "OpenDKIM: couldn't load second key " << pConfig->m_dkPrivateKey2 << endl;
+	}
 
 	return true;
 }
@@ -268,15 +1034,41 @@ void OpenDKIM::shutdown(void)
 
 void OpenDKIM::cleanupThread(void)
 {
+	pthread_once(&m_stateKeyOnce, createStateKey);
+
+	DKIMThreadState *pState = static_cast<DKIMThreadState*>(pthread_getspecific(m_stateKey));
+	if (pState != NULL)
+	{
+		pthread_setspecific(m_stateKey, NULL);
+		delete pState;
+	}
+
 	// Because OpenDKIM uses OpenSSL, each thread should call this at exit time
 	ERR_remove_thread_state(NULL);
 }
 
+bool OpenDKIM::serializeSigning(bool serialize)
+{
+	bool wasSerialized = m_serializeSigning;
+
+	m_serializeSigning = serialize;
+
+	return wasSerialized;
+}
+
 bool OpenDKIM::canSign(void) const
 {
+	if (m_domainName.empty() == true)
+	{
+		return false;
+	}
+	if (m_keys.empty() == false)
+	{
+		return true;
+	}
+
 	if ((m_pLib == NULL) ||
 		(m_pPrivateKey == NULL) ||
-		(m_domainName.empty() == true) ||
 		(m_selector.empty() == true) ||
 		(m_privateKeyFileName.empty() == true))
 	{
@@ -293,6 +1085,7 @@ bool OpenDKIM::lockedSign(const string &messageData,
 	dkim_sigkey_t key = reinterpret_cast<unsigned char*>(m_pPrivateKey);
 	dkim_query_t queryType = DKIM_QUERY_FILE;
 	uint64_t fixedTime = (uint64_t)time(NULL);
+	dkim_alg_t signAlg = (m_algorithm == DKIMSigningKey::RSA_SHA256 ? DKIM_SIGN_RSASHA256 : DKIM_SIGN_RSASHA1);
 
 	if ((canSign() == false) ||
 		(messageData.empty() == true) ||
@@ -301,6 +1094,11 @@ bool OpenDKIM::lockedSign(const string &messageData,
 		return false;
 	}
 
+	if (m_keys.empty() == false)
+	{
+		return signWithBodyHash(messageData, pMsg, simpleCanon);
+	}
+
 	dkim_options(m_pLib, DKIM_OP_SETOPT, DKIM_OPTS_QUERYMETHOD,
 		&queryType, sizeof(queryType));
 	dkim_options(m_pLib, DKIM_OP_SETOPT, DKIM_OPTS_QUERYINFO,
@@ -314,13 +1112,13 @@ bool OpenDKIM::lockedSign(const string &messageData,
 	{
 		m_pObj = dkim_sign(m_pLib, reinterpret_cast<const unsigned char*>(JOBID), NULL, key, reinterpret_cast<const unsigned char*>(m_selector.c_str()), reinterpret_cast<const unsigned char*>(m_domainName.c_str()),
 				DKIM_CANON_RELAXED, DKIM_CANON_SIMPLE,
-				DKIM_SIGN_RSASHA1, -1L, &status);
+				signAlg, -1L, &status);
 	}
 	else
 	{
 		m_pObj = dkim_sign(m_pLib, reinterpret_cast<const unsigned char*>(JOBID), NULL, key, reinterpret_cast<const unsigned char*>(m_selector.c_str()), reinterpret_cast<const unsigned char*>(m_domainName.c_str()),
 				DKIM_CANON_RELAXED, DKIM_CANON_RELAXED,
-				DKIM_SIGN_RSASHA1, -1L, &status);
+				signAlg, -1L, &status);
 	}
 
 	if (m_pObj == NULL)
@@ -397,20 +1195,55 @@ bool OpenDKIM::lockedVerify(const string &messageData,
 
 	dkim_set_key_lookup(m_pLib, keyLookup);
 
-	feedHeader(pMsg->getSignatureHeader());
+	const vector<string> &signatureHeaders = pMsg->getSignatureHeaders();
+	for (vector<string>::const_iterator headerIter = signatureHeaders.begin();
+		headerIter != signatureHeaders.end(); ++headerIter)
+	{
+		string header(*headerIter);
+
+		// Signatures on top of another one end with its separator
+		if ((header.length() >= 2) &&
+			(header.compare(header.length() - 2, 2, "\r\n") == 0))
+		{
+			header.resize(header.length() - 2);
+		}
+		feedHeader(header);
+	}
 	if (feedMessage(messageData, pMsg) == false)
 	{
 		return false;
 	}
 
-	DKIM_SIGINFO *pSig = dkim_getsignature(m_pObj);
+	DKIM_SIGINFO **pSigs = NULL;
 	DKIM_SIGERROR error = DKIM_SIGERROR_UNKNOWN;
+	int sigsCount = 0;
 
-	if (pSig != NULL)
+	if ((dkim_getsiglist(m_pObj, &pSigs, &sigsCount) != DKIM_STAT_OK) ||
+		(pSigs == NULL))
 	{
-		error = dkim_sig_geterror(pSig);
+		sigsCount = 0;
 	}
-	else
+	for (int sigNum = 0; sigNum < sigsCount; ++sigNum)
+	{
+		unsigned char *pSelector = dkim_sig_getselector(pSigs[sigNum]);
+
+		// Only signatures made with the first key can be checked
+		if ((pSelector == NULL) ||
+			(m_selector != reinterpret_cast<const char*>(pSelector)))
+		{
+#ifdef DEBUG
+			clog << "OpenDKIM::verify: no public key for signature " << sigNum << endl;
+#endif
+			continue;
+		}
+
+		error = dkim_sig_geterror(pSigs[sigNum]);
+		if (error != DKIM_SIGERROR_OK)
+		{
+			break;
+		}
+	}
+	if (sigsCount == 0)
 	{
 		clog << "OpenDKIM: failed to get signature object" << endl;
 	}
@@ -433,6 +1266,20 @@ bool OpenDKIM::lockedVerify(const string &messageData,
 bool OpenDKIM::sign(const string &messageData,
 	SMTPMessage *pMsg, bool simpleCanon)
 {
+	// Only OpenDKIM needs the lock
+	if ((m_keys.empty() == false) &&
+		(m_serializeSigning == false))
+	{
+		if ((canSign() == false) ||
+			(messageData.empty() == true) ||
+			(pMsg == NULL))
+		{
+			return false;
+		}
+
+		return signWithBodyHash(messageData, pMsg, simpleCanon);
+	}
+
 	pthread_mutex_lock(&m_mutex);
 
 	bool status = lockedSign(messageData, pMsg, simpleCanon);
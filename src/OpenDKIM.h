@@ -20,15 +20,50 @@
 #ifndef _OPENDKIM_H_
 #define _OPENDKIM_H_
 
+#include <sys/types.h>
+#include <time.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <dkim.h>
+#include <openssl/evp.h>
 #include <string>
+#include <map>
+#include <vector>
 
 #include "ConfigurationFile.h"
 #include "DomainAuth.h"
 #include "SMTPMessage.h"
 
+/// A private key parsed by OpenSSL, and how it signs.
+class DKIMSigningKey
+{
+	public:
+		typedef enum { RSA_SHA1 = 0, RSA_SHA256, ED25519_SHA256 } Algorithm;
+
+		DKIMSigningKey();
+		DKIMSigningKey(const DKIMSigningKey &other);
+		virtual ~DKIMSigningKey();
+
+		DKIMSigningKey &operator=(const DKIMSigningKey &other);
+
+		/// Returns the algorithm's name, as found in the a= tag.
+		static std::string getAlgorithmName(Algorithm algorithm);
+
+		/// Parses an algorithm name; returns false if it's not supported.
+		static bool parseAlgorithm(const std::string &name, Algorithm &algorithm);
+
+		/// Returns true if the key can be used with the algorithm.
+		bool isSuitable(Algorithm algorithm) const;
+
+		std::string m_fileName;
+		time_t m_modTime;
+		off_t m_size;
+		std::string m_selector;
+		Algorithm m_algorithm;
+		EVP_PKEY *m_pKey;
+
+};
+
 /// OpenDKIM based domain authenticator
 class OpenDKIM : public DomainAuth
 {
@@ -45,7 +80,17 @@ class OpenDKIM : public DomainAuth
 		/// Cleans up the current thread's state.
 		static void cleanupThread(void);
 
-		/// Loads the private key for the given domain name.
+		/**
+		  * Makes signing go through the global lock, as it did when all
+		  * signatures were made by OpenDKIM. Returns the previous setting.
+		  * This is meant for benchmarking.
+		  */
+		static bool serializeSigning(bool serialize);
+
+		/**
+		  * Loads the private key(s) for the given domain name.
+		  * Keys are parsed once per process, and again only if the file changes.
+		  */
 		virtual bool loadPrivateKey(ConfigurationFile *pConfig);
 
 		/// Returns true if messages can be signed.
@@ -64,10 +109,52 @@ class OpenDKIM : public DomainAuth
 	protected:
 		static pthread_mutex_t m_mutex;
 		static DKIM_LIB *m_pLib;
+		static pthread_once_t m_stateKeyOnce;
+		static pthread_key_t m_stateKey;
+		static bool m_serializeSigning;
+		static bool m_loggedSecondKey;
+		static pthread_mutex_t m_keysMutex;
+		static std::map<std::string, DKIMSigningKey> m_cachedKeys;
 		std::string m_selector;
 		std::string m_privateKeyFileName;
+		DKIMSigningKey::Algorithm m_algorithm;
+		std::vector<DKIMSigningKey> m_keys;
 		DKIM *m_pObj;
 
+		static void createStateKey(void);
+
+		/**
+		  * Gets the parsed key for domain and selector from the cache,
+		  * parsing the file if needed. Returns false if OpenSSL can't parse it.
+		  */
+		static bool getCachedKey(const std::string &domainName,
+			const std::string &selector, const std::string &fileName,
+			DKIMSigningKey &key);
+
+		/// Adds a key that signs with the named algorithm, or the key's default.
+		bool addKey(DKIMSigningKey &key, const std::string &algorithmName);
+
+		/**
+		  * Returns the base64 encoded hash of the canonicalized body.
+		  * Hashes are cached per thread by the SHA-256 of the raw body, so that
+		  * identical bodies are only canonicalized once.
+		  */
+		std::string getBodyHash(const char *pBody, size_t bodyLen,
+			bool simpleCanon, bool useSHA256);
+
+		/// Returns a signature header value made with the given key.
+		std::string signWithKey(const DKIMSigningKey &key,
+			const char *pBody, size_t bodyLen,
+			SMTPMessage *pMsg, bool simpleCanon);
+
+		/**
+		  * Signs with each key, with body hashes computed here rather than
+		  * by OpenDKIM. This only uses the calling thread's state and needs
+		  * no lock.
+		  */
+		bool signWithBodyHash(const std::string &messageData,
+			SMTPMessage *pMsg, bool simpleCanon);
+
 		bool feedHeader(const std::string &header);
 
 		bool feedMessage(const std::string &messageData,
@@ -25,12 +25,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define QP_X86
+#endif
 
 #include "QuotedPrintable.h"
 
 using std::clog;
 using std::clog;
 using std::endl;
+using std::string;
 
 static const char _hexdigits[] = "0123456789ABCDEF";
 
@@ -145,12 +150,96 @@ qp_decode (const char *iptr, size_t isize, char *optr, size_t osize,
   return consumed - wscount;
 }
 
+/* Copies bytes that need neither quoting nor a line break, up to maxLen;
+   returns how many were copied */
+typedef size_t (*CopySimpleFunc)(const char *, size_t, char *);
+
+#ifdef QP_X86
+__attribute__((target("sse2")))
+static size_t copySimple_sse2(const char *pData, size_t maxLen, char *pOutput)
+{
+	size_t copied = 0;
+
+	while (maxLen - copied >= 16)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i *)(pData + copied));
+		// Printable characters but '=', and tabs
+		__m128i printable = _mm_andnot_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('=')),
+			_mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8(31)),
+				_mm_cmplt_epi8(in, _mm_set1_epi8(127))));
+		__m128i simple = _mm_or_si128(printable, _mm_cmpeq_epi8(in, _mm_set1_epi8('\t')));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(simple);
+
+		if (mask == 0xffff)
+		{
+			_mm_storeu_si128((__m128i *)(pOutput + copied), in);
+			copied += 16;
+			continue;
+		}
+
+		// Copy up to the first byte that needs attention
+		size_t simpleLen = (size_t)__builtin_ctz(~mask);
+		memcpy(pOutput + copied, pData + copied, simpleLen);
+
+		return copied + simpleLen;
+	}
+
+	return copied;
+}
+
+__attribute__((target("avx2")))
+static size_t copySimple_avx2(const char *pData, size_t maxLen, char *pOutput)
+{
+	size_t copied = 0;
+
+	while (maxLen - copied >= 32)
+	{
+		__m256i in = _mm256_loadu_si256((const __m256i *)(pData + copied));
+		__m256i printable = _mm256_andnot_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('=')),
+			_mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8(31)),
+				_mm256_cmpgt_epi8(_mm256_set1_epi8(127), in)));
+		__m256i simple = _mm256_or_si256(printable, _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\t')));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(simple);
+
+		if (mask == 0xffffffff)
+		{
+			_mm256_storeu_si256((__m256i *)(pOutput + copied), in);
+			copied += 32;
+			continue;
+		}
+
+		size_t simpleLen = (size_t)__builtin_ctz(~mask);
+		memcpy(pOutput + copied, pData + copied, simpleLen);
+		_mm256_zeroupper();
+
+		return copied + simpleLen;
+	}
+	// Avoid AVX to SSE transition penalties
+	_mm256_zeroupper();
+
+	return copied + copySimple_sse2(pData + copied, maxLen - copied, pOutput + copied);
+}
+#endif
+
+static CopySimpleFunc getSimpleCopier(void)
+{
+#ifdef QP_X86
+	static CopySimpleFunc simpleCopier = (__builtin_cpu_supports("avx2") ? copySimple_avx2 :
+		(__builtin_cpu_supports("sse2") ? copySimple_sse2 : NULL));
+
+	return simpleCopier;
+#else
+	return NULL;
+#endif
+}
+
 static int
 qp_encode (const char *iptr, size_t isize, char *optr, size_t osize,
-	   size_t *nbytes, int *line_len)
+	   size_t *nbytes, int *line_len, int *last_char)
 {
   unsigned int c;
   size_t consumed = 0;
+  CopySimpleFunc copySimple = getSimpleCopier();
 
   *nbytes = 0;
 
@@ -162,6 +251,32 @@ qp_encode (const char *iptr, size_t isize, char *optr, size_t osize,
   while (consumed < isize)
     {
       int simple_char;
+
+      /* Runs of plain characters that fit on the line are copied in bulk */
+      if (copySimple != NULL && *line_len < QP_LINE_MAX)
+	{
+	  size_t maxlen = QP_LINE_MAX - *line_len;
+
+	  if (maxlen > isize - consumed)
+	    maxlen = isize - consumed;
+	  if (maxlen > osize - *nbytes)
+	    maxlen = osize - *nbytes;
+	  if (maxlen >= 16)
+	    {
+	      size_t copied = copySimple (iptr, maxlen, optr);
+
+	      if (copied > 0)
+		{
+		  iptr += copied;
+		  optr += copied;
+		  consumed += copied;
+		  (*nbytes) += copied;
+		  (*line_len) += copied;
+		  *last_char = (unsigned char) optr[-1];
+		  continue;
+		}
+	    }
+	}
       
       /* candidate byte to convert */
       c = *(unsigned char*) iptr;
@@ -171,7 +286,7 @@ qp_encode (const char *iptr, size_t isize, char *optr, size_t osize,
 	             || c == '\n';
 
       if (*line_len == QP_LINE_MAX
-	  || (c == '\n' && consumed && ISWS (optr[-1]))
+	  || (c == '\n' && ISWS (*last_char))
 	  || (!simple_char && *line_len >= (QP_LINE_MAX - 3)))
 	{
 	  /* to cut a qp line requires two bytes */
@@ -182,6 +297,7 @@ qp_encode (const char *iptr, size_t isize, char *optr, size_t osize,
 	  *optr++ = '\n';
 	  (*nbytes) += 2;
 	  *line_len = 0;
+	  *last_char = '\n';
 	}
 	  
       if (simple_char)
@@ -193,6 +309,7 @@ qp_encode (const char *iptr, size_t isize, char *optr, size_t osize,
 	  *optr++ = c;
 	  (*nbytes)++;
 	  (*line_len)++;
+	  *last_char = c;
 
 	  iptr++;
 	  consumed++;
@@ -212,6 +329,7 @@ qp_encode (const char *iptr, size_t isize, char *optr, size_t osize,
 
 	  (*nbytes) += 3;
 	  (*line_len) += 3;
+	  *last_char = optr[-1];
 
 	  /* we've actuall used up one byte of input */
 	  iptr++;
@@ -240,9 +358,9 @@ char *QuotedPrintable::encode(const char *pData, size_t &dataLen)
 	}
 
 	size_t nbytes = 0;
-	int lineLen = 0;
+	int lineLen = 0, lastChar = 0;
 	char *pEncodedData = new char[outputLen];
-	int consumed = qp_encode(pData, (size_t)dataLen, pEncodedData, outputLen, &nbytes, &lineLen);
+	int consumed = qp_encode(pData, (size_t)dataLen, pEncodedData, outputLen, &nbytes, &lineLen, &lastChar);
 	if (dataLen > (size_t)consumed)
 	{
 		// Not everything was consumed, probably because the output buffer is too small
@@ -276,3 +394,79 @@ char *QuotedPrintable::encode(const char *pData, size_t &dataLen)
 	return pEncodedData;
 }
 
+QPSegment::QPSegment(const char *pData, size_t dataLen) :
+	m_tailLineLen(0),
+	m_tailLastChar(0)
+{
+	const char *pNewLine = NULL;
+
+	if (pData != NULL)
+	{
+		pNewLine = (const char *)memchr(pData, '\n', dataLen);
+	}
+	if (pNewLine == NULL)
+	{
+		if (pData != NULL)
+		{
+			m_head.assign(pData, dataLen);
+		}
+		return;
+	}
+
+	size_t headLen = pNewLine - pData + 1;
+	m_head.assign(pData, headLen);
+
+	// Past a line break, encoding doesn't depend on what came before
+	QPEncoder encoder;
+
+	encoder.m_lineLen = 0;
+	encoder.m_lastChar = '\n';
+	encoder.encode(pData + headLen, dataLen - headLen, m_encodedTail);
+	m_tailLineLen = encoder.m_lineLen;
+	m_tailLastChar = encoder.m_lastChar;
+}
+
+QPSegment::~QPSegment()
+{
+}
+
+QPEncoder::QPEncoder() :
+	m_lineLen(0),
+	m_lastChar(0)
+{
+}
+
+QPEncoder::~QPEncoder()
+{
+}
+
+void QPEncoder::encode(const char *pData, size_t dataLen, string &output)
+{
+	size_t consumed = 0;
+
+	while ((pData != NULL) &&
+		(consumed < dataLen))
+	{
+		size_t outputPos = output.length();
+		size_t outputLen = ((dataLen - consumed) * 3) + 3;
+		size_t nbytes = 0;
+
+		// Encode in place at the end of the output
+		output.resize(outputPos + outputLen);
+		consumed += qp_encode(pData + consumed, dataLen - consumed, &output[outputPos],
+			outputLen, &nbytes, &m_lineLen, &m_lastChar);
+		output.resize(outputPos + nbytes);
+	}
+}
+
+void QPEncoder::append(const QPSegment &segment, string &output)
+{
+	encode(segment.m_head.c_str(), segment.m_head.length(), output);
+	if ((segment.m_head.empty() == false) &&
+		(segment.m_head[segment.m_head.length() - 1] == '\n'))
+	{
+		output += segment.m_encodedTail;
+		m_lineLen = segment.m_tailLineLen;
+		m_lastChar = segment.m_tailLastChar;
+	}
+}
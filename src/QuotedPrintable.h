@@ -22,6 +22,7 @@
 #define _QUOTEDPRINTABLE_H_
 
 #include <stdlib.h>
+#include <string>
 
 // Quoted-printable encoding.
 class QuotedPrintable
@@ -45,4 +46,48 @@ class QuotedPrintable
 
 };
 
+/**
+  * A piece of content that's always encoded the same way once past its
+  * first line break. Everything up to that line break depends on where
+  * the previous piece left the line, so only the rest is encoded ahead.
+  */
+class QPSegment
+{
+	public:
+		QPSegment(const char *pData, size_t dataLen);
+		virtual ~QPSegment();
+
+		std::string m_head;
+		std::string m_encodedTail;
+		int m_tailLineLen;
+		int m_tailLastChar;
+
+};
+
+/**
+  * Quoted-printable encodes content piece by piece, with the same soft
+  * line breaks as if it had been encoded in one go.
+  */
+class QPEncoder
+{
+	public:
+		QPEncoder();
+		virtual ~QPEncoder();
+
+		/// Encodes data and appends it to output.
+		void encode(const char *pData, size_t dataLen, std::string &output);
+
+		/// Appends a segment prepared ahead of time.
+		void append(const QPSegment &segment, std::string &output);
+
+		int m_lineLen;
+		int m_lastChar;
+
+	private:
+		// QPEncoder objects cannot be copied.
+		QPEncoder(const QPEncoder &other);
+		QPEncoder &operator=(const QPEncoder &other);
+
+};
+
 #endif // _QUOTEDPRINTABLE_H_
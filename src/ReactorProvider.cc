@@ -0,0 +1,508 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include "LibETPANSessionPool.h"
+#include "ReactorProvider.h"
+
+// Maximum number of connections a batch is spread over
+#define MAX_CONNECTIONS_PER_BATCH 4
+// Maximum number of batches a session keeps under way
+#define MAX_PENDING_BATCHES 4
+
+using std::clog;
+using std::endl;
+using std::string;
+using std::stringstream;
+using std::map;
+using std::vector;
+using std::min;
+using std::max;
+
+static void setBlocking(int socket)
+{
+	int flags = fcntl(socket, F_GETFL, 0);
+
+	// libetpan expects blocking sockets
+	if (flags >= 0)
+	{
+		fcntl(socket, F_SETFL, flags & ~O_NONBLOCK);
+	}
+}
+
+ReactorProvider::ReactorProvider() :
+	LibETPANProvider(),
+	m_pBatch(NULL)
+{
+}
+
+ReactorProvider::~ReactorProvider()
+{
+	// The reactor mustn't be left with connections that point here
+	releaseBatch(true);
+}
+
+unsigned int ReactorProvider::getMaxConnections(void) const
+{
+	// Sessions that fall back to libetpan use only one
+	if (usesReactor() == false)
+	{
+		return 1;
+	}
+
+	return min((unsigned int)max(m_messages.size(), (size_t)1),
+		(unsigned int)MAX_CONNECTIONS_PER_BATCH);
+}
+
+bool ReactorProvider::startSession(bool reset)
+{
+	if (usesReactor() == false)
+	{
+		return LibETPANProvider::startSession(reset);
+	}
+
+	SMTPReactor *pReactor = SMTPReactor::getInstance();
+
+	if (m_messages.empty() == true)
+	{
+#ifdef DEBUG
+		clog << "ReactorProvider::startSession: no message" << endl;
+#endif
+		return true;
+	}
+
+	if (m_pBatch != NULL)
+	{
+		// Only one batch at a time
+		finishSession();
+	}
+
+	m_transactions.clear();
+	m_transactions.reserve(m_messages.size());
+	for (unsigned int msgNum = 0; msgNum < m_messages.size(); ++msgNum)
+	{
+		LibETPANMessage *pETPANMsg = m_messages[msgNum];
+
+		if ((pETPANMsg == NULL) ||
+			(pETPANMsg->m_sent == true))
+		{
+			continue;
+		}
+
+		ReactorTransaction transaction;
+		const char *pEnvId = pETPANMsg->getEnvId();
+
+		transaction.m_reversePath = pETPANMsg->m_smtpFrom;
+		if (pEnvId != NULL)
+		{
+			transaction.m_envId = pEnvId;
+		}
+		if (pETPANMsg->m_dsnFlags == SMTPMessage::SUCCESS)
+		{
+			transaction.m_notify = "SUCCESS";
+		}
+		else if (pETPANMsg->m_dsnFlags == SMTPMessage::FAILURE)
+		{
+			transaction.m_notify = "FAILURE";
+		}
+		else
+		{
+			transaction.m_notify = "NEVER";
+		}
+		for (map<string, int>::iterator recipIter = pETPANMsg->m_recipients.begin();
+			recipIter != pETPANMsg->m_recipients.end(); ++recipIter)
+		{
+			transaction.m_recipients.push_back(recipIter->first);
+		}
+		if (pETPANMsg->m_pString != NULL)
+		{
+			transaction.m_pData = pETPANMsg->m_pString->str;
+			transaction.m_dataLength = pETPANMsg->m_pString->len;
+		}
+		transaction.m_index = msgNum;
+
+		m_transactions.push_back(transaction);
+	}
+	if (m_transactions.empty() == true)
+	{
+		return true;
+	}
+
+	// Spread transactions over connections to the same server, as many as the session took
+	unsigned int connectionsCount = min((unsigned int)m_transactions.size(),
+		min(max(m_connectionsBudget, 1U), (unsigned int)MAX_CONNECTIONS_PER_BATCH));
+	struct sockaddr_storage address;
+	socklen_t addressLength = 0;
+	unsigned int pooledCount = 0;
+
+	m_pBatch = new ReactorBatch();
+	for (unsigned int connNum = 0; connNum < connectionsCount; ++connNum)
+	{
+		ReactorConnection *pConnection = new ReactorConnection(m_pBatch, m_hostName, m_port);
+		unsigned int msgsCount = 0;
+		bool isESMTP = false;
+
+		// Established connections go first
+		mailsmtp *pSession = acquireSession(isESMTP, msgsCount);
+		if (pSession != NULL)
+		{
+			bool hasPipelining = false;
+
+#ifdef HAVE_MAILSMTP_ESMTP_PIPELINING
+			hasPipelining = ((pSession->esmtp & MAILSMTP_ESMTP_PIPELINING) != 0);
+#endif
+			pConnection->adopt(mailstream_low_get_fd(mailstream_get_low(pSession->stream)),
+				isESMTP, ((pSession->esmtp & MAILSMTP_ESMTP_DSN) != 0),
+				hasPipelining, msgsCount);
+			++pooledCount;
+		}
+		// Resolve here, the reactor's loop mustn't block on it
+		else if ((addressLength > 0) ||
+			(resolveServer(address, addressLength) == true))
+		{
+			memcpy(&pConnection->m_address, &address, sizeof(struct sockaddr_storage));
+			pConnection->m_addressLength = addressLength;
+		}
+		if ((m_idleTimeout > 0) &&
+			(m_maxMsgsPerConnection > 0))
+		{
+			// Keep it for the next batch, unless it has had enough
+			pConnection->m_maxMsgsCount = m_maxMsgsPerConnection;
+		}
+
+		m_pBatch->m_connections.push_back(pConnection);
+		m_pooledSessions.push_back(pSession);
+	}
+	for (unsigned int transNum = 0; transNum < m_transactions.size(); ++transNum)
+	{
+		m_pBatch->m_connections[transNum % connectionsCount]->m_transactions.push_back(&m_transactions[transNum]);
+	}
+
+#ifdef DEBUG
+	clog << "ReactorProvider::startSession: " << m_transactions.size() << " messages over "
+		<< connectionsCount << " connections, " << pooledCount << " of them reused, "
+		<< pReactor->getConnectionsCount() << " connections in flight" << endl;
+#endif
+	if (pReactor->submit(m_pBatch) == false)
+	{
+		releaseBatch(false);
+		m_transactions.clear();
+		m_error = MAILSMTP_ERROR_STREAM;
+		return false;
+	}
+	m_error = MAILSMTP_NO_ERROR;
+
+	return true;
+}
+
+unsigned int ReactorProvider::getMaxPendingSessions(void) const
+{
+	if (usesReactor() == false)
+	{
+		return 1;
+	}
+
+	return MAX_PENDING_BATCHES;
+}
+
+bool ReactorProvider::finishSession(void)
+{
+	if (m_pBatch == NULL)
+	{
+		return true;
+	}
+
+	releaseBatch(true);
+
+	bool allStarted = true;
+
+	// Translate replies the way LibETPANProvider does
+	m_error = MAILSMTP_NO_ERROR;
+	for (vector<ReactorTransaction>::iterator transIter = m_transactions.begin();
+		transIter != m_transactions.end(); ++transIter)
+	{
+		LibETPANMessage *pETPANMsg = m_messages[transIter->m_index];
+
+		// Messages that weren't attempted may be retried with another server
+		if (transIter->m_started == false)
+		{
+			allStarted = false;
+			continue;
+		}
+		pETPANMsg->m_sent = true;
+
+		m_error = replyCodeToError(transIter->m_mailReply, 250);
+		if (m_error != MAILSMTP_NO_ERROR)
+		{
+			int statusCode = errorToStatusCode(m_error);
+
+			for (map<string, int>::iterator recipIter = pETPANMsg->m_recipients.begin();
+				recipIter != pETPANMsg->m_recipients.end(); ++recipIter)
+			{
+				recipIter->second = statusCode;
+			}
+			pETPANMsg->m_response = transIter->m_response;
+			continue;
+		}
+
+		unsigned int rcptNum = 0, successfulRecipients = 0;
+		for (map<string, int>::iterator recipIter = pETPANMsg->m_recipients.begin();
+			recipIter != pETPANMsg->m_recipients.end(); ++recipIter, ++rcptNum)
+		{
+			int rcptReply = 0;
+
+			if (rcptNum < transIter->m_rcptReplies.size())
+			{
+				rcptReply = transIter->m_rcptReplies[rcptNum];
+			}
+			m_error = replyCodeToError(rcptReply, 250);
+
+			int statusCode = errorToStatusCode(m_error);
+			if (statusCode <= 250)
+			{
+				++successfulRecipients;
+			}
+			else
+			{
+				// Update this failed recipient now
+				recipIter->second = statusCode;
+			}
+		}
+
+		if (successfulRecipients == 0)
+		{
+			continue;
+		}
+
+		if (pETPANMsg->m_pString != NULL)
+		{
+			if (transIter->m_dataReply == 354)
+			{
+				// The connection dropped before the end of data was acknowledged
+				m_error = MAILSMTP_ERROR_STREAM;
+			}
+			else
+			{
+				m_error = replyCodeToError(transIter->m_dataReply, 250);
+			}
+		}
+
+		int statusCode = errorToStatusCode(m_error);
+		for (map<string, int>::iterator recipIter = pETPANMsg->m_recipients.begin();
+			recipIter != pETPANMsg->m_recipients.end(); ++recipIter)
+		{
+			// Update those recipients that didn't fail earlier
+			if (recipIter->second == -1)
+			{
+				recipIter->second = statusCode;
+			}
+		}
+		pETPANMsg->m_response = transIter->m_response;
+#ifdef DEBUG
+		clog << "ReactorProvider::startSession: message status " << statusCode
+			<< "/" << m_error << ", response " << pETPANMsg->m_response << endl;
+#endif
+	}
+
+	m_transactions.clear();
+
+	if (allStarted == false)
+	{
+		// Let the session cycle to another server for the rest
+		m_error = MAILSMTP_ERROR_CONNECTION_REFUSED;
+		return false;
+	}
+
+	return true;
+}
+
+bool ReactorProvider::usesReactor(void) const
+{
+	// The reactor speaks neither TLS nor SASL
+	if ((m_authenticate == true) ||
+		(m_startTLS == true) ||
+		(SMTPReactor::getInstance() == NULL))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool ReactorProvider::resolveServer(struct sockaddr_storage &address,
+	socklen_t &addressLength) const
+{
+	struct addrinfo hints;
+	struct addrinfo *pResults = NULL;
+	stringstream portStr;
+
+	// Host names are normally addresses picked from A records
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	portStr << m_port;
+	if ((getaddrinfo(m_hostName.c_str(), portStr.str().c_str(), &hints, &pResults) != 0) ||
+		(pResults == NULL))
+	{
+		clog << "Couldn't resolve " << m_hostName << endl;
+		return false;
+	}
+
+	memcpy(&address, pResults->ai_addr, pResults->ai_addrlen);
+	addressLength = pResults->ai_addrlen;
+	freeaddrinfo(pResults);
+
+	return true;
+}
+
+mailsmtp *ReactorProvider::acquireSession(bool &isESMTP, unsigned int &msgsCount)
+{
+	if ((m_idleTimeout == 0) ||
+		(m_maxMsgsPerConnection == 0))
+	{
+		return NULL;
+	}
+
+	LibETPANSessionPool *pPool = LibETPANSessionPool::getInstance();
+	string serverKey(getServerKey());
+
+	mailsmtp *pSession = pPool->acquire(serverKey, m_idleTimeout, isESMTP, msgsCount);
+	while (pSession != NULL)
+	{
+		// RSET checks the server is still there, better here than in the reactor's loop
+		if ((pSession->stream != NULL) &&
+			(mailsmtp_reset(pSession) == MAILSMTP_NO_ERROR))
+		{
+			pPool->recordReused();
+
+			return pSession;
+		}
+
+		pPool->discard(pSession, true);
+		pSession = pPool->acquire(serverKey, m_idleTimeout, isESMTP, msgsCount);
+	}
+
+	return NULL;
+}
+
+void ReactorProvider::releaseConnection(ReactorConnection *pConnection, mailsmtp *pSession)
+{
+	LibETPANSessionPool *pPool = LibETPANSessionPool::getInstance();
+	bool isIdle = ((pConnection->m_state == ReactorConnection::IDLE) &&
+		(pConnection->m_socket >= 0));
+
+	if (pSession == NULL)
+	{
+		if (pConnection->m_connected == true)
+		{
+			pPool->recordOpened();
+		}
+		if (isIdle == false)
+		{
+			// Closed by the reactor already, or when the connection is deleted
+			return;
+		}
+
+		// Wrap the socket up so that it can be pooled
+		pSession = mailsmtp_new(0, NULL);
+		if (pSession != NULL)
+		{
+			pSession->stream = mailstream_socket_open(pConnection->m_socket);
+			if (pSession->stream == NULL)
+			{
+				mailsmtp_free(pSession);
+				pSession = NULL;
+			}
+		}
+		if (pSession == NULL)
+		{
+			pConnection->close();
+			return;
+		}
+		pConnection->m_ownsSocket = false;
+
+		pSession->esmtp = 0;
+		if (pConnection->m_isESMTP == true)
+		{
+			pSession->esmtp |= MAILSMTP_ESMTP;
+		}
+		if (pConnection->m_hasDSN == true)
+		{
+			pSession->esmtp |= MAILSMTP_ESMTP_DSN;
+		}
+#ifdef HAVE_MAILSMTP_ESMTP_PIPELINING
+		if (pConnection->m_hasPipelining == true)
+		{
+			pSession->esmtp |= MAILSMTP_ESMTP_PIPELINING;
+		}
+#endif
+	}
+
+	if (isIdle == true)
+	{
+		setBlocking(pConnection->m_socket);
+		// The session owns the socket now
+		pConnection->m_socket = -1;
+
+		pPool->release(getServerKey(), pSession, pConnection->m_isESMTP,
+			pConnection->m_msgsCount, m_idleTimeout);
+		return;
+	}
+
+	// Whatever happened to it, don't wait on the server to say goodbye
+	if (pSession->stream != NULL)
+	{
+		mailstream_close(pSession->stream);
+		pSession->stream = NULL;
+	}
+	pPool->discard(pSession, false);
+}
+
+void ReactorProvider::releaseBatch(bool wait)
+{
+	if (m_pBatch == NULL)
+	{
+		return;
+	}
+
+	if (wait == true)
+	{
+		m_pBatch->wait();
+	}
+
+	// Idle connections go back to the pool, others are closed
+	for (unsigned int connNum = 0; connNum < m_pBatch->m_connections.size(); ++connNum)
+	{
+		releaseConnection(m_pBatch->m_connections[connNum], m_pooledSessions[connNum]);
+	}
+	m_pooledSessions.clear();
+
+	delete m_pBatch;
+	m_pBatch = NULL;
+}
+#endif
@@ -0,0 +1,72 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _REACTORPROVIDER_H_
+#define _REACTORPROVIDER_H_
+
+#include <sys/socket.h>
+#include <vector>
+
+#include "LibETPANProvider.h"
+#include "SMTPReactor.h"
+
+/**
+  * A SMTP provider that builds messages with libetpan and hands their
+  * delivery to the shared epoll reactor, spreading each batch over
+  * several connections. Connections are taken from, and returned to,
+  * the libetpan session pool, and startSession() doesn't wait for
+  * the batch to be delivered.
+  */
+class ReactorProvider : public LibETPANProvider
+{
+	public:
+		ReactorProvider();
+		virtual ~ReactorProvider();
+
+		virtual unsigned int getMaxConnections(void) const;
+
+		virtual bool startSession(bool reset);
+
+		virtual unsigned int getMaxPendingSessions(void) const;
+
+		virtual bool finishSession(void);
+
+	protected:
+		ReactorBatch *m_pBatch;
+		std::vector<ReactorTransaction> m_transactions;
+		std::vector<mailsmtp*> m_pooledSessions;
+
+		bool usesReactor(void) const;
+
+		bool resolveServer(struct sockaddr_storage &address,
+			socklen_t &addressLength) const;
+
+		mailsmtp *acquireSession(bool &isESMTP, unsigned int &msgsCount);
+
+		void releaseConnection(ReactorConnection *pConnection, mailsmtp *pSession);
+
+		void releaseBatch(bool wait);
+
+	private:
+		ReactorProvider(const ReactorProvider &other);
+		ReactorProvider &operator=(const ReactorProvider &other);
+
+};
+
+#endif // _REACTORPROVIDER_H_
@@ -18,20 +18,206 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 #include <iostream>
+#include <sstream>
 #include <algorithm>
+#include <deque>
+#include <vector>
+#include <openssl/rand.h>
 
+#include "DNSCache.h"
 #include "Resolver.h"
 
+// Maximum number of queries in flight at once
+#define MAX_QUERIES_IN_FLIGHT 512
+// Queries sent from the same sockets, hence the same ports
+#define MAX_QUERIES_PER_BATCH 64
+// Milliseconds to wait for an answer before asking again
+#define QUERY_TIMEOUT 2000
+// Seconds names without records are remembered for, unless their zone says otherwise
+#define NEGATIVE_TTL 300
+// As recommended by RFC 2308
+#define MAX_NEGATIVE_TTL 10800
+
 using std::clog;
 using std::endl;
 using std::string;
 using std::set;
+using std::map;
+using std::deque;
+using std::vector;
+using std::stringstream;
 using std::max;
+using std::min;
+
+/// A query sent and not yet answered.
+class PendingQuery
+{
+	public:
+		PendingQuery() :
+			m_queryLength(0),
+			m_attempts(0),
+			m_deadline(0),
+			m_batchNum(0)
+		{
+		}
+
+		string m_name;
+		u_char m_query[NS_PACKETSZ];
+		int m_queryLength;
+		unsigned int m_attempts;
+		long long m_deadline;
+		unsigned int m_batchNum;
+
+};
+
+/// A name server, IPv4 or IPv6.
+class NameServer
+{
+	public:
+		NameServer() :
+			m_addressLength(0)
+		{
+			memset(&m_address, 0, sizeof(m_address));
+		}
+
+		bool isSameAddress(const struct sockaddr_storage &address) const
+		{
+			if (address.ss_family != m_address.ss_family)
+			{
+				return false;
+			}
+
+			if (address.ss_family == AF_INET6)
+			{
+				const struct sockaddr_in6 *pAddress = (const struct sockaddr_in6 *)&address;
+				const struct sockaddr_in6 *pServer = (const struct sockaddr_in6 *)&m_address;
+
+				return ((pAddress->sin6_port == pServer->sin6_port) &&
+					(memcmp(&pAddress->sin6_addr, &pServer->sin6_addr, sizeof(struct in6_addr)) == 0));
+			}
+
+			const struct sockaddr_in *pAddress = (const struct sockaddr_in *)&address;
+			const struct sockaddr_in *pServer = (const struct sockaddr_in *)&m_address;
+
+			return ((pAddress->sin_port == pServer->sin_port) &&
+				(pAddress->sin_addr.s_addr == pServer->sin_addr.s_addr));
+		}
+
+		struct sockaddr_storage m_address;
+		socklen_t m_addressLength;
+
+};
+
+/// Sockets a batch of queries is sent from, one per address family.
+class QueryBatch
+{
+	public:
+		QueryBatch() :
+			m_queriesCount(0),
+			m_pendingCount(0)
+		{
+			m_sockFds[0] = m_sockFds[1] = -1;
+		}
+
+		/// Returns the socket for that family, opening it with a port of its own the first time.
+		int getSocket(int family)
+		{
+			unsigned int familyNum = (family == AF_INET6 ? 1 : 0);
+
+			if (m_sockFds[familyNum] < 0)
+			{
+				m_sockFds[familyNum] = socket(family, SOCK_DGRAM, 0);
+				if (m_sockFds[familyNum] < 0)
+				{
+					clog << "Couldn't open socket for queries: " << strerror(errno) << endl;
+					return -1;
+				}
+				fcntl(m_sockFds[familyNum], F_SETFL, fcntl(m_sockFds[familyNum], F_GETFL) | O_NONBLOCK);
+			}
+
+			return m_sockFds[familyNum];
+		}
+
+		void close(void)
+		{
+			for (unsigned int familyNum = 0; familyNum < 2; ++familyNum)
+			{
+				if (m_sockFds[familyNum] >= 0)
+				{
+					::close(m_sockFds[familyNum]);
+					m_sockFds[familyNum] = -1;
+				}
+			}
+		}
+
+		int m_sockFds[2];
+		unsigned int m_queriesCount;
+		unsigned int m_pendingCount;
+
+};
+
+static long long getTimeInMs(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (long long)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static unsigned short getRandomId(void)
+{
+	unsigned short queryId = 0;
+
+	if (RAND_bytes((unsigned char *)&queryId, sizeof(queryId)) != 1)
+	{
+		queryId = (unsigned short)random();
+	}
+
+	return queryId;
+}
+
+static bool isSameName(const string &name1, const string &name2)
+{
+	string::size_type len1 = name1.length(), len2 = name2.length();
+
+	// Ignore the root
+	if ((len1 > 0) &&
+		(name1[len1 - 1] == '.'))
+	{
+		--len1;
+	}
+	if ((len2 > 0) &&
+		(name2[len2 - 1] == '.'))
+	{
+		--len2;
+	}
+
+	return ((len1 == len2) &&
+		(strncasecmp(name1.c_str(), name2.c_str(), len1) == 0));
+}
+
+static bool isIPAddress(const string &hostName)
+{
+	struct in6_addr address;
+
+	return ((inet_pton(AF_INET, hostName.c_str(), &address) == 1) ||
+		(inet_pton(AF_INET6, hostName.c_str(), &address) == 1));
+}
 
 static void addNameResourceRecords(const string &domainName, time_t queryTime,
 	ns_msg *pMsg, int type, ns_sect section, set<ResourceRecord> &servers)
@@ -86,7 +272,7 @@ static void addNameResourceRecords(const string &domainName, time_t queryTime,
 #endif
 
 		// Is this the type of record we are looking for ?
-		// We only support MX and A records for the time being
+		// We only support MX, A and AAAA records for the time being
 		if ((type == ns_t_mx) &&
 			(ns_rr_type(rr) == ns_t_mx))
 		{
@@ -99,12 +285,14 @@ static void addNameResourceRecords(const string &domainName, time_t queryTime,
 				continue;
 			}
 		}
-		else if ((type == ns_t_a) &&
-			(ns_rr_type(rr) == ns_t_a))
+		else if (((type == ns_t_a) &&
+			(ns_rr_type(rr) == ns_t_a)) ||
+			((type == ns_t_aaaa) &&
+			(ns_rr_type(rr) == ns_t_aaaa)))
 		{
 			if (sscanf(pRRBuffer, "%s %s %s %s %s", &domainStr, &ttlStr, &classStr, &typeStr, &hostStr) != 5)
 			{
-				clog << "Couldn't parse A RR" << endl;
+				clog << "Couldn't parse A/AAAA RR" << endl;
 
 				delete[] pRRBuffer;
 				continue;
@@ -152,6 +340,65 @@ static void addNameResourceRecords(const string &domainName, time_t queryTime,
 	}
 }
 
+// Returns false if the name server couldn't answer. Negative answers have no records.
+static bool parseAnswer(const string &domainName, int type, time_t queryTime,
+	const u_char *pAnswer, int answerLength, set<ResourceRecord> &servers,
+	time_t &expiryTime)
+{
+	ns_msg msg;
+
+	if (ns_initparse(pAnswer, answerLength, &msg) != 0)
+	{
+		return false;
+	}
+
+	int rcode = ns_msg_getflag(msg, ns_f_rcode);
+	if ((rcode != ns_r_noerror) &&
+		(rcode != ns_r_nxdomain))
+	{
+		return false;
+	}
+
+	if (rcode == ns_r_noerror)
+	{
+		addNameResourceRecords(domainName, queryTime, &msg, type, ns_s_an, servers);
+	}
+	if (servers.empty() == false)
+	{
+		// The answer is as good as its shortest lived record
+		expiryTime = servers.begin()->m_expiryTime;
+		for (set<ResourceRecord>::const_iterator recordIter = servers.begin();
+			recordIter != servers.end(); ++recordIter)
+		{
+			expiryTime = min(expiryTime, recordIter->m_expiryTime);
+		}
+
+		return true;
+	}
+
+	// The zone's SOA says how long the lack of records may be remembered
+	int negativeTtl = NEGATIVE_TTL;
+	int recordsCount = ns_msg_count(msg, ns_s_ns);
+	for (int recordNum = 0; recordNum < recordsCount; ++recordNum)
+	{
+		ns_rr rr;
+
+		if ((ns_parserr(&msg, ns_s_ns, recordNum, &rr) == 0) &&
+			(ns_rr_type(rr) == ns_t_soa) &&
+			(ns_rr_rdlen(rr) >= 5 * NS_INT32SZ))
+		{
+			// MINIMUM is the last field
+			int minimumTtl = (int)ns_get32(ns_rr_rdata(rr) + ns_rr_rdlen(rr) - NS_INT32SZ);
+
+			negativeTtl = min((int)ns_rr_ttl(rr), minimumTtl);
+			break;
+		}
+	}
+	expiryTime = queryTime + min(max(negativeTtl, 60), MAX_NEGATIVE_TTL);
+
+	return true;
+}
+
 ResourceRecord::ResourceRecord() :
 	m_priority(0),
 	m_ttl(60),
@@ -272,54 +519,437 @@ bool Resolver::queryARecords(const string &domainName,
 	return Resolver::queryRecords(domainName, ns_t_a, servers);
 }
 
+bool Resolver::queryAAAARecords(const string &domainName,
+	set<ResourceRecord> &servers)
+{
+	return Resolver::queryRecords(domainName, ns_t_aaaa, servers);
+}
+
 bool Resolver::queryRecords(const string &domainName, int type,
 	set<ResourceRecord> &servers)
 {
 	u_char nsBuffer[4096];
+	bool found = false;
 
 	if (domainName.empty() == true)
 	{
 		return false;
 	}
 
+	// Was this looked up recently, here or by another process ?
+	if (DNSCache::getInstance()->getAnswer(domainName, type, servers, found) == true)
+	{
+		return found;
+	}
+
 #ifdef DEBUG
 	_res.options |= RES_DEBUG;
 #endif
 	time_t timeNow = time(NULL);
+	u_char queryBuffer[NS_PACKETSZ];
+	int responseLength = -1;
 	// FIXME: broken name servers may return "No such name" for queries of class ns_c_any
-	int responseLength = res_query(domainName.c_str(), ns_c_in, type, nsBuffer, 4096);
+	// Unlike res_query(), res_send() returns negative answers, and their SOA
+	int queryLength = res_mkquery(ns_o_query, domainName.c_str(), ns_c_in, type,
+		NULL, 0, NULL, queryBuffer, NS_PACKETSZ);
+	if (queryLength > 0)
+	{
+		responseLength = res_send(queryBuffer, queryLength, nsBuffer, 4096);
+	}
 	if (responseLength < 0)
 	{
-		if (errno == 0)
-		{
-			clog << "No record of type " << type << " for " << domainName << endl;
-		}
-		else
-		{
 #ifdef HAVE_STRERROR_R
-			char errBuffer[1024];
+		char errBuffer[1024];
 
-			strerror_r(errno, errBuffer, 1024);
+		strerror_r(errno, errBuffer, 1024);
 #else
-			char *errBuffer = strerror(errno);
+		char *errBuffer = strerror(errno);
 #endif
-			clog << "Name query error " << errno << " on " << domainName << ": " << errBuffer << endl;
-		}
+		clog << "Name query error " << errno << " on " << domainName << ": " << errBuffer << endl;
 
 		return false;
 	}
 
-	ns_msg msg;
-
-	ns_initparse(nsBuffer, responseLength, &msg);
+	time_t expiryTime = 0;
 
 	// Parse the answer
-	addNameResourceRecords(domainName, timeNow, &msg, type, ns_s_an, servers);
-#if 0
-	// Parse the authority section 
-	addNameResourceRecords(domainName, timeNow, &msg, type, ns_s_ns, servers);
-#endif
+	if (parseAnswer(domainName, type, timeNow, nsBuffer, min(responseLength, 4096),
+		servers, expiryTime) == false)
+	{
+		clog << "Name server failure on " << domainName << ", type " << type << endl;
+
+		return false;
+	}
+	if (servers.empty() == true)
+	{
+		clog << "No record of type " << type << " for " << domainName << endl;
+	}
+	DNSCache::getInstance()->setAnswer(domainName, type, servers, expiryTime);
 
 	return !servers.empty();
 }
 
+void Resolver::prefetchRecords(const set<string> &domainNames,
+	bool fallbackToARecord)
+{
+	DNSCache *pCache = DNSCache::getInstance();
+	map<string, set<ResourceRecord> > mxAnswers, aAnswers, aaaaAnswers;
+	set<string> mxNames, aNames, aaaaNames;
+	unsigned int cachedCount = 0;
+
+	for (set<string>::const_iterator nameIter = domainNames.begin();
+		nameIter != domainNames.end(); ++nameIter)
+	{
+		set<ResourceRecord> servers;
+		bool found = false;
+
+		if ((nameIter->empty() == true) ||
+			(isIPAddress(*nameIter) == true))
+		{
+			continue;
+		}
+
+		// Only ask for what isn't cached yet
+		if (pCache->getAnswer(*nameIter, ns_t_mx, servers, found) == true)
+		{
+			mxAnswers[*nameIter] = servers;
+			++cachedCount;
+		}
+		else
+		{
+			mxNames.insert(*nameIter);
+		}
+	}
+	if ((mxAnswers.empty() == true) &&
+		(mxNames.empty() == true))
+	{
+		return;
+	}
+
+	size_t cachedMXCount = mxAnswers.size();
+
+	long long startTime = getTimeInMs();
+
+	queryAll(mxNames, ns_t_mx, mxAnswers);
+
+	// Then the IPv4 and IPv6 addresses of the servers
+	for (map<string, set<ResourceRecord> >::const_iterator answerIter = mxAnswers.begin();
+		answerIter != mxAnswers.end(); ++answerIter)
+	{
+		set<string> hostNames;
+
+		if (answerIter->second.empty() == false)
+		{
+			for (set<ResourceRecord>::const_iterator recordIter = answerIter->second.begin();
+				recordIter != answerIter->second.end(); ++recordIter)
+			{
+				if (isIPAddress(recordIter->m_hostName) == false)
+				{
+					hostNames.insert(recordIter->m_hostName);
+				}
+			}
+		}
+		else if (fallbackToARecord == true)
+		{
+			hostNames.insert(answerIter->first);
+		}
+
+		for (set<string>::const_iterator hostIter = hostNames.begin();
+			hostIter != hostNames.end(); ++hostIter)
+		{
+			set<ResourceRecord> addresses;
+			bool found = false;
+
+			if (pCache->getAnswer(*hostIter, ns_t_a, addresses, found) == true)
+			{
+				++cachedCount;
+			}
+			else
+			{
+				aNames.insert(*hostIter);
+			}
+			if (pCache->getAnswer(*hostIter, ns_t_aaaa, addresses, found) == true)
+			{
+				++cachedCount;
+			}
+			else
+			{
+				aaaaNames.insert(*hostIter);
+			}
+		}
+	}
+	queryAll(aNames, ns_t_a, aAnswers);
+	queryAll(aaaaNames, ns_t_aaaa, aaaaAnswers);
+
+	clog << "Prefetched " << mxAnswers.size() - cachedMXCount << "/" << mxNames.size()
+		<< " MX, " << aAnswers.size() << "/" << aNames.size() << " A and "
+		<< aaaaAnswers.size() << "/" << aaaaNames.size() << " AAAA answers in "
+		<< getTimeInMs() - startTime << " ms, " << cachedCount << " were cached" << endl;
+}
+
+void Resolver::queryAll(const set<string> &names, int type,
+	map<string, set<ResourceRecord> > &answers)
+{
+	struct __res_state resState;
+	vector<NameServer> servers;
+	map<unsigned int, QueryBatch> batches;
+	map<unsigned short, PendingQuery> inFlight;
+	deque<string> toSend(names.begin(), names.end());
+	unsigned int batchNum = 0;
+
+	if (names.empty() == true)
+	{
+		return;
+	}
+
+	memset(&resState, 0, sizeof(resState));
+	if (res_ninit(&resState) != 0)
+	{
+		clog << "Couldn't initialize resolver state" << endl;
+		return;
+	}
+
+	for (int nsNum = 0; nsNum < resState.nscount; ++nsNum)
+	{
+		NameServer server;
+
+#ifdef __GLIBC__
+		// glibc keeps IPv6 name servers aside
+		struct sockaddr_in6 *pIPv6Address = resState._u._ext.nsaddrs[nsNum];
+
+		if ((pIPv6Address != NULL) &&
+			(pIPv6Address->sin6_family == AF_INET6))
+		{
+			memcpy(&server.m_address, pIPv6Address, sizeof(struct sockaddr_in6));
+			server.m_addressLength = sizeof(struct sockaddr_in6);
+			servers.push_back(server);
+			continue;
+		}
+#endif
+		if (resState.nsaddr_list[nsNum].sin_family != AF_INET)
+		{
+			clog << "Skipping name server " << nsNum << " of unknown family" << endl;
+			continue;
+		}
+		memcpy(&server.m_address, &resState.nsaddr_list[nsNum], sizeof(struct sockaddr_in));
+		server.m_addressLength = sizeof(struct sockaddr_in);
+		servers.push_back(server);
+	}
+
+	unsigned int nsCount = (unsigned int)servers.size();
+	unsigned int maxAttempts = (unsigned int)max(resState.retry, 1) * max(nsCount, 1U);
+
+	if (nsCount == 0)
+	{
+		clog << "Couldn't set up asynchronous queries" << endl;
+		res_nclose(&resState);
+		return;
+	}
+
+	while ((toSend.empty() == false) ||
+		(inFlight.empty() == false))
+	{
+		long long timeNow = getTimeInMs();
+
+		// Keep the pipe full
+		while ((inFlight.size() < MAX_QUERIES_IN_FLIGHT) &&
+			(toSend.empty() == false))
+		{
+			PendingQuery query;
+
+			query.m_name = toSend.front();
+			toSend.pop_front();
+			query.m_queryLength = res_nmkquery(&resState, ns_o_query, query.m_name.c_str(),
+				ns_c_in, type, NULL, 0, NULL, query.m_query, NS_PACKETSZ);
+			if (query.m_queryLength < NS_HFIXEDSZ)
+			{
+				continue;
+			}
+
+			// Each batch of queries is sent from new sockets, hence new ports
+			if (batches[batchNum].m_queriesCount >= MAX_QUERIES_PER_BATCH)
+			{
+				++batchNum;
+			}
+			query.m_batchNum = batchNum;
+			++batches[batchNum].m_queriesCount;
+			++batches[batchNum].m_pendingCount;
+
+			// Don't make answers any easier to forge than they have to be
+			unsigned short queryId = getRandomId();
+			while (inFlight.find(queryId) != inFlight.end())
+			{
+				queryId = getRandomId();
+			}
+			query.m_query[0] = (u_char)(queryId >> 8);
+			query.m_query[1] = (u_char)(queryId & 0xff);
+			// Force the first send
+			query.m_deadline = timeNow;
+			inFlight[queryId] = query;
+		}
+
+		// (Re)send queries whose time is up, rotating through name servers
+		long long nextDeadline = timeNow + QUERY_TIMEOUT;
+		map<unsigned short, PendingQuery>::iterator queryIter = inFlight.begin();
+		while (queryIter != inFlight.end())
+		{
+			PendingQuery &query = queryIter->second;
+
+			if (query.m_deadline <= timeNow)
+			{
+				if (query.m_attempts >= maxAttempts)
+				{
+					clog << "No answer for " << query.m_name << ", type " << type << endl;
+
+					--batches[query.m_batchNum].m_pendingCount;
+					inFlight.erase(queryIter++);
+					continue;
+				}
+
+				const NameServer &server = servers[query.m_attempts % nsCount];
+				int sockFd = batches[query.m_batchNum].getSocket(server.m_address.ss_family);
+
+				if (sockFd >= 0)
+				{
+					sendto(sockFd, query.m_query, query.m_queryLength, 0,
+						(const struct sockaddr *)&server.m_address, server.m_addressLength);
+				}
+				++query.m_attempts;
+				query.m_deadline = timeNow + QUERY_TIMEOUT;
+			}
+			nextDeadline = min(nextDeadline, query.m_deadline);
+			++queryIter;
+		}
+
+		// Close the sockets of batches that were fully answered
+		vector<struct pollfd> pollFds;
+		map<unsigned int, QueryBatch>::iterator batchIter = batches.begin();
+		while (batchIter != batches.end())
+		{
+			if ((batchIter->second.m_pendingCount == 0) &&
+				(batchIter->first != batchNum))
+			{
+				batchIter->second.close();
+				batches.erase(batchIter++);
+				continue;
+			}
+
+			for (unsigned int familyNum = 0; familyNum < 2; ++familyNum)
+			{
+				struct pollfd pollFd;
+
+				pollFd.fd = batchIter->second.m_sockFds[familyNum];
+				pollFd.events = POLLIN;
+				pollFd.revents = 0;
+				if (pollFd.fd >= 0)
+				{
+					pollFds.push_back(pollFd);
+				}
+			}
+			++batchIter;
+		}
+		if ((inFlight.empty() == true) ||
+			(pollFds.empty() == true))
+		{
+			continue;
+		}
+
+		if (poll(&pollFds[0], pollFds.size(), (int)max(nextDeadline - timeNow, 1LL)) <= 0)
+		{
+			continue;
+		}
+
+		// Read all answers available
+		for (vector<struct pollfd>::const_iterator pollIter = pollFds.begin();
+			pollIter != pollFds.end(); ++pollIter)
+		{
+			if ((pollIter->revents & POLLIN) == 0)
+			{
+				continue;
+			}
+
+			u_char answer[4096];
+			struct sockaddr_storage fromAddress;
+			socklen_t fromLength = sizeof(fromAddress);
+			ssize_t answerLength = 0;
+			while ((answerLength = recvfrom(pollIter->fd, answer, sizeof(answer), 0,
+				(struct sockaddr *)&fromAddress, &fromLength)) > 0)
+			{
+				fromLength = sizeof(fromAddress);
+				if (answerLength < NS_HFIXEDSZ)
+				{
+					continue;
+				}
+
+				unsigned short answerId = (unsigned short)((answer[0] << 8) | answer[1]);
+				queryIter = inFlight.find(answerId);
+				if (queryIter == inFlight.end())
+				{
+					continue;
+				}
+
+				// Only trust name servers we asked, on the socket we asked them from
+				QueryBatch &batch = batches[queryIter->second.m_batchNum];
+				bool isServer = false;
+				if ((batch.m_sockFds[0] == pollIter->fd) ||
+					(batch.m_sockFds[1] == pollIter->fd))
+				{
+					for (vector<NameServer>::const_iterator serverIter = servers.begin();
+						serverIter != servers.end(); ++serverIter)
+					{
+						if (serverIter->isSameAddress(fromAddress) == true)
+						{
+							isServer = true;
+							break;
+						}
+					}
+				}
+
+				ns_msg msg;
+				ns_rr questionRR;
+				if ((isServer == false) ||
+					(ns_initparse(answer, (int)answerLength, &msg) != 0) ||
+					(ns_msg_count(msg, ns_s_qd) != 1) ||
+					(ns_parserr(&msg, ns_s_qd, 0, &questionRR) != 0) ||
+					(isSameName(ns_rr_name(questionRR), queryIter->second.m_name) == false))
+				{
+					continue;
+				}
+
+				PendingQuery &query = queryIter->second;
+				time_t queryTime = time(NULL);
+
+				if (ns_msg_getflag(msg, ns_f_tc) != 0)
+				{
+					// Leave truncated answers to the blocking resolver, which falls back to TCP
+					--batch.m_pendingCount;
+					inFlight.erase(queryIter);
+					continue;
+				}
+				set<ResourceRecord> records;
+				time_t expiryTime = 0;
+
+				if (parseAnswer(query.m_name, type, queryTime, answer, (int)answerLength,
+					records, expiryTime) == false)
+				{
+					// Ask the next name server now
+					query.m_deadline = 0;
+					continue;
+				}
+
+				answers[query.m_name] = records;
+				DNSCache::getInstance()->setAnswer(query.m_name, type, records, expiryTime);
+
+				--batch.m_pendingCount;
+				inFlight.erase(queryIter);
+			}
+		}
+	}
+
+	for (map<unsigned int, QueryBatch>::iterator batchIter = batches.begin();
+		batchIter != batches.end(); ++batchIter)
+	{
+		batchIter->second.close();
+	}
+	res_nclose(&resState);
+}
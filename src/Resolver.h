@@ -27,6 +27,7 @@
 #include <time.h>
 #include <string>
 #include <set>
+#include <map>
 #include <queue>
 
 /// Wraps information about RRs.
@@ -69,12 +70,32 @@ class Resolver
 		static bool queryARecords(const std::string &domainName,
 			std::set<ResourceRecord> &servers);
 
+		/// Queries the name server for the given FQDN, type AAAA.
+		static bool queryAAAARecords(const std::string &domainName,
+			std::set<ResourceRecord> &servers);
+
+		/**
+		  * Queries MX records of all domains in parallel, then A and AAAA records
+		  * of their servers, or of domains without MX records if fallbackToARecord
+		  * is true. Answers are kept in DNSCache until they expire, for
+		  * queryMXRecords(), queryARecords() and queryAAAARecords() to use.
+		  */
+		static void prefetchRecords(const std::set<std::string> &domainNames,
+			bool fallbackToARecord);
+
 	protected:
 		Resolver();
 
+		/**
+		  * Sends queries for all names without waiting for answers one by one.
+		  * Names that were answered, with or without records, are set in answers.
+		  */
+		static void queryAll(const std::set<std::string> &names, int type,
+			std::map<std::string, std::set<ResourceRecord> > &answers);
+
 		/**
 		  * Queries the name server for the FQDN of the specified type.
-		  * Type may be ns_t_mx, ns_t_a or any other type defined in arpa/nameser.h.
+		  * Type may be ns_t_mx, ns_t_a, ns_t_aaaa or any other type defined in arpa/nameser.h.
 		  */
 		static bool queryRecords(const std::string &domainName, int type,
 			std::set<ResourceRecord> &servers);
@@ -39,6 +39,7 @@ using std::pair;
 using std::string;
 using std::ofstream;
 using std::stringstream;
+using std::vector;
 
 SMTPHeader::SMTPHeader(const std::string &name, const std::string &value, const std::string &path) :
 	m_name(name),
@@ -131,7 +132,7 @@ void SMTPMessage::buildHeaders(void)
 		appendHeader("X-Complaints-To", m_complaints, "");
 	}
 
-	// All these headers are short so it should be okay to substitute their fields for each message
+	// These headers are compiled once per campaign
 	if (m_pDetails != NULL)
 	{
 		string suffix(m_msgIdSuffix);
@@ -139,12 +140,13 @@ void SMTPMessage::buildHeaders(void)
 		if (m_pDetails->m_subject.empty() == false)
 		{
 			appendHeader("Subject",
-				substitute(m_pDetails->m_subject, m_fieldValues), "");
+				m_pDetails->substituteHeader(MessageDetails::SUBJECT_HEADER, m_fieldValues), "");
 		}
 
 		if (m_pDetails->m_senderEmailAddress.empty() == false)
 		{
-			string senderEmailAddress(substitute(m_pDetails->m_senderEmailAddress, m_fieldValues));
+			string senderEmailAddress(m_pDetails->substituteHeader(MessageDetails::SENDER_HEADER,
+				m_fieldValues));
 			string::size_type atPos = senderEmailAddress.find('@');
 
 			if (atPos != string::npos)
@@ -167,18 +169,19 @@ void SMTPMessage::buildHeaders(void)
 
 		if (m_pDetails->m_fromEmailAddress.empty() == false)
 		{
-			m_smtpFrom = substitute(m_pDetails->m_fromEmailAddress, m_fieldValues);
+			m_smtpFrom = m_pDetails->substituteHeader(MessageDetails::FROM_ADDRESS_HEADER,
+				m_fieldValues);
 
 			appendHeader("From",
-				substitute(m_pDetails->m_fromName, m_fieldValues),
+				m_pDetails->substituteHeader(MessageDetails::FROM_NAME_HEADER, m_fieldValues),
 				m_smtpFrom);
 		}
 
 		if (m_pDetails->m_replyToEmailAddress.empty() == false)
 		{
 			appendHeader("Reply-To",
-				substitute(m_pDetails->m_replyToName, m_fieldValues),
-				substitute(m_pDetails->m_replyToEmailAddress, m_fieldValues));
+				m_pDetails->substituteHeader(MessageDetails::REPLY_TO_NAME_HEADER, m_fieldValues),
+				m_pDetails->substituteHeader(MessageDetails::REPLY_TO_ADDRESS_HEADER, m_fieldValues));
 		}
 	}
 }
@@ -305,6 +308,8 @@ bool SMTPMessage::setSignatureHeader(const string &header,
 	m_signatureHeader = header;
 	m_signatureHeader += ": ";
 	m_signatureHeader += value;
+	// Signatures are prepended
+	m_signatureHeaders.insert(m_signatureHeaders.begin(), m_signatureHeader);
 
 	return true;
 }
@@ -314,6 +319,17 @@ string SMTPMessage::getSignatureHeader(void) const
 	return m_signatureHeader;
 }
 
+const vector<string> &SMTPMessage::getSignatureHeaders(void) const
+{
+	return m_signatureHeaders;
+}
+
+void SMTPMessage::clearSignatureHeaders(void)
+{
+	m_signatureHeader.clear();
+	m_signatureHeaders.clear();
+}
+
 string SMTPMessage::substitute(const string &content,
 	const map<string, string> &fieldValues)
 {
@@ -383,6 +399,10 @@ string SMTPMessage::getReversePath(void) const
 	return reversePath;
 }
 
+void SMTPMessage::clearRecipients(void)
+{
+}
+
 void SMTPMessage::dumpToFile(const string &fileBaseName) const
 {
 	string msgFileName(fileBaseName);
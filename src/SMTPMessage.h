@@ -100,6 +100,12 @@ class SMTPMessage
 		/// Gets the signature header.
 		virtual std::string getSignatureHeader(void) const;
 
+		/// Gets all signature headers, topmost first.
+		const std::vector<std::string> &getSignatureHeaders(void) const;
+
+		/// Drops signature headers, before the message is signed again.
+		virtual void clearSignatureHeaders(void);
+
 		/// Substitutes any content for insertion into this message.
 		std::string substitute(const std::string &content,
 			const std::map<std::string, std::string> &fieldValues);
@@ -120,12 +126,16 @@ class SMTPMessage
 		/// Adds a recipient.
 		virtual void addRecipient(const std::string &emailAddress) = 0;
 
+		/// Forgets recipients, before the message is queued again.
+		virtual void clearRecipients(void);
+
 		/// Dumps plain and HTML parts to file.
 		void dumpToFile(const std::string &fileBaseName) const;
 
 	protected:
 		std::string m_reversePath;
 		std::string m_signatureHeader;
+		std::vector<std::string> m_signatureHeaders;
 		unsigned int m_subId;
 
 		void substituteContent(const std::map<std::string, std::string> &fieldValues);
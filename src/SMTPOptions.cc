@@ -25,7 +25,10 @@ using std::string;
 SMTPOptions::SMTPOptions() :
 	m_dsnNotify("NEVER"),
 	m_mailRelayPort(25),
-	m_mailRelayTLS(false)
+	m_mailRelayTLS(false),
+	m_connectionIdleTimeout(30),
+	m_maxMsgsPerConnection(100),
+	m_maxConnectionsPerServer(0)
 {
 }
 
@@ -39,7 +42,10 @@ SMTPOptions::SMTPOptions(const SMTPOptions &other) :
 	m_mailRelayUserName(other.m_mailRelayUserName),
 	m_mailRelayPassword(other.m_mailRelayPassword),
 	m_mailRelayTLS(other.m_mailRelayTLS),
-	m_dumpFileBaseName(other.m_dumpFileBaseName)
+	m_dumpFileBaseName(other.m_dumpFileBaseName),
+	m_connectionIdleTimeout(other.m_connectionIdleTimeout),
+	m_maxMsgsPerConnection(other.m_maxMsgsPerConnection),
+	m_maxConnectionsPerServer(other.m_maxConnectionsPerServer)
 {
 }
 
@@ -59,6 +65,9 @@ SMTPOptions &SMTPOptions::operator=(const SMTPOptions &other)
 	m_mailRelayPassword = other.m_mailRelayPassword;
 	m_mailRelayTLS = other.m_mailRelayTLS;
 	m_dumpFileBaseName = other.m_dumpFileBaseName;
+	m_connectionIdleTimeout = other.m_connectionIdleTimeout;
+	m_maxMsgsPerConnection = other.m_maxMsgsPerConnection;
+	m_maxConnectionsPerServer = other.m_maxConnectionsPerServer;
 
 	return *this;
 }
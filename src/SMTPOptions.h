@@ -43,6 +43,9 @@ class SMTPOptions
 		std::string m_mailRelayPassword;
 		bool m_mailRelayTLS;
 		std::string m_dumpFileBaseName;
+		unsigned int m_connectionIdleTimeout;
+		unsigned int m_maxMsgsPerConnection;
+		unsigned int m_maxConnectionsPerServer;
 
 };
 
@@ -27,6 +27,11 @@
 #include "config.h"
 #ifdef USE_LIBETPAN
 #include "LibETPANProvider.h"
+#include "LibETPANSessionPool.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include "ReactorProvider.h"
+#include "SMTPReactor.h"
+#endif
 #endif
 #ifdef USE_LIBESMTP
 #include "LibESMTPProvider.h"
@@ -36,8 +41,12 @@
 using std::clog;
 using std::endl;
 using std::string;
+using std::vector;
 
-SMTPProvider::SMTPProvider()
+SMTPProvider::SMTPProvider() :
+	m_idleTimeout(0),
+	m_maxMsgsPerConnection(0),
+	m_connectionsBudget(1)
 {
 }
 
@@ -54,6 +63,38 @@ void SMTPProvider::enableAuthentication(const string &authRealm,
 	m_authPassword = authPassword;
 }
 
+void SMTPProvider::enableSessionReuse(unsigned int idleTimeout,
+	unsigned int maxMsgsPerConnection)
+{
+	m_idleTimeout = idleTimeout;
+	m_maxMsgsPerConnection = maxMsgsPerConnection;
+}
+
+void SMTPProvider::setFallbackAddresses(const vector<string> &addresses)
+{
+	m_fallbackAddresses = addresses;
+}
+
+unsigned int SMTPProvider::getMaxConnections(void) const
+{
+	return 1;
+}
+
+void SMTPProvider::setConnectionsBudget(unsigned int connectionsCount)
+{
+	m_connectionsBudget = connectionsCount;
+}
+
+unsigned int SMTPProvider::getMaxPendingSessions(void) const
+{
+	return 1;
+}
+
+bool SMTPProvider::finishSession(void)
+{
+	return true;
+}
+
 string SMTPProvider::getAuthUserName(void) const
 {
 	return m_authUserName;
@@ -67,6 +108,16 @@ string SMTPProvider::getAuthPassword(void) const
 SMTPProvider *SMTPProviderFactory::getProvider(void)
 {
 #ifdef USE_LIBETPAN
+#ifdef HAVE_SYS_EPOLL_H
+	char *pEnvVar = getenv("GIVEMAIL_SMTP_REACTOR");
+
+	// This hands delivery over to the shared reactor
+	if ((pEnvVar != NULL) &&
+		(strncasecmp(pEnvVar, "Y", 1) == 0))
+	{
+		return new ReactorProvider();
+	}
+#endif
 	return new LibETPANProvider();
 #else
 #ifdef USE_LIBESMTP
@@ -78,3 +129,16 @@ SMTPProvider *SMTPProviderFactory::getProvider(void)
 	return NULL;
 }
 
+void SMTPProviderFactory::closeSessions(void)
+{
+#ifdef USE_LIBETPAN
+	LibETPANSessionPool *pPool = LibETPANSessionPool::getInstance();
+
+	pPool->closeIdle(0);
+	pPool->logStatistics();
+#ifdef HAVE_SYS_EPOLL_H
+	SMTPReactor::shutdown();
+#endif
+#endif
+}
+
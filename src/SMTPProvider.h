@@ -23,6 +23,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "MessageDetails.h"
 #include "StatusUpdater.h"
@@ -49,6 +50,13 @@ class SMTPProvider
 
 		virtual void enableStartTLS(void) = 0;
 
+		/**
+		  * Lets established sessions be reused for up to maxMsgsPerConnection messages,
+		  * provided they haven't been idle for more than idleTimeout seconds.
+		  */
+		virtual void enableSessionReuse(unsigned int idleTimeout,
+			unsigned int maxMsgsPerConnection);
+
 		std::string getAuthUserName(void) const;
 
 		std::string getAuthPassword(void) const;
@@ -58,6 +66,18 @@ class SMTPProvider
 		virtual bool setServer(const std::string &hostName,
 			unsigned int port) = 0;
 
+		/**
+		  * Sets other addresses of the server set with setServer(). Providers that
+		  * support it race connections to them, the first one to connect wins.
+		  */
+		virtual void setFallbackAddresses(const std::vector<std::string> &addresses);
+
+		/// Returns how many connections to the server startSession() would like to open.
+		virtual unsigned int getMaxConnections(void) const;
+
+		/// Sets how many connections to the server startSession() may open.
+		void setConnectionsBudget(unsigned int connectionsCount);
+
 		virtual SMTPMessage *newMessage(const std::map<std::string, std::string> &fieldValues,
 			MessageDetails *pDetails, SMTPMessage::DSNNotification dsnFlags,
 			bool enableMdn = false,
@@ -68,6 +88,15 @@ class SMTPProvider
 
 		virtual bool startSession(bool reset) = 0;
 
+		/**
+		  * Returns how many sessions startSession() may leave running at once,
+		  * 1 if it only returns once the session is over.
+		  */
+		virtual unsigned int getMaxPendingSessions(void) const;
+
+		/// Waits for the session left running by startSession() to be over.
+		virtual bool finishSession(void);
+
 		virtual void updateRecipientsStatus(StatusUpdater *pUpdater) = 0;
 
 		virtual int getCurrentError(void) = 0;
@@ -82,6 +111,10 @@ class SMTPProvider
 		std::string m_authRealm;
 		std::string m_authUserName;
 		std::string m_authPassword;
+		unsigned int m_idleTimeout;
+		unsigned int m_maxMsgsPerConnection;
+		std::vector<std::string> m_fallbackAddresses;
+		unsigned int m_connectionsBudget;
 
 	private:
 		SMTPProvider(const SMTPProvider &other);
@@ -95,6 +128,9 @@ class SMTPProviderFactory
 	public:
 		static SMTPProvider *getProvider(void);
 
+		/// Closes sessions kept open by providers, and stops the reactor.
+		static void closeSessions(void);
+
 	protected:
 		SMTPProviderFactory() { }
 		~SMTPProviderFactory() { }
@@ -0,0 +1,1025 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <iostream>
+
+#include "SMTPReactor.h"
+
+// Seconds to wait for a reply or for the socket to become writable
+#define REACTOR_TIMEOUT 300
+#define REACTOR_MAX_EVENTS 64
+
+using std::clog;
+using std::endl;
+using std::string;
+using std::vector;
+using std::deque;
+using std::set;
+
+static string getLocalHostName(void)
+{
+	char hostName[256];
+
+	if (gethostname(hostName, 256) != 0)
+	{
+		return "localhost";
+	}
+	hostName[255] = '\0';
+
+	return hostName;
+}
+
+static bool hasExtension(const string &ehloText, const string &extension)
+{
+	string::size_type startPos = 0, endPos = ehloText.find('\n');
+
+	// One extension per line, possibly followed by parameters
+	while (endPos != string::npos)
+	{
+		string line(ehloText.substr(startPos, endPos - startPos));
+
+		if ((strncasecmp(line.c_str(), extension.c_str(), extension.length()) == 0) &&
+			((line.length() == extension.length()) ||
+			(line[extension.length()] == ' ')))
+		{
+			return true;
+		}
+
+		startPos = endPos + 1;
+		endPos = ehloText.find('\n', startPos);
+	}
+
+	return false;
+}
+
+ReactorTransaction::ReactorTransaction() :
+	m_pData(NULL),
+	m_dataLength(0),
+	m_index(0),
+	m_started(false),
+	m_mailReply(0),
+	m_dataReply(0)
+{
+}
+
+ReactorTransaction::ReactorTransaction(const ReactorTransaction &other) :
+	m_reversePath(other.m_reversePath),
+	m_envId(other.m_envId),
+	m_notify(other.m_notify),
+	m_recipients(other.m_recipients),
+	m_pData(other.m_pData),
+	m_dataLength(other.m_dataLength),
+	m_index(other.m_index),
+	m_started(other.m_started),
+	m_mailReply(other.m_mailReply),
+	m_rcptReplies(other.m_rcptReplies),
+	m_dataReply(other.m_dataReply),
+	m_response(other.m_response)
+{
+}
+
+ReactorTransaction::~ReactorTransaction()
+{
+}
+
+ReactorTransaction &ReactorTransaction::operator=(const ReactorTransaction &other)
+{
+	if (this != &other)
+	{
+		m_reversePath = other.m_reversePath;
+		m_envId = other.m_envId;
+		m_notify = other.m_notify;
+		m_recipients = other.m_recipients;
+		m_pData = other.m_pData;
+		m_dataLength = other.m_dataLength;
+		m_index = other.m_index;
+		m_started = other.m_started;
+		m_mailReply = other.m_mailReply;
+		m_rcptReplies = other.m_rcptReplies;
+		m_dataReply = other.m_dataReply;
+		m_response = other.m_response;
+	}
+
+	return *this;
+}
+
+ReactorConnection::ReactorConnection(ReactorBatch *pBatch, const string &hostName,
+	unsigned int port) :
+	m_pBatch(pBatch),
+	m_hostName(hostName),
+	m_port(port),
+	m_addressLength(0),
+	m_socket(-1),
+	m_ownsSocket(true),
+	m_state(CLOSED),
+	m_connected(false),
+	m_isESMTP(false),
+	m_hasDSN(false),
+	m_hasPipelining(false),
+	m_msgsCount(0),
+	m_maxMsgsCount(0),
+	m_deadline(0),
+	m_outputOffset(0),
+	m_pCurrent(NULL),
+	m_rcptIndex(0),
+	m_isPipelined(false),
+	m_timeout(REACTOR_TIMEOUT)
+{
+	memset(&m_address, 0, sizeof(struct sockaddr_storage));
+}
+
+ReactorConnection::~ReactorConnection()
+{
+	close();
+}
+
+void ReactorConnection::adopt(int socket, bool isESMTP, bool hasDSN,
+	bool hasPipelining, unsigned int msgsCount)
+{
+	m_socket = socket;
+	m_ownsSocket = false;
+	m_isESMTP = isESMTP;
+	m_hasDSN = hasDSN;
+	m_hasPipelining = hasPipelining;
+	m_msgsCount = msgsCount;
+}
+
+bool ReactorConnection::open(unsigned int timeout)
+{
+	m_timeout = timeout;
+
+	if (m_socket >= 0)
+	{
+		int flags = fcntl(m_socket, F_GETFL, 0);
+
+		// Past EHLO already
+		if ((flags < 0) ||
+			(fcntl(m_socket, F_SETFL, flags | O_NONBLOCK) < 0))
+		{
+			close();
+			return false;
+		}
+		m_connected = true;
+		nextTransaction();
+
+		return true;
+	}
+
+	// The address was resolved by the caller, not to hold up other connections
+	if (m_addressLength == 0)
+	{
+		return false;
+	}
+
+	m_socket = socket(m_address.ss_family, SOCK_STREAM, 0);
+	if (m_socket < 0)
+	{
+		return false;
+	}
+	m_ownsSocket = true;
+
+	int flags = fcntl(m_socket, F_GETFL, 0);
+	if ((flags < 0) ||
+		(fcntl(m_socket, F_SETFL, flags | O_NONBLOCK) < 0))
+	{
+		close();
+		return false;
+	}
+
+	if ((connect(m_socket, (struct sockaddr *)&m_address, m_addressLength) < 0) &&
+		(errno != EINPROGRESS))
+	{
+#ifdef DEBUG
+		clog << "ReactorConnection::open: couldn't connect to " << m_hostName
+			<< ":" << m_port << ", error " << errno << endl;
+#endif
+		close();
+		return false;
+	}
+
+	m_state = CONNECTING;
+	m_deadline = time(NULL) + m_timeout;
+
+	return true;
+}
+
+bool ReactorConnection::checkConnected(void)
+{
+	int socketError = 0;
+	socklen_t errorLength = sizeof(socketError);
+
+	if ((getsockopt(m_socket, SOL_SOCKET, SO_ERROR, &socketError, &errorLength) < 0) ||
+		(socketError != 0))
+	{
+#ifdef DEBUG
+		clog << "ReactorConnection::checkConnected: couldn't connect to " << m_hostName
+			<< ":" << m_port << ", error " << socketError << endl;
+#endif
+		return false;
+	}
+
+	// Wait for the greeting
+	m_connected = true;
+	m_state = GREETING;
+	m_deadline = time(NULL) + m_timeout;
+
+	return true;
+}
+
+bool ReactorConnection::readInput(void)
+{
+	char buffer[4096];
+
+	while (true)
+	{
+		ssize_t bytesCount = recv(m_socket, buffer, 4096, 0);
+
+		if (bytesCount > 0)
+		{
+			m_input.append(buffer, bytesCount);
+			m_deadline = time(NULL) + m_timeout;
+		}
+		else if (bytesCount == 0)
+		{
+			// The server hung up
+			return false;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else
+		{
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+		}
+	}
+
+	return true;
+}
+
+bool ReactorConnection::writeOutput(void)
+{
+	while (m_outputOffset < m_output.length())
+	{
+		ssize_t bytesCount = ::send(m_socket, m_output.c_str() + m_outputOffset,
+			m_output.length() - m_outputOffset, MSG_NOSIGNAL);
+
+		if (bytesCount >= 0)
+		{
+			// Large messages take a while, what matters is that they go through
+			m_outputOffset += bytesCount;
+			m_deadline = time(NULL) + m_timeout;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else
+		{
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+		}
+	}
+
+	m_output.clear();
+	m_outputOffset = 0;
+
+	return true;
+}
+
+bool ReactorConnection::getReply(int &replyCode, string &replyText)
+{
+	string::size_type startPos = 0, endPos = m_input.find('\n');
+	string text;
+
+	while (endPos != string::npos)
+	{
+		string line(m_input.substr(startPos, endPos - startPos));
+
+		if ((line.empty() == false) &&
+			(line[line.length() - 1] == '\r'))
+		{
+			line.resize(line.length() - 1);
+		}
+		if (line.length() > 4)
+		{
+			text += line.substr(4);
+			text += "\n";
+		}
+
+		startPos = endPos + 1;
+
+		// Multi-line replies have a dash after the code
+		if ((line.length() < 4) ||
+			(line[3] != '-'))
+		{
+			replyCode = atoi(line.substr(0, 3).c_str());
+			replyText = text;
+			m_input.erase(0, startPos);
+
+			return true;
+		}
+
+		endPos = m_input.find('\n', startPos);
+	}
+
+	return false;
+}
+
+void ReactorConnection::send(const string &command, State nextState)
+{
+	m_output += command;
+	m_output += "\r\n";
+	m_state = nextState;
+	m_deadline = time(NULL) + m_timeout;
+}
+
+void ReactorConnection::sendData(void)
+{
+	const char *pData = m_pCurrent->m_pData;
+	size_t dataLength = m_pCurrent->m_dataLength;
+	bool lineStart = true;
+
+	// Transparency (RFC 5321 section 4.5.2) and CRLF line endings
+	m_output.reserve(m_output.length() + dataLength + dataLength / 64 + 5);
+	for (size_t pos = 0; pos < dataLength; ++pos)
+	{
+		char currentChar = pData[pos];
+
+		if ((lineStart == true) &&
+			(currentChar == '.'))
+		{
+			m_output += '.';
+		}
+
+		if (currentChar == '\n')
+		{
+			if ((pos == 0) ||
+				(pData[pos - 1] != '\r'))
+			{
+				m_output += '\r';
+			}
+			lineStart = true;
+		}
+		else
+		{
+			lineStart = false;
+		}
+		m_output += currentChar;
+	}
+	if (lineStart == false)
+	{
+		m_output += "\r\n";
+	}
+	m_output += ".\r\n";
+
+	m_state = BODY;
+	m_deadline = time(NULL) + m_timeout;
+}
+
+string ReactorConnection::getRecipientCommand(void) const
+{
+	string command("RCPT TO:<");
+
+	command += m_pCurrent->m_recipients[m_rcptIndex];
+	command += ">";
+	if ((m_hasDSN == true) &&
+		(m_pCurrent->m_notify.empty() == false))
+	{
+		command += " NOTIFY=";
+		command += m_pCurrent->m_notify;
+	}
+
+	return command;
+}
+
+bool ReactorConnection::hasAcceptedRecipient(void) const
+{
+	for (vector<int>::const_iterator replyIter = m_pCurrent->m_rcptReplies.begin();
+		replyIter != m_pCurrent->m_rcptReplies.end(); ++replyIter)
+	{
+		if ((*replyIter == 250) ||
+			(*replyIter == 251))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ReactorConnection::nextTransaction(void)
+{
+	m_pCurrent = NULL;
+
+	if (m_transactions.empty() == true)
+	{
+		if (m_msgsCount < m_maxMsgsCount)
+		{
+			// The caller may use it for another batch
+			m_state = IDLE;
+			return;
+		}
+
+		send("QUIT", QUIT);
+		return;
+	}
+
+	m_pCurrent = m_transactions.front();
+	m_transactions.pop_front();
+	m_pCurrent->m_started = true;
+	m_pCurrent->m_rcptReplies.resize(m_pCurrent->m_recipients.size(), 0);
+	m_rcptIndex = 0;
+	m_isPipelined = false;
+	++m_msgsCount;
+
+	string command("MAIL FROM:<");
+	command += m_pCurrent->m_reversePath;
+	command += ">";
+	if (m_hasDSN == true)
+	{
+		command += " RET=FULL";
+		if (m_pCurrent->m_envId.empty() == false)
+		{
+			command += " ENVID=";
+			command += m_pCurrent->m_envId;
+		}
+	}
+
+	if ((m_hasPipelining == true) &&
+		(m_pCurrent->m_recipients.empty() == false) &&
+		(m_pCurrent->m_pData != NULL))
+	{
+		// Send everything up to DATA in one go (RFC 2920), replies come in the same order
+		m_isPipelined = true;
+		m_output += command;
+		m_output += "\r\n";
+		for (m_rcptIndex = 0; m_rcptIndex < m_pCurrent->m_recipients.size(); ++m_rcptIndex)
+		{
+			m_output += getRecipientCommand();
+			m_output += "\r\n";
+		}
+		m_rcptIndex = 0;
+		command = "DATA";
+	}
+
+	send(command, MAIL);
+}
+
+void ReactorConnection::handleReply(int replyCode, const string &replyText)
+{
+	string command;
+
+#ifdef DEBUG
+	clog << "ReactorConnection::handleReply: " << m_hostName << " state "
+		<< m_state << ", reply " << replyCode << endl;
+#endif
+	if (m_pCurrent != NULL)
+	{
+		m_pCurrent->m_response = replyText;
+	}
+
+	// The server is going away
+	if ((replyCode == 421) &&
+		(m_state != QUIT))
+	{
+		close();
+		return;
+	}
+
+	switch (m_state)
+	{
+		case GREETING:
+			if (replyCode != 220)
+			{
+				send("QUIT", QUIT);
+				break;
+			}
+			send(string("EHLO ") + getLocalHostName(), EHLO);
+			break;
+		case EHLO:
+			if (replyCode != 250)
+			{
+				send(string("HELO ") + getLocalHostName(), HELO);
+				break;
+			}
+			m_isESMTP = true;
+			m_hasDSN = hasExtension(replyText, "DSN");
+			m_hasPipelining = hasExtension(replyText, "PIPELINING");
+			nextTransaction();
+			break;
+		case HELO:
+			if (replyCode != 250)
+			{
+				send("QUIT", QUIT);
+				break;
+			}
+			nextTransaction();
+			break;
+		case MAIL:
+			m_pCurrent->m_mailReply = replyCode;
+			if (m_isPipelined == true)
+			{
+				// Replies to RCPT and DATA were asked for already
+				m_state = RCPT;
+				break;
+			}
+			if ((replyCode != 250) ||
+				(m_pCurrent->m_recipients.empty() == true))
+			{
+				send("RSET", RSET);
+				break;
+			}
+			// Fall through to send the first recipient
+		case RCPT:
+			if (m_state == RCPT)
+			{
+				m_pCurrent->m_rcptReplies[m_rcptIndex] = replyCode;
+				++m_rcptIndex;
+			}
+			if (m_isPipelined == true)
+			{
+				if (m_rcptIndex >= m_pCurrent->m_recipients.size())
+				{
+					m_state = DATA;
+				}
+				break;
+			}
+			if (m_rcptIndex < m_pCurrent->m_recipients.size())
+			{
+				send(getRecipientCommand(), RCPT);
+			}
+			else if ((hasAcceptedRecipient() == true) &&
+				(m_pCurrent->m_pData != NULL))
+			{
+				send("DATA", DATA);
+			}
+			else
+			{
+				send("RSET", RSET);
+			}
+			break;
+		case DATA:
+			m_pCurrent->m_dataReply = replyCode;
+			if (replyCode != 354)
+			{
+				send("RSET", RSET);
+			}
+			else if (hasAcceptedRecipient() == true)
+			{
+				sendData();
+			}
+			else
+			{
+				// A pipelined DATA shouldn't have gone through, end it right away
+				send(".", BODY);
+			}
+			break;
+		case BODY:
+			m_pCurrent->m_dataReply = replyCode;
+			nextTransaction();
+			break;
+		case RSET:
+			if (replyCode != 250)
+			{
+				send("QUIT", QUIT);
+				break;
+			}
+			nextTransaction();
+			break;
+		case QUIT:
+		default:
+			close();
+			break;
+	}
+}
+
+void ReactorConnection::close(void)
+{
+	if (m_socket >= 0)
+	{
+		// Adopted sockets are closed by whoever lent them
+		if (m_ownsSocket == true)
+		{
+			::close(m_socket);
+		}
+		m_socket = -1;
+	}
+	m_state = CLOSED;
+	m_pCurrent = NULL;
+}
+
+ReactorBatch::ReactorBatch() :
+	m_pendingCount(0)
+{
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_cond, NULL);
+}
+
+ReactorBatch::~ReactorBatch()
+{
+	for (vector<ReactorConnection*>::iterator connIter = m_connections.begin();
+		connIter != m_connections.end(); ++connIter)
+	{
+		delete *connIter;
+	}
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+void ReactorBatch::connectionDone(void)
+{
+	pthread_mutex_lock(&m_mutex);
+	if (m_pendingCount > 0)
+	{
+		--m_pendingCount;
+	}
+	if (m_pendingCount == 0)
+	{
+		pthread_cond_signal(&m_cond);
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void ReactorBatch::wait(void)
+{
+	pthread_mutex_lock(&m_mutex);
+	while (m_pendingCount > 0)
+	{
+		pthread_cond_wait(&m_cond, &m_mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
+}
+
+SMTPReactor *SMTPReactor::m_pInstance = NULL;
+pthread_mutex_t SMTPReactor::m_instanceMutex = PTHREAD_MUTEX_INITIALIZER;
+
+SMTPReactor::SMTPReactor() :
+	m_epollFd(-1),
+	m_mustQuit(false),
+	m_timeout(REACTOR_TIMEOUT)
+{
+	m_wakeFds[0] = m_wakeFds[1] = -1;
+	pthread_mutex_init(&m_mutex, NULL);
+}
+
+SMTPReactor::~SMTPReactor()
+{
+	stop();
+	pthread_mutex_destroy(&m_mutex);
+}
+
+SMTPReactor *SMTPReactor::getInstance(void)
+{
+	pthread_mutex_lock(&m_instanceMutex);
+	if (m_pInstance == NULL)
+	{
+		m_pInstance = new SMTPReactor();
+		if (m_pInstance->start() == false)
+		{
+			clog << "Couldn't start the SMTP reactor" << endl;
+
+			delete m_pInstance;
+			m_pInstance = NULL;
+		}
+	}
+	pthread_mutex_unlock(&m_instanceMutex);
+
+	return m_pInstance;
+}
+
+void SMTPReactor::shutdown(void)
+{
+	pthread_mutex_lock(&m_instanceMutex);
+	if (m_pInstance != NULL)
+	{
+		delete m_pInstance;
+		m_pInstance = NULL;
+	}
+	pthread_mutex_unlock(&m_instanceMutex);
+}
+
+bool SMTPReactor::start(void)
+{
+	m_epollFd = epoll_create(REACTOR_MAX_EVENTS);
+	if (m_epollFd < 0)
+	{
+		return false;
+	}
+
+	// Submitters wake up the reactor through this pipe
+	if (pipe(m_wakeFds) != 0)
+	{
+		return false;
+	}
+	fcntl(m_wakeFds[0], F_SETFL, fcntl(m_wakeFds[0], F_GETFL, 0) | O_NONBLOCK);
+
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(struct epoll_event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFds[0], &event) != 0)
+	{
+		return false;
+	}
+
+	if (pthread_create(&m_threadId, NULL, threadFunc, (void*)this) != 0)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+void SMTPReactor::stop(void)
+{
+	if (m_wakeFds[1] >= 0)
+	{
+		pthread_mutex_lock(&m_mutex);
+		m_mustQuit = true;
+		pthread_mutex_unlock(&m_mutex);
+
+		if (write(m_wakeFds[1], "q", 1) == 1)
+		{
+			pthread_join(m_threadId, NULL);
+		}
+
+		::close(m_wakeFds[0]);
+		::close(m_wakeFds[1]);
+		m_wakeFds[0] = m_wakeFds[1] = -1;
+	}
+
+	if (m_epollFd >= 0)
+	{
+		::close(m_epollFd);
+		m_epollFd = -1;
+	}
+}
+
+void *SMTPReactor::threadFunc(void *pArg)
+{
+	SMTPReactor *pReactor = (SMTPReactor *)pArg;
+
+	if (pReactor != NULL)
+	{
+		pReactor->loop();
+	}
+
+	return NULL;
+}
+
+bool SMTPReactor::submit(ReactorBatch *pBatch)
+{
+	if (pBatch == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&pBatch->m_mutex);
+	pBatch->m_pendingCount = pBatch->m_connections.size();
+	pthread_mutex_unlock(&pBatch->m_mutex);
+	if (pBatch->m_connections.empty() == true)
+	{
+		return true;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	bool mustQuit = m_mustQuit;
+	if (mustQuit == false)
+	{
+		for (vector<ReactorConnection*>::iterator connIter = pBatch->m_connections.begin();
+			connIter != pBatch->m_connections.end(); ++connIter)
+		{
+			m_submitted.push_back(*connIter);
+		}
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	if (mustQuit == true)
+	{
+		return false;
+	}
+
+	// The loop picks up submitted connections at least once a second anyway
+	if (write(m_wakeFds[1], "s", 1) != 1)
+	{
+		clog << "Couldn't wake up the SMTP reactor" << endl;
+	}
+
+	return true;
+}
+
+unsigned int SMTPReactor::getConnectionsCount(void)
+{
+	unsigned int connectionsCount = 0;
+
+	pthread_mutex_lock(&m_mutex);
+	connectionsCount = m_connections.size() + m_submitted.size();
+	pthread_mutex_unlock(&m_mutex);
+
+	return connectionsCount;
+}
+
+void SMTPReactor::loop(void)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	bool mustQuit = false;
+
+	while (mustQuit == false)
+	{
+		int eventsCount = epoll_wait(m_epollFd, events, REACTOR_MAX_EVENTS, 1000);
+
+		if ((eventsCount < 0) &&
+			(errno != EINTR))
+		{
+			clog << "SMTP reactor failed with error " << errno << endl;
+			break;
+		}
+
+		for (int eventNum = 0; eventNum < eventsCount; ++eventNum)
+		{
+			ReactorConnection *pConnection = (ReactorConnection *)events[eventNum].data.ptr;
+
+			if (pConnection == NULL)
+			{
+				char buffer[64];
+
+				// Drain the wake-up pipe
+				while (read(m_wakeFds[0], buffer, 64) > 0);
+				continue;
+			}
+
+			handleEvents(pConnection, events[eventNum].events);
+		}
+		addSubmitted();
+
+		// Give up on connections that have been quiet for too long
+		time_t timeNow = time(NULL);
+		set<ReactorConnection*>::iterator connIter = m_connections.begin();
+		while (connIter != m_connections.end())
+		{
+			ReactorConnection *pConnection = *connIter;
+
+			++connIter;
+			if (pConnection->m_deadline < timeNow)
+			{
+				clog << "Timed out on " << pConnection->m_hostName << endl;
+
+				release(pConnection);
+			}
+		}
+
+		pthread_mutex_lock(&m_mutex);
+		mustQuit = m_mustQuit;
+		pthread_mutex_unlock(&m_mutex);
+	}
+
+	// Anything left is abandoned
+	addSubmitted();
+	while (m_connections.empty() == false)
+	{
+		release(*m_connections.begin());
+	}
+}
+
+void SMTPReactor::addSubmitted(void)
+{
+	deque<ReactorConnection*> submitted;
+
+	pthread_mutex_lock(&m_mutex);
+	submitted.swap(m_submitted);
+	pthread_mutex_unlock(&m_mutex);
+
+	for (deque<ReactorConnection*>::iterator connIter = submitted.begin();
+		connIter != submitted.end(); ++connIter)
+	{
+		ReactorConnection *pConnection = *connIter;
+
+		pthread_mutex_lock(&m_mutex);
+		m_connections.insert(pConnection);
+		pthread_mutex_unlock(&m_mutex);
+		if (pConnection->open(m_timeout) == false)
+		{
+			release(pConnection);
+			continue;
+		}
+
+		watch(pConnection, true);
+	}
+}
+
+void SMTPReactor::handleEvents(ReactorConnection *pConnection, unsigned int events)
+{
+	if (pConnection->m_state == ReactorConnection::CONNECTING)
+	{
+		if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+			(pConnection->checkConnected() == false))
+		{
+			release(pConnection);
+			return;
+		}
+	}
+	else if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+	{
+		int replyCode = 0;
+		string replyText;
+		bool readOk = pConnection->readInput();
+
+		// Process whatever came in before a possible hang up
+		while ((pConnection->m_state != ReactorConnection::IDLE) &&
+			(pConnection->m_state != ReactorConnection::CLOSED) &&
+			(pConnection->getReply(replyCode, replyText) == true))
+		{
+			pConnection->handleReply(replyCode, replyText);
+		}
+
+		if (readOk == false)
+		{
+			pConnection->close();
+		}
+		if ((pConnection->m_state == ReactorConnection::IDLE) ||
+			(pConnection->m_state == ReactorConnection::CLOSED))
+		{
+			release(pConnection);
+			return;
+		}
+	}
+
+	if (pConnection->writeOutput() == false)
+	{
+		release(pConnection);
+		return;
+	}
+
+	watch(pConnection, false);
+}
+
+void SMTPReactor::watch(ReactorConnection *pConnection, bool add)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(struct epoll_event));
+	event.events = EPOLLIN;
+	if ((pConnection->m_state == ReactorConnection::CONNECTING) ||
+		(pConnection->m_output.empty() == false))
+	{
+		event.events |= EPOLLOUT;
+	}
+	event.data.ptr = (void*)pConnection;
+
+	if (epoll_ctl(m_epollFd, (add == true ? EPOLL_CTL_ADD : EPOLL_CTL_MOD),
+		pConnection->m_socket, &event) != 0)
+	{
+		clog << "Couldn't watch connection to " << pConnection->m_hostName << endl;
+
+		release(pConnection);
+	}
+}
+
+void SMTPReactor::release(ReactorConnection *pConnection)
+{
+	if (pConnection->m_socket >= 0)
+	{
+		epoll_ctl(m_epollFd, EPOLL_CTL_DEL, pConnection->m_socket, NULL);
+	}
+	// Idle connections are left for the caller to reuse
+	if (pConnection->m_state != ReactorConnection::IDLE)
+	{
+		pConnection->close();
+	}
+
+	pthread_mutex_lock(&m_mutex);
+	m_connections.erase(pConnection);
+	pthread_mutex_unlock(&m_mutex);
+
+	// The caller may delete the connection as soon as this returns
+	pConnection->m_pBatch->connectionDone();
+}
+#endif
@@ -0,0 +1,234 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _SMTPREACTOR_H_
+#define _SMTPREACTOR_H_
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <string>
+#include <set>
+#include <vector>
+#include <deque>
+
+class ReactorBatch;
+
+/// A mail transaction, as seen by the reactor.
+class ReactorTransaction
+{
+	public:
+		ReactorTransaction();
+		ReactorTransaction(const ReactorTransaction &other);
+		virtual ~ReactorTransaction();
+
+		ReactorTransaction &operator=(const ReactorTransaction &other);
+
+		// Input
+		std::string m_reversePath;
+		std::string m_envId;
+		std::string m_notify;
+		std::vector<std::string> m_recipients;
+		const char *m_pData;
+		size_t m_dataLength;
+		unsigned int m_index;
+
+		// Output
+		bool m_started;
+		int m_mailReply;
+		std::vector<int> m_rcptReplies;
+		int m_dataReply;
+		std::string m_response;
+
+};
+
+/// One SMTP connection and its state machine.
+class ReactorConnection
+{
+	public:
+		typedef enum { CONNECTING = 0, GREETING, EHLO, HELO, MAIL, RCPT, DATA, BODY, RSET, QUIT, IDLE, CLOSED } State;
+
+		ReactorConnection(ReactorBatch *pBatch, const std::string &hostName,
+			unsigned int port);
+		virtual ~ReactorConnection();
+
+		ReactorBatch *m_pBatch;
+		std::string m_hostName;
+		unsigned int m_port;
+		std::deque<ReactorTransaction*> m_transactions;
+		struct sockaddr_storage m_address;
+		socklen_t m_addressLength;
+		int m_socket;
+		bool m_ownsSocket;
+		State m_state;
+		bool m_connected;
+		bool m_isESMTP;
+		bool m_hasDSN;
+		bool m_hasPipelining;
+		unsigned int m_msgsCount;
+		unsigned int m_maxMsgsCount;
+		time_t m_deadline;
+		std::string m_input;
+		std::string m_output;
+		size_t m_outputOffset;
+
+		/**
+		  * Takes over an established connection that's ready for a transaction.
+		  * The socket is left open when the connection is closed.
+		  */
+		void adopt(int socket, bool isESMTP, bool hasDSN,
+			bool hasPipelining, unsigned int msgsCount);
+
+		/**
+		  * Opens the socket to m_address and starts connecting, or starts
+		  * the first transaction if the connection was adopted.
+		  */
+		bool open(unsigned int timeout);
+
+		/// Called when the socket is writable while connecting.
+		bool checkConnected(void);
+
+		/// Reads what the server sent; returns false on error.
+		bool readInput(void);
+
+		/// Writes pending output; returns false on error.
+		bool writeOutput(void);
+
+		/// Extracts one complete reply from the input, if any.
+		bool getReply(int &replyCode, std::string &replyText);
+
+		/// Advances the state machine given a reply.
+		void handleReply(int replyCode, const std::string &replyText);
+
+		/// Closes the connection, leaving transactions as they are.
+		void close(void);
+
+	protected:
+		ReactorTransaction *m_pCurrent;
+		unsigned int m_rcptIndex;
+		bool m_isPipelined;
+		unsigned int m_timeout;
+
+		void send(const std::string &command, State nextState);
+
+		std::string getRecipientCommand(void) const;
+
+		bool hasAcceptedRecipient(void) const;
+
+		void sendData(void);
+
+		void nextTransaction(void);
+
+	private:
+		// ReactorConnection objects cannot be copied
+		ReactorConnection(const ReactorConnection &other);
+		ReactorConnection &operator=(const ReactorConnection &other);
+
+};
+
+/// A set of connections a caller waits on.
+class ReactorBatch
+{
+	public:
+		ReactorBatch();
+		virtual ~ReactorBatch();
+
+		/// Records a connection is done; wakes up the caller when all are.
+		void connectionDone(void);
+
+		/// Waits for all connections to be done.
+		void wait(void);
+
+		std::vector<ReactorConnection*> m_connections;
+
+	protected:
+		pthread_mutex_t m_mutex;
+		pthread_cond_t m_cond;
+		unsigned int m_pendingCount;
+
+		friend class SMTPReactor;
+
+	private:
+		// ReactorBatch objects cannot be copied
+		ReactorBatch(const ReactorBatch &other);
+		ReactorBatch &operator=(const ReactorBatch &other);
+
+};
+
+/**
+  * An epoll reactor that multiplexes SMTP connections on behalf of all
+  * worker threads. Callers submit batches of connections, and wait on each
+  * whenever they need its outcome. Connections that may carry more messages
+  * are left idle, rather than closed, once their transactions are done.
+  */
+class SMTPReactor
+{
+	public:
+		virtual ~SMTPReactor();
+
+		/// Returns the reactor, starting it if necessary.
+		static SMTPReactor *getInstance(void);
+
+		/// Stops the reactor if it was started.
+		static void shutdown(void);
+
+		/// Runs the batch's connections, without waiting for them to be done.
+		bool submit(ReactorBatch *pBatch);
+
+		/// Returns the number of connections in flight.
+		unsigned int getConnectionsCount(void);
+
+	protected:
+		static SMTPReactor *m_pInstance;
+		static pthread_mutex_t m_instanceMutex;
+		pthread_mutex_t m_mutex;
+		pthread_t m_threadId;
+		int m_epollFd;
+		int m_wakeFds[2];
+		bool m_mustQuit;
+		unsigned int m_timeout;
+		std::deque<ReactorConnection*> m_submitted;
+		std::set<ReactorConnection*> m_connections;
+
+		SMTPReactor();
+
+		bool start(void);
+
+		void stop(void);
+
+		static void *threadFunc(void *pArg);
+
+		void loop(void);
+
+		void addSubmitted(void);
+
+		void handleEvents(ReactorConnection *pConnection, unsigned int events);
+
+		void watch(ReactorConnection *pConnection, bool add);
+
+		void release(ReactorConnection *pConnection);
+
+	private:
+		// SMTPReactor objects cannot be copied
+		SMTPReactor(const SMTPReactor &other);
+		SMTPReactor &operator=(const SMTPReactor &other);
+
+};
+
+#endif // _SMTPREACTOR_H_
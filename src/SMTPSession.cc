@@ -23,35 +23,51 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
 
 #include "config.h"
+#include "ConnectionSemaphores.h"
+#include "ExchangerThrottle.h"
 #include "SMTPSession.h"
 #include "Timer.h"
 
 using std::clog;
 using std::endl;
+using std::deque;
 using std::map;
+using std::queue;
 using std::set;
 using std::string;
 using std::stringstream;
+using std::vector;
 using std::min;
 
 static bool isIPAddress(const string &hostName)
 {
+	struct in6_addr address;
+
 	// Is the domain really a domain ?
-	for (string::size_type i = 0; i < hostName.length(); ++i)
-	{
-		if ((isdigit(hostName[i]) == 0) &&
-			(hostName[i] != '.'))
-		{
-			return false;
-		}
-	}
+	return ((inet_pton(AF_INET, hostName.c_str(), &address) == 1) ||
+		(inet_pton(AF_INET6, hostName.c_str(), &address) == 1));
+}
 
-	return true;
+PendingBatch::PendingBatch(SMTPProvider *pProvider, const string &address,
+	unsigned int msgsCount, off_t msgsDataSize,
+	const Timer &sessionTimer) :
+	m_pProvider(pProvider),
+	m_address(address),
+	m_msgsCount(msgsCount),
+	m_msgsDataSize(msgsDataSize),
+	m_sessionTimer(sessionTimer)
+{
+}
+
+PendingBatch::~PendingBatch()
+{
 }
 
 pthread_mutex_t SMTPSession::m_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -60,6 +76,8 @@ SMTPSession::SMTPSession(const DomainLimits &domainLimits,
 	const SMTPOptions &options) :
 	m_domainLimits(domainLimits),
 	m_options(options),
+	m_exchanger(ExchangerThrottle::getExchangerName(domainLimits.m_domainName, domainLimits.m_mxRecords)),
+	m_batchSize(ExchangerThrottle::getInstance()->getBatchSize(m_exchanger, domainLimits.m_maxMsgsPerServer)),
 	m_msgsCount(0),
 	m_msgsDataSize(0),
 	m_pProvider(SMTPProviderFactory::getProvider()),
@@ -99,6 +117,8 @@ SMTPSession::SMTPSession(const DomainLimits &domainLimits,
 
 SMTPSession::~SMTPSession()
 {
+	finishPendingBatches(NULL, 0);
+	releaseConnection();
 	destroySession();
 	if (m_pProvider != NULL)
 	{
@@ -174,6 +194,8 @@ bool SMTPSession::createSession(void)
 		{
 			m_pProvider->enableStartTLS();
 		}
+		m_pProvider->enableSessionReuse(m_options.m_connectionIdleTimeout,
+			m_options.m_maxMsgsPerConnection);
 	}
 
 	return true;
@@ -189,7 +211,7 @@ void SMTPSession::destroySession(void)
 
 bool SMTPSession::initializeAddresses(ResourceRecord &mxRecord)
 {
-	set<ResourceRecord> aRecords;
+	set<ResourceRecord> aRecords, aaaaRecords;
 
 	if (isIPAddress(mxRecord.m_hostName) == true)
 	{
@@ -198,9 +220,16 @@ bool SMTPSession::initializeAddresses(ResourceRecord &mxRecord)
 
 		aRecords.insert(aRecord);
 	}
-	else if (Resolver::queryARecords(mxRecord.m_hostName, aRecords) == false)
+	else
 	{
-		return false;
+		bool hasIPv4 = Resolver::queryARecords(mxRecord.m_hostName, aRecords);
+		bool hasIPv6 = Resolver::queryAAAARecords(mxRecord.m_hostName, aaaaRecords);
+
+		if ((hasIPv4 == false) &&
+			(hasIPv6 == false))
+		{
+			return false;
+		}
 	}
 
 	// Empty the list of A records
@@ -209,16 +238,23 @@ bool SMTPSession::initializeAddresses(ResourceRecord &mxRecord)
 		mxRecord.m_addresses.pop();
 	}
 
-	for (set<ResourceRecord>::const_iterator addressIter = aRecords.begin();
-		addressIter != aRecords.end(); ++addressIter)
+	// IPv4 addresses first, since not all providers can connect to IPv6 ones
+	// Those that race connections reorder addresses themselves
+	for (unsigned int familyNum = 0; familyNum < 2; ++familyNum)
 	{
-		// Don't put discarded records back in
-		if (isDiscarded(*addressIter) == false)
+		const set<ResourceRecord> &records = (familyNum == 0 ? aRecords : aaaaRecords);
+
+		for (set<ResourceRecord>::const_iterator recordIter = records.begin();
+			recordIter != records.end(); ++recordIter)
 		{
-			clog << "Host " << mxRecord.m_hostName
-				<< " has IP address " << addressIter->m_hostName << endl;
+			// Don't put discarded records back in
+			if (isDiscarded(*recordIter) == false)
+			{
+				clog << "Host " << mxRecord.m_hostName
+					<< " has IP address " << recordIter->m_hostName << endl;
 
-			mxRecord.m_addresses.push(*addressIter);
+				mxRecord.m_addresses.push(*recordIter);
+			}
 		}
 	}
 
@@ -394,6 +430,23 @@ bool SMTPSession::setServer(ResourceRecord &mxRecord)
 		clog << "Set server for " << m_domainLimits.m_domainName << " to "
 			<< frontRecord.m_hostName << ":" << port << endl;
 
+		// The other addresses of this server can be raced against this one
+		vector<string> fallbackAddresses;
+		queue<ResourceRecord> otherRecords(mxRecord.m_addresses);
+		while (otherRecords.empty() == false)
+		{
+			const ResourceRecord &otherRecord = otherRecords.front();
+
+			if ((otherRecord.m_hostName != frontRecord.m_hostName) &&
+				(isDiscarded(otherRecord) == false) &&
+				(otherRecord.hasExpired(timeNow) == false))
+			{
+				fallbackAddresses.push_back(otherRecord.m_hostName);
+			}
+			otherRecords.pop();
+		}
+		m_pProvider->setFallbackAddresses(fallbackAddresses);
+
 		// Push it back
 		mxRecord.m_addresses.push(frontRecord);
 
@@ -403,24 +456,119 @@ bool SMTPSession::setServer(ResourceRecord &mxRecord)
 	return false;
 }
 
-void SMTPSession::discardCurrentServer(void)
+string SMTPSession::getCurrentAddress(void) const
 {
 	if (m_topQueue.empty() == true)
 	{
-		return;
+		return "";
 	}
 
 	// Currently-used records were pushed to the back of their respective queues
-	ResourceRecord currentMXRecord(m_topQueue.back());
-	if (currentMXRecord.m_addresses.empty() == false)
+	const ResourceRecord &currentMXRecord = m_topQueue.back();
+	if (currentMXRecord.m_addresses.empty() == true)
 	{
-		ResourceRecord &currentARecord = currentMXRecord.m_addresses.back();
+		return "";
+	}
 
-		clog << "Discarding " << currentARecord.m_hostName << endl;
+	return currentMXRecord.m_addresses.back().m_hostName;
+}
 
-		// Discard this particular A record
-		m_discarded.insert(currentARecord.m_hostName);
+void SMTPSession::discardServer(const string &address)
+{
+	if (address.empty() == true)
+	{
+		return;
 	}
+
+	clog << "Discarding " << address << endl;
+
+	// Discard this particular A record
+	m_discarded.insert(address);
+}
+
+bool SMTPSession::acquireConnection(StatusUpdater *pUpdater)
+{
+	unsigned int maxConnections = m_options.m_maxConnectionsPerServer;
+	unsigned int wantedCount = m_pProvider->getMaxConnections();
+
+	m_pProvider->setConnectionsBudget(wantedCount);
+	if ((maxConnections == 0) ||
+		(m_topQueue.empty() == true))
+	{
+		return true;
+	}
+
+	// The current MX record was pushed to the back of the queue
+	string serverName(m_topQueue.back().m_hostName);
+	ConnectionSemaphores *pSemaphores = ConnectionSemaphores::getInstance();
+	int connectionHandle = -1;
+	bool isWaiting = false, pendingOk = true;
+
+	// Other threads and slaves will let go eventually
+	while (pSemaphores->tryAcquire(serverName, maxConnections, connectionHandle) == false)
+	{
+		// Our own batches may be holding the connections, wrap up the oldest one
+		if (m_pendingBatches.empty() == false)
+		{
+			PendingBatch *pBatch = m_pendingBatches.front();
+
+			m_pendingBatches.pop_front();
+			if (m_mutexSessions == true)
+			{
+				pthread_mutex_unlock(&m_mutex);
+			}
+			if (finishBatch(pBatch, pUpdater, true) == false)
+			{
+				pendingOk = false;
+			}
+			if (m_mutexSessions == true)
+			{
+				pthread_mutex_lock(&m_mutex);
+			}
+			continue;
+		}
+
+		if (isWaiting == false)
+		{
+			clog << "Waiting for one of " << maxConnections << " connections to "
+				<< serverName << endl;
+			isWaiting = true;
+		}
+
+		// Don't hold up other sessions meanwhile
+		if (m_mutexSessions == true)
+		{
+			pthread_mutex_unlock(&m_mutex);
+		}
+		usleep(100000);
+		if (m_mutexSessions == true)
+		{
+			pthread_mutex_lock(&m_mutex);
+		}
+	}
+	m_connectionHandles.push_back(connectionHandle);
+
+	// Each extra connection the provider opens needs its own, but don't wait for those
+	while ((m_connectionHandles.size() < wantedCount) &&
+		(pSemaphores->tryAcquire(serverName, maxConnections, connectionHandle) == true))
+	{
+		m_connectionHandles.push_back(connectionHandle);
+	}
+	m_pProvider->setConnectionsBudget((unsigned int)m_connectionHandles.size());
+
+	return pendingOk;
+}
+
+void SMTPSession::releaseConnection(void)
+{
+	ConnectionSemaphores *pSemaphores = ConnectionSemaphores::getInstance();
+
+	for (vector<int>::const_iterator handleIter = m_connectionHandles.begin();
+		handleIter != m_connectionHandles.end(); ++handleIter)
+	{
+		pSemaphores->release(*handleIter);
+	}
+	m_connectionHandles.clear();
 }
 
 bool SMTPSession::isDiscarded(const ResourceRecord &aRecord)
@@ -476,12 +624,11 @@ bool SMTPSession::queueMessage(SMTPMessage *pMsg,
 		setRecipientSpecificHeaders = false;
 	}
 
-	m_pProvider->queueMessage(pMsg);
-
 #ifdef DEBUG
 	clog << "SMTPSession::queueMessage: " << recipients.size() << " recipients" << endl;
 #endif
 	map<string, Recipient>::const_iterator recipIter = recipients.begin();
+	bool isQueued = false;
 	while (recipIter != recipients.end())
 	{
 		string toHeader;
@@ -489,6 +636,13 @@ bool SMTPSession::queueMessage(SMTPMessage *pMsg,
 		string dsnEnvId;
 		string unsubscribeLink;
 
+		// Each batch has its own provider session
+		if (isQueued == false)
+		{
+			m_pProvider->queueMessage(pMsg);
+			isQueued = true;
+		}
+
 		if ((setRecipientSpecificHeaders == true) &&
 			(pMsg->m_pDetails != NULL))
 		{
@@ -507,7 +661,7 @@ bool SMTPSession::queueMessage(SMTPMessage *pMsg,
 		}
 
 		// Add as many recipients as allowed
-		while ((m_msgsCount < m_domainLimits.m_maxMsgsPerServer) && (recipIter != recipients.end()))
+		while ((m_msgsCount < m_batchSize) && (recipIter != recipients.end()))
 		{
 			string name(recipIter->second.m_name), emailAddress(recipIter->second.m_emailAddress);
 			Recipient::RecipientType type(recipIter->second.m_type);
@@ -647,6 +801,18 @@ bool SMTPSession::queueMessage(SMTPMessage *pMsg,
 				break;
 			}
 		}
+
+		if (recipIter != recipients.end())
+		{
+			// The next batch rebuilds this message, earlier ones must be done with it
+			if (finishPendingBatches(pUpdater, 0) == false)
+			{
+				serverOk = false;
+				break;
+			}
+			pMsg->clearRecipients();
+			isQueued = false;
+		}
 	}
 
 	return serverOk;
@@ -654,23 +820,26 @@ bool SMTPSession::queueMessage(SMTPMessage *pMsg,
 
 bool SMTPSession::dispatchMessages(StatusUpdater *pUpdater, bool force)
 {
-	bool serverOk = true;
-
 	if ((m_pProvider == NULL) ||
 		(m_msgsCount == 0))
 	{
-		// No message queued
+		// No message queued, but earlier batches may still be under way
+		if (force == true)
+		{
+			return finishPendingBatches(pUpdater, 0);
+		}
+
 		return true;
 	}
 
 	// Do we have to send messages now ?
-	if ((m_msgsCount < m_domainLimits.m_maxMsgsPerServer) &&
+	if ((m_msgsCount < m_batchSize) &&
 		(force == false))
 	{
 		// No, we don't
 #ifdef DEBUG
 		clog << "SMTPSession::dispatchMessages: post-poned sending ("
-			<< m_msgsCount << "/" << m_domainLimits.m_maxMsgsPerServer << ")" << endl;
+			<< m_msgsCount << "/" << m_batchSize << ")" << endl;
 #endif
 		return true;
 	}
@@ -691,17 +860,86 @@ bool SMTPSession::dispatchMessages(StatusUpdater *pUpdater, bool force)
 	clog << "SMTPSession::dispatchMessages: sending " << m_msgsCount << " messages" << endl;
 #endif
 	Timer sessionTimer;
+	bool serverOk = true, pendingOk = true;
 	if (m_mutexSessions == true)
 	{
 		pthread_mutex_lock(&m_mutex);
 	}
+	pendingOk = acquireConnection(pUpdater);
+	// Time spent waiting doesn't tell how fast the server is
+	sessionTimer.start();
 	if (m_pProvider->startSession(false) == false)
 	{
 		recordError();
 		serverOk = false;
 	}
+	if (m_mutexSessions == true)
+	{
+		pthread_mutex_unlock(&m_mutex);
+	}
+
+	PendingBatch *pBatch = new PendingBatch(m_pProvider, getCurrentAddress(),
+		m_msgsCount, m_msgsDataSize, sessionTimer);
+	unsigned int maxPendingCount = m_pProvider->getMaxPendingSessions();
+
+	pBatch->m_connectionHandles.swap(m_connectionHandles);
+	m_msgsCount = 0;
+	m_msgsDataSize = 0;
+	if ((serverOk == false) ||
+		(maxPendingCount <= 1))
+	{
+		// Wrap it up now
+		if (finishBatch(pBatch, pUpdater, serverOk) == false)
+		{
+			return false;
+		}
+
+		return pendingOk;
+	}
+
+	// The provider carries on with this batch while another one takes the next
+	m_pendingBatches.push_back(pBatch);
+	m_pProvider = SMTPProviderFactory::getProvider();
+	if (createSession() == false)
+	{
+		serverOk = false;
+	}
+
+	if ((finishPendingBatches(pUpdater, (force == true) ? 0 : maxPendingCount - 1) == false) ||
+		(pendingOk == false))
+	{
+		serverOk = false;
+	}
+
+	return serverOk;
+}
+
+bool SMTPSession::finishBatch(PendingBatch *pBatch, StatusUpdater *pUpdater,
+	bool serverOk)
+{
+	SMTPProvider *pCurrentProvider = m_pProvider;
+	bool isPending = (pBatch->m_pProvider != m_pProvider), pendingOk = true;
+
+	// What follows works on the current provider and connections, make them the batch's
+	m_pProvider = pBatch->m_pProvider;
+	m_connectionHandles.swap(pBatch->m_connectionHandles);
+	if (isPending == true)
+	{
+		recordError(true);
+	}
+
+	if (m_mutexSessions == true)
+	{
+		pthread_mutex_lock(&m_mutex);
+	}
+	if ((serverOk == true) &&
+		(m_pProvider->finishSession() == false))
+	{
+		recordError();
+		serverOk = false;
+	}
 #ifdef DEBUG
-	clog << "SMTPSession::dispatchMessages: sent " << m_msgsCount << " messages" << endl;
+	clog << "SMTPSession::finishBatch: sent " << pBatch->m_msgsCount << " messages" << endl;
 #endif
 	// Did some kind of connection error occur ?
 	// FIXME: this is hacky
@@ -709,12 +947,15 @@ bool SMTPSession::dispatchMessages(StatusUpdater *pUpdater, bool force)
 		(m_errorMsg.find("onnect") != string::npos))
 	{
 		// Try again with another server
-		discardCurrentServer();
+		discardServer(pBatch->m_address);
+		releaseConnection();
 
 		serverOk = cycleServers();
 		if (serverOk == true)
 		{
-			if (m_pProvider->startSession(true) == false)
+			pendingOk = acquireConnection(pUpdater);
+			if ((m_pProvider->startSession(true) == false) ||
+				(m_pProvider->finishSession() == false))
 			{
 				recordError();
 			}
@@ -730,8 +971,8 @@ bool SMTPSession::dispatchMessages(StatusUpdater *pUpdater, bool force)
 		pthread_mutex_unlock(&m_mutex);
 	}
 
-	suseconds_t sessionMilliSecs = sessionTimer.stop();
-	clog << "Sent " << m_msgsCount << " messages (" << m_msgsDataSize
+	suseconds_t sessionMilliSecs = pBatch->m_sessionTimer.stop();
+	clog << "Sent " << pBatch->m_msgsCount << " messages (" << pBatch->m_msgsDataSize
 		<< " bytes) to " << m_domainLimits.m_domainName
 		<< " in " << sessionMilliSecs / 1000 << " seconds: ";
 	if (sessionMilliSecs == 0)
@@ -740,25 +981,64 @@ bool SMTPSession::dispatchMessages(StatusUpdater *pUpdater, bool force)
 	}
 	else
 	{
-		clog << ((m_msgsDataSize * 1000) / (1024 * sessionMilliSecs)) << " kb/s" << endl;
+		clog << ((pBatch->m_msgsDataSize * 1000) / (1024 * sessionMilliSecs)) << " kb/s" << endl;
 	}
 
+	unsigned int acceptedCount = 0, deferredCount = pBatch->m_msgsCount;
 	if (serverOk == true)
 	{
-		sessionTimer.start();
+		unsigned int previousAcceptedCount = 0, previousDeferredCount = 0;
+		Timer statusTimer;
+
+		if (pUpdater != NULL)
+		{
+			pUpdater->getRepliesCount(previousAcceptedCount, previousDeferredCount);
+		}
+
+		statusTimer.start();
 
 		m_pProvider->updateRecipientsStatus(pUpdater);
 
-		clog << "Enumerated " << m_msgsCount << " messages in "
-			<< sessionTimer.stop() / 1000 << " seconds" << endl;
+		clog << "Enumerated " << pBatch->m_msgsCount << " messages in "
+			<< statusTimer.stop() / 1000 << " seconds" << endl;
+
+		deferredCount = 0;
+		if (pUpdater != NULL)
+		{
+			pUpdater->getRepliesCount(acceptedCount, deferredCount);
+			acceptedCount -= previousAcceptedCount;
+			deferredCount -= previousDeferredCount;
+		}
 	}
-	m_msgsCount = 0;
-	m_msgsDataSize = 0;
 
-	// Destroy the current session
-	destroySession();
-	// ...and create a new one for the next batch
-	if (createSession() == false)
+	releaseConnection();
+
+	// Failing to get a session through counts as being deferred
+	m_batchSize = ExchangerThrottle::getInstance()->recordBatch(m_exchanger,
+		m_domainLimits.m_maxMsgsPerServer, pBatch->m_msgsCount,
+		acceptedCount, deferredCount, (unsigned int)sessionMilliSecs);
+
+	if (isPending == true)
+	{
+		// That provider was only for this batch
+		delete m_pProvider;
+		m_pProvider = pCurrentProvider;
+		m_connectionHandles.swap(pBatch->m_connectionHandles);
+	}
+	else
+	{
+		// Destroy the current session
+		// Providers that support it will have kept the connection open
+		destroySession();
+		// ...and create a new one for the next batch
+		if (createSession() == false)
+		{
+			serverOk = false;
+		}
+	}
+	delete pBatch;
+
+	if (pendingOk == false)
 	{
 		serverOk = false;
 	}
@@ -766,6 +1046,24 @@ bool SMTPSession::dispatchMessages(StatusUpdater *pUpdater, bool force)
 	return serverOk;
 }
 
+bool SMTPSession::finishPendingBatches(StatusUpdater *pUpdater, unsigned int maxCount)
+{
+	bool serverOk = true;
+
+	while (m_pendingBatches.size() > maxCount)
+	{
+		PendingBatch *pBatch = m_pendingBatches.front();
+
+		m_pendingBatches.pop_front();
+		if (finishBatch(pBatch, pUpdater, true) == false)
+		{
+			serverOk = false;
+		}
+	}
+
+	return serverOk;
+}
+
 bool SMTPSession::signMessage(SMTPMessage *pMsg, DomainAuth &domainAuth)
 {
 	if ((pMsg == NULL) ||
@@ -774,6 +1072,9 @@ bool SMTPSession::signMessage(SMTPMessage *pMsg, DomainAuth &domainAuth)
 		return false;
 	}
 
+	// The message may have been signed for an earlier batch
+	pMsg->clearSignatureHeaders();
+
 	string fullMessage(m_pProvider->getMessageData(pMsg));
 
 	// Proceed if keys etc are not set and signing isn't possible
@@ -786,12 +1087,18 @@ bool SMTPSession::signMessage(SMTPMessage *pMsg, DomainAuth &domainAuth)
 	if ((domainAuth.sign(fullMessage, pMsg, false) == true) &&
 		((m_verifySignatures == false) || (domainAuth.verify(fullMessage, pMsg) == true)))
 	{
-		string signatureHeader(pMsg->getSignatureHeader());
+		const vector<string> &signatureHeaders = pMsg->getSignatureHeaders();
 
+		m_msgsDataSize += fullMessage.length();
+		// There may be more than one signature
+		for (vector<string>::const_iterator headerIter = signatureHeaders.begin();
+			headerIter != signatureHeaders.end(); ++headerIter)
+		{
 #ifdef DEBUG
-		clog << "SMTPSession::signMessage: signature is '" << signatureHeader << endl;
+			clog << "SMTPSession::signMessage: signature is '" << *headerIter << endl;
 #endif
-		m_msgsDataSize += fullMessage.length() + signatureHeader.length();
+			m_msgsDataSize += headerIter->length();
+		}
 
 		return true;
 	}
@@ -809,6 +1116,11 @@ unsigned int SMTPSession::getTopMXServersCount(void) const
 	return m_topQueue.size();
 }
 
+unsigned int SMTPSession::getBatchSize(void) const
+{
+	return m_batchSize;
+}
+
 bool SMTPSession::cycleServers(void)
 {
 	if (m_topQueue.empty() == true)
@@ -980,6 +1292,11 @@ bool SMTPSession::generateMessages(DomainAuth &domainAuth,
 	{
 		messageOk = false;
 	}
+	// Messages can't be deleted while batches under way still use them
+	if (finishPendingBatches(pUpdater, 0) == false)
+	{
+		messageOk = false;
+	}
 
 	clog << "Dispatched " << messages.size() << " messages to " << m_domainLimits.m_domainName
 		<< " in " << generationTimer.stop() / 1000 << " seconds" << endl;
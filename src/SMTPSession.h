@@ -22,10 +22,12 @@
 #define _SMTPSESSION_H_
 
 #include <pthread.h>
+#include <deque>
 #include <map>
 #include <queue>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "DomainAuth.h"
 #include "DomainLimits.h"
@@ -35,6 +37,30 @@
 #include "SMTPOptions.h"
 #include "SMTPProvider.h"
 #include "StatusUpdater.h"
+#include "Timer.h"
+
+/// A batch of messages a provider may still be sending.
+class PendingBatch
+{
+	public:
+		PendingBatch(SMTPProvider *pProvider, const std::string &address,
+			unsigned int msgsCount, off_t msgsDataSize,
+			const Timer &sessionTimer);
+		~PendingBatch();
+
+		SMTPProvider *m_pProvider;
+		std::string m_address;
+		std::vector<int> m_connectionHandles;
+		unsigned int m_msgsCount;
+		off_t m_msgsDataSize;
+		Timer m_sessionTimer;
+
+	private:
+		// PendingBatch objects cannot be copied
+		PendingBatch(const PendingBatch &other);
+		PendingBatch &operator=(const PendingBatch &other);
+
+};
 
 /// A session is associated to each domain name emails are to be sent to.
 class SMTPSession
@@ -53,6 +79,9 @@ class SMTPSession
 		/// Returns the number of top-priority MX servers.
 		unsigned int getTopMXServersCount(void) const;
 
+		/// Returns how many messages are sent per batch.
+		unsigned int getBatchSize(void) const;
+
 		/// Cycles to the next MX/A record pair.
 		bool cycleServers(void);
 
@@ -84,9 +113,13 @@ class SMTPSession
 		static pthread_mutex_t m_mutex;
 		DomainLimits m_domainLimits;
 		SMTPOptions m_options;
+		std::string m_exchanger;
+		unsigned int m_batchSize;
+		std::vector<int> m_connectionHandles;
 		unsigned int m_msgsCount;
 		off_t m_msgsDataSize;
 		SMTPProvider *m_pProvider;
+		std::deque<PendingBatch*> m_pendingBatches;
 		int m_topPriority;
 		std::queue<ResourceRecord> m_topQueue;
 		std::set<std::string> m_discarded;
@@ -114,8 +147,22 @@ class SMTPSession
 		/// Sets the server to be used to one of the MX record's addresses.
 		bool setServer(ResourceRecord &mxRecord);
 
-		/// Discards the current server.
-		void discardCurrentServer(void);
+		/// Returns the address of the current server.
+		std::string getCurrentAddress(void) const;
+
+		/// Discards the server at the given address.
+		void discardServer(const std::string &address);
+
+		/**
+		  * Waits until another connection to the current server is allowed,
+		  * then takes as many more as the provider can use, if they are free.
+		  * Pending batches are finished first, as they may hold the connections.
+		  * Returns false if one of them failed.
+		  */
+		bool acquireConnection(StatusUpdater *pUpdater);
+
+		/// Lets the connections to the current server go to someone else.
+		void releaseConnection(void);
 
 		/// Returns true if this record was previously discarded.
 		bool isDiscarded(const ResourceRecord &aRecord);
@@ -125,9 +172,22 @@ class SMTPSession
 			std::map<std::string, Recipient> &recipients,
 			StatusUpdater *pUpdater, bool isPersonalized);
 
-		/// Dispatches all queued messages.
+		/**
+		  * Dispatches all queued messages. Providers that can leave sessions running
+		  * keep a few batches under way; if force is true, all of them are finished.
+		  */
 		bool dispatchMessages(StatusUpdater *pUpdater, bool force);
 
+		/**
+		  * Waits for the provider to be done with a batch, and records how it went.
+		  * serverOk is false if the provider couldn't start the batch.
+		  */
+		bool finishBatch(PendingBatch *pBatch, StatusUpdater *pUpdater,
+			bool serverOk);
+
+		/// Finishes the oldest pending batches, until no more than maxCount are left.
+		bool finishPendingBatches(StatusUpdater *pUpdater, unsigned int maxCount);
+
 		/// Signs a message prior to sending.
 		bool signMessage(SMTPMessage *pMsg, DomainAuth &domainAuth);
 
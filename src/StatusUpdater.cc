@@ -21,6 +21,7 @@
 #include <utility>
 #include <iostream>
 
+#include "ExchangerThrottle.h"
 #include "StatusUpdater.h"
 
 using std::clog;
@@ -31,7 +32,9 @@ using std::string;
 using std::map;
 using std::pair;
 
-StatusUpdater::StatusUpdater(const string &statusFileName)
+StatusUpdater::StatusUpdater(const string &statusFileName) :
+	m_acceptedCount(0),
+	m_deferredCount(0)
 {
 	if (statusFileName.empty() == false)
 	{
@@ -68,6 +71,14 @@ void StatusUpdater::updateRecipientStatus(const string &emailAddress,
 		<< " (" << ((pText != NULL) ? pText : "") << ")" << endl;
 
 	m_status.insert(pair<string, int>(emailAddress, statusCode));
+	if ((statusCode >= 200) && (statusCode < 300))
+	{
+		++m_acceptedCount;
+	}
+	else if (ExchangerThrottle::isDeferral(statusCode) == true)
+	{
+		++m_deferredCount;
+	}
 	if (m_statusFile.is_open() == true)
 	{
 		m_statusFile << statusCode << "," << emailAddress << "," << msgId << endl;
@@ -79,8 +90,17 @@ const map<string, int> &StatusUpdater::getStatus(void) const
 	return m_status;
 }
 
+void StatusUpdater::getRepliesCount(unsigned int &acceptedCount,
+	unsigned int &deferredCount) const
+{
+	acceptedCount = m_acceptedCount;
+	deferredCount = m_deferredCount;
+}
+
 void StatusUpdater::clear(void)
 {
 	m_status.clear();
+	m_acceptedCount = 0;
+	m_deferredCount = 0;
 }
 
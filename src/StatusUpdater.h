@@ -44,12 +44,18 @@ class StatusUpdater
 		/// Returns accumulated statuses.
 		const std::map<std::string, int> &getStatus(void) const;
 
+		/// Returns how many recipients were accepted and deferred so far.
+		void getRepliesCount(unsigned int &acceptedCount,
+			unsigned int &deferredCount) const;
+
 		/// Clear accumulated statuses.
 		void clear(void);
 
 	protected:
 		std::ofstream m_statusFile;
 		std::map<std::string, int> m_status;
+		unsigned int m_acceptedCount;
+		unsigned int m_deferredCount;
 
 	private:
 		StatusUpdater(const StatusUpdater &other);
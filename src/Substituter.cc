@@ -18,16 +18,84 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <ctype.h>
+#include <limits.h>
 #include <iostream>
 
 #include "Substituter.h"
 
+#define NO_SLOT UINT_MAX
+
 using std::clog;
 using std::endl;
 using std::map;
 using std::string;
+using std::vector;
 using namespace ctemplate;
 
+static bool isValidName(const string &name)
+{
+	if (name.empty() == true)
+	{
+		return false;
+	}
+
+	for (string::size_type pos = 0; pos < name.length(); ++pos)
+	{
+		if ((isalnum((int)name[pos]) == 0) &&
+			(name[pos] != '_') &&
+			(name[pos] != '-') &&
+			(name[pos] != '.'))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void appendEscaped(const string &value, bool convertSpaces,
+	string &content)
+{
+	// Same as ctemplate's html_escape and pre_escape modifiers
+	for (string::size_type pos = 0; pos < value.length(); ++pos)
+	{
+		switch (value[pos])
+		{
+			case '&':
+				content += "&amp;";
+				break;
+			case '"':
+				content += "&quot;";
+				break;
+			case '\'':
+				content += "&#39;";
+				break;
+			case '<':
+				content += "&lt;";
+				break;
+			case '>':
+				content += "&gt;";
+				break;
+			case '\r':
+			case '\n':
+			case '\v':
+			case '\f':
+			case '\t':
+				if (convertSpaces == true)
+				{
+					content += ' ';
+					break;
+				}
+				content += value[pos];
+				break;
+			default:
+				content += value[pos];
+				break;
+		}
+	}
+}
+
 Substituter::Substituter(const string &dictionaryId,
 	const string &contentTemplate, bool escapeEntities) :
 	m_contentTemplate(contentTemplate),
@@ -39,15 +107,381 @@ Substituter::~Substituter()
 {
 }
 
+bool Substituter::substituteEncoded(const map<string, string> &fieldValues,
+	string &content)
+{
+	return false;
+}
+
+TemplateProgram::Instruction::Instruction(OpCode opCode, string::size_type offset,
+	string::size_type length, unsigned int slot, Modifier modifier) :
+	m_opCode(opCode),
+	m_offset(offset),
+	m_length(length),
+	m_slot(slot),
+	m_modifier(modifier),
+	m_jump(0),
+	m_segment(0)
+{
+}
+
+TemplateProgram::TemplateProgram(const string &contentTemplate) :
+	m_template(contentTemplate),
+	m_literalsLength(0),
+	m_isValid(false)
+{
+	m_isValid = compile();
+	if (m_isValid == true)
+	{
+		// Literals are encoded as far as they can be ahead of time
+		for (vector<Instruction>::iterator instrIter = m_instructions.begin();
+			instrIter != m_instructions.end(); ++instrIter)
+		{
+			if (instrIter->m_opCode == LITERAL)
+			{
+				instrIter->m_segment = (unsigned int)m_segments.size();
+				m_segments.push_back(QPSegment(m_template.c_str() + instrIter->m_offset,
+					instrIter->m_length));
+			}
+		}
+	}
+#ifdef DEBUG
+	clog << "TemplateProgram: " << m_instructions.size() << " instructions, "
+		<< m_fieldNames.size() << " slots, valid " << m_isValid << endl;
+#endif
+}
+
+TemplateProgram::~TemplateProgram()
+{
+}
+
+bool TemplateProgram::isValid(void) const
+{
+	return m_isValid;
+}
+
+bool TemplateProgram::hasFields(void) const
+{
+	for (vector<Instruction>::const_iterator instrIter = m_instructions.begin();
+		instrIter != m_instructions.end(); ++instrIter)
+	{
+		if (instrIter->m_opCode != LITERAL)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+unsigned int TemplateProgram::getSlot(const string &fieldName)
+{
+	for (unsigned int slot = 0; slot < m_fieldNames.size(); ++slot)
+	{
+		if (m_fieldNames[slot] == fieldName)
+		{
+			return slot;
+		}
+	}
+
+	m_fieldNames.push_back(fieldName);
+
+	return m_fieldNames.size() - 1;
+}
+
+bool TemplateProgram::compile(void)
+{
+	vector<unsigned int> openSections;
+	vector<string> openNames;
+	string::size_type pos = 0;
+
+	while (pos < m_template.length())
+	{
+		string::size_type startPos = m_template.find("{{", pos);
+
+		if (startPos == string::npos)
+		{
+			startPos = m_template.length();
+		}
+		if (startPos > pos)
+		{
+			m_instructions.push_back(Instruction(LITERAL, pos, startPos - pos, NO_SLOT));
+			m_literalsLength += startPos - pos;
+		}
+		if (startPos == m_template.length())
+		{
+			break;
+		}
+
+		string::size_type endPos = m_template.find("}}", startPos + 2);
+		if (endPos == string::npos)
+		{
+			return false;
+		}
+
+		string marker(m_template.substr(startPos + 2, endPos - startPos - 2));
+		pos = endPos + 2;
+
+		if (marker.empty() == true)
+		{
+			return false;
+		}
+		else if (marker[0] == '!')
+		{
+			// Comments are dropped
+			continue;
+		}
+		else if (marker[0] == '#')
+		{
+			string sectionName(marker.substr(1));
+			unsigned int slot = NO_SLOT;
+
+			if (isValidName(sectionName) == false)
+			{
+				return false;
+			}
+
+			// Sections are shown when the matching field has a value
+			if ((sectionName.length() > 8) &&
+				(sectionName.substr(sectionName.length() - 8) == "_section"))
+			{
+				slot = getSlot(sectionName.substr(0, sectionName.length() - 8));
+			}
+
+			openSections.push_back(m_instructions.size());
+			openNames.push_back(sectionName);
+			m_instructions.push_back(Instruction(SECTION_START, 0, 0, slot));
+			continue;
+		}
+		else if (marker[0] == '/')
+		{
+			if ((openNames.empty() == true) ||
+				(openNames.back() != marker.substr(1)))
+			{
+				return false;
+			}
+
+			m_instructions[openSections.back()].m_jump = m_instructions.size();
+			m_instructions.push_back(Instruction(SECTION_END, 0, 0, NO_SLOT));
+			openSections.pop_back();
+			openNames.pop_back();
+			continue;
+		}
+
+		// Leave includes, pragmas, delimiters and other modifiers to ctemplate
+		string fieldName(marker);
+		Modifier modifier = NO_ESCAPE;
+		string::size_type colonPos = marker.find(':');
+
+		if (colonPos != string::npos)
+		{
+			string modifierName(marker.substr(colonPos + 1));
+
+			fieldName = marker.substr(0, colonPos);
+			if ((modifierName == "h") ||
+				(modifierName == "html_escape"))
+			{
+				modifier = HTML_ESCAPE;
+			}
+			else if ((modifierName == "p") ||
+				(modifierName == "pre_escape"))
+			{
+				modifier = PRE_ESCAPE;
+			}
+			else if (modifierName != "none")
+			{
+				return false;
+			}
+		}
+		if (isValidName(fieldName) == false)
+		{
+			return false;
+		}
+
+		m_instructions.push_back(Instruction(VARIABLE, 0, 0, getSlot(fieldName), modifier));
+	}
+
+	if (openSections.empty() == false)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+void TemplateProgram::render(const map<string, string> &fieldValues,
+	string &content) const
+{
+	vector<const string *> values(m_fieldNames.size(), NULL);
+
+	// Resolve slots once
+	for (unsigned int slot = 0; slot < m_fieldNames.size(); ++slot)
+	{
+		map<string, string>::const_iterator valueIter = fieldValues.find(m_fieldNames[slot]);
+
+		if (valueIter != fieldValues.end())
+		{
+			values[slot] = &valueIter->second;
+		}
+	}
+
+	content.clear();
+	content.reserve(m_literalsLength + m_literalsLength / 8);
+	for (unsigned int instrNum = 0; instrNum < m_instructions.size(); ++instrNum)
+	{
+		const Instruction &instr = m_instructions[instrNum];
+
+		switch (instr.m_opCode)
+		{
+			case LITERAL:
+				content.append(m_template, instr.m_offset, instr.m_length);
+				break;
+			case VARIABLE:
+				if (values[instr.m_slot] == NULL)
+				{
+					break;
+				}
+				if (instr.m_modifier == NO_ESCAPE)
+				{
+					content += *values[instr.m_slot];
+				}
+				else
+				{
+					appendEscaped(*values[instr.m_slot],
+						(instr.m_modifier == HTML_ESCAPE), content);
+				}
+				break;
+			case SECTION_START:
+				if ((instr.m_slot == NO_SLOT) ||
+					(values[instr.m_slot] == NULL))
+				{
+					// Skip to the end of the section
+					instrNum = instr.m_jump;
+				}
+				break;
+			case SECTION_END:
+			default:
+				break;
+		}
+	}
+}
+
+void TemplateProgram::renderEncoded(const map<string, string> &fieldValues,
+	string &content) const
+{
+	vector<const string *> values(m_fieldNames.size(), NULL);
+	QPEncoder encoder;
+	string escapedValue;
+
+	for (unsigned int slot = 0; slot < m_fieldNames.size(); ++slot)
+	{
+		map<string, string>::const_iterator valueIter = fieldValues.find(m_fieldNames[slot]);
+
+		if (valueIter != fieldValues.end())
+		{
+			values[slot] = &valueIter->second;
+		}
+	}
+
+	content.clear();
+	content.reserve(m_literalsLength + m_literalsLength / 4);
+	for (unsigned int instrNum = 0; instrNum < m_instructions.size(); ++instrNum)
+	{
+		const Instruction &instr = m_instructions[instrNum];
+
+		switch (instr.m_opCode)
+		{
+			case LITERAL:
+				encoder.append(m_segments[instr.m_segment], content);
+				break;
+			case VARIABLE:
+				if (values[instr.m_slot] == NULL)
+				{
+					break;
+				}
+				if (instr.m_modifier == NO_ESCAPE)
+				{
+					encoder.encode(values[instr.m_slot]->c_str(),
+						values[instr.m_slot]->length(), content);
+				}
+				else
+				{
+					escapedValue.clear();
+					appendEscaped(*values[instr.m_slot],
+						(instr.m_modifier == HTML_ESCAPE), escapedValue);
+					encoder.encode(escapedValue.c_str(), escapedValue.length(), content);
+				}
+				break;
+			case SECTION_START:
+				if ((instr.m_slot == NO_SLOT) ||
+					(values[instr.m_slot] == NULL))
+				{
+					instrNum = instr.m_jump;
+				}
+				break;
+			case SECTION_END:
+			default:
+				break;
+		}
+	}
+}
+
+CompiledSubstituter::CompiledSubstituter(const string &dictionaryId,
+	const string &contentTemplate, bool escapeEntities) :
+	Substituter(dictionaryId, contentTemplate, escapeEntities),
+	m_program(contentTemplate)
+{
+}
+
+CompiledSubstituter::~CompiledSubstituter()
+{
+}
+
+bool CompiledSubstituter::isValid(void) const
+{
+	return m_program.isValid();
+}
+
+bool CompiledSubstituter::hasFields(void) const
+{
+	return m_program.hasFields();
+}
+
+bool CompiledSubstituter::hasField(const string &fieldName) const
+{
+	return CTemplateSubstituter::hasField(m_contentTemplate, fieldName);
+}
+
+void CompiledSubstituter::substitute(const map<string, string> &fieldValues,
+	string &content)
+{
+	m_program.render(fieldValues, content);
+}
+
+bool CompiledSubstituter::substituteEncoded(const map<string, string> &fieldValues,
+	string &content)
+{
+	m_program.renderEncoded(fieldValues, content);
+
+	return true;
+}
+
 CTemplateSubstituter::CTemplateSubstituter(const string &dictionaryId,
 	const string &contentTemplate, bool escapeEntities) :
 	Substituter(dictionaryId, contentTemplate, escapeEntities),
-	m_dict(dictionaryId)
+	m_templateName(dictionaryId),
+	m_cached(false)
 {
+	// Parse the template once, under the dictionary's name
+	m_cached = Template::StringToTemplateCache(m_templateName, m_contentTemplate);
 }
 
 CTemplateSubstituter::~CTemplateSubstituter()
 {
+	if (m_cached == true)
+	{
+		Template::RemoveStringFromTemplateCache(m_templateName);
+	}
 }
 
 bool CTemplateSubstituter::hasFields(void) const
@@ -87,23 +521,24 @@ bool CTemplateSubstituter::hasField(const string &fieldName) const
 void CTemplateSubstituter::substitute(const map<string, string> &fieldValues,
 	string &content)
 {
+	TemplateDictionary dict(m_templateName);
+
 	// Set dictionary values
 	for (map<string, string>::const_iterator valueIter = fieldValues.begin();
 		valueIter != fieldValues.end(); ++valueIter)
 	{
-		m_dict.SetValue(valueIter->first, valueIter->second);
-		m_dict.ShowSection(valueIter->first + "_section");
+		dict.SetValue(valueIter->first, valueIter->second);
+		dict.ShowSection(valueIter->first + "_section");
 	}
 
-	// Create a template named after the dictionary
-	Template::StringToTemplateCache(m_dict.name(), m_contentTemplate);
-	Template *pTemplate = Template::GetTemplate(m_dict.name(), DO_NOT_STRIP);
+	Template *pTemplate = Template::GetTemplate(m_templateName, DO_NOT_STRIP);
 	if (pTemplate == NULL)
 	{
 		content = m_contentTemplate;
 		return;
 	}
 
-	pTemplate->Expand(&content, &m_dict);
+	content.clear();
+	pTemplate->Expand(&content, &dict);
 }
 
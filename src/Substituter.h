@@ -24,8 +24,11 @@
 #include <map>
 #include <set>
 #include <string>
+#include <vector>
 #include <ctemplate/template.h>
 
+#include "QuotedPrintable.h"
+
 /// Substitutes fields in content with their actual values.
 class Substituter
 {
@@ -45,6 +48,14 @@ class Substituter
 		virtual void substitute(const std::map<std::string, std::string> &fieldValues,
 			std::string &content) = 0;
 
+		/**
+		  * Substitutes fields and quoted-printable encodes the result.
+		  * Returns false if this isn't supported, in which case content
+		  * is left alone.
+		  */
+		virtual bool substituteEncoded(const std::map<std::string, std::string> &fieldValues,
+			std::string &content);
+
 	protected:
 		std::string m_contentTemplate;
 		bool m_escapeEntities;
@@ -55,6 +66,107 @@ class Substituter
 
 };
 
+/**
+  * A template compiled into literal segments, field slots and sections.
+  * Programs are immutable once compiled and may be shared across threads.
+  */
+class TemplateProgram
+{
+	public:
+		TemplateProgram(const std::string &contentTemplate);
+		virtual ~TemplateProgram();
+
+		/// Returns false if the template uses syntax that isn't supported.
+		bool isValid(void) const;
+
+		/// Returns whether there are fields to substitute in the content.
+		bool hasFields(void) const;
+
+		/// Renders the template into content, reusing its buffer.
+		void render(const std::map<std::string, std::string> &fieldValues,
+			std::string &content) const;
+
+		/**
+		  * Renders the template quoted-printable encoded, with literals
+		  * encoded ahead of time.
+		  */
+		void renderEncoded(const std::map<std::string, std::string> &fieldValues,
+			std::string &content) const;
+
+	protected:
+		typedef enum { LITERAL = 0, VARIABLE, SECTION_START, SECTION_END } OpCode;
+		typedef enum { NO_ESCAPE = 0, HTML_ESCAPE, PRE_ESCAPE } Modifier;
+
+		/// An instruction.
+		class Instruction
+		{
+			public:
+				Instruction(OpCode opCode, std::string::size_type offset,
+					std::string::size_type length, unsigned int slot,
+					Modifier modifier = NO_ESCAPE);
+
+				OpCode m_opCode;
+				std::string::size_type m_offset;
+				std::string::size_type m_length;
+				unsigned int m_slot;
+				Modifier m_modifier;
+				unsigned int m_jump;
+				unsigned int m_segment;
+
+		};
+
+		std::string m_template;
+		std::vector<Instruction> m_instructions;
+		std::vector<std::string> m_fieldNames;
+		std::vector<QPSegment> m_segments;
+		std::string::size_type m_literalsLength;
+		bool m_isValid;
+
+		bool compile(void);
+
+		unsigned int getSlot(const std::string &fieldName);
+
+	private:
+		TemplateProgram(const TemplateProgram &other);
+		TemplateProgram &operator=(const TemplateProgram &other);
+
+};
+
+/// Substitutes fields in content with a compiled template.
+class CompiledSubstituter : public Substituter
+{
+	public:
+		CompiledSubstituter(const std::string &dictionaryId,
+			const std::string &contentTemplate,
+			bool escapeEntities);
+		virtual ~CompiledSubstituter();
+
+		/// Returns whether the template could be compiled.
+		bool isValid(void) const;
+
+		/// Returns whether there are fields to substitute in the content.
+		virtual bool hasFields(void) const;
+
+		/// Returns whether the given field name is to be substituted.
+		virtual bool hasField(const std::string &fieldName) const;
+
+		/// Substitutes fields, links and images if applicable.
+		virtual void substitute(const std::map<std::string, std::string> &fieldValues,
+			std::string &content);
+
+		/// Substitutes fields and quoted-printable encodes the result.
+		virtual bool substituteEncoded(const std::map<std::string, std::string> &fieldValues,
+			std::string &content);
+
+	protected:
+		TemplateProgram m_program;
+
+	private:
+		CompiledSubstituter(const CompiledSubstituter &other);
+		CompiledSubstituter &operator=(const CompiledSubstituter &other);
+
+};
+
 /// Substitutes fields in content with their actual values.
 class CTemplateSubstituter : public Substituter
 {
@@ -79,7 +191,8 @@ class CTemplateSubstituter : public Substituter
 			std::string &content);
 
 	protected:
-		ctemplate::TemplateDictionary m_dict;
+		std::string m_templateName;
+		bool m_cached;
 
 	private:
 		CTemplateSubstituter(const CTemplateSubstituter &other);
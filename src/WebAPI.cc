@@ -100,7 +100,8 @@ RecipientsXMLPrinter::~RecipientsXMLPrinter()
 
 void RecipientsXMLPrinter::print(bool minimumDetails,
 	off_t maxCount, off_t startOffset,
-	off_t totalCount, map<string, Recipient> &recipients)
+	off_t totalCount, const string &continuationToken,
+	map<string, Recipient> &recipients)
 {
 	if (m_pAPI == NULL)
 	{
@@ -110,6 +111,10 @@ void RecipientsXMLPrinter::print(bool minimumDetails,
 	char numStr[64];
 	snprintf(numStr, 64, "%ld", totalCount);
 	m_pAPI->m_outputStream << "<TotalCount>" << numStr << "</TotalCount>\r\n";
+	if (continuationToken.empty() == false)
+	{
+		m_pAPI->m_outputStream << "<ContinuationToken>" << continuationToken << "</ContinuationToken>\r\n";
+	}
 
 	for (map<string, Recipient>::const_iterator recipientIter = recipients.begin();
 		recipientIter != recipients.end(); ++recipientIter)
@@ -162,6 +167,7 @@ void RecipientsCSVPrinter::print(bool minimumDetails,
 	off_t maxCount,
 	off_t startOffset,
 	off_t totalCount,
+	const string &continuationToken,
 	map<string, Recipient> &recipients)
 {
 	m_outputStream << "ID,NAME,STATUS,STATUSCODE,STATUSMSG,EMAILADDRESS,TIMESENT,NUMATTEMPTS,"
@@ -189,6 +195,13 @@ void RecipientsCSVPrinter::print(bool minimumDetails,
 		m_outputStream << "," << recipient.m_returnPathEmailAddress << "\r\n";
 		m_outputStream.flush();
 	}
+
+	// Headers are out by now, so the token for the next page comes last
+	if (continuationToken.empty() == false)
+	{
+		m_outputStream << "#CONTINUATIONTOKEN," << quoteColumn(continuationToken) << "\r\n";
+		m_outputStream.flush();
+	}
 }
 
 WebAPI::WebAPI(CampaignSQL *pCampaignData, UsageLogger *pLogger,
@@ -231,6 +244,60 @@ string WebAPI::encodeEntities(const string &xml)
 	return encodedXml;
 }
 
+string WebAPI::encodeToken(const string &campaignId, const string &recipientId)
+{
+	string plainToken(campaignId + "\n" + recipientId);
+	string token;
+	char hexStr[3];
+
+	// Hexadecimal can go in a URL as is
+	for (string::size_type pos = 0; pos < plainToken.length(); ++pos)
+	{
+		snprintf(hexStr, 3, "%02x", (unsigned int)(unsigned char)plainToken[pos]);
+		token += hexStr;
+	}
+
+	return token;
+}
+
+bool WebAPI::decodeToken(const string &token, const string &campaignId,
+	string &recipientId)
+{
+	string plainToken;
+
+	if ((token.empty() == true) ||
+		(token.length() % 2 != 0))
+	{
+		return false;
+	}
+
+	for (string::size_type pos = 0; pos < token.length(); pos += 2)
+	{
+		string hexStr(token.substr(pos, 2));
+		char *pEnd = NULL;
+
+		long value = strtol(hexStr.c_str(), &pEnd, 16);
+		if ((pEnd == NULL) ||
+			(*pEnd != '\0'))
+		{
+			return false;
+		}
+		plainToken += (char)value;
+	}
+
+	// Tokens are only good for the campaign they were issued for
+	string::size_type sepPos = plainToken.find('\n');
+	if ((sepPos == string::npos) ||
+		(plainToken.substr(0, sepPos) != campaignId) ||
+		(sepPos + 1 >= plainToken.length()))
+	{
+		return false;
+	}
+	recipientId = plainToken.substr(sepPos + 1);
+
+	return true;
+}
+
 void WebAPI::outputCampaign(const Campaign &campaign, const string &detailsLevel)
 {
 	m_outputStream << "<Campaign>\r\n";
@@ -983,7 +1050,7 @@ bool WebAPI::importAction(xmlNode *pImportNode)
 
 bool WebAPI::listAction(xmlNode *pListNode)
 {
-	string objects("Campaigns"), detailsLevel("Min");
+	string objects("Campaigns"), detailsLevel("Min"), continuationToken;
 	off_t maxCount = 10, startOffset = 0;
 
 	if (xmlHasProp(pListNode, BAD_CAST"Objects"))
@@ -1002,6 +1069,10 @@ bool WebAPI::listAction(xmlNode *pListNode)
 	{
 		startOffset = (unsigned int)atoi((const char*)xmlGetProp(pListNode, BAD_CAST"StartOffset"));
 	}
+	if (xmlHasProp(pListNode, BAD_CAST"ContinuationToken"))
+	{
+		continuationToken = (const char*)xmlGetProp(pListNode, BAD_CAST"ContinuationToken");
+	}
 
 	if (objects == "Campaigns")
 	{
@@ -1079,7 +1150,11 @@ bool WebAPI::listAction(xmlNode *pListNode)
 		}
 
 		RecipientsXMLPrinter printer(this);
-		listRecipients(campaign, false, maxCount, startOffset, printer);
+		if (listRecipients(campaign, false, maxCount, startOffset,
+			continuationToken, printer) == false)
+		{
+			return false;
+		}
 	}
 	else
 	{
@@ -1417,20 +1492,49 @@ void WebAPI::listCampaigns(const Campaign &campaign, const string &detailsLevel,
 	}
 }
 
-void WebAPI::listRecipients(const Campaign &campaign, bool minimumDetails,
-	off_t maxCount, off_t startOffset,
+bool WebAPI::listRecipients(const Campaign &campaign, bool minimumDetails,
+	off_t maxCount, off_t startOffset, const string &continuationToken,
 	RecipientsPrinter &printer)
 {
 	map<string, Recipient> recipients;
+	string afterId, lastId, nextToken;
 	off_t totalCount = 0;
 
+	if ((continuationToken.empty() == false) &&
+		(decodeToken(continuationToken, campaign.m_id, afterId) == false))
+	{
+		m_errorMsg = "Invalid Continuation Token";
+		m_errorCode = LIST_ERROR + 5;
+		return false;
+	}
+
 	totalCount = m_pCampaignData->countRecipients(campaign.m_id, "", "", false);
 
 	// Get the recipients
-	m_pCampaignData->getRecipients(campaign.m_id,
-		maxCount, startOffset, recipients);
+	if ((afterId.empty() == false) ||
+		(startOffset == 0))
+	{
+		// Seek past the last recipient of the previous page
+		m_pCampaignData->getNextRecipients(campaign.m_id,
+			maxCount, afterId, recipients, lastId);
+	}
+	else
+	{
+		m_pCampaignData->getRecipients(campaign.m_id,
+			maxCount, startOffset, recipients, &lastId);
+	}
+
+	// A short page is the last one
+	if ((lastId.empty() == false) &&
+		((off_t)recipients.size() >= maxCount))
+	{
+		nextToken = encodeToken(campaign.m_id, lastId);
+	}
+
+	printer.print(minimumDetails, maxCount, startOffset, totalCount,
+		nextToken, recipients);
 
-	printer.print(minimumDetails, maxCount, startOffset, totalCount, recipients);
+	return true;
 }
 
 off_t WebAPI::importCSV(const Campaign &campaign, CSVParser *pParser,
@@ -45,6 +45,7 @@ class RecipientsPrinter
 			off_t maxCount,
 			off_t startOffset,
 			off_t totalCount,
+			const std::string &continuationToken,
 			std::map<std::string, Recipient> &recipients) = 0;
 
 };
@@ -62,6 +63,7 @@ class RecipientsXMLPrinter : public RecipientsPrinter
 			off_t maxCount,
 			off_t startOffset,
 			off_t totalCount,
+			const std::string &continuationToken,
 			std::map<std::string, Recipient> &recipients);
 
 	protected:
@@ -69,7 +71,10 @@ class RecipientsXMLPrinter : public RecipientsPrinter
 
 };
 
-/// Dumps a recipients list as CSV.
+/**
+  * Dumps a recipients list as CSV. If there are more recipients, the last
+  * line is #CONTINUATIONTOKEN followed by the token to pass to get the next page.
+  */
 class RecipientsCSVPrinter : public RecipientsPrinter
 {
 	public:
@@ -80,6 +85,7 @@ class RecipientsCSVPrinter : public RecipientsPrinter
 			off_t maxCount,
 			off_t startOffset,
 			off_t totalCount,
+			const std::string &continuationToken,
 			std::map<std::string, Recipient> &recipients);
 
 	protected:
@@ -108,10 +114,14 @@ class WebAPI
 			const std::string &detailsLevel, off_t maxCount,
 			off_t startOffset);
 
-		/// Lists recipients belonging to the given campaign ID.
-		void listRecipients(const Campaign &campaign,
+		/**
+		  * Lists recipients belonging to the given campaign ID.
+		  * If continuationToken isn't empty, the list resumes where the previous one ended
+		  * and startOffset is ignored.
+		  */
+		bool listRecipients(const Campaign &campaign,
 			bool minimumDetails, off_t maxCount,
-			off_t startOffset,
+			off_t startOffset, const std::string &continuationToken,
 			RecipientsPrinter &printer);
 
 		typedef enum { CSV_NAME = 0, CSV_EMAIL_ADDRESS, CSV_STATUS,
@@ -133,6 +143,12 @@ class WebAPI
 		std::string m_errorMsg;
 		int m_errorCode;
 
+		static std::string encodeToken(const std::string &campaignId,
+			const std::string &recipientId);
+
+		static bool decodeToken(const std::string &token,
+			const std::string &campaignId, std::string &recipientId);
+
 		void outputCampaign(const Campaign &campaign,
 			const std::string &detailLevels);
 
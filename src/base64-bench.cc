@@ -0,0 +1,147 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <iostream>
+#include <string>
+
+#include "Base64.h"
+
+using namespace std;
+
+typedef enum { ENCODE = 0, ENCODE_LINES, DECODE } Operation;
+
+static double getTime(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (double)now.tv_sec + (double)now.tv_usec / 1000000.0;
+}
+
+// Returns the throughput in MB/s of the input, and the output in outputData.
+static double run(Operation operation, const string &inputData,
+	unsigned int iterations, string &outputData)
+{
+	double startTime = getTime();
+
+	for (unsigned int iterationNum = 0; iterationNum < iterations; ++iterationNum)
+	{
+		unsigned long dataLen = (unsigned long)inputData.length();
+		char *pOutput = NULL;
+
+		if (operation == ENCODE)
+		{
+			pOutput = Base64::encode(inputData.c_str(), dataLen);
+		}
+		else if (operation == ENCODE_LINES)
+		{
+			pOutput = Base64::encodeLines(inputData.c_str(), dataLen);
+		}
+		else
+		{
+			pOutput = Base64::decode(inputData.c_str(), dataLen);
+		}
+
+		if (pOutput != NULL)
+		{
+			if (iterationNum == 0)
+			{
+				outputData.assign(pOutput, dataLen);
+			}
+			delete[] pOutput;
+		}
+	}
+
+	double elapsedTime = getTime() - startTime;
+	if (elapsedTime <= 0.0)
+	{
+		return 0.0;
+	}
+
+	return ((double)inputData.length() * iterations) / (elapsedTime * 1024.0 * 1024.0);
+}
+
+int main(int argc, char **argv)
+{
+	// Sizes of a recipient ID, a Message-Id, and a typical attachment
+	unsigned long sizes[] = { 16, 48, 2 * 1024 * 1024 };
+	const char *operationNames[] = { "encode", "encodeLines", "decode" };
+	unsigned int totalBytes = 256 * 1024 * 1024;
+	bool allMatch = true;
+
+	if (argc > 1)
+	{
+		totalBytes = (unsigned int)atoi(argv[1]) * 1024 * 1024;
+	}
+
+	srand(42);
+	for (unsigned int sizeNum = 0; sizeNum < sizeof(sizes) / sizeof(unsigned long); ++sizeNum)
+	{
+		string data;
+		unsigned int iterations = totalBytes / sizes[sizeNum];
+
+		for (unsigned long pos = 0; pos < sizes[sizeNum]; ++pos)
+		{
+			data += (char)(rand() % 256);
+		}
+
+		unsigned long encodedLen = (unsigned long)data.length();
+		char *pEncoded = Base64::encodeLines(data.c_str(), encodedLen);
+		string encodedData(pEncoded, encodedLen);
+
+		delete[] pEncoded;
+
+		for (unsigned int operationNum = ENCODE; operationNum <= DECODE; ++operationNum)
+		{
+			Operation operation = (Operation)operationNum;
+			const string &inputData = (operation == DECODE ? encodedData : data);
+			string scalarOutput, simdOutput;
+
+			// The scalar code is what we had before SIMD
+			Base64::useSIMD(false);
+			double scalarRate = run(operation, inputData, iterations, scalarOutput);
+			Base64::useSIMD(true);
+			double simdRate = run(operation, inputData, iterations, simdOutput);
+
+			cout << operationNames[operationNum] << " " << sizes[sizeNum] << " bytes: scalar "
+				<< scalarRate << " MB/s, dispatched " << simdRate << " MB/s";
+			if (scalarRate > 0.0)
+			{
+				cout << ", x" << simdRate / scalarRate;
+			}
+			if (scalarOutput != simdOutput)
+			{
+				cout << ", OUTPUT MISMATCH";
+				allMatch = false;
+			}
+			cout << endl;
+		}
+	}
+
+	if (allMatch == false)
+	{
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -1167,6 +1167,7 @@ int main(int argc, char **argv)
 		returnCode = EXIT_FAILURE;
 	}
 
+	SMTPProviderFactory::closeSessions();
 	OpenDKIM::shutdown();
 
 	// Close the log file
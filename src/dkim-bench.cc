@@ -0,0 +1,218 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright 2026 Fabrice Colin
+ *
+ *  This code is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ConfigurationFile.h"
+#include "OpenDKIM.h"
+#include "SMTPMessage.h"
+
+using namespace std;
+
+/// A message that only has headers.
+class BenchMessage : public SMTPMessage
+{
+	public:
+		BenchMessage() :
+			SMTPMessage(map<string, string>(), NULL, NEVER, false, "", "")
+		{
+			m_headers.push_back(SMTPHeader("From", "Sender", "sender@example.com"));
+			m_headers.push_back(SMTPHeader("To", "", "recipient@example.org"));
+			m_headers.push_back(SMTPHeader("Subject", "Benchmarking DKIM signatures", ""));
+			m_headers.push_back(SMTPHeader("Date", "Sat, 17 Oct 2026 10:00:00 +0000", ""));
+			m_headers.push_back(SMTPHeader("Message-Id", "", "bench@example.com"));
+			m_headers.push_back(SMTPHeader("MIME-Version", "1.0", ""));
+			m_headers.push_back(SMTPHeader("Content-Type", "multipart/mixed; boundary=\"bench\"", ""));
+		}
+		virtual ~BenchMessage()
+		{
+		}
+
+		virtual void setEnvId(const string &dsnEnvId)
+		{
+		}
+
+		virtual void addRecipient(const string &emailAddress)
+		{
+		}
+
+};
+
+class BenchArg
+{
+	public:
+		BenchArg() :
+			m_pMessageData(NULL),
+			m_signaturesCount(0),
+			m_signedCount(0)
+		{
+		}
+
+		const string *m_pMessageData;
+		unsigned int m_signaturesCount;
+		unsigned int m_signedCount;
+
+};
+
+static double getTime(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (double)now.tv_sec + (double)now.tv_usec / 1000000.0;
+}
+
+static void *signThreadFunc(void *pArg)
+{
+	BenchArg *pBenchArg = static_cast<BenchArg*>(pArg);
+	OpenDKIM domainKeys;
+	BenchMessage message;
+
+	// Each worker thread has its own authenticator
+	if (domainKeys.loadPrivateKey(ConfigurationFile::getInstance("")) == true)
+	{
+		for (unsigned int sigNum = 0; sigNum < pBenchArg->m_signaturesCount; ++sigNum)
+		{
+			message.clearSignatureHeaders();
+			if (domainKeys.sign(*pBenchArg->m_pMessageData, &message, false) == true)
+			{
+				++pBenchArg->m_signedCount;
+			}
+		}
+	}
+
+	OpenDKIM::cleanupThread();
+
+	return NULL;
+}
+
+// Returns signatures per second over threadsCount threads.
+static double run(unsigned int threadsCount, unsigned int signaturesCount,
+	const string &messageData, bool &allSigned)
+{
+	vector<BenchArg> args(threadsCount);
+	vector<pthread_t> threadIds(threadsCount);
+	double startTime = getTime();
+
+	for (unsigned int threadNum = 0; threadNum < threadsCount; ++threadNum)
+	{
+		args[threadNum].m_pMessageData = &messageData;
+		args[threadNum].m_signaturesCount = signaturesCount;
+		pthread_create(&threadIds[threadNum], NULL, signThreadFunc, &args[threadNum]);
+	}
+	for (unsigned int threadNum = 0; threadNum < threadsCount; ++threadNum)
+	{
+		pthread_join(threadIds[threadNum], NULL);
+		if (args[threadNum].m_signedCount != signaturesCount)
+		{
+			allSigned = false;
+		}
+	}
+
+	double elapsedTime = getTime() - startTime;
+	if (elapsedTime <= 0.0)
+	{
+		return 0.0;
+	}
+
+	return ((double)threadsCount * signaturesCount) / elapsedTime;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int maxThreads = 16, signaturesCount = 500;
+	bool allSigned = true;
+
+	if (argc < 2)
+	{
+		cerr << "Usage: " << argv[0] << " PRIVATE_KEY_FILE [MAX_THREADS [SIGNATURES_PER_THREAD]]" << endl;
+		return EXIT_FAILURE;
+	}
+	if (argc > 2)
+	{
+		maxThreads = (unsigned int)atoi(argv[2]);
+	}
+	if (argc > 3)
+	{
+		signaturesCount = (unsigned int)atoi(argv[3]);
+	}
+
+	ConfigurationFile *pConfig = ConfigurationFile::getInstance("");
+	pConfig->m_dkPrivateKey = argv[1];
+	pConfig->m_dkDomain = "example.com";
+	pConfig->m_dkSelector = "bench";
+
+	if (OpenDKIM::initialize() == false)
+	{
+		cerr << "Couldn't initialize OpenDKIM" << endl;
+		return EXIT_FAILURE;
+	}
+
+	// A short text part and a 64kB attachment
+	stringstream dataStr;
+	dataStr << "MIME-Version: 1.0\r\n\r\n--bench\r\nContent-Type: text/plain\r\n\r\n"
+		<< "Hello,\r\n\r\nThis is a  benchmark.\r\n\r\n--bench\r\n"
+		<< "Content-Type: application/octet-stream\r\nContent-Transfer-Encoding: base64\r\n\r\n";
+	srand(42);
+	for (unsigned int lineNum = 0; lineNum < 1024; ++lineNum)
+	{
+		for (unsigned int charNum = 0; charNum < 64; ++charNum)
+		{
+			dataStr << (char)('A' + rand() % 26);
+		}
+		dataStr << "\r\n";
+	}
+	dataStr << "--bench--\r\n";
+	string messageData(dataStr.str());
+
+	for (unsigned int threadsCount = 1; threadsCount <= maxThreads; threadsCount *= 2)
+	{
+		// Serialized signing is what we had before per-thread state
+		OpenDKIM::serializeSigning(true);
+		double serializedRate = run(threadsCount, signaturesCount, messageData, allSigned);
+		OpenDKIM::serializeSigning(false);
+		double parallelRate = run(threadsCount, signaturesCount, messageData, allSigned);
+
+		cout << threadsCount << " threads: serialized " << serializedRate
+			<< " signatures/s, per-thread " << parallelRate << " signatures/s";
+		if (serializedRate > 0.0)
+		{
+			cout << ", x" << parallelRate / serializedRate;
+		}
+		cout << endl;
+	}
+
+	OpenDKIM::shutdown();
+
+	if (allSigned == false)
+	{
+		cerr << "Some messages couldn't be signed" << endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
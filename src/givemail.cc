@@ -22,10 +22,16 @@
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
+#include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <limits.h>
+#include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <libintl.h>
@@ -36,7 +42,9 @@
 #include <algorithm>
 
 #include "ConfigurationFile.h"
+#include "DNSCache.h"
 #include "DomainsMap.h"
+#include "ExchangerThrottle.h"
 #include "OpenDKIM.h"
 #include "Process.h"
 #include "Recipient.h"
@@ -54,11 +62,16 @@
 
 //#define _TEST_CHILD_ENV
 #define EXIT_ASK_FOR_RESTART 10
+// Seconds to wait for another slave to be done resolving
+#define RESOLVER_LOCK_TIMEOUT 120
 
 using namespace std;
 
 #ifdef USE_MYSQL
 static MySQLBase *g_pDb = NULL;
+static DBStatusWriter *g_pStatusWriter = NULL;
+static string g_workerId;
+static unsigned int g_leasesCount = 0;
 #endif
 static bool g_mustQuit = false;
 static int g_returnCode = EXIT_SUCCESS;
@@ -290,7 +303,8 @@ static void sendToDomain(const string &campaignId,
 		return;
 	}
 
-	DBStatusUpdater *pUpdater = new DBStatusUpdater(g_pDb, campaignId);
+	DBStatusUpdater *pUpdater = new DBStatusUpdater(g_pDb, campaignId, g_pStatusWriter);
+	string lastRecipientId;
 
 	while ((g_mustQuit == false) &&
 		(g_pDb != NULL))
@@ -298,16 +312,44 @@ static void sendToDomain(const string &campaignId,
 		Timer batchTimer;
 		CampaignSQL campaignData(g_pDb);
 		map<string, Recipient> recipients;
-		// Make sure we get in one go at least as many as "number of MX servers" * "max msgs per server"
-		off_t maxRecipientsCount = (off_t)max((unsigned int)100, domainLimits.m_maxMsgsPerServer * session.getTopMXServersCount());
+		string nextRecipientId;
+		// Make sure we get in one go at least as many as "number of MX servers" * "msgs per batch"
+		off_t maxRecipientsCount = (off_t)max((unsigned int)100, session.getBatchSize() * session.getTopMXServersCount());
 
-		// Get a group of waiting recipients for this domain
-		if (campaignData.getRecipients(campaignId, "Waiting",
+		if (pConfig->m_leaseDuration > 0)
+		{
+			stringstream leaseIdStr;
+
+			// Other threads, slaves and hosts may be leasing recipients of this domain too
+			leaseIdStr << g_workerId << ":" << __sync_add_and_fetch(&g_leasesCount, 1);
+
+			if (campaignData.leaseRecipients(campaignId, domainLimits.m_domainName,
+				leaseIdStr.str(), pConfig->m_leaseDuration, maxRecipientsCount,
+				recipients) == false)
+			{
+				break;
+			}
+		}
+		// Get a group of waiting recipients for this domain, past those already processed
+		// whose status may not have been written yet
+		else if (campaignData.getRecipients(campaignId, "Waiting",
 			domainLimits.m_domainName, maxRecipientsCount,
-			recipients) == false)
+			recipients, lastRecipientId, &nextRecipientId) == false)
 		{
 			break;
 		}
+		else
+		{
+			lastRecipientId = nextRecipientId;
+		}
+		// Those whose status is still queued are Waiting, don't send to them again
+		if ((pUpdater->skipPending(recipients) > 0) &&
+			(recipients.empty() == true))
+		{
+			pUpdater->waitForWrites();
+			continue;
+		}
+		pUpdater->setRecipients(recipients);
 
 		// Send to all recipients
 		if (session.generateMessages(domainAuth, pDetails, recipients, pUpdater) == false)
@@ -352,6 +394,7 @@ static void sendToDomain(const string &campaignId,
 				apiFailuresCount = 0;
 			}
 		}
+		pUpdater->flush();
 		pUpdater->clear();
 
 		cout << "Grabbed and emailed " << recipients.size() << " recipients in "
@@ -398,7 +441,7 @@ void *workerThreadFunc(void *pArg)
 		{
 			cout << "Skipping domain " << domainName << endl;
 
-			DBStatusUpdater updater(g_pDb, pThreadArg->m_campaignId);
+			DBStatusUpdater updater(g_pDb, pThreadArg->m_campaignId, g_pStatusWriter);
 			updater.updateRecipientsStatus(domainName, 0, "No MX record");
 		}
 
@@ -416,6 +459,54 @@ void *workerThreadFunc(void *pArg)
 	return NULL;
 }
 
+/// Waits for other slave processes to be done resolving, for a while.
+static int lockResolver(void)
+{
+	string lockDirectory(MessageDetails::getPrivateDirectory());
+	struct stat lockStat;
+
+	if (lockDirectory.empty() == true)
+	{
+		return -1;
+	}
+
+	string lockFileName(lockDirectory + "/dns.lock");
+	int lockFd = open(lockFileName.c_str(), O_RDWR|O_CREAT|O_NOFOLLOW, S_IRUSR|S_IWUSR);
+	if (lockFd < 0)
+	{
+		return -1;
+	}
+
+	// Only this user should be able to hold it
+	if ((fstat(lockFd, &lockStat) != 0) ||
+		(S_ISREG(lockStat.st_mode) == 0) ||
+		(lockStat.st_uid != getuid()))
+	{
+		close(lockFd);
+		return -1;
+	}
+
+	for (unsigned int attemptNum = 0; attemptNum < RESOLVER_LOCK_TIMEOUT * 10; ++attemptNum)
+	{
+		if (flock(lockFd, LOCK_EX|LOCK_NB) == 0)
+		{
+			return lockFd;
+		}
+		if ((errno != EWOULDBLOCK) &&
+			(errno != EINTR))
+		{
+			break;
+		}
+		usleep(100000);
+	}
+
+	// Resolving again is only a waste of time
+	clog << "Couldn't lock " << lockFileName << ", resolving anyway" << endl;
+	close(lockFd);
+
+	return -1;
+}
+
 /// Run in slave mode.
 static bool runSlave(const string &campaignId, const string &slaveId)
 {
@@ -453,22 +544,75 @@ static bool runSlave(const string &campaignId, const string &slaveId)
 
 	cout << "Processing campaign " << pCampaign->m_name << "(" << campaignId << ")" << endl;
 
-	off_t rowsCount = 0;
+	off_t rowsCount = 0, slavesCount = 0, offset = 0;
 	bool multiThreaded = true;
 
 	// Get a list of domains
-	if (slaveId.empty() == true)
+	rowsCount = campaignData.listDomains(campaignId, "Waiting", domainsBreakdown);
+
+	// Make room for all of them, then start with what previous slaves resolved
+	DNSCache *pCache = DNSCache::getInstance();
+	pCache->reserve((pConfig->m_dnsCacheSlots > 0) ? pConfig->m_dnsCacheSlots :
+		DNSCache::getSlotsCount(domainsBreakdown.size()));
+	pCache->load(pConfig->m_dnsCacheFile);
+	if (slaveId.empty() == false)
 	{
-		rowsCount = campaignData.listDomains(campaignId, "Waiting", domainsBreakdown);
+		multiThreaded = false;
 	}
-	else
+	if (pConfig->m_leaseDuration > 0)
 	{
-		off_t offset = (off_t)atoll(slaveId.c_str());
+		char hostName[HOST_NAME_MAX + 1];
+		stringstream workerIdStr;
 
-		// Partition the domains map based on the number of slave processes
-		rowsCount = campaignData.listDomains(campaignId, "Waiting", domainsBreakdown,
-			pConfig->m_maxSlaves, offset);
-		multiThreaded = false;
+		// Slaves lease recipients from all domains, whichever has the most left
+		if (gethostname(hostName, HOST_NAME_MAX) != 0)
+		{
+			hostName[0] = '\0';
+		}
+		hostName[HOST_NAME_MAX] = '\0';
+		workerIdStr << hostName << ":" << getpid();
+		g_workerId = workerIdStr.str();
+	}
+	else if (slaveId.empty() == false)
+	{
+		// Partition the domains map based on the number of slave processes, once resolved
+		slavesCount = pConfig->m_maxSlaves;
+		offset = (off_t)atoll(slaveId.c_str());
+	}
+
+	if (rowsCount > 0)
+	{
+		set<string> domainNames;
+
+		// Resolve all domains in parallel before workers need them
+		for (multimap<off_t, string>::const_iterator domainIter = domainsBreakdown.begin();
+			domainIter != domainsBreakdown.end(); ++domainIter)
+		{
+			domainNames.insert(domainIter->second);
+		}
+		// The first slave process resolves for all, the others find answers in the shared cache
+		int lockFd = -1;
+		if (slaveId.empty() == false)
+		{
+			lockFd = lockResolver();
+		}
+		Resolver::prefetchRecords(domainNames, true);
+		if (lockFd >= 0)
+		{
+			flock(lockFd, LOCK_UN);
+			close(lockFd);
+		}
+
+		if (pConfig->m_adaptiveThrottling == true)
+		{
+			// Workers per exchanger start at, and never exceed, the configured limit
+			ExchangerThrottle::getInstance()->enable((pConfig->m_maxSlavesPerExchanger > 0) ?
+				pConfig->m_maxSlavesPerExchanger : (unsigned int)pConfig->m_maxSlaves);
+		}
+
+		// Domains that share mail exchangers go together
+		rowsCount = pDomainsMap->groupByExchanger(pConfig->m_maxSlavesPerExchanger,
+			slavesCount, offset);
 	}
 
 	if (rowsCount == 0)
@@ -479,6 +623,19 @@ static bool runSlave(const string &campaignId, const string &slaveId)
 
 	cout << "Campaign has " << rowsCount << " domains" << endl;
 
+	if (pConfig->m_statusFlushSize > 0)
+	{
+		// Recipients' status is written in batches by a separate thread
+		g_pStatusWriter = new DBStatusWriter(g_pDb, pConfig->m_statusFlushSize,
+			pConfig->m_statusFlushInterval,
+			DBStatusWriter::toDurability(pConfig->m_statusDurability));
+		if (g_pStatusWriter->start() == false)
+		{
+			delete g_pStatusWriter;
+			g_pStatusWriter = NULL;
+		}
+	}
+
 	if (multiThreaded == false)
 	{
 		ThreadArg *pThreadArg = new ThreadArg(campaignId, pDetails);
@@ -531,7 +688,7 @@ static bool runSlave(const string &campaignId, const string &slaveId)
 				{
 					cout << "Skipping domain " << domainName << endl;
 
-					DBStatusUpdater updater(g_pDb, campaignId);
+					DBStatusUpdater updater(g_pDb, campaignId, g_pStatusWriter);
 					updater.updateRecipientsStatus(domainName, 0, "No MX record");
 				}
 
@@ -553,6 +710,17 @@ static bool runSlave(const string &campaignId, const string &slaveId)
 		}
 	}
 
+	if (g_pStatusWriter != NULL)
+	{
+		// Write or drop pending status updates
+		g_pStatusWriter->stop();
+		delete g_pStatusWriter;
+		g_pStatusWriter = NULL;
+	}
+
+	ExchangerThrottle::getInstance()->logStatistics();
+	DNSCache::getInstance()->save(pConfig->m_dnsCacheFile);
+
 	delete pCampaign;
 	delete pDetails;
 
@@ -1006,9 +1174,16 @@ int main(int argc, char **argv)
 		}
 	}
 
+	SMTPProviderFactory::closeSessions();
 	OpenDKIM::shutdown();
 
-	// FIXME: delete g_pDb, as well as DomainsMap and ConfigurationFile instances
+	// All threads were joined by now
+	if (g_pDb != NULL)
+	{
+		delete g_pDb;
+		g_pDb = NULL;
+	}
+	// FIXME: delete DomainsMap and ConfigurationFile instances
 
 	// Close the log file
 	cout.rdbuf(coutBuff);
@@ -780,8 +780,17 @@ static bool processRequest(MySQLBase *pDb, DBUsageLogger &usageLogger,
 				pPrinter = new RecipientsXMLPrinter(&api);
 			}
 
-			api.listRecipients(campaign, false, maxCount, startOffset, *pPrinter);
-			usageLogger.logRequest(actionParam, 0);
+			// Pages after the first are asked for with the token the previous one ended with
+			if (api.listRecipients(campaign, false, maxCount, startOffset,
+				getQueryParameter(queryString, "token="), *pPrinter) == true)
+			{
+				usageLogger.logRequest(actionParam, 0);
+			}
+			else
+			{
+				outputError("Invalid token parameter");
+				usageLogger.logRequest(actionParam, GET_ERROR + 4);
+			}
 
 			delete pPrinter;
 			parsedOk = true;